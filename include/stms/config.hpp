@@ -44,16 +44,68 @@ namespace stms {
     constexpr bool logToUniqueFile = false; //!< If true, write log output to `<logsDir>/<datetime>.log`
     constexpr bool logToStdout = true; //!< If true, write log output to stdout
     constexpr char logsDir[] = "./stms_logs"; //!< Directory for log output. There must NOT be a trailing slash
+    constexpr unsigned logThreadBufferLen = 64; //!< Max number of records a thread buffers before handing them off. See `getLogBuffering`.
+    constexpr unsigned logThreadFlushMs = 50; //!< Max number of milliseconds a thread-buffered log record waits before being handed off.
 
     constexpr unsigned certAndCipherLen = 256; //!< Size of the string to allocate for logging OpenSSL certs and ciphers
     constexpr int waitEventsSleepAmount = 4; //!< Milliseconds to pause for on `waitEvents` so that newly connected clients are visible.
     constexpr int sslShutdownMaxRetries = 10; //!< Maximum amount of times to retry `SSL_shutdown` (see OpenSSL docs)
     constexpr int minIoTimeout = 1000; //!< Minimum amount of time to wait for pending TLS IO (in milliseconds).
-    constexpr int tcpListenBacklog = 8; //!< The size of the TCP `accept` backlog. See man page for `listen`.
+    constexpr int tcpListenBacklog = 128; //!< Default size of the TCP `accept` backlog. See `_stms_PlainBase::setListenBacklog`.
+    constexpr int acceptBatchLen = 64; //!< Max connections (or DTLS ClientHellos) `SSLServer::tick` accepts at once.
+    constexpr unsigned idleWheelResolution = 10; //!< Granularity (in milliseconds) of `SSLServer`'s client idle timeouts.
     constexpr int maxRecvLen = 16384; //!< The size (bytes) of the buffer to allocate for incoming TLS packets. RFC 8449
-    constexpr int secretCookieLen = 16; //!< Length of DTLS cookie. See `stms::secretCookie` in `ssl.hpp`.
+    constexpr int secretCookieLen = 16; //!< Length of the secrets DTLS cookies are computed with. See `CookieKeys`.
+
+    constexpr int sendCoalesceMax = 16384; //!< Default max bytes of queued messages `SSLServer` merges into 1 TLS record. RFC 8446
+    constexpr unsigned sendFlushDelay = 0; //!< Default milliseconds `SSLServer` waits for messages to merge. 0 = write immediately
+    constexpr std::size_t sendHighWatermark = 1UL << 20UL; //!< Default bytes queued to 1 peer before `send()` returns -4. ~1MB
+    constexpr std::size_t sendLowWatermark = 1UL << 18UL; //!< Default queued bytes a peer must drain to before it is writable again. 256KB
+    constexpr std::size_t dtlsDemuxQueueLen = 64; //!< Max datagrams queued per client with `SSLServer::setDtlsDemux`. Extras are dropped.
+    constexpr long dtlsDemuxMtu = 1500; //!< Link MTU reported to OpenSSL for clients with `SSLServer::setDtlsDemux`.
+    constexpr int shardTickWaitMs = 16; //!< Max milliseconds each `ShardedSSLServer` thread blocks in `waitEvents`.
+    constexpr std::size_t clientTableStripes = 16; //!< Number of independently locked stripes in `SSLServer`'s client table.
+    constexpr std::size_t sessionCacheSize = 20480; //!< Default max number of TLS sessions in a `SessionCache`.
+    constexpr unsigned sessionCacheTtl = 7200; //!< Default seconds TLS sessions can be resumed for. Also the ticket lifetime hint.
+    constexpr unsigned ticketKeyLifetime = 3600; //!< Default seconds a session ticket key is used before it is rotated.
+    constexpr std::size_t ticketKeyHistory = 2; //!< Default number of rotated-out session ticket keys that are still accepted.
+    constexpr unsigned cookieKeyLifetime = 3600; //!< Default seconds a DTLS cookie secret is used before it is rotated.
+    constexpr unsigned cookieKeyGrace = 60; //!< Default seconds cookies from a rotated-out DTLS cookie secret are still accepted.
+    constexpr std::size_t cookieMacCacheLen = 4; //!< Number of keyed DTLS cookie MAC contexts each thread keeps cloned.
+    constexpr int sendFileChunk = 16384; //!< Bytes of a file passed to each `SSL_write` when `sendFile()` can't use kTLS.
+    constexpr int eventLoopMaxEvents = 256; //!< Max number of ready fds an `EventLoop` fetches per `epoll_wait`.
+    constexpr int reactorMaxReadsPerTask = 64; //!< Max records an `IOBackend::eEpoll` read task handles before re-submitting itself.
+    constexpr unsigned uringEntries = 256; //!< Number of submission queue entries in each `IOUring`.
+    constexpr unsigned uringRecvBufs = 256; //!< Number of buffers the kernel can receive into per `UDPPeer` with io_uring. Must be a power of 2.
+    constexpr unsigned uringRecvBufSize = 2048; //!< Size of each io_uring receive buffer. Larger datagrams are dropped.
+    constexpr unsigned metricsRequestWaitMs = 100; //!< Max milliseconds `MetricsExporter` waits for a scraper's request, and for room to send its response.
+    constexpr int metricsMaxPending = 16; //!< Max unanswered connections to a `MetricsExporter`. Further ones wait in the backlog.
 
     constexpr int maxPlainRecvLen = 65536; //!< Size of IP packet in bytes i think.
+    constexpr std::size_t framerRingCapacity = 65536; //!< Initial ring buffer size of each `MessageFramer`. Grows to fit larger messages.
+    constexpr std::size_t framerMaxMessageLen = 1UL << 24UL; //!< Default max payload of a framed message. Longer ones drop the connection. 16MB
+    constexpr std::size_t packetPoolMinSize = 256; //!< Smallest `PacketBuffer` size class. Must be a power of 2.
+    constexpr std::size_t packetPoolMaxSize = 65536; //!< Largest `PacketBuffer` size class. Larger buffers are `new`ed.
+    constexpr unsigned packetPoolSlabBuffers = 32; //!< Number of buffers carved out of each slab allocation.
+    constexpr unsigned packetPoolThreadCache = 64; //!< Max free buffers of each size class cached per thread.
+    constexpr unsigned udpBatchSize = 32; //!< Max number of datagrams `UDPPeer` receives per `recvmmsg`.
+    constexpr unsigned tcpWriteBatch = 64; //!< Max number of buffers `TCPServer` & `TCPClient` gather into each `sendmsg`.
+    constexpr std::size_t zeroCopyMinBytes = 16384; //!< Smallest send made with `MSG_ZEROCOPY`. Copying smaller ones is cheaper than pinning their pages.
+    constexpr std::size_t reliableMtu = 1200; //!< Default max datagram `ReliableUDP` sends, header included. Safe on practically every path.
+    constexpr int reliableMaxTransmissions = 10; //!< Times `ReliableUDP` sends a reliable packet before giving up on the peer.
+    constexpr unsigned reliableInitialRtoMs = 250; //!< Retransmission timeout of `ReliableUDP` before the first RTT sample.
+    constexpr unsigned reliableMinRtoMs = 50; //!< Lower bound of `ReliableUDP`'s retransmission timeout. Covers delayed acks.
+    constexpr unsigned reliableMaxRtoMs = 3000; //!< Upper bound of `ReliableUDP`'s retransmission timeout, including backoff.
+    constexpr double reliableInitialCwnd = 16; //!< Initial congestion window of `ReliableUDP`, in packets.
+    constexpr double reliableMaxCwnd = 4096; //!< Max congestion window of `ReliableUDP`, in packets.
+    constexpr unsigned reliableReorderThreshold = 3; //!< A packet is lost once this many later ones were acked (fast retransmit).
+    constexpr unsigned reliablePacingBurst = 8; //!< Max packets `ReliableUDP` sends back to back when pacing falls behind.
+    constexpr std::size_t reliableMaxPartials = 64; //!< Max incomplete messages per channel and peer kept for reassembly by `ReliableUDP`.
+    constexpr std::size_t reliableMaxMessageLen = 1UL << 20UL; //!< Default max length of a message `ReliableUDP` sends or reassembles. 1MB
+    constexpr std::size_t reliableRecvBufferLen = 1UL << 22UL; //!< Default max bytes of incomplete and held back messages per `ReliableUDP` peer. 4MB
+    constexpr unsigned reliableMaxIdWindow = 4096; //!< Max message ids past the next undelivered one a reliable `ReliableUDP` channel accepts.
+    constexpr std::size_t reliableMaxPeers = 4096; //!< Default max peers `ReliableUDP` creates state for on incoming datagrams.
+    constexpr std::size_t impairmentQueueLimit = 1 << 20; //!< Default bytes `NetImpairment` buffers behind a bandwidth cap before tail-dropping.
     constexpr int maxStopBlock = 5000; //!< Maximum number of milliseconds to block on `stop()`
 
     /// If true, allow experimental OpenGL driver features, useful for backwards/forward compatibility.
@@ -17,6 +17,7 @@
 #include <iomanip>
 #include <iostream>
 #include <string>
+#include <atomic>
 
 #include "stms/async.hpp"
 
@@ -36,6 +37,12 @@ namespace stms {
         eFatal = 0b100000, //!< Fatal error! Value 32. (6th bit)
     };
 
+    /// Source of the timestamps of `LogRecord`s. See `setLogTimestampMode`.
+    enum class LogTimestampMode : uint8_t {
+        eWallClock, //!< Read `std::chrono::system_clock` for every record. This is the default.
+        eTsc //!< Read a monotonic cycle counter (`rdtsc` on x86) for every record. Converted to wall time when consumed.
+    };
+
     /// Struct representing a single log message.
     struct LogRecord {
         /**
@@ -50,6 +57,10 @@ namespace stms {
         LogLevel level = LogLevel::eInvalid; //!< Severity of the message. See `LogLevel`.
         std::chrono::system_clock::time_point time; //!< Time at which the message was generated
 
+        /// Raw cycle counter value if the record was generated in `LogTimestampMode::eTsc`, otherwise 0.
+        /// `time` is filled in from this when the record is consumed, before any log hooks are called.
+        uint64_t tsc = 0;
+
         const char *file = ""; //!< File from which the message originated
         unsigned line{}; //!< Line of the source file from which the message originated
 
@@ -60,9 +71,27 @@ namespace stms {
 
     void quitLogging(); //!< Quit logging. If you used `stms::initAll`, you do not have to call this.
 
+    /**
+     * @brief Set where the timestamps of log records come from. See `LogTimestampMode`.
+     *        Switching to `eTsc` calibrates the cycle counter against the wall clock, which blocks for ~10ms.
+     *        In `eTsc` mode, log calls don't read the wall clock at all; the consumer converts the cycle count to
+     *        wall time when rendering the record instead.
+     * @param mode New timestamp mode.
+     */
+    void setLogTimestampMode(LogTimestampMode mode);
+
+    /**
+     * @brief Query the current timestamp mode. See `setLogTimestampMode`.
+     * @return The current `LogTimestampMode`.
+     */
+    LogTimestampMode getLogTimestampMode();
+
 #   ifdef STMS_ENABLE_LOGGING
     void insertImpl(std::unique_ptr<LogRecord> rec); //!< Internal implementation detail. Don't touch.
 
+    /// Internal implementation detail. Don't touch. Allocates a `LogRecord` timestamped according to `LogTimestampMode`
+    std::unique_ptr<LogRecord> newLogRecord(LogLevel lvl, const char *file, unsigned line);
+
     /**
      * @brief NEVER this function directly. Instead, use the logging macros (`STMS_INFO`, `STMS_WARN`, etc.).
      *        This function inserts a `LogRecord` into `logQueue` and starts a log-consume task (`consumeLogs`).
@@ -76,7 +105,7 @@ namespace stms {
      */
     template<typename... Args>
     void insertLog(LogLevel lvl, unsigned line, const char *file, const char *fmtStr, const Args &... args) {
-        std::unique_ptr<LogRecord> insert = std::make_unique<LogRecord>(lvl, std::chrono::system_clock::now(), file, line);
+        std::unique_ptr<LogRecord> insert = newLogRecord(lvl, file, line);
 
         try {
             fmt::format_to(insert->msg, fmtStr, args...);
@@ -148,7 +177,29 @@ namespace stms {
         return val;
     }
 
+    /**
+     * @brief Toggle thread-local log buffering. You can modify this variable. By default, this is false.
+     *
+     * If false, every log call hands its `LogRecord` to the log consumer (`consumeLogs`) immediately, which means
+     * every log call from every thread contends on the same queue.
+     *
+     * If true, each thread appends its records to a buffer of its own instead. The buffer is handed to the consumer
+     * in one go when it holds `logThreadBufferLen` records, when `logThreadFlushMs` milliseconds have passed, or
+     * immediately if an `eError` or `eFatal` record is logged. The consumer processes records in timestamp order,
+     * so records from different threads are still interleaved correctly (as long as they are consumed together).
+     */
+    inline std::atomic_bool &getLogBuffering() {
+        static std::atomic_bool val{false};
+        return val;
+    }
+
     void consumeLogs(); //!< Process all the logs in `logQueue`, essentially flushing the log message backlog
+
+    /**
+     * @brief Hand the contents of every thread's log buffer to the log consumer now, regardless of how full or old
+     *        they are. Only relevant if `getLogBuffering()` is true. This is called automatically in `quitLogging`.
+     */
+    void flushLogBuffers();
 }
 
 #endif //__STONEMASON_LOGGING_HPP
@@ -0,0 +1,98 @@
+/**
+ * @file stms/net/dtls_cookie.hpp
+ * @brief Provides `CookieKeys`, the rotating secrets `SSLServer` uses for stateless DTLS cookie exchanges.
+ *        You shouldn't have to include this manually.
+ */
+
+#pragma once
+
+#ifndef __STONEMASON_NET_DTLS_COOKIE_HPP
+#define __STONEMASON_NET_DTLS_COOKIE_HPP
+//!< Include guard
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <shared_mutex>
+
+#include <sys/socket.h>
+
+#include "openssl/ssl.h"
+#include "stms/config.hpp"
+
+namespace stms {
+    /**
+     * @brief Secrets DTLS cookies are computed with (HMAC-SHA1 of the peer's address). A cookie proves that the peer
+     *        can receive at its address, without the server keeping any state until it does.
+     *
+     *        Cookies are verified for every ClientHello, including spoofed ones, so each key keeps a MAC context that
+     *        was keyed once up front. Each thread that computes cookies clones it once and then only resets it, instead
+     *        of deriving the HMAC pads from the secret on every call.
+     *
+     *        A new secret is generated every `lifetime` seconds. Cookies from the previous secret are still accepted
+     *        for `grace` seconds after that, so handshakes that were in flight during the rotation don't fail.
+     *        Can be shared between several servers, like `SessionTicketKeys`.
+     */
+    class CookieKeys {
+    private:
+        struct Key; //!< A single secret & its keyed MAC context. Defined in the source file.
+
+        std::shared_ptr<const Key> current; //!< Secret new cookies are computed with. Guarded by `keysMtx`
+        std::shared_ptr<const Key> previous; //!< Secret before `current`, or `nullptr`. Guarded by `keysMtx`
+        std::chrono::steady_clock::time_point rotatedAt; //!< Time `previous` was replaced. Guarded by `keysMtx`
+        std::shared_mutex keysMtx; //!< Guards `current`, `previous` & `rotatedAt`
+        unsigned lifetimeSecs = cookieKeyLifetime; //!< See `setRotation`
+        unsigned graceSecs = cookieKeyGrace; //!< See `setRotation`
+
+        void rotateLocked(); //!< Generate a new secret and demote `current` to `previous`. Requires `keysMtx`.
+
+        /// Rotate if `current` is older than `lifetimeSecs`. Requires a shared lock on `keysMtx`, which it may release.
+        void rotateIfDue(std::shared_lock<std::shared_mutex> &lg);
+
+    public:
+        CookieKeys(); //!< Constructor. Generates the first secret. Throws `std::runtime_error` if that fails.
+
+        ~CookieKeys(); //!< Destructor
+
+        CookieKeys(const CookieKeys &rhs) = delete; //!< Deleted copy constructor
+        CookieKeys &operator=(const CookieKeys &rhs) = delete; //!< Deleted copy assignment operator
+
+        /**
+         * @brief Configure secret rotation
+         * @param lifetime Number of seconds a secret is used to issue new cookies before it is replaced. If 0, secrets
+         *                 are only replaced by `rotate()`. Defaults to `cookieKeyLifetime`.
+         * @param grace Number of seconds cookies from the replaced secret are still accepted. Defaults to
+         *              `cookieKeyGrace`.
+         */
+        void setRotation(unsigned lifetime, unsigned grace);
+
+        void rotate(); //!< Replace the current secret right away, i.e. if it may have been leaked.
+
+        /**
+         * @brief Compute the cookie of a peer with the current secret. Only the family, port & IP address are used,
+         *        so the cookie is the same no matter if the address came from `recvfrom` or from a BIO.
+         * @param peer Address of the peer. Must be `AF_INET` or `AF_INET6`.
+         * @param out Buffer of at least `DTLS1_COOKIE_LENGTH - 1` bytes to write the cookie to
+         * @return Length of the cookie, or 0 on error.
+         */
+        unsigned generate(const sockaddr *peer, uint8_t *out);
+
+        /**
+         * @brief Check a cookie against the current secret, and the previous one if it's within its grace period.
+         * @param peer Address the cookie came from. Must be `AF_INET` or `AF_INET6`.
+         * @param cookie Cookie to check
+         * @param len Length of `cookie`
+         * @return True if `peer` got `cookie` from us.
+         */
+        bool verify(const sockaddr *peer, const uint8_t *cookie, unsigned len);
+
+        /**
+         * @brief Make `ctx` use `keys` for DTLS cookies. Internal impl detail, called by `SSLServer`.
+         * @param ctx OpenSSL context of a server. It keeps a reference to `keys` until it is freed.
+         * @param keys Keys to use
+         */
+        static void install(SSL_CTX *ctx, const std::shared_ptr<CookieKeys> &keys);
+    };
+}
+
+#endif //__STONEMASON_NET_DTLS_COOKIE_HPP
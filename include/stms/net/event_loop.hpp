@@ -0,0 +1,90 @@
+/**
+ * @file stms/net/event_loop.hpp
+ * @brief Provides `EventLoop`, a thin wrapper around `epoll` for servers that need to watch many sockets at once.
+ *        You should not have to include this manually.
+ */
+
+#pragma once
+
+#ifndef __STONEMASON_NET_EVENT_LOOP_HPP
+#define __STONEMASON_NET_EVENT_LOOP_HPP
+//!< Include guard
+
+#include <vector>
+#include <cstdint>
+
+#include "stms/config.hpp"
+
+namespace stms {
+
+    /// A single readiness event returned by `EventLoop::wait`.
+    struct FDEvent {
+        int fd; //!< File descriptor that is ready.
+        uint32_t events; //!< Bitmask of `epoll` events that happened (`EPOLLIN`, `EPOLLOUT`, `EPOLLHUP`, etc.)
+    };
+
+    /**
+     * @brief Wrapper around an `epoll` instance. File descriptors are registered once and only the ones that are
+     *        ready are returned from `wait`, so the cost of waiting doesn't depend on the number of registered fds.
+     *        Registering and removing fds is thread-safe, even while another thread is blocked in `wait`.
+     *        Only available on Linux; on other platforms `isValid()` is always false.
+     */
+    class EventLoop {
+    private:
+        int epollFd = -1; //!< `epoll` file descriptor. -1 if creation failed.
+
+    public:
+        EventLoop(); //!< Create a new `epoll` instance. Check `isValid()` to see if it succeeded.
+
+        ~EventLoop(); //!< Closes the `epoll` fd.
+
+        EventLoop(const EventLoop &rhs) = delete; //!< Deleted copy constructor
+        EventLoop &operator=(const EventLoop &rhs) = delete; //!< Deleted copy assignment operator
+
+        EventLoop(EventLoop &&rhs) noexcept; //!< Move constructor
+        EventLoop &operator=(EventLoop &&rhs) noexcept; //!< Move assignment operator
+
+        /**
+         * @brief Start watching a file descriptor.
+         * @param fd File descriptor to watch
+         * @param events `epoll` events to watch for (e.g. `EPOLLIN`), optionally with `EPOLLET` for edge-triggered
+         *               or `EPOLLONESHOT` to disable `fd` after it is reported once (re-enable it with `modify`).
+         * @return True if successful, false otherwise.
+         */
+        bool add(int fd, uint32_t events);
+
+        /**
+         * @brief Change the events watched for on an fd. Also re-arms fds registered with `EPOLLONESHOT`.
+         * @param fd File descriptor that was previously `add`ed.
+         * @param events New events to watch for. See `add`.
+         * @return True if successful, false otherwise.
+         */
+        bool modify(int fd, uint32_t events);
+
+        /**
+         * @brief Stop watching a file descriptor. Closing an fd also implicitly removes it.
+         * @param fd File descriptor to remove
+         * @return True if successful, false otherwise.
+         */
+        bool remove(int fd);
+
+        /**
+         * @brief Block until at least 1 registered fd is ready, or until `timeoutMs` runs out. At most
+         *        `eventLoopMaxEvents` events are returned per call.
+         * @param timeoutMs Maximum number of milliseconds to block. 0 returns immediately, -1 blocks forever.
+         * @param out Ready fds are appended to this vector.
+         * @return Number of events appended to `out`, or -1 on error.
+         */
+        int wait(int timeoutMs, std::vector<FDEvent> &out);
+
+        /**
+         * @brief Query if the `epoll` instance was successfully created.
+         * @return True if this `EventLoop` can be used.
+         */
+        [[nodiscard]] inline bool isValid() const {
+            return epollFd != -1;
+        }
+    };
+}
+
+#endif //__STONEMASON_NET_EVENT_LOOP_HPP
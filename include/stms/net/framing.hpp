@@ -0,0 +1,118 @@
+/**
+ * @file stms/net/framing.hpp
+ * @brief Provides `MessageFramer`, which splits a byte stream (TCP or TLS) into length-prefixed messages.
+ *        Used by `setFramedRecvCallback` of `SSLServer`, `SSLClient`, `TCPServer` and `TCPClient`.
+ */
+
+#pragma once
+
+#ifndef __STONEMASON_NET_FRAMING_HPP
+#define __STONEMASON_NET_FRAMING_HPP
+//!< Include guard
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <utility>
+
+#include "stms/config.hpp"
+
+namespace stms {
+    /// Length of the header in front of every framed message: The payload length as a big-endian `uint32_t`.
+    constexpr std::size_t frameHeaderLen = 4;
+
+    /**
+     * @brief Build the header to send in front of a framed message, i.e. with `TCPClient::sendv`.
+     * @param msgLen Length of the message payload in bytes, not including the header.
+     * @return Header bytes
+     */
+    inline std::array<uint8_t, frameHeaderLen> encodeFrameHeader(uint32_t msgLen) {
+        return {static_cast<uint8_t>(msgLen >> 24U), static_cast<uint8_t>(msgLen >> 16U),
+                static_cast<uint8_t>(msgLen >> 8U), static_cast<uint8_t>(msgLen)};
+    }
+
+    /**
+     * @brief Reassembles length-prefixed messages from a byte stream in a ring buffer. The transport reads straight
+     *        into the free space of the ring (see `writeSpan`), so a message that doesn't cross the end of the ring is
+     *        handed out in place without any copies. A message that does cross it is copied once, into a scratch
+     *        buffer, to make it contiguous.
+     *
+     *        Not thread-safe. The transports only ever have 1 read task per connection, so each connection just
+     *        owns a `MessageFramer`.
+     */
+    class MessageFramer {
+    private:
+        std::unique_ptr<uint8_t[]> ring; //!< Ring buffer of `capacity` bytes
+        std::size_t capacity; //!< Size of `ring`. Grows (up to fit `maxMsgLen`) if a message doesn't fit.
+        std::size_t head = 0; //!< Index in `ring` of the first unparsed byte
+        std::size_t used = 0; //!< Number of unparsed bytes in `ring`, starting at `head`
+        std::size_t maxMsgLen; //!< Max payload length. Longer messages are a protocol error.
+
+        std::unique_ptr<uint8_t[]> scratch; //!< Buffer messages crossing the end of `ring` are copied into.
+        std::size_t scratchLen = 0; //!< Size of `scratch`
+
+        /// Copy `len` bytes starting at index `from` of `ring` (wrapping around) into `dst`.
+        void copyOut(std::size_t from, uint8_t *dst, std::size_t len) const;
+
+        /// Grow `ring` to at least `minCapacity` bytes, moving the unparsed bytes to the start.
+        void grow(std::size_t minCapacity);
+
+    public:
+        /**
+         * @brief Constructor
+         * @param maxMessageLen Max payload length of a message. Longer ones make `commit` fail.
+         * @param initialCapacity Initial size of the ring buffer. It grows if a message doesn't fit.
+         */
+        explicit MessageFramer(std::size_t maxMessageLen = framerMaxMessageLen,
+                               std::size_t initialCapacity = framerRingCapacity);
+
+        MessageFramer(const MessageFramer &rhs) = delete; //!< Deleted copy constructor
+        MessageFramer &operator=(const MessageFramer &rhs) = delete; //!< Deleted copy assignment operator
+
+        /**
+         * @brief Get the contiguous free space at the end of the unparsed data, to read into.
+         *        Pass the number of bytes written to `commit`.
+         * @return Pointer and length of the free space. The length is never 0.
+         */
+        std::pair<uint8_t *, std::size_t> writeSpan();
+
+        /**
+         * @brief Mark `len` bytes written into `writeSpan()` as received and call `onMessage` for every message
+         *        completed by them, in order.
+         * @param len Number of bytes written, at most the length returned by `writeSpan`.
+         * @param onMessage Called with the payload of each complete message. The payload is only valid until
+         *                  `onMessage` returns, and must not be passed to `PacketBuffer::retain`.
+         * @return False if a message is longer than the max message length. The stream can't be recovered from that,
+         *         so the connection should be dropped.
+         */
+        bool commit(std::size_t len, const std::function<void(uint8_t *, std::size_t)> &onMessage);
+
+        /**
+         * @brief Same as copying `data` into `writeSpan()` and calling `commit`, for data that was already read
+         *        somewhere else.
+         * @param data Received data
+         * @param len Length of `data` in bytes
+         * @param onMessage See `commit`
+         * @return See `commit`
+         */
+        bool feed(const uint8_t *data, std::size_t len, const std::function<void(uint8_t *, std::size_t)> &onMessage);
+
+        /**
+         * @brief Get the number of received bytes that aren't part of a complete message yet.
+         * @return Number of bytes
+         */
+        [[nodiscard]] inline std::size_t getBufferedBytes() const {
+            return used;
+        }
+
+        /// Discard any partially received message, i.e. after reconnecting.
+        inline void reset() {
+            head = 0;
+            used = 0;
+        }
+    };
+}
+
+#endif //__STONEMASON_NET_FRAMING_HPP
@@ -0,0 +1,166 @@
+/**
+ * @file stms/net/impairment.hpp
+ * @brief Provides `NetImpairment`, which makes the datagram sockets of `UDPPeer`, `SSLServer` and `SSLClient` behave
+ *        like a bad network: Datagrams are lost, duplicated, reordered, delayed and rate limited, reproducibly from
+ *        a seed. Meant for testing retry and timeout logic on loopback.
+ */
+
+#pragma once
+
+#ifndef __STONEMASON_NET_IMPAIRMENT_HPP
+#define __STONEMASON_NET_IMPAIRMENT_HPP
+//!< Include guard
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+
+#include <sys/socket.h>
+
+#include "openssl/bio.h"
+#include "stms/config.hpp"
+#include "stms/net/packet_pool.hpp"
+
+namespace stms {
+    /// What `NetImpairment` does to outgoing datagrams. Every probability is in [0, 1].
+    struct ImpairmentConfig {
+        uint64_t seed = 0; //!< Seed of the random decisions. The same seed gives the same impairment.
+
+        double lossRate = 0; //!< Probability that a datagram is silently dropped
+        double duplicateRate = 0; //!< Probability that a datagram is sent twice
+        double reorderRate = 0; //!< Probability that a datagram is held back by `reorderDelayMs`, so later ones overtake it
+        unsigned reorderDelayMs = 20; //!< Extra delay of datagrams picked by `reorderRate`
+
+        unsigned latencyMs = 0; //!< Fixed delay added to every datagram
+        unsigned jitterMs = 0; //!< Every datagram gets a uniformly random extra delay of up to this many milliseconds
+
+        uint64_t bandwidthBytesPerSec = 0; //!< Rate datagrams leave at, as if over a link this fast. 0 for unlimited.
+        std::size_t queueLimitBytes = impairmentQueueLimit; //!< Datagrams that would queue more than this behind the bandwidth cap are dropped.
+    };
+
+    /// Counters of what `NetImpairment` did. See `NetImpairment::getStats`.
+    struct ImpairmentStats {
+        uint64_t datagrams = 0; //!< Datagrams passed to the shim
+        uint64_t sent = 0; //!< Datagrams written to the socket, including duplicates
+        uint64_t lost = 0; //!< Datagrams dropped by `lossRate`
+        uint64_t overflowed = 0; //!< Datagrams dropped because the bandwidth cap queue was full
+        uint64_t duplicated = 0; //!< Datagrams sent twice
+        uint64_t reordered = 0; //!< Datagrams held back by `reorderDelayMs`
+        uint64_t delayed = 0; //!< Datagrams that weren't sent right away
+    };
+
+    /**
+     * @brief Network impairment shim for datagram sockets. Pass one to `_stms_PlainBase::setImpairment` and every
+     *        datagram the transport sends goes through `sendto` here instead of straight to the socket. Impairing both
+     *        ends (or sharing one `NetImpairment` between them) impairs both directions.
+     *
+     *        The decisions for each datagram are drawn from a PRNG seeded with `ImpairmentConfig::seed`, in the order
+     *        datagrams are passed in. With a single sending thread, a given seed always drops, duplicates and delays
+     *        the same datagrams. Delayed datagrams are sent by a background thread that is started on first use.
+     */
+    class NetImpairment {
+    private:
+        using Clock = std::chrono::steady_clock; //!< Clock used for all timing
+
+        /// A datagram waiting for its delay to run out.
+        struct Pending {
+            int fd; //!< Socket to send it from
+            sockaddr_storage addr; //!< Destination. Unused if `addrLen` is 0.
+            socklen_t addrLen; //!< Length of `addr`, or 0 for connected sockets.
+            PacketBuffer data; //!< Copy of the datagram
+        };
+
+        ImpairmentConfig config; //!< See `ImpairmentConfig`
+
+        std::mutex mtx; //!< Guards everything below
+        std::mt19937_64 rng; //!< Source of every decision
+        ImpairmentStats stats; //!< See `getStats`
+        std::condition_variable cv; //!< Wakes `worker` when a datagram is queued or on destruction
+        std::map<std::pair<Clock::time_point, uint64_t>, Pending> pending; //!< Delayed datagrams by due time & arrival
+        uint64_t nextOrder = 0; //!< Tie breaker between datagrams due at the same time, so they go out in order.
+        Clock::time_point linkFreeAt; //!< Time the simulated link finishes sending everything queued on it
+        std::thread worker; //!< Sends delayed datagrams. Not started until something is delayed.
+        bool stopping = false; //!< Tells `worker` to exit
+
+        double uniform(); //!< Draw a number in [0, 1). Requires `mtx`.
+
+        /// Send a datagram now, counting it. Requires `mtx`.
+        ssize_t sendNow(int fd, const void *data, std::size_t len, int flags, const sockaddr *addr, socklen_t addrLen);
+
+        void run(); //!< Body of `worker`
+
+    public:
+        /**
+         * @brief Constructor
+         * @param cfg What to do to datagrams. See `ImpairmentConfig`.
+         */
+        explicit NetImpairment(const ImpairmentConfig &cfg);
+
+        ~NetImpairment(); //!< Destructor. Datagrams that are still delayed are dropped; `flush` them first.
+
+        NetImpairment(const NetImpairment &rhs) = delete; //!< Deleted copy constructor
+        NetImpairment &operator=(const NetImpairment &rhs) = delete; //!< Deleted copy assignment operator
+
+        /**
+         * @brief Send a datagram through the shim. Same interface as `::sendto`.
+         * @param fd Socket to send from
+         * @param data Datagram to send. Copied if it is delayed.
+         * @param len Length of `data` in bytes
+         * @param flags Flags for `::sendto`. Only used for datagrams sent right away.
+         * @param addr Destination, or `nullptr` for connected sockets.
+         * @param addrLen Length of `addr`
+         * @return `len` if the datagram was dropped or delayed (as it would be on the network), otherwise the result of
+         *         `::sendto`.
+         */
+        ssize_t sendto(int fd, const void *data, std::size_t len, int flags, const sockaddr *addr, socklen_t addrLen);
+
+        /**
+         * @brief Same as `sendto`, but the datagram is gathered from a `msghdr` like `::sendmsg`.
+         * @param fd Socket to send from
+         * @param hdr Datagram to send. Control data is ignored.
+         * @param flags Flags for `::sendmsg`
+         * @return See `sendto`
+         */
+        ssize_t sendmsg(int fd, const msghdr *hdr, int flags);
+
+        /**
+         * @brief Send the delayed datagrams of a socket right away. Must be called before the socket is closed, as
+         *        datagrams already "on the wire" (like a final close_notify) would otherwise be lost or sent from
+         *        whatever socket reuses the fd. `_stms_PlainBase` does this for you.
+         * @param fd Socket that is about to be closed
+         */
+        void flush(int fd);
+
+        /**
+         * @brief Put a filter in front of an OpenSSL datagram BIO, so that DTLS records written to it go through the
+         *        shim. Reads and controls are passed straight through to `next`.
+         * @param imp Shim to send through. The BIO keeps a reference to it.
+         * @param next BIO to wrap. Freed with the returned BIO.
+         * @param sharedFd Socket `next` may use that is shared with other BIOs (i.e. the listening socket). Every other
+         *                 socket's delayed datagrams are flushed when the BIO is freed.
+         * @return The filter BIO, to use in place of `next`.
+         */
+        static BIO *wrapBio(const std::shared_ptr<NetImpairment> &imp, BIO *next, int sharedFd = -1);
+
+        /**
+         * @brief Get a snapshot of the counters.
+         * @return Counters
+         */
+        ImpairmentStats getStats();
+
+        /**
+         * @brief Get the config passed to the constructor.
+         * @return The config
+         */
+        [[nodiscard]] inline const ImpairmentConfig &getConfig() const {
+            return config;
+        }
+    };
+}
+
+#endif //__STONEMASON_NET_IMPAIRMENT_HPP
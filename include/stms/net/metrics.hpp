@@ -0,0 +1,289 @@
+/**
+ * @file stms/net/metrics.hpp
+ * @brief Provides traffic & connection counters for `SSLServer`, `SSLClient` and `UDPPeer` (`NetMetrics`), and
+ *        `MetricsExporter`, which publishes them in the Prometheus text format.
+ */
+
+#pragma once
+
+#ifndef __STONEMASON_NET_METRICS_HPP
+#define __STONEMASON_NET_METRICS_HPP
+//!< Include guard
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "stms/config.hpp"
+
+namespace stms {
+    class SSLServer;
+    class ShardedSSLServer;
+    class SSLClient;
+    class UDPPeer;
+
+    /// Upper bounds (in milliseconds) of the buckets of the handshake duration histogram. Slower ones go in a last,
+    /// unbounded bucket.
+    constexpr std::array<unsigned, 10> handshakeBucketsMs{1, 5, 10, 25, 50, 100, 250, 500, 1000, 5000};
+
+    /// Point-in-time copy of the metrics of a server, client or peer. Counters are totals since construction.
+    struct MetricsSnapshot {
+        uint64_t bytesIn = 0; //!< Bytes of application data received
+        uint64_t bytesOut = 0; //!< Bytes of application data sent
+        uint64_t messagesIn = 0; //!< Number of messages (reads, framed messages or datagrams) passed to the callbacks
+        uint64_t messagesOut = 0; //!< Number of messages (or datagrams) sent
+        uint64_t wantReadRetries = 0; //!< IO retried after `SSLStatus::eWantRead`
+        uint64_t wantWriteRetries = 0; //!< IO retried after `SSLStatus::eWantWrite` (or `EAGAIN` for `UDPPeer`)
+        uint64_t timeouts = 0; //!< Connections or operations that were given up on after `timeoutMs`/`maxTimeouts`
+        uint64_t kicks = 0; //!< Clients dropped with `SSLServer::kickClient`
+        uint64_t handshakes = 0; //!< Completed handshakes
+        uint64_t handshakeFailures = 0; //!< Handshakes that failed or timed out
+        uint64_t handshakeMicros = 0; //!< Total duration of the completed handshakes, in microseconds
+        /// Number of completed handshakes in each bucket of `handshakeBucketsMs` (not cumulative). The last is `+Inf`.
+        std::array<uint64_t, handshakeBucketsMs.size() + 1> handshakeBuckets{};
+
+        std::size_t connections = 0; //!< Number of connected clients (1 or 0 for a client)
+        std::size_t handshaking = 0; //!< Number of handshakes in progress
+        std::size_t queuedBytes = 0; //!< Bytes waiting to be sent
+        std::size_t queuedMessages = 0; //!< Messages (or datagrams) waiting to be sent
+        std::size_t mtu = 0; //!< Current PMTU for DTLS (smallest among the clients of a server), 0 if unknown.
+
+        /**
+         * @brief Add up 2 snapshots, i.e. to get the total of several shards. `mtu` becomes the smaller nonzero one.
+         * @param rhs Right Hand Side of the `+=`
+         * @return A reference to `this`
+         */
+        MetricsSnapshot &operator+=(const MetricsSnapshot &rhs);
+
+        /**
+         * @brief Get the average duration of the completed handshakes.
+         * @return Average in milliseconds, or 0 if no handshakes completed.
+         */
+        [[nodiscard]] inline double meanHandshakeMs() const {
+            return handshakes == 0 ? 0 : static_cast<double>(handshakeMicros) / 1000.0 / static_cast<double>(handshakes);
+        }
+    };
+
+    /**
+     * @brief Counters of a server, client, peer or single connection. Every method only does relaxed atomic adds,
+     *        so counting never takes a lock and can be done from any thread. Gauges such as queue depths aren't kept
+     *        here; They are read from the owner when a snapshot is taken. Internal impl detail; Use the `getMetrics`
+     *        of the owner.
+     */
+    class NetMetrics {
+    private:
+        std::atomic<uint64_t> bytesIn{0}; //!< See `MetricsSnapshot::bytesIn`
+        std::atomic<uint64_t> bytesOut{0}; //!< See `MetricsSnapshot::bytesOut`
+        std::atomic<uint64_t> messagesIn{0}; //!< See `MetricsSnapshot::messagesIn`
+        std::atomic<uint64_t> messagesOut{0}; //!< See `MetricsSnapshot::messagesOut`
+        std::atomic<uint64_t> wantReadRetries{0}; //!< See `MetricsSnapshot::wantReadRetries`
+        std::atomic<uint64_t> wantWriteRetries{0}; //!< See `MetricsSnapshot::wantWriteRetries`
+        std::atomic<uint64_t> timeouts{0}; //!< See `MetricsSnapshot::timeouts`
+        std::atomic<uint64_t> kicks{0}; //!< See `MetricsSnapshot::kicks`
+        std::atomic<uint64_t> handshakeFailures{0}; //!< See `MetricsSnapshot::handshakeFailures`
+        std::atomic<uint64_t> handshakeMicros{0}; //!< See `MetricsSnapshot::handshakeMicros`
+        std::array<std::atomic<uint64_t>, handshakeBucketsMs.size() + 1> handshakeBuckets{}; //!< See `MetricsSnapshot::handshakeBuckets`
+
+    public:
+        NetMetrics() = default; //!< Default constructor
+
+        NetMetrics(const NetMetrics &rhs) = delete; //!< Deleted copy constructor
+        NetMetrics &operator=(const NetMetrics &rhs) = delete; //!< Deleted copy assignment operator
+
+        /**
+         * @brief Count received data
+         * @param bytes Number of bytes received
+         * @param messages Number of messages they made up
+         */
+        inline void addIn(std::size_t bytes, std::size_t messages = 1) {
+            bytesIn.fetch_add(bytes, std::memory_order_relaxed);
+            messagesIn.fetch_add(messages, std::memory_order_relaxed);
+        }
+
+        /**
+         * @brief Count sent data
+         * @param bytes Number of bytes sent
+         * @param messages Number of messages they made up
+         */
+        inline void addOut(std::size_t bytes, std::size_t messages = 1) {
+            bytesOut.fetch_add(bytes, std::memory_order_relaxed);
+            messagesOut.fetch_add(messages, std::memory_order_relaxed);
+        }
+
+        /// Count an IO retried after `SSLStatus::eWantRead`
+        inline void addWantRead() {
+            wantReadRetries.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        /// Count an IO retried after `SSLStatus::eWantWrite`
+        inline void addWantWrite() {
+            wantWriteRetries.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        /// Count a timeout
+        inline void addTimeout() {
+            timeouts.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        /// Count a kicked client
+        inline void addKick() {
+            kicks.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        /// Count a failed handshake
+        inline void addHandshakeFailure() {
+            handshakeFailures.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        /**
+         * @brief Count a completed handshake
+         * @param durationMs How long it took, in milliseconds
+         */
+        void addHandshake(float durationMs);
+
+        /// Copy all counters into `out`. Gauges are left untouched.
+        void addTo(MetricsSnapshot &out) const;
+
+        /// Overwrite all counters with those of `rhs`. Used when the owner is moved.
+        void copyFrom(const NetMetrics &rhs);
+    };
+
+    /**
+     * @brief Publishes the metrics of servers, clients and peers in the Prometheus text exposition format (v0.0.4).
+     *        Every registered source is a label value (`source="<name>"`), and per-client metrics of `SSLServer`s
+     *        additionally have `client="<uuid>"`.
+     *
+     *        The text can be written to a file (i.e. for node_exporter's textfile collector) with `writeFile`, or
+     *        served on a local socket with `listen` and `tick`: Each connection gets a HTTP/1.0 response with the
+     *        current metrics and is then closed, so Prometheus can scrape it directly. Sources are only read while
+     *        rendering, so exporting costs nothing in between. Sources can be added, removed and rendered from any
+     *        thread, but `listen`, `tick` and `close` must not be called concurrently.
+     */
+    class MetricsExporter {
+    public:
+        using Source = std::function<MetricsSnapshot()>; //!< Gets the totals of a source
+        /// Gets per-client snapshots of a source, as (client label, snapshot) pairs.
+        using ClientSource = std::function<std::vector<std::pair<std::string, MetricsSnapshot>>()>;
+
+    private:
+        /// A registered source
+        struct SourceEntry {
+            std::string name; //!< Value of the `source` label
+            Source totals; //!< See `Source`
+            ClientSource clients; //!< See `ClientSource`. May be empty.
+        };
+
+        std::vector<SourceEntry> sources; //!< Registered sources. Guarded by `sourcesMtx`
+        std::mutex sourcesMtx; //!< Mutex guarding `sources`
+
+        /// A scraper waiting for its response. See `tick`
+        struct PendingConn {
+            int fd; //!< Socket of the connection
+            std::chrono::steady_clock::time_point accepted; //!< Time the connection was accepted
+            std::string request; //!< Bytes of the request received so far
+        };
+
+        int listenSock = -1; //!< Socket from `listen`, or -1
+        std::string unixPath; //!< Path the `listenSock` is bound to if it's a Unix socket, to unlink on `close`.
+        std::vector<PendingConn> pending; //!< Accepted connections that haven't been answered yet
+
+        /// Answer a connection with the current metrics and close it.
+        void respond(const PendingConn &conn);
+
+    public:
+        MetricsExporter() = default; //!< Default constructor
+
+        ~MetricsExporter(); //!< Destructor. Calls `close()`.
+
+        MetricsExporter(const MetricsExporter &rhs) = delete; //!< Deleted copy constructor
+        MetricsExporter &operator=(const MetricsExporter &rhs) = delete; //!< Deleted copy assignment operator
+
+        /**
+         * @brief Register a source. A source with the same name is replaced.
+         * @param name Value of the `source` label
+         * @param totals Called for the totals of the source every time the metrics are rendered.
+         * @param clients Called for per-client metrics every time the metrics are rendered. May be `nullptr`.
+         */
+        void addSource(const std::string &name, const Source &totals, const ClientSource &clients = nullptr);
+
+        /**
+         * @brief Register a `SSLServer`. It must outlive this exporter, or be `removeSource`d first.
+         * @param name Value of the `source` label
+         * @param serv Server to export. Per-client metrics are exported if enabled with `SSLServer::setClientMetrics`
+         */
+        void addSource(const std::string &name, SSLServer &serv);
+
+        /**
+         * @brief Register a `ShardedSSLServer`, summed across shards. It must outlive this exporter, or be
+         *        `removeSource`d first.
+         * @param name Value of the `source` label
+         * @param serv Server to export. Per-client metrics are exported if enabled with `setClientMetrics`
+         */
+        void addSource(const std::string &name, ShardedSSLServer &serv);
+
+        /**
+         * @brief Register a `SSLClient`. It must outlive this exporter, or be `removeSource`d first.
+         * @param name Value of the `source` label
+         * @param cli Client to export
+         */
+        void addSource(const std::string &name, SSLClient &cli);
+
+        /**
+         * @brief Register a `UDPPeer`. It must outlive this exporter, or be `removeSource`d first.
+         * @param name Value of the `source` label
+         * @param peer Peer to export
+         */
+        void addSource(const std::string &name, UDPPeer &peer);
+
+        /**
+         * @brief Unregister a source
+         * @param name Name passed to `addSource`
+         */
+        void removeSource(const std::string &name);
+
+        /**
+         * @brief Render the metrics of every source in the Prometheus text format.
+         * @return The metrics
+         */
+        std::string render();
+
+        /**
+         * @brief Write the metrics to a file. The file is replaced atomically (written next to it, then renamed),
+         *        so readers never see half of it.
+         * @param path Path of the file
+         * @return True if successful
+         */
+        bool writeFile(const std::string &path);
+
+        /**
+         * @brief Serve the metrics on a Unix socket. Connections are answered in `tick()`.
+         * @param path Path to bind the socket to. An existing socket file there is replaced.
+         * @return True if successful
+         */
+        bool listen(const std::string &path);
+
+        /**
+         * @brief Serve the metrics on the loopback interface (127.0.0.1). Connections are answered in `tick()`.
+         * @param port TCP port to listen on
+         * @return True if successful
+         */
+        bool listen(uint16_t port);
+
+        /**
+         * @brief Accept connections on the socket from `listen` and answer those that sent their request (or waited
+         *        `metricsRequestWaitMs` without sending anything). Only blocks if a scraper doesn't read its response,
+         *        for at most `metricsRequestWaitMs` at a time.
+         */
+        void tick();
+
+        void close(); //!< Stop listening and drop pending connections. Registered sources are kept.
+    };
+}
+
+#endif //__STONEMASON_NET_METRICS_HPP
@@ -14,9 +14,16 @@
 
 #include "openssl/ssl.h"
 #include <string>
+#include <memory>
+#include <mutex>
+#include <atomic>
 #include <netdb.h>
 #include <stms/async.hpp>
 
+#include "stms/net/uring.hpp"
+#include "stms/net/packet_pool.hpp"
+#include "stms/net/impairment.hpp"
+
 #include <sys/socket.h>
 #include <sys/poll.h>
 
@@ -37,6 +44,20 @@ namespace stms {
         eReadReady = POLLIN
     };
 
+    /// Mechanism a server uses to find out which sockets have data to process. See `_stms_PlainBase::setIoBackend`.
+    enum class IOBackend : uint8_t {
+        /// Every `tick()` checks every socket individually. Works everywhere, but is O(number of clients) in syscalls.
+        ePoll,
+        /// Sockets are registered once with an `EventLoop` (`epoll`), and only sockets that are ready are processed.
+        eEpoll,
+        /**
+         * IO is submitted and completed through an `IOUring`: Multishot receives into kernel-provided buffers and
+         * batched sends for `UDPPeer`, and multishot accept/poll for `SSLServer`. Requires Linux 6.0+. Falls back
+         * to `eEpoll` (or `ePoll` for `UDPPeer`, which only has 1 socket) if io_uring is unavailable.
+         */
+        eIOUring
+    };
+
     /**
      * @brief Base class for all servers and clients, both plain and (D)TLS.
      */
@@ -56,11 +77,22 @@ namespace stms {
 
         unsigned timeoutMs = 15000; //!< Number of milliseconds to wait for IO before kicking peer.
         int maxTimeouts = 9; //!< Maximum number of times an IO operation can time out before giving up.
+        int listenBacklog = tcpListenBacklog; //!< Backlog passed to `listen` by TCP servers. See `setListenBacklog`.
 
         bool running = false; //!< Bool of if the server/client is online.
 
         stms::PoolLike *pPool{}; //!< Pool to submit tasks to.
 
+        IOBackend ioBackend = IOBackend::ePoll; //!< How readiness is detected. See `setIoBackend`
+        bool edgeTriggered = false; //!< If true and `ioBackend` is `eEpoll`, sockets are registered with `EPOLLET`.
+
+        std::shared_ptr<IOUring> uring; //!< io_uring used if `ioBackend` is `eIOUring`, `nullptr` otherwise.
+        std::mutex uringMtx; //!< Mutex serializing submissions to and completions from `uring`.
+        int uringWakeFd = -1; //!< `eventfd` polled by `uring`, so that other threads can interrupt `waitUring`.
+        std::atomic_bool uringWaiting{false}; //!< True while a thread is blocked in `waitUring`.
+
+        std::shared_ptr<NetImpairment> impairment; //!< Shim outgoing datagrams go through, or `nullptr`. See `setImpairment`.
+
         explicit _stms_PlainBase(bool isServ, stms::PoolLike *pool, bool isUdp); //!< Internal constructor.
 
         virtual void onStart() {}; //!< Internal overridable handler. Don't touch
@@ -68,6 +100,38 @@ namespace stms {
 
         bool tryAddr(addrinfo *addr, int num); //!< Attempt to use an address from `pAddrCandidates`. For internal implementation.
 
+        /**
+         * @brief Create `uring` and register `sock` with it as fixed file 0. Called from `onStart` of subclasses that
+         *        support `IOBackend::eIOUring`.
+         * @param numBufs Number of buffers for multishot receives. If 0, no buffer ring is set up.
+         * @param bufSize Size of each buffer
+         * @return True if successful. If false, `uring` is `nullptr` and the caller should fall back.
+         */
+        bool startUring(unsigned numBufs = 0, unsigned bufSize = 0);
+
+        /// Cancel everything pending on `uring` and destroy it. Called from `stop()` after `onStop()`.
+        void stopUring();
+
+        /// Interrupt a `waitUring` in progress on another thread, so that newly queued requests get submitted.
+        void wakeUring();
+
+        /**
+         * @brief Submit anything queued on `uring` and collect the completions. Internal wake-ups are filtered out.
+         * @param out Vector to append completions to.
+         * @return False if `uring` isn't in use.
+         */
+        bool reapUring(std::vector<UringCompletion> &out);
+
+        /**
+         * @brief Submit anything queued on `uring`, then block until there are completions or `toMs` runs out.
+         * @param toMs Maximum number of milliseconds to block
+         * @return False if `uring` isn't in use.
+         */
+        bool waitUring(int toMs);
+
+        /// Wrap a datagram BIO with `impairment`, if there is one. Internal impl detail.
+        BIO *impairBio(BIO *bio, int sharedFd = -1);
+
         _stms_PlainBase() = default; //!< Protected default constructor
         virtual ~_stms_PlainBase(); //!< Virtual destructor
 
@@ -123,6 +187,16 @@ namespace stms {
             maxTimeouts = newMax;
         }
 
+        /**
+         * @brief Set `listenBacklog`, the number of connections the kernel queues for a TCP server before they are
+         *        accepted. Connection storms beyond it are dropped (or SYN-cookied) by the kernel. Only takes effect on
+         *        the next `start()`. Capped by `net.core.somaxconn`.
+         * @param backlog Size of the backlog. See `man listen`.
+         */
+        inline void setListenBacklog(int backlog) {
+            listenBacklog = backlog;
+        }
+
         /**
          * @brief Controls what address to bind on (server) or connect to (client). See `man getaddrinfo`
          * @param port Either port number ("80") or service name ("http"). See https://www.iana.org/assignments/service-names-port-numbers/service-names-port-numbers.xhtml
@@ -138,6 +212,20 @@ namespace stms {
             wantV6 = preferV6;
         }
 
+        /**
+         * @brief Set the mechanism used to find sockets with pending IO. Only takes effect on the next `start()`.
+         *        Currently only `SSLServer` and `UDPPeer` make use of this; everything else ignores it.
+         *        **Note: With `IOBackend::eEpoll`, `tick()` and `waitEvents()` must be called from the same thread.**
+         * @param backend `IOBackend::eEpoll` is recommended for servers with many clients. `IOBackend::eIOUring`
+         *                additionally batches syscalls on recent kernels. See `IOBackend` for fallbacks.
+         * @param edge If true, sockets are registered edge-triggered (`EPOLLET`) and are drained completely each time
+         *             they become ready. Otherwise, they are level-triggered and re-armed after each read.
+         */
+        inline void setIoBackend(IOBackend backend, bool edge = false) {
+            ioBackend = backend;
+            edgeTriggered = edge;
+        }
+
         /**
          * @brief Get `timeoutMs`
          * @return unsigned Number of milliseconds to wait for IO operations before giving up.
@@ -145,6 +233,32 @@ namespace stms {
         [[nodiscard]] inline unsigned getTimeout() const {
             return timeoutMs;
         }
+
+        /**
+         * @brief Query if this is a server (bound to the host address) or a client (connected to it).
+         * @return True for servers
+         */
+        [[nodiscard]] inline bool isServer() const {
+            return isServ;
+        }
+
+        /**
+         * @brief Send every outgoing datagram through a `NetImpairment` shim, to simulate a bad network. Only applies
+         *        to UDP (`UDPPeer` and DTLS), and sends with `IOBackend::eIOUring` and `MSG_ZEROCOPY` fall back to
+         *        regular sends while it is set. Must be called before `start()`.
+         * @param shim Shim to use, or `nullptr` to send straight to the socket again. May be shared between transports.
+         */
+        inline void setImpairment(const std::shared_ptr<NetImpairment> &shim) {
+            impairment = shim;
+        }
+
+        /**
+         * @brief Get the shim set with `setImpairment`
+         * @return The shim, or `nullptr` if there is none.
+         */
+        [[nodiscard]] inline const std::shared_ptr<NetImpairment> &getImpairment() const {
+            return impairment;
+        }
     };
 }
 
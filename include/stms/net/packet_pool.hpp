@@ -0,0 +1,136 @@
+/**
+ * @file stms/net/packet_pool.hpp
+ * @brief Provides `PacketBuffer`, a reference-counted buffer allocated from a slab-based pool with per-thread caches.
+ *        Used for the receive and send paths of everything in stms/net.
+ */
+
+#pragma once
+
+#ifndef __STONEMASON_NET_PACKET_POOL_HPP
+#define __STONEMASON_NET_PACKET_POOL_HPP
+//!< Include guard
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+#include "stms/config.hpp"
+
+namespace stms {
+
+    /// Header placed in front of the data of every `PacketBuffer`. Internal impl detail.
+    struct alignas(16) _stms_PacketHeader {
+        std::atomic<uint32_t> refs; //!< Number of `PacketBuffer`s referring to this buffer.
+        uint32_t size; //!< Number of bytes of the buffer in use
+        uint32_t capacity; //!< Number of bytes following this header
+        uint8_t sizeClass; //!< Index of the size class this was allocated from, or 0xFF if it was `new`ed.
+    };
+
+    /**
+     * @brief Reference-counted handle to a packet buffer. Copying a `PacketBuffer` shares the buffer; it is returned
+     *        to the pool once the last handle is destroyed. Buffers up to `packetPoolMaxSize` bytes are pooled, larger
+     *        ones fall back to the heap.
+     *
+     *        Allocation and release are thread-safe. Each thread keeps a small cache of free buffers, so allocating
+     *        and releasing on the same thread usually doesn't take any locks.
+     */
+    class PacketBuffer {
+    private:
+        _stms_PacketHeader *hdr = nullptr; //!< Buffer this handle refers to, or `nullptr` if it is empty.
+
+        explicit PacketBuffer(_stms_PacketHeader *h) : hdr(h) {} //!< Adopt `h` without touching its reference count.
+
+        void release(); //!< Drop this handle's reference and return the buffer to the pool if it was the last one.
+
+    public:
+        PacketBuffer() = default; //!< Construct an empty handle.
+
+        ~PacketBuffer() { release(); } //!< Drops the reference held by this handle.
+
+        PacketBuffer(const PacketBuffer &rhs) noexcept; //!< Copy constructor. Shares the buffer.
+        PacketBuffer &operator=(const PacketBuffer &rhs) noexcept; //!< Copy assignment operator. Shares the buffer.
+
+        PacketBuffer(PacketBuffer &&rhs) noexcept; //!< Move constructor
+        PacketBuffer &operator=(PacketBuffer &&rhs) noexcept; //!< Move assignment operator
+
+        /**
+         * @brief Get a buffer from the pool. The contents are uninitialized.
+         * @param capacity Minimum number of bytes the buffer should be able to hold
+         * @return New buffer with `size() == capacity`
+         */
+        static PacketBuffer alloc(std::size_t capacity);
+
+        /**
+         * @brief Get a buffer from the pool holding a copy of `len` bytes of `src`.
+         * @param src Data to copy
+         * @param len Number of bytes to copy
+         * @return New buffer with `size() == len`
+         */
+        static PacketBuffer copyOf(const uint8_t *src, std::size_t len);
+
+        /**
+         * @brief Take a reference to the buffer that `data` points to the start of. This lets receive callbacks that
+         *        are handed a raw `uint8_t *` keep the buffer around after the callback returns without copying it.
+         *        `data` is looked up in the pool's allocations and never dereferenced, so any pointer is safe to pass.
+         * @param data Data pointer received in a callback
+         * @return Handle to the buffer, or an empty handle if `data` isn't the start of a live `PacketBuffer`, in which
+         *         case you must copy it.
+         */
+        static PacketBuffer retain(const uint8_t *data);
+
+        /**
+         * @brief Get the data of this buffer
+         * @return Pointer to `capacity()` bytes, or `nullptr` if this handle is empty.
+         */
+        [[nodiscard]] inline uint8_t *data() const {
+            return hdr == nullptr ? nullptr : reinterpret_cast<uint8_t *>(hdr + 1);
+        }
+
+        /**
+         * @brief Get the number of bytes of the buffer in use. See `setSize`.
+         * @return Size in bytes
+         */
+        [[nodiscard]] inline std::size_t size() const {
+            return hdr == nullptr ? 0 : hdr->size;
+        }
+
+        /**
+         * @brief Set the number of bytes of the buffer in use. Shared by all handles to the buffer.
+         * @param newSize New size in bytes. Must not exceed `capacity()`.
+         */
+        inline void setSize(std::size_t newSize) {
+            hdr->size = static_cast<uint32_t>(newSize);
+        }
+
+        /**
+         * @brief Get the number of bytes the buffer can hold.
+         * @return Capacity in bytes
+         */
+        [[nodiscard]] inline std::size_t capacity() const {
+            return hdr == nullptr ? 0 : hdr->capacity;
+        }
+
+        /**
+         * @brief Get the number of handles sharing this buffer.
+         * @return Reference count, or 0 if this handle is empty.
+         */
+        [[nodiscard]] inline unsigned useCount() const {
+            return hdr == nullptr ? 0 : hdr->refs.load(std::memory_order_acquire);
+        }
+
+        /// Drop the reference to the buffer, leaving this handle empty.
+        inline void reset() {
+            release();
+        }
+
+        /**
+         * @brief Query if this handle refers to a buffer
+         * @return False if this handle is empty
+         */
+        explicit inline operator bool() const {
+            return hdr != nullptr;
+        }
+    };
+}
+
+#endif //__STONEMASON_NET_PACKET_POOL_HPP
@@ -1,11 +1,495 @@
+/**
+ * @file stms/net/plain_tcp.hpp
+ * @brief Provides unencrypted TCP servers and clients (`TCPServer` and `TCPClient`) with the same interface as
+ *        `SSLServer` and `SSLClient`, for trusted networks where TLS is pure overhead.
+ * @author Grant Yang (rotartsi0482@gmail.com)
+ * @date 4/22/21
+ */
+
+#pragma once
+
+#ifndef __STONEMASON_NET_PLAIN_TCP_HPP
+#define __STONEMASON_NET_PLAIN_TCP_HPP
+//!< Include guard
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+#include <sys/uio.h>
+
+#include "stms/net/net.hpp"
+#include "stms/net/event_loop.hpp"
+#include "stms/net/framing.hpp"
+#include "stms/util/uuid.hpp"
+#include "stms/util/striped_map.hpp"
 
 namespace stms {
-    class TCPServer {
-        private:
+    /**
+     * @brief A connected TCP socket and the messages waiting to be written to it. Shared by `TCPServer` (1 per client)
+     *        and `TCPClient`. Internal impl detail, don't touch.
+     */
+    struct TCPConnection {
+        /// A message waiting in `sendQueue` for the writer task.
+        struct PendingWrite {
+            PacketBuffer buf; //!< Copy of the message, if it was sent with `copy`
+            iovec iov{}; //!< The message, if it is a single buffer (or was copied)
+            std::vector<iovec> iovs; //!< The parts of the message, if it was passed to `sendv` as several buffers
+            std::size_t len = 0; //!< Total length of the message in bytes
+            std::shared_ptr<std::promise<int>> prom; //!< Promise returned from `send`
+        };
+
+        int sock = -1; //!< Socket file descriptor. Closed when this object is destroyed.
+        std::string addrStr{}; //!< Peer's address as a ${host}:${port} string
+        sockaddr_storage addr{}; //!< Peer's address
+        socklen_t addrLen{}; //!< Size of `addr`
+
+        std::atomic<uint8_t> readState{0}; //!< 0 = idle, 1 = a task is draining the socket. See `TCPServer::drainClient`
+        /// `steady_clock` time (as a count since its epoch) data was last received. See `touch`
+        std::atomic<std::chrono::steady_clock::rep> lastActive{0};
+        std::unique_ptr<MessageFramer> framer; //!< Reassembles messages with `setFramedRecvCallback`. Only touched by the read task.
+
+        std::mutex sendMtx; //!< Guards everything below
+        std::deque<PendingWrite> sendQueue; //!< Messages waiting to be written by the writer task
+        std::size_t queuedBytes = 0; //!< Total length of the unwritten parts of the messages in `sendQueue`
+        std::size_t frontWritten = 0; //!< Number of bytes of `sendQueue.front()` already written
+        bool writerActive = false; //!< True if a writer task was submitted and hasn't emptied `sendQueue` yet.
+        bool wantWritable = false; //!< True if a `send()` was refused, so the writable callback should be called.
+
+        TCPConnection() = default; //!< Default constructor
+        ~TCPConnection(); //!< Destructor. Closes `sock` and fails the unwritten messages with -1.
+
+        TCPConnection(const TCPConnection &rhs) = delete; //!< Deleted copy constructor
+        TCPConnection &operator=(const TCPConnection &rhs) = delete; //!< Deleted copy assignment operator
 
+        /// Record that data was received just now, pushing back the idle timeout. Safe to call from any thread.
+        inline void touch() {
+            lastActive.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+        }
+
+        /**
+         * @brief Query if nothing was received for `timeoutMs`. Safe to call from any thread.
+         * @param timeoutMs Idle timeout in milliseconds
+         * @return True if the last `touch` was at least `timeoutMs` ago.
+         */
+        [[nodiscard]] inline bool isIdleFor(unsigned timeoutMs) const {
+            auto last = std::chrono::steady_clock::time_point(
+                    std::chrono::steady_clock::duration(lastActive.load(std::memory_order_relaxed)));
+            return std::chrono::steady_clock::now() - last >= std::chrono::milliseconds(timeoutMs);
+        }
+
+        /**
+         * @brief Resolve the promises of every message in `sendQueue` and clear it. Requires `sendMtx`.
+         * @param code Value to resolve the promises with
+         */
+        void failPendingSends(int code);
+
+        /**
+         * @brief Queue a message. Internal impl detail of `TCPServer::sendv` and `TCPClient::sendv`.
+         * @param iov Parts of the message
+         * @param iovCnt Number of parts
+         * @param copy If true, the parts are gathered into a single copy.
+         * @param high High watermark. The message is refused with -4 if it would take `queuedBytes` past this.
+         * @param prom Promise to resolve once the message is written
+         * @return True if the caller has to submit a writer task (`writerActive` was false).
+         */
+        bool queue(const iovec *iov, std::size_t iovCnt, bool copy, std::size_t high,
+                   const std::shared_ptr<std::promise<int>> &prom);
+
+        /**
+         * @brief Write out `sendQueue` until it's empty, with up to `tcpWriteBatch` messages per `sendmsg`.
+         *        Only 1 thread may call this at a time (the one that got true from `queue`). Internal impl detail.
+         * @param ioTimeoutMs Max time to wait for the socket to become writable before counting a timeout
+         * @param maxTimeouts Max number of timeouts in a row before giving up
+         * @param low Low watermark. `onWritable` is called once the queue drains to it after a refused `send()`.
+         * @param onWritable Writable callback, called without holding `sendMtx`.
+         * @return 0 if everything was written, -2 on a socket error or -3 on timeout. The rest of the queue is failed
+         *         with the same value.
+         */
+        int writeQueued(unsigned ioTimeoutMs, int maxTimeouts, std::size_t low, const std::function<void()> &onWritable);
     };
 
-    class TCPClient {
-        
+    /**
+     * @brief Unencrypted TCP server with the same interface as `SSLServer`: Clients are addressed by UUID, data is
+     *        delivered to callbacks on the pool, and `send()` returns a future. Readiness is detected with an
+     *        `EventLoop` (or `poll` where `epoll` is unavailable), every readable client is drained by one pool task,
+     *        and messages queued to a client are written by one writer task with `sendmsg`, many at a time.
+     */
+    class TCPServer : public _stms_PlainBase {
+    private:
+        /// Table of connected clients. Lookups only lock 1 stripe, so `send()` etc. don't contend with `tick()`.
+        StripedMap<UUID, std::shared_ptr<TCPConnection>> clients{clientTableStripes};
+        /// Serializes inserting into & removing from `clients`, and guards `fdClients`.
+        std::mutex clientsMtx;
+        std::unordered_map<int, UUID> fdClients; //!< Client fd -> UUID, for events from `loop`. Guarded by `clientsMtx`
+        std::queue<UUID> deadClients; //!< Queue of clients to be disconnected in `tick`. Guarded by `deadMtx`
+        std::mutex deadMtx; //!< Mutex guarding `deadClients`. Never held while locking anything else.
+
+        std::unique_ptr<EventLoop> loop; //!< Reactor watching the listening socket & clients. `nullptr` if unavailable.
+        std::vector<FDEvent> readyEvents; //!< Events from `waitEvents` to be handled in the next `tick`.
+
+        bool noDelay = true; //!< If true, clients are accepted with `TCP_NODELAY`. See `setNoDelay`
+        std::size_t highWatermark = sendHighWatermark; //!< Queued bytes at which `send()` starts refusing. See `setSendWatermarks`
+        std::size_t lowWatermark = sendLowWatermark; //!< Queued bytes at which `writableCallback` is called. See `setSendWatermarks`
+
+        /**
+         * @brief Called asynchronously for each chunk of data received from a client. Same as
+         *        `SSLServer::recvCallback`, except that TCP is a byte stream: Chunks don't line up with `send()`s.
+         *        The data is only valid until the callback returns. Use `PacketBuffer::retain` to keep it around.
+         */
+        std::function<void(const UUID &, const sockaddr *const, uint8_t *, int)> recvCallback = [](
+                const UUID &, const sockaddr *const, uint8_t *, int) {};
+
+        /// Called from `tick()` for each client that connects. Same as `SSLServer::connectCallback`
+        std::function<void(const UUID &, const sockaddr *const)> connectCallback = [](const UUID &,
+                                                                                      const sockaddr *const) {};
+
+        /// Called from `tick()` for each client that disconnects or is kicked. Same as `SSLServer::disconnectCallback`
+        std::function<void(const UUID &, const sockaddr *const)> disconnectCallback = [](const UUID &,
+                                                                                         const sockaddr *const) {};
+
+        /// Called asynchronously when a client that `send()` refused drained to the low watermark. See `SSLServer::writableCallback`
+        std::function<void(const UUID &)> writableCallback = [](const UUID &) {};
+
+        /// Called asynchronously with every complete length-prefixed message. See `setFramedRecvCallback`
+        std::function<void(const UUID &, const sockaddr *const, uint8_t *, int)> framedRecvCallback;
+        std::size_t maxFramedLen = framerMaxMessageLen; //!< Max payload length with `framedRecvCallback`.
+
+        void acceptClients(); //!< `accept` every pending connection. Internal impl detail.
+
+        /// Start a read task for a readable client, if there isn't one already. Internal impl detail.
+        void dispatchRead(const std::shared_ptr<TCPConnection> &cli, const UUID &uuid);
+
+        /// Read from a client until the socket is empty, then re-arm it in `loop`. Internal impl detail.
+        void drainClient(const std::shared_ptr<TCPConnection> &cli, const UUID &uuid);
+
+        /// Writer task of a client. Internal impl detail.
+        void flushClient(const std::shared_ptr<TCPConnection> &cli, const UUID &uuid);
+
+        /// Queue a client to be disconnected in `tick`. Internal impl detail.
+        void markDead(const UUID &uuid);
+
+        /// Unregister a client from `loop` & `fdClients` and close it. Requires `clientsMtx`. Internal impl detail.
+        void dropClient(const UUID &uuid, const std::shared_ptr<TCPConnection> &cli);
+
+        void onStart() override; //!< Hook called in `start`. Internal impl detail.
+        void onStop() override; //!< Hook called in `stop`. Internal impl detail.
+
+    public:
+        /**
+         * @brief Constructor
+         * @param pool `ThreadPool` to submit async tasks to.
+         */
+        explicit TCPServer(stms::PoolLike *pool);
+
+        ~TCPServer() override; //!< Destructor. Stops the server if it is running.
+
+        TCPServer(const TCPServer &rhs) = delete; //!< Deleted copy constructor
+        TCPServer &operator=(const TCPServer &rhs) = delete; //!< Deleted copy assignment operator
+
+        /**
+         * @brief Set the new `recvCallback`. See documentation for `stms::TCPServer::recvCallback`
+         * @param newCb The new callback to replace the old one
+         */
+        inline void
+        setRecvCallback(const std::function<void(const UUID &, const sockaddr *const, uint8_t *, int)> &newCb) {
+            recvCallback = newCb;
+        }
+
+        /**
+         * @brief Set the new `connectCallback`. See documentation for `stms::TCPServer::connectCallback`
+         * @param newCb The new callback to replace the old one
+         */
+        inline void setConnectCallback(const std::function<void(const UUID &, const sockaddr *const)> &newCb) {
+            connectCallback = newCb;
+        }
+
+        /**
+         * @brief Set the new `disconnectCallback`. See documentation for `stms::TCPServer::disconnectCallback`
+         * @param newCb The new callback to replace the old one
+         */
+        inline void setDisconnectCallback(const std::function<void(const UUID &, const sockaddr *const)> &newCb) {
+            disconnectCallback = newCb;
+        }
+
+        /**
+         * @brief Set the new `writableCallback`. See documentation for `stms::TCPServer::writableCallback`
+         * @param newCb The new callback to replace the old one
+         */
+        inline void setWritableCallback(const std::function<void(const UUID &)> &newCb) {
+            writableCallback = newCb;
+        }
+
+        /**
+         * @brief Receive length-prefixed messages instead of raw chunks of the stream. See
+         *        `SSLServer::setFramedRecvCallback`. Must be called before `start()`.
+         * @param newCb Callback to call with every complete message. Pass `nullptr` to go back to `recvCallback`.
+         * @param maxMessageLen Max payload length of a message. Clients sending longer ones are dropped.
+         */
+        inline void setFramedRecvCallback(const std::function<void(const UUID &, const sockaddr *const, uint8_t *, int)> &newCb,
+                                          std::size_t maxMessageLen = framerMaxMessageLen) {
+            framedRecvCallback = newCb;
+            maxFramedLen = maxMessageLen;
+        }
+
+        /**
+         * @brief Control Nagle's algorithm for clients accepted afterwards. With `TCP_NODELAY` (the default), small
+         *        writes go out immediately instead of waiting to be merged with later ones. The writer task already
+         *        merges queued messages into one `sendmsg`, so this is usually what you want. See `setCork` for
+         *        batching explicitly.
+         * @param enable If true, set `TCP_NODELAY` on accepted sockets.
+         */
+        inline void setNoDelay(bool enable) {
+            noDelay = enable;
+        }
+
+        /**
+         * @brief Cork or uncork a client's socket (`TCP_CORK`). While corked, the kernel only sends full segments,
+         *        so a burst of small `send()`s goes out in as few packets as possible. Uncorking flushes the rest.
+         * @param cli UUID of the client
+         * @param cork If true, cork. Otherwise, uncork and flush.
+         * @return False if `cli` doesn't exist or corking isn't supported on this platform.
+         */
+        bool setCork(const UUID &cli, bool cork);
+
+        /**
+         * @brief Bound how much data may be queued to a single client. Same as `SSLServer::setSendWatermarks`.
+         * @param high Max number of queued bytes. Defaults to `sendHighWatermark`.
+         * @param low Number of queued bytes at which the client is writable again. Defaults to `sendLowWatermark`.
+         */
+        inline void setSendWatermarks(std::size_t high, std::size_t low) {
+            highWatermark = high;
+            lowWatermark = low;
+        }
+
+        /**
+         * @brief Get the number of bytes queued to a client that haven't been written to the socket yet.
+         * @param cli UUID of the client to query
+         * @return Number of bytes, or 0 if `cli` doesn't exist.
+         */
+        std::size_t getQueuedBytes(const UUID &cli);
+
+        /**
+         * @brief Replace the client's UUID with a newly generated UUIDv4
+         * @param client Client UUID to replace
+         * @return Newly generated UUID, or a UUID filled with 0s if no client with the uuid `client` exists.
+         */
+        UUID refreshUuid(const UUID &client);
+
+        /**
+         * @brief Replace a client's uuid with a new one.
+         * @param old Old UUID to replace
+         * @param newUuid New UUID to replace it with.
+         * @return True if a client had uuid `old` and the uuid was updated.
+         */
+        bool setNewUuid(const UUID &old, const UUID &newUuid);
+
+        /**
+         * @brief Generate a list of all the currently connected clients. O(n).
+         * @return A `std::vector` containing all the uuids of the currently connected clients.
+         */
+        std::vector<UUID> getClientUuids();
+
+        /**
+         * @brief Query if a client is connected
+         * @param cli UUID of the client to look for
+         * @return True if a client with the UUID `cli` is connected.
+         */
+        bool hasClient(const UUID &cli);
+
+        /**
+         * @brief Get the number of currently connected clients
+         * @return Number of clients
+         */
+        inline std::size_t getNumClients() {
+            return clients.size();
+        }
+
+        /**
+         * @brief Disconnect a client on the next call to `tick`. Messages still queued to it are dropped.
+         * @param cliId The uuid of the client to kick
+         */
+        void kickClient(const UUID &cliId);
+
+        /**
+         * @brief Send a message to a client. Messages to the same client are written in order.
+         * @param clientUuid UUID of the client to send this message to.
+         * @param msg Data to send
+         * @param msgLen Length of `msg` in bytes
+         * @param cpy If true, `msg` is copied. Otherwise, it must stay valid until the returned future is ready.
+         * @return Same as `SSLServer::send`: The number of bytes sent, 0 if `clientUuid` is invalid, -1 if the server
+         *         is stopped (or the client disconnected first), -2 on a socket error, -3 on timeout and -4 if the
+         *         client's queue is over the high watermark.
+         */
+        inline std::future<int> send(const UUID &clientUuid, const uint8_t *const msg, int msgLen, bool cpy = false) {
+            iovec iov{const_cast<uint8_t *>(msg), static_cast<std::size_t>(msgLen)};
+            return sendv(clientUuid, &iov, 1, cpy);
+        }
+
+        /**
+         * @brief Send a message gathered from several buffers, i.e. a header and a body, without concatenating them.
+         * @param clientUuid UUID of the client to send this message to.
+         * @param iov Parts of the message. The array itself is always copied.
+         * @param iovCnt Number of parts
+         * @param cpy If true, the parts are gathered into a single copy. Otherwise, they must stay valid until the
+         *            returned future is ready.
+         * @return See `send`
+         */
+        std::future<int> sendv(const UUID &clientUuid, const iovec *iov, std::size_t iovCnt, bool cpy = false);
+
+        /**
+         * @brief Block until a client is readable or connecting, for at most `timeoutMs` milliseconds. The ready
+         *        sockets are handled in the next `tick()`, which must be called from the same thread.
+         * @param timeoutMs Maximum amount of time to block for, in milliseconds
+         */
+        void waitEvents(int timeoutMs) override;
+
+        /**
+         * @brief Accept connections, start reading from ready clients and disconnect dead or timed out ones.
+         *        To be called at a regular interval, after `waitEvents`.
+         * @return True if the server is running, otherwise false.
+         */
+        bool tick();
     };
-}
\ No newline at end of file
+
+    /**
+     * @brief Unencrypted TCP client with the same interface as `SSLClient`.
+     */
+    class TCPClient : public _stms_PlainBase {
+    private:
+        std::shared_ptr<TCPConnection> conn; //!< Connection to the server. `nullptr` while stopped.
+        std::atomic_bool peerClosed{false}; //!< Set by the read/writer tasks if the connection broke. Stops in `tick`
+        bool noDelay = true; //!< If true, `TCP_NODELAY` is set on connect. See `setNoDelay`
+        std::size_t highWatermark = sendHighWatermark; //!< Queued bytes at which `send()` starts refusing. See `setSendWatermarks`
+        std::size_t lowWatermark = sendLowWatermark; //!< Queued bytes at which `writableCallback` is called. See `setSendWatermarks`
+
+        /// Called asynchronously for each chunk of data received. See `SSLClient::recvCallback`
+        std::function<void(uint8_t *, size_t)> recvCallback = [](uint8_t *, size_t) {};
+
+        /// Called asynchronously when `send()` returned -4 and the queue drained to the low watermark.
+        std::function<void()> writableCallback = []() {};
+
+        /// Called asynchronously with every complete length-prefixed message. See `setFramedRecvCallback`
+        std::function<void(uint8_t *, size_t)> framedRecvCallback;
+        std::size_t maxFramedLen = framerMaxMessageLen; //!< Max payload length with `framedRecvCallback`.
+
+        void drain(const std::shared_ptr<TCPConnection> &c); //!< Read task. Internal impl detail.
+        void flush(const std::shared_ptr<TCPConnection> &c); //!< Writer task. Internal impl detail.
+
+        void onStart() override; //!< Hook called in `start`. Internal impl detail.
+        void onStop() override; //!< Hook called in `stop`. Internal impl detail.
+
+    public:
+        /**
+         * @brief Constructor
+         * @param pool `ThreadPool` to submit async tasks to.
+         */
+        explicit TCPClient(stms::PoolLike *pool);
+
+        ~TCPClient() override; //!< Destructor. Stops the client if it is running.
+
+        TCPClient(const TCPClient &rhs) = delete; //!< Deleted copy constructor
+        TCPClient &operator=(const TCPClient &rhs) = delete; //!< Deleted copy assignment operator
+
+        /**
+         * @brief Set a new `recvCallback`. See documentation for `stms::TCPClient::recvCallback`
+         * @param newCb New callback to replace the old one with
+         */
+        inline void setRecvCallback(const std::function<void(uint8_t *, size_t)> &newCb) {
+            recvCallback = newCb;
+        }
+
+        /**
+         * @brief Set a new `writableCallback`. See documentation for `stms::TCPClient::writableCallback`
+         * @param newCb New callback to replace the old one with
+         */
+        inline void setWritableCallback(const std::function<void()> &newCb) {
+            writableCallback = newCb;
+        }
+
+        /**
+         * @brief Receive length-prefixed messages instead of raw chunks of the stream. See
+         *        `SSLServer::setFramedRecvCallback`. Takes effect on the next `start()`.
+         * @param newCb Callback to call with every complete message. Pass `nullptr` to go back to `recvCallback`.
+         * @param maxMessageLen Max payload length of a message. Longer ones stop the client.
+         */
+        inline void setFramedRecvCallback(const std::function<void(uint8_t *, size_t)> &newCb,
+                                          std::size_t maxMessageLen = framerMaxMessageLen) {
+            framedRecvCallback = newCb;
+            maxFramedLen = maxMessageLen;
+        }
+
+        /**
+         * @brief Control Nagle's algorithm. See `TCPServer::setNoDelay`. Only takes effect on the next `start()`.
+         * @param enable If true, set `TCP_NODELAY`.
+         */
+        inline void setNoDelay(bool enable) {
+            noDelay = enable;
+        }
+
+        /**
+         * @brief Cork or uncork the socket. See `TCPServer::setCork`
+         * @param cork If true, cork. Otherwise, uncork and flush.
+         * @return False if stopped or corking isn't supported on this platform.
+         */
+        bool setCork(bool cork);
+
+        /**
+         * @brief Bound how much data may be queued. See `SSLClient::setSendWatermarks`
+         * @param high Max number of queued bytes. Defaults to `sendHighWatermark`.
+         * @param low Number of queued bytes at which sending is possible again. Defaults to `sendLowWatermark`.
+         */
+        inline void setSendWatermarks(std::size_t high, std::size_t low) {
+            highWatermark = high;
+            lowWatermark = low;
+        }
+
+        /**
+         * @brief Get the number of bytes passed to `send()` that haven't been written to the socket yet.
+         * @return Number of bytes
+         */
+        std::size_t getQueuedBytes();
+
+        /**
+         * @brief Send a message to the server. Messages are written in order, many per `sendmsg`.
+         * @param data Data to send
+         * @param size Length of `data` in bytes
+         * @param copy If true, `data` is copied. Otherwise, it must stay valid until the returned future is ready.
+         * @return Same as `SSLClient::send`.
+         */
+        inline std::future<int> send(const uint8_t *const data, int size, bool copy = false) {
+            iovec iov{const_cast<uint8_t *>(data), static_cast<std::size_t>(size)};
+            return sendv(&iov, 1, copy);
+        }
+
+        /**
+         * @brief Send a message gathered from several buffers. See `TCPServer::sendv`
+         * @param iov Parts of the message. The array itself is always copied.
+         * @param iovCnt Number of parts
+         * @param copy If true, the parts are gathered into a single copy.
+         * @return Same as `send()`.
+         */
+        std::future<int> sendv(const iovec *iov, std::size_t iovCnt, bool copy = false);
+
+        /**
+         * @brief Block until there is data from the server to read, blocking at maximum `timeoutMs` milliseconds.
+         * @param timeoutMs Maximum amount of time to block for in milliseconds
+         */
+        void waitEvents(int timeoutMs) override;
+
+        /**
+         * @brief Start reading if there is data, and stop if the server disconnected or the connection timed out.
+         *        To be called at a regular interval.
+         * @return True if the client is still running.
+         */
+        bool tick();
+    };
+}
+
+#endif //__STONEMASON_NET_PLAIN_TCP_HPP
@@ -5,8 +5,24 @@
 //!< Include guard
 
 #include "stms/net/net.hpp"
+#include "stms/net/metrics.hpp"
+
+#include <deque>
+#include <sys/uio.h>
 
 namespace stms {
+    /**
+     * @brief A single datagram, as delivered to `UDPPeer`'s batch receive callback or passed to `UDPPeer::sendToMany`.
+     */
+    struct UDPMessage {
+        const sockaddr *addr = nullptr; //!< Address the datagram came from or should go to. May be `nullptr` when sending from a client.
+        socklen_t addrLen = 0; //!< Size in bytes of `addr`. Varies depending on IPv4 or IPv6
+        uint8_t *data = nullptr; //!< Raw data of the datagram
+        ssize_t size = 0; //!< Number of bytes in `data`
+    };
+
+    struct UDPSendReq;
+
     /**
      * @brief Class for UDP Client or server.
      */
@@ -18,14 +34,74 @@ namespace stms {
          * Parameters:
          *      `const sockaddr *const`: The address the packet originated from
          *      `socklen_t`: Size in bytes of the first parameter. Varies depending on IPv4 or IPv6
-         *      `uint8_t *`: Buffer containing raw data of packet
+         *      `uint8_t *`: Buffer containing raw data of packet. Only valid until the callback returns; Use
+         *                   `PacketBuffer::retain` to keep it around without copying.
          *      `ssize_t`: Number of bytes received (length of the previous prameter)
          */
         std::function<void(const sockaddr *const, socklen_t, uint8_t *, ssize_t)> recvCallback = [](
                 const sockaddr *const, socklen_t, uint8_t *, ssize_t) {};
         
+        /**
+         * @brief Callback to be called with every batch of datagrams received. If set, this is called instead of
+         *        `recvCallback`. Parameters:
+         *      `UDPMessage *`: Array of received datagrams. Only valid for the duration of the call; Use
+         *                      `PacketBuffer::retain` on `data` to keep a datagram around without copying.
+         *      `std::size_t`: Number of datagrams in the array
+         */
+        std::function<void(UDPMessage *, std::size_t)> batchRecvCallback;
+
         bool isReading = false; //!< Internal implementation detail. True if data is being received from a peer.
 
+        std::vector<PacketBuffer> recvBufs; //!< `udpBatchSize` pooled buffers for `recvmmsg`. Internal impl detail.
+        std::vector<sockaddr_storage> recvAddrs; //!< Source addresses for `recvmmsg`. Internal impl detail.
+        std::vector<UDPMessage> recvMsgs; //!< Batch of received datagrams passed to the callbacks. Internal impl detail.
+
+        /// Receive up to `udpBatchSize` datagrams into `recvMsgs`. Returns the number received, or -1. Internal impl detail.
+        int recvBatch(int fd);
+
+        /// Hand a batch of datagrams to `batchRecvCallback` or `recvCallback`. Internal impl detail.
+        void deliverBatch(UDPMessage *msgs, std::size_t num);
+
+        msghdr uringRecvHdr{}; //!< Template for multishot `recvmsg` with `IOBackend::eIOUring`. Internal impl detail.
+        bool uringRecvArmed = false; //!< True if the multishot `recvmsg` is still active. Internal impl detail.
+        std::atomic<unsigned> uringSendsInFlight{0}; //!< Sends submitted to `uring` but not completed. Internal impl detail.
+        std::vector<UringCompletion> uringCompletions; //!< Scratch space for `tick`. Internal impl detail.
+        std::vector<UringCompletion> uringRecvPending; //!< Received datagrams not yet handed to `recvCallback`. Internal impl detail.
+
+        void onStart() override; //!< Hook called in `start`. Internal impl detail.
+        void onStop() override; //!< Hook called in `stop`. Internal impl detail.
+
+        bool tickUring(); //!< `tick` for `IOBackend::eIOUring`. Returns false if `uring` isn't in use. Internal impl detail.
+
+        /// Finish a send submitted to `uring`, fulfilling its promise. Internal impl detail.
+        void completeUringSend(const UringCompletion &c);
+
+        /// A `MSG_ZEROCOPY` send whose buffer the kernel may still be reading from.
+        struct ZeroCopySend {
+            uint32_t seq; //!< Sequence number the kernel reports the completion of this send with
+            int sent; //!< Number of bytes sent, to fulfil `prom` with
+            std::shared_ptr<std::promise<int>> prom; //!< Promise returned from `sendToV`
+        };
+
+        bool zeroCopy = false; //!< If true, try to use `MSG_ZEROCOPY` for large sends. See `setZeroCopy`
+        std::size_t zeroCopyMin = zeroCopyMinBytes; //!< Smallest send made with `MSG_ZEROCOPY`. See `setZeroCopy`
+        bool zeroCopyActive = false; //!< True if `SO_ZEROCOPY` was enabled on `sock`. Internal impl detail.
+        std::mutex zeroCopyMtx; //!< Guards `zeroCopySeq` & `zeroCopyPending`, and orders `MSG_ZEROCOPY` sends.
+        uint32_t zeroCopySeq = 0; //!< Sequence number of the next `MSG_ZEROCOPY` send. Internal impl detail.
+        std::deque<ZeroCopySend> zeroCopyPending; //!< Sends waiting for their completion notification. Internal impl detail.
+        std::atomic<uint64_t> zeroCopyCopied{0}; //!< See `getZeroCopyCopied`
+        NetMetrics metrics; //!< See `getMetrics`
+
+        /**
+         * @brief Send a message with `MSG_ZEROCOPY`. On success, `req->prom` is fulfilled once the kernel is done
+         *        with the data. Internal impl detail.
+         * @return Same as `sendmsg`
+         */
+        ssize_t sendZeroCopy(int fd, const UDPSendReq &req);
+
+        /// Fulfil the promises of `MSG_ZEROCOPY` sends completed on the socket error queue. Internal impl detail.
+        void reapZeroCopy();
+
     public:
         /**
          * @brief Construct a new UDPPeer object
@@ -50,6 +126,14 @@ namespace stms {
             recvCallback = n;
         }
 
+        /**
+         * @brief Set the `batchRecvCallback` object. Datagrams are then delivered in batches instead of to `recvCallback`.
+         * @param n New callback (see `batchRecvCallback`). Pass `nullptr` to go back to `recvCallback`.
+         */
+        inline void setBatchRecvCallback(const std::function<void(UDPMessage *, std::size_t)> &n) {
+            batchRecvCallback = n;
+        }
+
         /**
          * @brief Send data to the server. Only works in client `UDPPeer`s that have `connect`ed. 
          * This is an alias for `sendTo(nullptr, 0, data, size, copy);`
@@ -66,7 +150,8 @@ namespace stms {
         }
 
         /**
-         * @brief Send bytes to another peer
+         * @brief Send bytes to another peer. With `IOBackend::eIOUring`, sends are batched and submitted by the thread
+         *        calling `tick()` and `waitEvents()`, so keep ticking for them to go out.
          * 
          * @param addr Address to send bytes to
          * @param addrlen Length of address struct, obtained in `recvCallback`.
@@ -80,6 +165,87 @@ namespace stms {
          */
         std::future<int> sendTo(const sockaddr *const addr, socklen_t addrlen, const uint8_t *const data, size_t size, bool copy = false);
 
+        /**
+         * @brief Send a datagram gathered from several buffers, i.e. a header and a body, without concatenating them
+         *        first. Otherwise identical to `sendTo`.
+         * @param addr Address to send bytes to. May be `nullptr` for client `UDPPeer`s that have `connect`ed.
+         * @param addrlen Length of address struct, obtained in `recvCallback`.
+         * @param iov Array of buffers that make up the datagram. The array itself is always copied.
+         * @param iovCnt Number of buffers in `iov`
+         * @param copy If true, the buffers are gathered into a single copy. Otherwise, it is assumed that they will
+         *             still be there when they are read from directly on another thread. With `setZeroCopy`, this is
+         *             until the returned future is ready.
+         * @return std::future<int> See `sendTo`. If the datagram was sent with `MSG_ZEROCOPY`, the future is only ready
+         *                          once the kernel is done reading from `iov`, which is only noticed by `tick()`.
+         */
+        std::future<int> sendToV(const sockaddr *const addr, socklen_t addrlen, const iovec *iov, std::size_t iovCnt,
+                                 bool copy = false);
+
+        /**
+         * @brief Send a datagram gathered from several buffers to the server. Only works in client `UDPPeer`s.
+         *        This is an alias for `sendToV(nullptr, 0, iov, iovCnt, copy);`
+         * @param iov Array of buffers that make up the datagram
+         * @param iovCnt Number of buffers in `iov`
+         * @param copy See `sendToV`
+         * @return std::future<int> See `sendToV`.
+         */
+        inline std::future<int> sendv(const iovec *iov, std::size_t iovCnt, bool copy = false) {
+            return sendToV(nullptr, 0, iov, iovCnt, copy);
+        }
+
+        /**
+         * @brief Send large datagrams with `MSG_ZEROCOPY` (Linux 5.0+), so the kernel reads them straight from the
+         *        caller's buffers instead of copying them. Only applies to sends with `copy = false` of at least
+         *        `minBytes`. Their futures aren't ready until the kernel notifies us on the socket error queue that
+         *        it no longer needs the buffers, so only free them after that. Must be called before `start()`.
+         *        Ignored with `IOBackend::eIOUring`. Off by default.
+         * @param enable If true, use `MSG_ZEROCOPY` where possible
+         * @param minBytes Smallest send to use `MSG_ZEROCOPY` for. Defaults to `zeroCopyMinBytes`.
+         */
+        inline void setZeroCopy(bool enable, std::size_t minBytes = zeroCopyMinBytes) {
+            zeroCopy = enable;
+            zeroCopyMin = minBytes;
+        }
+
+        /**
+         * @brief Get the number of `MSG_ZEROCOPY` sends the kernel ended up copying anyway, i.e. over loopback or to
+         *        a device without scatter-gather support. If this is most of them, `setZeroCopy` only adds overhead.
+         * @return Number of copied sends since construction
+         */
+        [[nodiscard]] inline uint64_t getZeroCopyCopied() const {
+            return zeroCopyCopied.load(std::memory_order_relaxed);
+        }
+
+        /**
+         * @brief Get the traffic counters of this peer. `queuedMessages` is the number of io_uring sends in flight;
+         *        There are no handshakes, and `mtu` is always 0. See `MetricsExporter` for exporting them.
+         * @return Snapshot of the metrics since construction
+         */
+        [[nodiscard]] MetricsSnapshot getMetrics() const;
+
+        /**
+         * @brief Send many datagrams at once with `sendmmsg`, instead of 1 task and 1 syscall per datagram.
+         *        Destination addresses are always copied. This bypasses the io_uring queue with `IOBackend::eIOUring`.
+         * @param msgs Array of datagrams to send. `addr` may be `nullptr` for client `UDPPeer`s that have `connect`ed.
+         * @param num Number of datagrams in `msgs`
+         * @param copy If true, the data of each message is copied. Otherwise, it is assumed that the data will still
+         *             be there when it is read from directly on another thread.
+         * @return std::future<int> Future that can be used to block until the operation is complete. If there is an error,
+         *                          a negative value is returned; otherwise, the number of datagrams sent is returned.
+         *                          -1 is returned if the `UDPPeer` has not been started. -3 is returned if the operation times out.
+         */
+        std::future<int> sendToMany(const UDPMessage *msgs, std::size_t num, bool copy = false);
+
+        /**
+         * @brief Alias for `sendToMany(msgs.data(), msgs.size(), copy)`
+         * @param msgs Datagrams to send
+         * @param copy If true, the data of each message is copied.
+         * @return std::future<int> See the other overload.
+         */
+        inline std::future<int> sendToMany(const std::vector<UDPMessage> &msgs, bool copy = false) {
+            return sendToMany(msgs.data(), msgs.size(), copy);
+        }
+
         /**
          * @brief Block until there is data from a peer to process or until `toMs` runs out.
          * @param toMs Maximum number of milliseconds to block.
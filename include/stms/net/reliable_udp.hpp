@@ -0,0 +1,365 @@
+/**
+ * @file stms/net/reliable_udp.hpp
+ * @brief Provides `ReliableUDP`, which multiplexes unreliable, reliable-unordered and reliable-ordered channels over
+ *        a single `UDPPeer`. Reliable messages are acknowledged selectively and retransmitted, messages larger than
+ *        the MTU are fragmented, and sending is paced by an AIMD congestion controller. Unlike TCP, a lost packet
+ *        only holds up its own channel (or nothing at all, on unordered channels).
+ */
+
+#pragma once
+
+#ifndef __STONEMASON_NET_RELIABLE_UDP_HPP
+#define __STONEMASON_NET_RELIABLE_UDP_HPP
+//!< Include guard
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "stms/net/plain_udp.hpp"
+
+namespace stms {
+    /// Delivery guarantees of a `ReliableUDP` channel.
+    enum class ChannelType : uint8_t {
+        eUnreliable, //!< Messages may be lost, but never duplicated. Delivered as soon as they are complete.
+        eReliableUnordered, //!< Every message arrives exactly once, in whatever order it completes.
+        eReliableOrdered //!< Every message arrives exactly once, in the order it was sent.
+    };
+
+    /// Snapshot of the connection state `ReliableUDP` keeps per peer. See `ReliableUDP::getStats`.
+    struct ReliableStats {
+        double srttMs = 0; //!< Smoothed round trip time in milliseconds, or 0 if there is no sample yet.
+        double cwnd = 0; //!< Congestion window, in packets.
+        std::size_t inFlight = 0; //!< Reliable packets sent but not acked yet.
+        std::size_t queuedBytes = 0; //!< Bytes of messages passed to `send` that weren't completely acked yet.
+        uint64_t packetsSent = 0; //!< Data packets sent, including retransmissions.
+        uint64_t retransmits = 0; //!< Packets that were declared lost and sent again.
+    };
+
+    /// State `ReliableUDP` keeps for each peer. Internal impl detail, don't touch.
+    struct ReliablePeer {
+        using Clock = std::chrono::steady_clock; //!< Clock used for all timing
+
+        /// A message passed to `ReliableUDP::send`, shared by all of its fragments.
+        struct OutMessage {
+            std::shared_ptr<std::promise<int>> prom; //!< Promise returned from `send`
+            std::size_t len = 0; //!< Length of the message in bytes
+            uint32_t fragsLeft = 0; //!< Number of fragments that weren't acked yet
+        };
+
+        /// A fragment waiting to be sent, with its header already filled in except for the sequence number.
+        struct Fragment {
+            PacketBuffer wire; //!< Header and payload of the datagram
+            bool reliable = false; //!< If true, the fragment is retransmitted until it is acked.
+            int transmissions = 0; //!< Number of times the fragment was sent
+            std::shared_ptr<OutMessage> msg; //!< Message this is part of. `nullptr` for unreliable fragments.
+        };
+
+        /// A reliable fragment sent but not acked yet.
+        struct InFlight {
+            Fragment frag; //!< The fragment
+            Clock::time_point sentAt; //!< Time the fragment was sent with this sequence number
+        };
+
+        /// A message whose fragments are being reassembled.
+        struct Partial {
+            std::vector<uint8_t> data; //!< Reassembled message
+            std::vector<bool> have; //!< Which fragments arrived
+            uint16_t numHave = 0; //!< Number of true entries in `have`
+        };
+
+        /// Receive state of a single channel.
+        struct InChannel {
+            std::map<uint32_t, Partial> partials; //!< Incomplete messages by message id
+            uint32_t nextId = 0; //!< Ordered: Next id to deliver. Unordered: Every id below this was delivered.
+            std::set<uint32_t> deliveredAbove; //!< Unordered: Ids at or after `nextId` that were delivered.
+            std::map<uint32_t, std::vector<uint8_t>> ready; //!< Ordered: Complete messages waiting for earlier ones
+            uint32_t newestId = 0; //!< Unreliable: Newest id delivered
+            uint64_t seenBits = 0; //!< Unreliable: Bit i is set if `newestId - 1 - i` was delivered
+            bool seenAny = false; //!< Unreliable: False until the first message is delivered
+        };
+
+        sockaddr_storage addr{}; //!< Address of the peer
+        socklen_t addrLen = 0; //!< Length of `addr`. 0 if this is the server of a client `UDPPeer`.
+        Clock::time_point lastRecv; //!< Time a datagram was last received from the peer
+
+        uint64_t nextSeq = 0; //!< Sequence number of the next data packet. Only the low 32 bits are sent.
+        uint64_t largestAcked = 0; //!< Largest sequence number acked, plus 1. 0 if nothing was acked yet.
+        std::vector<uint32_t> nextMsgId; //!< Next message id of each channel
+        std::deque<Fragment> sendQueue; //!< Reliable fragments waiting for room in the congestion window
+        std::deque<Fragment> unreliableQueue; //!< Unreliable fragments waiting to be paced out. Not held up by `cwnd`.
+        std::size_t unreliableBytes = 0; //!< Payload bytes in `unreliableQueue`
+        std::map<uint64_t, InFlight> inFlight; //!< Reliable fragments sent but not acked, by sequence number
+        std::size_t queuedBytes = 0; //!< See `ReliableStats::queuedBytes`
+
+        double cwnd = reliableInitialCwnd; //!< Congestion window in packets
+        double ssthresh = reliableMaxCwnd; //!< Slow start threshold in packets
+        Clock::time_point recoveryStart; //!< Losses of packets sent before this don't shrink `cwnd` again.
+        double srttMs = 0; //!< Smoothed round trip time. 0 until the first sample.
+        double rttVarMs = 0; //!< Round trip time variation
+        unsigned rtoBackoff = 1; //!< Multiplier of the retransmission timeout, doubled on every timeout.
+        Clock::time_point nextSendTime; //!< Pacing: Time the next packet may be sent at
+        uint64_t packetsSent = 0; //!< See `ReliableStats::packetsSent`
+        uint64_t retransmits = 0; //!< See `ReliableStats::retransmits`
+
+        uint32_t largestRecv = 0; //!< Largest sequence number received
+        uint64_t recvBits = 0; //!< Bit i is set if `largestRecv - 1 - i` was received
+        bool recvAny = false; //!< False until the first data packet arrives
+        unsigned unackedRecv = 0; //!< Data packets received since the last ack was sent
+        bool ackNow = false; //!< Set when a packet arrives out of order, so it is acked without delay.
+        std::vector<InChannel> inChannels; //!< Receive state of each channel
+        std::size_t recvBytes = 0; //!< Bytes held in `partials` and `ready` of every channel
+
+        /// Get the current retransmission timeout, including backoff.
+        [[nodiscard]] Clock::duration rto() const;
+
+        /// Resolve the promises of every unacked message and clear all send state.
+        void failPendingSends(int code);
+    };
+
+    /**
+     * @brief Reliable and unreliable channels over a `UDPPeer`, without TCP's head-of-line blocking.
+     *
+     *        Channels are added with `addChannel` in the same order on both ends. Every data packet gets a sequence
+     *        number, and the receiver acks the largest one it got together with a bitmap of the 64 before it, so a
+     *        single ack covers many losses. A reliable packet is resent (with a new sequence number) once 3 later
+     *        packets were acked or its retransmission timeout ran out. Messages larger than the MTU are split into
+     *        fragments and reassembled on the other end.
+     *
+     *        The congestion window grows by 1 packet per ack in slow start and by 1 packet per window afterwards,
+     *        and is halved once per round trip that sees a loss (AIMD). Packets are paced evenly over the round trip
+     *        instead of being sent in bursts.
+     *
+     *        Works on both server and client `UDPPeer`s. It takes over the peer's `recvCallback`, so don't set that
+     *        (or `batchRecvCallback`) yourself. Call `tick()` at a regular interval, next to the peer's `tick()`.
+     */
+    class ReliableUDP {
+    private:
+        UDPPeer *peer; //!< Transport. Not owned.
+        std::vector<ChannelType> channels; //!< Type of each channel
+
+        std::mutex peersMtx; //!< Guards `peers`. Never held while calling callbacks.
+        std::unordered_map<std::string, std::unique_ptr<ReliablePeer>> peers; //!< Peers by raw address bytes
+
+        std::size_t mtu = reliableMtu; //!< See `setMtu`
+        std::size_t highWatermark = sendHighWatermark; //!< See `setSendWatermark`
+        std::size_t maxMessageLen = reliableMaxMessageLen; //!< See `setMaxMessageLen`
+        std::size_t recvBufferLen = reliableRecvBufferLen; //!< See `setRecvBufferLen`
+        std::size_t maxPeers = reliableMaxPeers; //!< See `setMaxPeers`
+
+        /**
+         * @brief Called asynchronously with every complete message, from the peer's read task. Parameters:
+         *      `const sockaddr *const`, `socklen_t`: Address of the sender
+         *      `uint8_t`: Channel the message was sent on
+         *      `uint8_t *`, `std::size_t`: The message. Only valid until the callback returns.
+         */
+        std::function<void(const sockaddr *const, socklen_t, uint8_t, uint8_t *, std::size_t)> recvCallback = [](
+                const sockaddr *const, socklen_t, uint8_t, uint8_t *, std::size_t) {};
+
+        /// Called when a peer is dropped because it stopped acking or timed out. Its unacked messages fail with -3.
+        std::function<void(const sockaddr *const, socklen_t)> disconnectCallback = [](const sockaddr *const, socklen_t) {};
+
+        /// A message to be passed to `recvCallback` once `peersMtx` is released.
+        struct Delivery {
+            uint8_t channel; //!< Channel of the message
+            uint8_t *data; //!< Points into the received datagram, or into `owned`
+            std::size_t len; //!< Length of the message
+            std::vector<uint8_t> owned; //!< Reassembled message, if it wasn't delivered straight from the datagram
+        };
+
+        /// Get the key of a peer in `peers`. Internal impl detail.
+        [[nodiscard]] std::string peerKey(const sockaddr *addr, socklen_t addrLen) const;
+
+        /**
+         * @brief Find or create a peer. Requires `peersMtx`. Internal impl detail.
+         * @param remote If true, the peer is only created if there are less than `maxPeers`.
+         * @return The peer, or `nullptr` if it doesn't exist and wasn't created.
+         */
+        ReliablePeer *getPeer(const std::string &key, const sockaddr *addr, socklen_t addrLen, bool remote);
+
+        /// `recvCallback` of `peer`. Internal impl detail.
+        void onDatagram(const sockaddr *addr, socklen_t addrLen, uint8_t *data, std::size_t len);
+
+        /// Handle an ack, returning true if anything new was acked. Requires `peersMtx`. Internal impl detail.
+        bool handleAck(ReliablePeer &p, const uint8_t *data, std::size_t len, ReliablePeer::Clock::time_point now);
+
+        /**
+         * @brief Handle a data packet. Requires `peersMtx`. Internal impl detail.
+         *        Packets that don't fit in the receive limits aren't acked, so reliable ones are resent later.
+         */
+        void handleData(ReliablePeer &p, uint8_t *data, std::size_t len, std::vector<Delivery> &out);
+
+        /// Drop the incomplete messages of a channel. Requires `peersMtx`. Internal impl detail.
+        static void clearPartials(ReliablePeer &p, ReliablePeer::InChannel &ch);
+
+        /// Deliver a complete message, or hold it back until earlier ones arrive on ordered channels. Requires `peersMtx`. Internal impl detail.
+        void completeMessage(ReliablePeer &p, uint8_t channel, uint32_t msgId, Delivery &&msg,
+                             std::vector<Delivery> &out);
+
+        /**
+         * @brief Requeue lost packets. Requires `peersMtx`. Internal impl detail.
+         * @return False if a packet was sent `reliableMaxTransmissions` times, so the peer must be dropped.
+         */
+        bool detectLosses(ReliablePeer &p, ReliablePeer::Clock::time_point now);
+
+        /**
+         * @brief Collect the ack and the data packets `p` may send now into `out`. Requires `peersMtx`.
+         *        Unreliable packets only wait for pacing, so a full congestion window doesn't hold them up.
+         *        Internal impl detail.
+         * @param delayAck If true, a single in-order packet isn't acked yet, so that the next one shares the ack.
+         * @param keep Keeps buffers `out` points to alive, that aren't in `p.inFlight`.
+         */
+        void flushPeer(ReliablePeer &p, ReliablePeer::Clock::time_point now, bool delayAck, std::vector<UDPMessage> &out,
+                       std::vector<PacketBuffer> &keep);
+
+        /// Send the datagrams collected by `flushPeer`. Requires `peersMtx`, as `out` points into `inFlight`. Internal impl detail.
+        void sendCollected(std::vector<UDPMessage> &out);
+
+    public:
+        /**
+         * @brief Constructor. Takes over `peer`'s `recvCallback`.
+         * @param transport `UDPPeer` to send over. Must outlive this object.
+         */
+        explicit ReliableUDP(UDPPeer *transport);
+
+        ~ReliableUDP(); //!< Destructor. Fails unacked messages with -1. Stop the `UDPPeer` before destroying this.
+
+        ReliableUDP(const ReliableUDP &rhs) = delete; //!< Deleted copy constructor
+        ReliableUDP &operator=(const ReliableUDP &rhs) = delete; //!< Deleted copy assignment operator
+
+        /**
+         * @brief Add a channel. Both ends must add the same channels in the same order, before exchanging messages.
+         * @param type Delivery guarantees of the channel
+         * @return Index of the new channel, to pass to `send`.
+         */
+        uint8_t addChannel(ChannelType type);
+
+        /**
+         * @brief Set the `recvCallback`. See documentation for `stms::ReliableUDP::recvCallback`
+         * @param newCb New callback to replace the old one with
+         */
+        inline void setRecvCallback(
+                const std::function<void(const sockaddr *const, socklen_t, uint8_t, uint8_t *, std::size_t)> &newCb) {
+            recvCallback = newCb;
+        }
+
+        /**
+         * @brief Set the `disconnectCallback`. See documentation for `stms::ReliableUDP::disconnectCallback`
+         * @param newCb New callback to replace the old one with
+         */
+        inline void setDisconnectCallback(const std::function<void(const sockaddr *const, socklen_t)> &newCb) {
+            disconnectCallback = newCb;
+        }
+
+        /**
+         * @brief Set the max size of the datagrams sent, header included. Larger messages are fragmented to fit.
+         *        Must be the same on both ends, and must be set before sending anything.
+         * @param bytes Max datagram size. Defaults to `reliableMtu`.
+         */
+        inline void setMtu(std::size_t bytes) {
+            mtu = bytes;
+        }
+
+        /**
+         * @brief Bound how many bytes of unacked messages may be queued to a single peer.
+         * @param high Once this many bytes are queued, `send()` refuses reliable messages with -4. Unreliable messages
+         *             waiting to be sent are bounded by this too, but the oldest ones are dropped to make room instead.
+         *             Defaults to `sendHighWatermark`.
+         */
+        inline void setSendWatermark(std::size_t high) {
+            highWatermark = high;
+        }
+
+        /**
+         * @brief Set the max length of a message. Longer ones are refused by `sendTo()` and dropped when received.
+         *        Should be the same on both ends.
+         * @param bytes Max message length. Defaults to `reliableMaxMessageLen`.
+         */
+        inline void setMaxMessageLen(std::size_t bytes) {
+            maxMessageLen = bytes;
+        }
+
+        /**
+         * @brief Bound how many bytes of incomplete and held back messages are buffered for a single peer.
+         *        Packets past the limit aren't acked, so reliable ones are resent once there is room again.
+         * @param bytes Max buffered bytes per peer. Must be at least `setMaxMessageLen`. Defaults to `reliableRecvBufferLen`.
+         */
+        inline void setRecvBufferLen(std::size_t bytes) {
+            recvBufferLen = bytes;
+        }
+
+        /**
+         * @brief Bound how many peers datagrams from new addresses can create state for. Datagrams from new
+         *        addresses are dropped while there are this many peers. `sendTo()` always creates the peer.
+         * @param num Max number of peers. Defaults to `reliableMaxPeers`.
+         */
+        inline void setMaxPeers(std::size_t num) {
+            maxPeers = num;
+        }
+
+        /**
+         * @brief Send a message on a channel.
+         * @param addr Address of the peer, obtained in `recvCallback`. `nullptr` for client `UDPPeer`s.
+         * @param addrLen Length of `addr`
+         * @param channel Index returned by `addChannel`
+         * @param data Message to send. Always copied.
+         * @param len Length of `data` in bytes
+         * @return Future set to `len` once every fragment was acked (or right away, on unreliable channels),
+         *         -1 if the peer is stopped or the message was dropped with the peer, -2 if the channel doesn't exist
+         *         or the message is too large (see `setMaxMessageLen`), -3 if the peer stopped acking, or -4 if too many bytes are
+         *         queued to the peer. See `setSendWatermark`.
+         */
+        std::future<int> sendTo(const sockaddr *const addr, socklen_t addrLen, uint8_t channel, const uint8_t *data,
+                                std::size_t len);
+
+        /**
+         * @brief Send a message to the server. Only works with client `UDPPeer`s. Alias for
+         *        `sendTo(nullptr, 0, channel, data, len)`.
+         * @param channel Index returned by `addChannel`
+         * @param data Message to send. Always copied.
+         * @param len Length of `data` in bytes
+         * @return See `sendTo`
+         */
+        inline std::future<int> send(uint8_t channel, const uint8_t *data, std::size_t len) {
+            return sendTo(nullptr, 0, channel, data, len);
+        }
+
+        /**
+         * @brief Retransmit lost packets, send delayed acks and paced packets, and drop peers that stopped responding
+         *        (for longer than the `UDPPeer`'s timeout). To be called at a regular interval.
+         */
+        void tick();
+
+        /**
+         * @brief Forget a peer. Its unacked messages fail with -1.
+         * @param addr Address of the peer. `nullptr` for client `UDPPeer`s.
+         * @param addrLen Length of `addr`
+         */
+        void dropPeer(const sockaddr *const addr, socklen_t addrLen);
+
+        /**
+         * @brief Get the number of peers with connection state.
+         * @return Number of peers
+         */
+        std::size_t getNumPeers();
+
+        /**
+         * @brief Get the connection state of a peer.
+         * @param addr Address of the peer. `nullptr` for client `UDPPeer`s.
+         * @param addrLen Length of `addr`
+         * @param out Filled with the state
+         * @return False if there is no state for the peer.
+         */
+        bool getStats(const sockaddr *const addr, socklen_t addrLen, ReliableStats &out);
+    };
+}
+
+#endif //__STONEMASON_NET_RELIABLE_UDP_HPP
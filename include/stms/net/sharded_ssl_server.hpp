@@ -0,0 +1,230 @@
+/**
+ * @file stms/net/sharded_ssl_server.hpp
+ * @brief Provides `ShardedSSLServer`, which spreads a DTLS or TLS server across several threads & cores.
+ */
+
+#pragma once
+
+#ifndef __STONEMASON_NET_SHARDED_SSL_SERVER_HPP
+#define __STONEMASON_NET_SHARDED_SSL_SERVER_HPP
+//!< Include guard
+
+#include <thread>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "stms/net/ssl_server.hpp"
+
+namespace stms {
+    /**
+     * @brief A DTLS or TLS server made up of several `SSLServer` shards. Each shard has its own listening socket
+     *        bound to the same address with `SO_REUSEPORT` (so the kernel spreads incoming connections across them),
+     *        its own reactor and client table, and is ticked by its own thread pinned to a separate core.
+     *
+     *        Clients are still addressed by `UUID`, and every method can be called from any thread.
+     */
+    class ShardedSSLServer {
+    private:
+        /// A shard and the thread ticking it.
+        struct Shard {
+            std::unique_ptr<SSLServer> serv; //!< The shard
+            std::thread thread; //!< Thread running `tick()` and `waitEvents()` on `serv` while it is running.
+        };
+
+        std::vector<Shard> shards; //!< All the shards. The number of shards is fixed on construction.
+        bool pinThreads = true; //!< If true, shard threads are pinned to separate cores. See `setPinThreads`
+
+        std::unordered_map<UUID, std::size_t> routes; //!< Cache of which shard each client is on. Guarded by `routesMtx`
+        std::mutex routesMtx; //!< Mutex guarding `routes`
+
+        /// User's connect callback. See `SSLServer::setConnectCallback`
+        std::function<void(const UUID &, const sockaddr *const)> connectCallback = [](const UUID &, const sockaddr *const) {};
+        /// User's disconnect callback. See `SSLServer::setDisconnectCallback`
+        std::function<void(const UUID &, const sockaddr *const)> disconnectCallback = [](const UUID &, const sockaddr *const) {};
+
+        /**
+         * @brief Find the shard a client is on. Internal impl detail.
+         * @return The shard, or `nullptr` if no shard has a client with the UUID.
+         */
+        SSLServer *findShard(const UUID &cli);
+
+        void shardLoop(std::size_t index); //!< Body of each shard's thread. Internal impl detail.
+
+    public:
+        /**
+         * @brief Construct the shards. They share `pool` for running callbacks, reads & writes.
+         * @param pool `ThreadPool` to submit async tasks to.
+         * @param isUdp If true, UDP/DTLS will be used. Otherwise, TCP/TLS is used.
+         * @param numShards Number of shards. If 0, 1 per core.
+         */
+        ShardedSSLServer(stms::PoolLike *pool, bool isUdp, unsigned numShards = 0);
+
+        ~ShardedSSLServer(); //!< Destructor. Stops the server if it is running.
+
+        ShardedSSLServer &operator=(const ShardedSSLServer &rhs) = delete; //!< Deleted copy operator=
+
+        ShardedSSLServer(const ShardedSSLServer &rhs) = delete; //!< Deleted copy constructor
+
+        /**
+         * @brief Apply settings to every shard, i.e. `setHostAddr`, `setCertAuth`, `setIoBackend`, etc.
+         *        Must be called while stopped. Use the setters below for callbacks instead of setting them here.
+         * @param fn Function called once for every shard.
+         */
+        void configure(const std::function<void(SSLServer &)> &fn);
+
+        /**
+         * @brief Set the `recvCallback` of every shard. See `SSLServer::setRecvCallback`
+         * @param newCb The new callback to replace the old one
+         */
+        void setRecvCallback(const std::function<void(const UUID &, const sockaddr *const, uint8_t *, int)> &newCb);
+
+        /**
+         * @brief Set the `framedRecvCallback` of every shard. See `SSLServer::setFramedRecvCallback`
+         * @param newCb The new callback to replace the old one
+         * @param maxMessageLen Max payload length of a message
+         */
+        void setFramedRecvCallback(const std::function<void(const UUID &, const sockaddr *const, uint8_t *, int)> &newCb,
+                                   std::size_t maxMessageLen = framerMaxMessageLen);
+
+        /**
+         * @brief Set the `connectCallback`. See `SSLServer::setConnectCallback`
+         * @param newCb The new callback to replace the old one
+         */
+        inline void setConnectCallback(const std::function<void(const UUID &, const sockaddr *const)> &newCb) {
+            connectCallback = newCb;
+        }
+
+        /**
+         * @brief Set the `disconnectCallback`. See `SSLServer::setDisconnectCallback`
+         * @param newCb The new callback to replace the old one
+         */
+        inline void setDisconnectCallback(const std::function<void(const UUID &, const sockaddr *const)> &newCb) {
+            disconnectCallback = newCb;
+        }
+
+        /**
+         * @brief Set the `writableCallback` of every shard. See `SSLServer::setWritableCallback`
+         * @param newCb The new callback to replace the old one
+         */
+        void setWritableCallback(const std::function<void(const UUID &)> &newCb);
+
+        /**
+         * @brief Control if shard threads are pinned to cores. Only takes effect on the next `start()`.
+         * @param pin If true (the default), shard `i` is pinned to core `i % numCores`. Only supported on Linux.
+         */
+        inline void setPinThreads(bool pin) {
+            pinThreads = pin;
+        }
+
+        void start(); //!< Start every shard and the threads ticking them.
+
+        void stop(); //!< Stop every shard and join their threads.
+
+        /**
+         * @brief Query if the server is running.
+         * @return True if any shard is still running.
+         */
+        [[nodiscard]] bool isRunning() const;
+
+        /**
+         * @brief Get a shard, for example to query the clients on it.
+         * @param index Index of the shard. Must be less than `getNumShards()`.
+         * @return Reference to the shard.
+         */
+        inline SSLServer &getShard(std::size_t index) {
+            return *shards[index].serv;
+        }
+
+        /**
+         * @brief Get the number of shards
+         * @return Number of shards
+         */
+        [[nodiscard]] inline std::size_t getNumShards() const {
+            return shards.size();
+        }
+
+        /**
+         * @brief Get the number of clients connected to all shards.
+         * @return Number of clients
+         */
+        std::size_t getNumClients();
+
+        /**
+         * @brief Generate a list of all the clients connected to all shards. O(n).
+         * @return A `std::vector` containing all the uuids of the currently connected clients.
+         */
+        std::vector<UUID> getClientUuids();
+
+        /**
+         * @brief Send a message to a client on any shard. See `SSLServer::send`
+         * @return Same as `SSLServer::send`. 0 if no shard has the client.
+         */
+        std::future<int> send(const UUID &clientUuid, const uint8_t *const msg, int msgLen, bool cpy = false);
+
+        /**
+         * @brief Send part of a file to a client on any shard. See `SSLServer::sendFile`
+         * @return Same as `SSLServer::sendFile`. 0 if no shard has the client.
+         */
+        std::future<int> sendFile(const UUID &clientUuid, int fd, off_t offset, int len);
+
+        /**
+         * @brief Disconnect a client on any shard. See `SSLServer::kickClient`
+         * @param cliId The uuid of the client to kick
+         */
+        void kickClient(const UUID &cliId);
+
+        /**
+         * @brief Replace a client's uuid with a new one. See `SSLServer::setNewUuid`
+         * @return True if a client had uuid `old` and the uuid was updated.
+         */
+        bool setNewUuid(const UUID &old, const UUID &newUuid);
+
+        /**
+         * @brief Replace the client's UUID with a newly generated UUIDv4. See `SSLServer::refreshUuid`
+         * @return Newly generated UUID, or a UUID filled with 0s if no shard has the client.
+         */
+        UUID refreshUuid(const UUID &client);
+
+        /**
+         * @brief Get the PMTU of the connection to a client. See `SSLServer::getMtu`
+         * @return The PMTU in bytes, or 0 if no shard has the client.
+         */
+        size_t getMtu(const UUID &cli);
+
+        /**
+         * @brief Get the number of bytes queued to a client. See `SSLServer::getQueuedBytes`
+         * @return Number of bytes, or 0 if no shard has the client.
+         */
+        std::size_t getQueuedBytes(const UUID &cli);
+
+        /**
+         * @brief Get the session resumption counters summed across all shards. See `SSLServer::getSessionStats`
+         *        Shards share the same `SessionTicketKeys` and `SessionCache` (unless replaced with `configure`),
+         *        so a client can resume its session on any shard.
+         * @return Combined stats. Caches shared by several shards are only counted once.
+         */
+        SessionStats getSessionStats();
+
+        /**
+         * @brief Get the metrics of all shards added up. See `SSLServer::getMetrics`
+         * @return Combined snapshot. `mtu` is the smallest of any client.
+         */
+        MetricsSnapshot getMetrics();
+
+        /**
+         * @brief Keep separate counters for each client on every shard. See `SSLServer::setClientMetrics`
+         * @param enable If true, clients get their own counters.
+         */
+        void setClientMetrics(bool enable);
+
+        /**
+         * @brief Get the counters of every client on any shard that has its own. See `SSLServer::getClientMetrics`
+         * @return Pairs of client UUIDs and their counters.
+         */
+        std::vector<std::pair<UUID, MetricsSnapshot>> getClientMetrics();
+    };
+}
+
+#endif //__STONEMASON_NET_SHARDED_SSL_SERVER_HPP
@@ -14,6 +14,7 @@
 //!< Include guard
 
 #include "openssl/ssl.h"
+#include <memory>
 #include <string>
 #include <netdb.h>
 #include <stms/async.hpp>
@@ -34,8 +35,8 @@ namespace stms {
     /// Internal fatal ssl exception. Implementation detail. If this is thrown but not caught, it's a bug
     class SSLFatalException : public std::exception {};
 
-    /// @brief This is `secretCookieLen` of random data to be used for DTLS stateless cookie exchanges
-    ///        (for protection against DDoS attacks).
+    /// @brief This is `secretCookieLen` of random data generated by `initOpenSsl`. `SSLServer` used to compute DTLS
+    ///        cookies from it; it now uses rotating `CookieKeys` instead.
     inline uint8_t *&getSecretCookie() {
         static uint8_t val[secretCookieLen];
         static auto *ret = reinterpret_cast<uint8_t *>(val);
@@ -46,7 +47,31 @@ namespace stms {
 
     void quitOpenSsl(); //!< Quit OpenSSL parts of STMS. No need to call this if you used `stms::initAll`.
 
-    int handleSslGetErr(SSL *, int); //!< Internal impl detail. You shouldn't touch this.
+    /// Outcome of an OpenSSL I/O call (`SSL_read`, `SSL_write`, `SSL_accept`, etc). See `getSslStatus`.
+    enum class SSLStatus {
+        eOk, //!< The call succeeded
+        eWantRead, //!< Retry the call once the socket is readable (`SSL_ERROR_WANT_READ`)
+        eWantWrite, //!< Retry the call once the socket is writable (`SSL_ERROR_WANT_WRITE`)
+        eRetry, //!< Some other non-fatal condition. Retry the call later.
+        eFatal //!< The connection is unusable and should be dropped
+    };
+
+    /**
+     * @brief Classify the return value of an OpenSSL I/O call without throwing. Internal impl detail.
+     *        Errors are logged and flushed, but `eWantRead` and `eWantWrite` aren't, as they are expected for
+     *        non-blocking sockets and happen on nearly every call under load.
+     * @param ssl Connection the call was made on
+     * @param ret Return value of the call
+     * @return Status of the call
+     */
+    SSLStatus getSslStatus(SSL *ssl, int ret);
+
+    /**
+     * @brief Exception-based wrapper around `getSslStatus`, kept for compatibility. Internal impl detail.
+     *        Throws `SSLWantReadException`, `SSLWantWriteException`, `SSLFatalException` or `SSLException`.
+     * @return `ret` if the call succeeded
+     */
+    int handleSslGetErr(SSL *, int);
 
     /**
      * @brief Log a single OpenSSL error, if there are errors to be processed.
@@ -59,6 +84,74 @@ namespace stms {
         while (handleSSLError() != 0);
     }
 
+    /**
+     * @brief Query if records sent over a connection are encrypted by the kernel (kTLS).
+     *        See `_stms_SSLBase::setKernelTls`
+     * @param ssl OpenSSL `SSL` object of a connection that finished its handshake
+     * @return True if kTLS is active for sending, so files can be sent with `SSL_sendfile`.
+     */
+    bool isKernelTlsSend(SSL *ssl);
+
+    /**
+     * @brief Writes part of a file to a TLS connection, one piece at a time. Internal impl detail of
+     *        `SSLServer::sendFile` and `SSLClient::sendFile`. If kTLS is active, `SSL_sendfile` is used so the file
+     *        never passes through user space. Otherwise, it is read in chunks of `sendFileChunk` bytes that are passed
+     *        to `SSL_write`.
+     */
+    class FileSender {
+    private:
+        SSL *ssl; //!< Connection to write to
+        int fd; //!< File to read from
+        off_t offset; //!< Offset into `fd` of the next byte to send
+        std::size_t remaining; //!< Number of bytes left to send
+        bool useSendfile; //!< True if kTLS is active
+        std::unique_ptr<uint8_t[]> chunk; //!< Chunk read from `fd`. Kept as-is when `SSL_write` must be retried.
+        int chunkLen = 0; //!< Number of bytes in `chunk`, or 0 if the next chunk has to be read.
+        SSLStatus status = SSLStatus::eOk; //!< See `getStatus`
+
+    public:
+        /**
+         * @brief Constructor. Doesn't send anything yet.
+         * @param connection Connection to write to
+         * @param file File descriptor of the file to send. It isn't closed.
+         * @param start Offset into `file` to start at
+         * @param len Number of bytes to send
+         */
+        FileSender(SSL *connection, int file, off_t start, std::size_t len);
+
+        /**
+         * @brief Send the next piece. Must be called with exclusive access to `ssl`.
+         * @return Number of bytes sent (> 0), -1 if the file couldn't be read, or 0 if the OpenSSL call didn't
+         *         complete. In that case, `getStatus()` says why, and `step()` must be called again to retry unless
+         *         it is `SSLStatus::eFatal`.
+         */
+        long step();
+
+        /**
+         * @brief Get the status of the last OpenSSL call made by `step()`.
+         * @return `SSLStatus::eOk` if it succeeded.
+         */
+        [[nodiscard]] inline SSLStatus getStatus() const {
+            return status;
+        }
+
+        /**
+         * @brief Query if the whole range was sent.
+         * @return True if there's nothing left to send.
+         */
+        [[nodiscard]] inline bool done() const {
+            return remaining == 0;
+        }
+
+        /**
+         * @brief Query if the file is sent with `SSL_sendfile`.
+         * @return True if kTLS is active for sending.
+         */
+        [[nodiscard]] inline bool isZeroCopy() const {
+            return useSendfile;
+        }
+    };
+
 
     /// Simple wrapper around OpenSSL server cache modes (see OpenSSL docs for `SSL_CTX_set_session_cache_mode`)
     enum SSLCacheModeBits {
@@ -121,6 +214,16 @@ namespace stms {
             SSL_CTX_set_session_cache_mode(pCtx, flags);
         }
 
+        /**
+         * @brief Offload record encryption of TCP connections to the kernel (kTLS) once the handshake is done. This
+         *        saves a copy through user space on every write, and lets `sendFile()` use `SSL_sendfile`.
+         *        Off by default. Only affects connections made afterwards. Connections fall back to regular TLS if the
+         *        kernel or the negotiated cipher don't support kTLS; query this per connection with `isKernelTlsSend`.
+         * @param enable If true, try to use kTLS.
+         * @return False if kTLS is unavailable (DTLS, or OpenSSL was built without it), so nothing changed.
+         */
+        bool setKernelTls(bool enable);
+
         /// Turn on anti-replay protection. There will be no duplicate packets. Only relevant for DTLS connections.
         inline void enableAntiReplay() {
             SSL_CTX_clear_options(pCtx, SSL_OP_NO_ANTI_REPLAY);
@@ -16,6 +16,9 @@
 
 #include "stms/async.hpp"
 #include "stms/net/ssl.hpp"
+#include "stms/net/ssl_session.hpp"
+#include "stms/net/framing.hpp"
+#include "stms/net/metrics.hpp"
 
 #include "openssl/ssl.h"
 #include "openssl/bio.h"
@@ -34,6 +37,26 @@ namespace stms {
         bool doShutdown = false; //!< If true, `SSL_shutdown` is called in `onStop()`.
         bool isReading = false; //!< Flag for if data is currently being read with `SSL_read()`.
         Stopwatch timeoutTimer{}; //!< `Stopwatch` for implementing connection timeouts.
+        std::unique_ptr<MessageFramer> framer; //!< Reassembles messages with `framedRecvCallback`. Recreated on `start()`.
+
+        std::mutex sslMtx; //!< Serializes calls on `pSsl` between the read task and the send tasks.
+        std::mutex sendMtx; //!< Guards `queuedBytes`, `queuedMessages` and `wantWritable`
+        std::size_t queuedBytes = 0; //!< Total length of the messages passed to `send()` that haven't been written yet
+        std::size_t queuedMessages = 0; //!< Number of the messages passed to `send()` that haven't been written yet
+        bool wantWritable = false; //!< True if a `send()` was refused, so `writableCallback` should be called.
+        std::size_t highWatermark = sendHighWatermark; //!< Queued bytes at which `send()` starts refusing. See `setSendWatermarks`
+        std::size_t lowWatermark = sendLowWatermark; //!< Queued bytes at which `writableCallback` is called. See `setSendWatermarks`
+
+        SSL_SESSION *session = nullptr; //!< Last session the server sent, resumed on the next `start()`. Guarded by `sessionMtx`
+        std::mutex sessionMtx; //!< Mutex guarding `session`
+        bool resumeSessions = true; //!< See `setSessionResumption`
+        bool sessionReused = false; //!< True if the last `start()` resumed `session`. See `isSessionReused`
+        uint64_t fullHandshakes = 0; //!< See `SessionStats::fullHandshakes`
+        uint64_t resumedHandshakes = 0; //!< See `SessionStats::resumedHandshakes`
+        NetMetrics metrics; //!< See `getMetrics`
+
+        /// OpenSSL callback storing sessions (or tickets) the server sends in `session`. Internal impl detail.
+        static int onNewSession(SSL *ssl, SSL_SESSION *sess);
 
         void onStart() override; //!< Hook called from `start()`. Internal impl detail.
         void onStop() override; //!< Hook called from `stop()`. Internal impl detail
@@ -45,9 +68,26 @@ namespace stms {
          *
          *        The first argument will ALWAYS be a valid `uint8_t *`, never `nullptr`. The second argument will
          *        ALWAYS be non-zero.
+         *
+         *        The data is only valid until the callback returns. Use `PacketBuffer::retain` on the 1st arg to
+         *        keep it around without copying.
          */
         std::function<void(uint8_t *, size_t)> recvCallback = [](uint8_t *, size_t) {};
 
+        /**
+         * @brief This is a callback function that is called asynchronously when `send()` returned -4 and enough of
+         *        the queued messages were written to drop below the low watermark, so that sending can be resumed.
+         *        See `setSendWatermarks`.
+         */
+        std::function<void()> writableCallback = []() {};
+
+        /**
+         * @brief Callback called asynchronously with every complete length-prefixed message from the server. If set,
+         *        this is called instead of `recvCallback`. See `setFramedRecvCallback`.
+         */
+        std::function<void(uint8_t *, size_t)> framedRecvCallback;
+        std::size_t maxFramedLen = framerMaxMessageLen; //!< Max payload length with `framedRecvCallback`.
+
         // Connect/Disconnect callback?
     public:
 
@@ -66,6 +106,85 @@ namespace stms {
             recvCallback = newCb;
         }
 
+        /**
+         * @brief Set a new `writableCallback`. See documentation for `stms::SSLClient::writableCallback`
+         * @param newCb New callback to replace the old one with
+         */
+        inline void setWritableCallback(const std::function<void()> &newCb) {
+            writableCallback = newCb;
+        }
+
+        /**
+         * @brief Receive length-prefixed messages instead of raw chunks of the stream. See
+         *        `SSLServer::setFramedRecvCallback`. Takes effect on the next `start()`. Ignored for DTLS.
+         * @param newCb Callback to call with every complete message. Pass `nullptr` to go back to `recvCallback`.
+         * @param maxMessageLen Max payload length of a message. Longer ones stop the client.
+         */
+        inline void setFramedRecvCallback(const std::function<void(uint8_t *, size_t)> &newCb,
+                                          std::size_t maxMessageLen = framerMaxMessageLen) {
+            framedRecvCallback = newCb;
+            maxFramedLen = maxMessageLen;
+        }
+
+        /**
+         * @brief Bound how much data may be waiting to be sent. Once more than `high` bytes passed to `send()` haven't
+         *        been written yet, `send()` refuses further messages with -4, until enough are written to get down to
+         *        `low` bytes and `writableCallback` is called. A message is always accepted if nothing is queued.
+         * @param high Max number of queued bytes. Defaults to `sendHighWatermark`.
+         * @param low Number of queued bytes at which sending is possible again. Must not exceed `high`.
+         *            Defaults to `sendLowWatermark`.
+         */
+        inline void setSendWatermarks(std::size_t high, std::size_t low) {
+            highWatermark = high;
+            lowWatermark = low;
+        }
+
+        /**
+         * @brief Control if the client remembers the session from the server and resumes it on the next `start()`
+         *        (on by default). Resuming skips the expensive parts of the handshake when reconnecting.
+         * @param enable If false, every `start()` does a full handshake.
+         */
+        inline void setSessionResumption(bool enable) {
+            resumeSessions = enable;
+        }
+
+        void clearSession(); //!< Forget the stored session, so that the next `start()` does a full handshake.
+
+        /**
+         * @brief Query if the last `start()` resumed a previous session instead of doing a full handshake.
+         * @return True if the session was resumed.
+         */
+        [[nodiscard]] inline bool isSessionReused() const {
+            return sessionReused;
+        }
+
+        /**
+         * @brief Get counters of resumed and full handshakes. The cache fields are always 0.
+         * @return Stats since the client was constructed. See `SessionStats::resumptionRate`.
+         */
+        [[nodiscard]] inline SessionStats getSessionStats() const {
+            SessionStats ret;
+            ret.fullHandshakes = fullHandshakes;
+            ret.resumedHandshakes = resumedHandshakes;
+            return ret;
+        }
+
+        /**
+         * @brief Get the traffic counters, handshake durations and send queue depth of this client. Counters are
+         *        totals across all connections since construction. See `MetricsExporter` for exporting them.
+         * @return Snapshot of the metrics
+         */
+        MetricsSnapshot getMetrics();
+
+        /**
+         * @brief Get the number of bytes passed to `send()` that haven't been written yet.
+         * @return Number of bytes
+         */
+        inline std::size_t getQueuedBytes() {
+            std::lock_guard<std::mutex> lg(sendMtx);
+            return queuedBytes;
+        }
+
         /**
          * @brief Send an message (in the form of an array of `uint8_t`s) to the server.
          * @param data Array of unsigned chars to send to the server
@@ -76,11 +195,33 @@ namespace stms {
          *         If there is an OpenSSL error, a value < 0 is returned. If a -1 is returned, then send() was called
          *         while the client was stopped, and you must start the client first. If a -2 is returned, then there
          *         was a fatal exception and we disconnected.
-         *         If -3 is returned, the operation timed out and we disconnected. Otherwise, a positive integer
-         *         containing the number of bytes sent is returned.
+         *         If -3 is returned, the operation timed out and we disconnected. If -4 is returned, too much data
+         *         is already queued and the message was dropped; wait for `writableCallback` before sending again
+         *         (see `setSendWatermarks`). Otherwise, a positive integer containing the number of bytes sent is
+         *         returned.
          */
         std::future<int> send(const uint8_t *const data, int size, bool copy = false);
 
+        /**
+         * @brief Send part of a file to the server. If kTLS is active (see `setKernelTls`), the file is sent with
+         *        `SSL_sendfile` and never copied into user space. Otherwise, it is read and `SSL_write`n in chunks of
+         *        `sendFileChunk` bytes. Only supported on TCP/TLS.
+         * @param fd File descriptor of the file. It must stay open until the returned future is ready.
+         * @param offset Offset into the file to start at
+         * @param len Number of bytes to send
+         * @return Same as `send()`, except that -5 is returned if the file couldn't be read (in which case part of it
+         *         may have been sent already), `len` or `offset` is negative, or this is a DTLS client.
+         */
+        std::future<int> sendFile(int fd, off_t offset, int len);
+
+        /**
+         * @brief Query if kTLS is active for sending. See `setKernelTls`
+         * @return True if records to the server are encrypted by the kernel.
+         */
+        [[nodiscard]] inline bool isKernelTls() const {
+            return running && isKernelTlsSend(pSsl);
+        }
+
         /**
          * @brief Block until there is data from the server to read, blocking at maximum `timeoutMs` milliseconds.
          * @param timeoutMs Maximum amount of time to block for in milliseconds
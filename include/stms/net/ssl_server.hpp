@@ -17,6 +17,8 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <unordered_map>
+#include <atomic>
+#include <deque>
 #include <stms/async.hpp>
 #include <stms/logging.hpp>
 #include <stms/util/timers.hpp>
@@ -25,14 +27,30 @@
 #include "openssl/bio.h"
 #include "openssl/err.h"
 #include "stms/net/ssl.hpp"
+#include "stms/net/ssl_session.hpp"
+#include "stms/net/dtls_cookie.hpp"
+#include "stms/net/event_loop.hpp"
+#include "stms/net/framing.hpp"
+#include "stms/net/metrics.hpp"
 #include "stms/util/uuid.hpp"
+#include "stms/util/striped_map.hpp"
+#include "stms/util/timing_wheel.hpp"
 
 namespace stms {
     class SSLServer;
 
     /// Struct containing all the client's data. Internal impl detail, don't touch.
     struct ClientRepresentation {
-        // TODO: Should a mutex be introduced to sync IO to this? (OpenSSL SSL object especially)
+        /// A message waiting in `sendQueue` for the writer task.
+        struct PendingSend {
+            PacketBuffer buf; //!< Copy of the message, if `SSLServer::send` was called with `cpy`
+            const uint8_t *data = nullptr; //!< Message to send. Points into `buf` if it was copied.
+            int len = 0; //!< Length of `data` in bytes
+            std::shared_ptr<std::promise<int>> prom; //!< Promise returned from `SSLServer::send`
+            int fileFd = -1; //!< If not -1, `len` bytes of this file are sent instead of `data`. See `SSLServer::sendFile`
+            off_t fileOffset = 0; //!< Offset into `fileFd` to start sending from
+        };
+
         std::string addrStr{}; //!< Client's address as a ${host}:${port} string
         sockaddr *pSockAddr = nullptr; //!< Client's address. Is a `reinterpret_cast`ed `sockaddr_in` or `sockaddr_in6`
         socklen_t sockAddrLen{}; //!< Size of `pSockAddr`.
@@ -40,14 +58,42 @@ namespace stms {
         int sock = 0; //!< Client socket file descriptor
         bool doShutdown = false; //!< If true, `SSL_shutdown` is called on `pSsl` when this object is destroyed.
         bool isReading = false; //!< Flag for if a `SSL_read` is in progress.
+        std::unique_ptr<MessageFramer> framer; //!< Reassembles messages with `SSLServer::setFramedRecvCallback`. Only touched by the read task.
+        std::unique_ptr<NetMetrics> metrics; //!< Counters of this client only, or `nullptr`. See `SSLServer::setClientMetrics`
+
+        /**
+         * @brief Read state used with `IOBackend::eEpoll`: 0 = idle, 1 = a task is draining the socket,
+         *        2 = draining, and another edge-triggered event arrived in the meantime so the task must go again.
+         */
+        std::atomic<uint8_t> readState{0};
 
-        /// A `Stopwatch` for checking if the connection timed out (ie `timeoutMs` milliseconds passed without response)
-        stms::Stopwatch timeoutTimer;
+        std::mutex sslMtx; //!< Serializes calls on `pSsl` between the read task and the writer task.
+
+        std::mutex sendMtx; //!< Guards `sendQueue`, `queuedBytes`, `writerActive`, `wantWritable`, `flushPending` and `flushTimer`
+        std::deque<PendingSend> sendQueue; //!< Messages waiting to be written by the writer task
+        std::size_t queuedBytes = 0; //!< Total length of the messages in `sendQueue`
+        bool writerActive = false; //!< True if a writer task was submitted and hasn't emptied `sendQueue` yet.
+        bool wantWritable = false; //!< True if a `send()` was refused, so `SSLServer::writableCallback` should be called.
+        bool flushPending = false; //!< True if this client is waiting in `SSLServer::pendingFlushes`.
+        stms::Stopwatch flushTimer; //!< (Re)started when a message is queued with nothing to flush it yet.
+
+        /// `steady_clock` time (as a count since its epoch) of the last response. See `touch` and `SSLServer::idleWheel`
+        std::atomic<std::chrono::steady_clock::rep> lastActive{0};
+
+        short handshakeEvents = 0; //!< `poll` events `SSL_accept` is waiting for while the handshake is in progress.
+        bool handshakeWatched = false; //!< True if `sock` was added to `SSLServer::loop` while handshaking.
+        stms::Stopwatch handshakeTimer; //!< Started when the handshake begins. See `SSLServer::advanceHandshakes`.
 
         /// Struct containing the parts of a `ClientRepresentation` relevant for DTLS connections
         struct DTLSSpecific {
             BIO_ADDR *pBioAddr = nullptr; //!< `pSockAddr` represented as a OpenSSL `BIO_ADDR`
             BIO *pBio = nullptr; //!< OpenSSL `BIO` object bound to this client
+
+            bool demuxed = false; //!< True if this client shares the server's socket. See `SSLServer::setDtlsDemux`
+            int demuxSock = -1; //!< Socket datagrams are sent from if `demuxed`.
+            std::string demuxKey; //!< Raw bytes of `pSockAddr`. Key of this client in `SSLServer::demuxClients`.
+            std::mutex inboxMtx; //!< Mutex guarding `inbox`
+            std::deque<PacketBuffer> inbox; //!< Datagrams received for this client that `pSsl` hasn't read yet.
         };
 
         /// Member containing all DTLS-specific fields. For non-dtls connections, this is always `nullptr`.
@@ -76,16 +122,106 @@ namespace stms {
          */
         ClientRepresentation(ClientRepresentation &&rhs) noexcept;
 
+        /// Record that the client responded just now, pushing back its idle timeout. Safe to call from any thread.
+        inline void touch() {
+            lastActive.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+        }
+
+        /// Get the time `touch` was last called.
+        [[nodiscard]] inline std::chrono::steady_clock::time_point getLastActive() const {
+            return std::chrono::steady_clock::time_point(
+                    std::chrono::steady_clock::duration(lastActive.load(std::memory_order_relaxed)));
+        }
+
         /// Terminate the server-side connection to this client. This will block until `SSL_shutdown` completes.
         void shutdownClient();
+
+        /**
+         * @brief Resolve the promises of every message in `sendQueue` and clear it. Requires `sendMtx`.
+         * @param code Value to resolve the promises with
+         */
+        void failPendingSends(int code);
     };
 
     /// A SSL/TLS server. Can be TCP (TLS) or UDP (DTLS)
     class SSLServer : public _stms_SSLBase {
     private:
-        std::unordered_map<UUID, std::shared_ptr<ClientRepresentation>> clients; //!< Table of connected clients.
-        std::queue<UUID> deadClients; //!< Queue of clients to be deleted in `tick`
-        std::mutex clientsMtx; //!< Mutex for syncing modification of the client table
+        /// Table of connected clients. Lookups only lock 1 stripe, so `send()` etc. don't contend with `tick()`.
+        StripedMap<UUID, std::shared_ptr<ClientRepresentation>> clients{clientTableStripes};
+        /// Serializes inserting into, removing from & iterating over `clients`, and guards `loopClients`.
+        /// Lookups in `clients` don't need this.
+        std::mutex clientsMtx;
+        std::queue<UUID> deadClients; //!< Queue of clients to be deleted in `tick`. Guarded by `deadMtx`
+        std::mutex deadMtx; //!< Mutex guarding `deadClients`. Never held while locking anything else.
+
+        /// A client waiting in `idleWheel`.
+        struct IdleEntry {
+            UUID uuid; //!< UUID the client had when it was scheduled. Stale if it was since changed.
+            std::weak_ptr<ClientRepresentation> cli; //!< The client
+        };
+
+        /**
+         * @brief Idle deadlines of connected clients, so that `tick` only looks at clients that may have timed out
+         *        instead of every client. Entries aren't moved when a client is `touch`ed; when an entry expires, the
+         *        client is either dropped or scheduled again for `lastActive + timeoutMs`. Guarded by `clientsMtx`.
+         */
+        TimingWheel<IdleEntry> idleWheel{std::chrono::milliseconds(idleWheelResolution)};
+
+        std::unique_ptr<EventLoop> loop; //!< Reactor used if `ioBackend` is `IOBackend::eEpoll`, `nullptr` otherwise.
+        std::unordered_map<int, UUID> loopClients; //!< Client fd -> UUID for `loop` or `uring`. Guarded by `clientsMtx`
+        std::vector<FDEvent> readyEvents; //!< Events from `waitEvents` to be handled in the next `tick`.
+        uint32_t clientEvents = 0; //!< `epoll` events client sockets are registered with. Set in `onStart`.
+        bool edgeClients = false; //!< If false, clients are `EPOLLONESHOT` and must be re-armed after reading.
+        bool uringReactor = false; //!< If true, `uring` is used instead of `loop` with `IOBackend::eIOUring`.
+        std::vector<UringCompletion> uringCompletions; //!< Scratch space for `handleUringCompletions`.
+
+        /// A DTLS client sharing the listening socket. See `setDtlsDemux`.
+        struct DemuxEntry {
+            std::shared_ptr<ClientRepresentation> cli; //!< The client
+            UUID uuid; //!< UUID of the client in `clients`. Only valid if `established`.
+            bool established = false; //!< False while handshaking.
+        };
+
+        bool dtlsDemux = false; //!< If true, DTLS clients share the listening socket. See `setDtlsDemux`
+        bool demuxActive = false; //!< `dtlsDemux` as of the last `start()`, and only if this is a DTLS server.
+        std::unordered_map<std::string, DemuxEntry> demuxClients; //!< Clients by raw peer address. Guarded by `demuxMtx`.
+        std::mutex demuxMtx; //!< Mutex guarding `demuxClients`. Lock after `clientsMtx` if both are needed.
+        PacketBuffer demuxBuf; //!< Buffer datagrams from the listening socket are received (or peeked) into.
+
+        /// Clients that are still handshaking, by fd. Guarded by `handshakeMtx`. See `advanceHandshakes`.
+        std::unordered_map<int, std::shared_ptr<ClientRepresentation>> handshakes;
+        std::mutex handshakeMtx; //!< Mutex guarding `handshakes`
+
+        int coalesceMax = sendCoalesceMax; //!< Max bytes of queued messages merged into 1 `SSL_write`. See `setSendCoalescing`
+        unsigned flushDelayMs = sendFlushDelay; //!< How long queued messages may wait to be merged. See `setSendCoalescing`
+        std::size_t highWatermark = sendHighWatermark; //!< Queued bytes at which `send()` starts refusing. See `setSendWatermarks`
+        std::size_t lowWatermark = sendLowWatermark; //!< Queued bytes at which `writableCallback` is called. See `setSendWatermarks`
+        std::vector<std::pair<UUID, std::weak_ptr<ClientRepresentation>>> pendingFlushes; //!< Clients with messages waiting for `flushDelayMs`.
+        std::mutex flushMtx; //!< Mutex guarding `pendingFlushes`
+
+        bool sessionTickets = true; //!< If true, stateless session tickets are issued. See `setSessionTickets`
+        /// Keys for encrypting session tickets. See `setTicketKeys`
+        std::shared_ptr<SessionTicketKeys> ticketKeys = std::make_shared<SessionTicketKeys>();
+        /// Cache of sessions for resuming by session ID. See `setSessionCache`
+        std::shared_ptr<SessionCache> sessionCache = std::make_shared<SessionCache>();
+        /// Secrets for DTLS cookies. See `setCookieKeys`
+        std::shared_ptr<CookieKeys> cookieKeys = std::make_shared<CookieKeys>();
+        std::atomic<uint64_t> fullHandshakes{0}; //!< See `SessionStats::fullHandshakes`
+        std::atomic<uint64_t> resumedHandshakes{0}; //!< See `SessionStats::resumedHandshakes`
+        NetMetrics metrics; //!< Counters of all clients together. See `getMetrics`
+        bool clientMetrics = false; //!< If true, clients get their own `ClientRepresentation::metrics`. See `setClientMetrics`
+
+        /// Call `fn` on `metrics`, and on the metrics of `cli` if it has its own. Internal impl detail.
+        template<typename F>
+        inline void record(ClientRepresentation &cli, F &&fn) {
+            fn(metrics);
+            if (cli.metrics) {
+                fn(*cli.metrics);
+            }
+        }
+
+        /// Fill in the queue depths & MTU of a client. Requires a reference to `cli`. Internal impl detail.
+        void addClientGauges(ClientRepresentation &cli, MetricsSnapshot &out);
 
         /**
          * @brief This is the callback that is called asynchronously for each packet the server receives from a client.
@@ -98,6 +234,9 @@ namespace stms {
          *        the user altered it using `refreshUuid` or `setNewUuid`). The 2nd arg is always a valid `sockaddr *`,
          *        never `nullptr`. The 3rd arg is always a valid `uint8_t *`, never `nullptr`. The 4th arg is always
          *        a positive `int` that is greater than 0.
+         *
+         *        The data is only valid until the callback returns. Use `PacketBuffer::retain` on the 3rd arg to
+         *        keep it around without copying.
          */
         std::function<void(const UUID &, const sockaddr *const, uint8_t *, int)> recvCallback = [](
                 const UUID &, const sockaddr *const, uint8_t *, int) {};
@@ -127,14 +266,136 @@ namespace stms {
         std::function<void(const UUID &, const sockaddr *const)> disconnectCallback = [](const UUID &,
                                                                                               const sockaddr *const) {};
 
+        /**
+         * @brief This is the callback that is called asynchronously when a client that `send()` returned -4 for has
+         *        drained its queue down to the low watermark, so that sending can be resumed.
+         *        The first argument (`const UUID &`) is the UUID of the client.
+         *
+         *        It is called at most once per time `send()` returned -4 for the client, from the client's writer task.
+         *        Calling `send()` from it is fine. See `setSendWatermarks`.
+         */
+        std::function<void(const UUID &)> writableCallback = [](const UUID &) {};
+
+        /**
+         * @brief Callback called asynchronously with every complete length-prefixed message received from a TCP client.
+         *        If set, this is called instead of `recvCallback`. Same arguments as `recvCallback`, except that the
+         *        data is the payload of exactly one message. See `setFramedRecvCallback`.
+         */
+        std::function<void(const UUID &, const sockaddr *const, uint8_t *, int)> framedRecvCallback;
+        std::size_t maxFramedLen = framerMaxMessageLen; //!< Max payload length with `framedRecvCallback`.
+
         /// Internal implementation detail. Don't touch
         void handleDtlsConnection(const std::shared_ptr<ClientRepresentation> &cli);
 
-        /// Internal implementation detail. Don't touch
-        void doHandshake(const std::shared_ptr<ClientRepresentation> &cli);
+        /// Make the first `SSL_accept` call and add the client to `handshakes`. Internal implementation detail.
+        void beginHandshake(const std::shared_ptr<ClientRepresentation> &cli);
+
+        /**
+         * @brief Call `SSL_accept` once without blocking. Internal implementation detail.
+         * @return 1 if the handshake completed, 0 if it is waiting for `cli->handshakeEvents`, -1 if it failed.
+         */
+        int stepHandshake(const std::shared_ptr<ClientRepresentation> &cli);
+
+        /// Ask `loop` or `uring` to report when `cli->handshakeEvents` happen. Internal implementation detail.
+        void armHandshake(const std::shared_ptr<ClientRepresentation> &cli);
+
+        /// Undo `armHandshake`. Internal implementation detail.
+        void disarmHandshake(const std::shared_ptr<ClientRepresentation> &cli);
+
+        /**
+         * @brief Step every handshake whose socket is ready, and drop those that took longer than `timeoutMs`.
+         *        Called from `tick()`, so handshakes never occupy a pool thread. Internal implementation detail.
+         */
+        void advanceHandshakes();
+
+        /// Assign a UUID to a client that finished its handshake and start receiving from it. Internal impl detail.
+        UUID finishHandshake(const std::shared_ptr<ClientRepresentation> &cli);
+
+        /// Add a client to `idleWheel`, due `timeoutMs` after it was last active. Requires `clientsMtx`. Internal impl detail.
+        void scheduleIdle(const UUID &uuid, const std::shared_ptr<ClientRepresentation> &cli);
+
+        /// Drop the clients in `idleWheel` that went `timeoutMs` without responding. Requires `clientsMtx`. Internal impl detail.
+        void expireIdleClients();
+
+        /// Receive datagrams from the listening socket and hand them to the clients they are from. Internal impl detail.
+        void demuxDatagrams();
+
+        /// `DTLSv1_listen` on a datagram from an unknown peer with `demuxActive`. Internal impl detail.
+        void acceptDemuxClient(const std::string &key, const sockaddr_storage &storage, socklen_t addrLen,
+                               PacketBuffer datagram);
+
+        /// Step a demultiplexed client's handshake, and drop it if it failed. Internal impl detail.
+        void stepDemuxHandshake(const std::string &key, const std::shared_ptr<ClientRepresentation> &cli);
+
+        /// Time out and retransmit for demultiplexed clients still handshaking. Internal impl detail.
+        void sweepDemuxHandshakes();
+
+        /// Accept or `DTLSv1_listen` for up to `acceptBatchLen` incoming clients. Internal implementation detail. Don't touch
+        void acceptClient();
+
+        /// Allocate a client and `DTLSv1_listen` for a ClientHello with a valid cookie. Internal impl detail.
+        void listenDtlsClient();
+
+        /// Set up a client for a non-blocking fd returned by `accept()` and start the handshake. Internal impl detail.
+        void setupTcpClient(int fd, const sockaddr_storage &storage, socklen_t addrLen);
+
+        /// Register a client with `loop` or `uring`. Requires `clientsMtx`. Internal impl detail.
+        void watchClient(int fd, const UUID &uuid);
+
+        /// Unregister a client from `loop` or `uring`. Requires `clientsMtx`. Internal impl detail.
+        void unwatchClient(int fd);
+
+        /// Accept clients and collect `readyEvents` from `uring`. Internal impl detail.
+        void handleUringCompletions();
+
+        /// Start a read task for a client reported ready by `loop`, if there isn't one already. Internal impl detail.
+        void dispatchRead(const std::shared_ptr<ClientRepresentation> &cli, const UUID &uuid);
+
+        /// Read from a client until `SSL_read` wants more data, then re-arm it in `loop`. Internal impl detail.
+        void drainClient(const std::shared_ptr<ClientRepresentation> &cli, const UUID &uuid);
+
+        /**
+         * @brief Get the buffer the next `SSL_read` from a client should go into: The free space of its
+         *        `MessageFramer` with `framedRecvCallback`, otherwise `recvBuf`. Internal impl detail.
+         */
+        std::pair<uint8_t *, int> readTarget(ClientRepresentation &cli, PacketBuffer &recvBuf);
+
+        /**
+         * @brief Hand `readLen` bytes `SSL_read` into `readTarget` to the callbacks. Internal impl detail.
+         * @return False if the client sent a message over the max length, so it must be dropped.
+         */
+        bool deliverRead(ClientRepresentation &cli, const UUID &uuid, PacketBuffer &recvBuf, int readLen);
+
+        /// Write out a client's `sendQueue`, merging small messages. Only 1 runs per client at a time. Internal impl detail.
+        void flushClient(const std::shared_ptr<ClientRepresentation> &cli, const UUID &uuid);
+
+        /**
+         * @brief `SSL_write` a single buffer to a client, retrying as needed. Internal impl detail.
+         * @return Number of bytes written, or -2/-3 for a fatal error/timeout (the client is then kicked).
+         */
+        int writeToClient(const std::shared_ptr<ClientRepresentation> &cli, const UUID &uuid, const uint8_t *data, int len);
+
+        /**
+         * @brief Send part of a file to a client with a `FileSender`, retrying as needed. Internal impl detail.
+         * @return `len`, -5 if the file couldn't be read, or -2/-3 for a fatal error/timeout (the client is then kicked).
+         */
+        int writeFileToClient(const std::shared_ptr<ClientRepresentation> &cli, const UUID &uuid, int fd, off_t offset,
+                              int len);
+
+        /**
+         * @brief Queue a message or file for the writer task of a client. Internal impl detail of `send` & `sendFile`.
+         * @param fnName Name of the calling function, for logging
+         * @return See `send`
+         */
+        std::future<int> queueSend(const UUID &clientUuid, ClientRepresentation::PendingSend &&pending,
+                                   const char *fnName);
+
+        /// Start writer tasks for clients in `pendingFlushes` that waited `flushDelayMs`. Internal impl detail.
+        void flushPendingSends();
 
         friend struct ClientRepresentation; //!< Internal implementation detail. Don't touch
 
+        void onStart() override; //!< Hook called in `start`. Internal impl detail.
         void onStop() override; //!< Hook called in `stop`. Internal impl detail.
 
     public:
@@ -183,6 +444,21 @@ namespace stms {
             connectCallback = newCb;
         }
 
+        /**
+         * @brief Receive length-prefixed messages instead of raw chunks of the stream. Each message must be sent with
+         *        the header from `encodeFrameHeader` in front of it. Data is read straight into a per-client ring
+         *        buffer and each complete message is passed to `newCb` in place, so it's only copied if it crosses
+         *        the end of the ring. Clients sending a message longer than `maxMessageLen` are dropped.
+         *        Must be called before `start()`. Ignored for DTLS, which already preserves message boundaries.
+         * @param newCb Callback to call with every complete message. Pass `nullptr` to go back to `recvCallback`.
+         * @param maxMessageLen Max payload length of a message.
+         */
+        inline void setFramedRecvCallback(const std::function<void(const UUID &, const sockaddr *const, uint8_t *, int)> &newCb,
+                                          std::size_t maxMessageLen = framerMaxMessageLen) {
+            framedRecvCallback = newCb;
+            maxFramedLen = maxMessageLen;
+        }
+
         /**
          * @brief Set the new `connectCallback`. See documentation for `stms::SSLServer::connectCallback`
          * @param newCb The new callback to replace the old one
@@ -192,6 +468,131 @@ namespace stms {
             disconnectCallback = newCb;
         }
 
+        /**
+         * @brief Make all DTLS clients share the listening socket instead of each getting their own connected
+         *        socket. Datagrams are matched to clients by their source address in a hash table. This saves a
+         *        file descriptor per client, and the kernel doesn't have to look through thousands of sockets
+         *        bound to the same port. Only takes effect on the next `start()`, and does nothing for TLS servers.
+         * @param demux If true, demultiplex in user space. Otherwise, use a socket per client (the default).
+         */
+        inline void setDtlsDemux(bool demux) {
+            dtlsDemux = demux;
+        }
+
+        /**
+         * @brief Control if stateless session tickets are issued (on by default). Clients can then resume their session
+         *        on reconnect, skipping the expensive parts of the handshake, without the server storing anything.
+         *        If off, sessions are resumed by session ID from the `SessionCache` instead (see `setSessionCache`).
+         *        Only takes effect on the next `start()`.
+         * @param enable If true, issue tickets encrypted with `getTicketKeys()`.
+         */
+        inline void setSessionTickets(bool enable) {
+            sessionTickets = enable;
+        }
+
+        /**
+         * @brief Set the keys session tickets are encrypted with. Only takes effect on the next `start()`.
+         *        By default, every server has its own keys, so share them to let clients resume with any server.
+         * @param keys The new keys. If `nullptr`, OpenSSL's internal keys are used, which are never rotated.
+         */
+        inline void setTicketKeys(const std::shared_ptr<SessionTicketKeys> &keys) {
+            ticketKeys = keys;
+        }
+
+        /**
+         * @brief Get the keys session tickets are encrypted with, i.e. to share them or to `rotate()` them.
+         * @return The keys. May be `nullptr`, see `setTicketKeys`.
+         */
+        inline std::shared_ptr<SessionTicketKeys> getTicketKeys() {
+            return ticketKeys;
+        }
+
+        /**
+         * @brief Set the secrets DTLS cookies are computed with. Only takes effect on the next `start()`.
+         *        By default, every server has its own secrets, so share them between servers a client may be routed to.
+         * @param keys The new keys. If `nullptr`, new keys are generated on `start()`.
+         */
+        inline void setCookieKeys(const std::shared_ptr<CookieKeys> &keys) {
+            cookieKeys = keys;
+        }
+
+        /**
+         * @brief Get the secrets DTLS cookies are computed with, i.e. to share them or to `rotate()` them.
+         * @return The keys
+         */
+        inline std::shared_ptr<CookieKeys> getCookieKeys() {
+            return cookieKeys;
+        }
+
+        /**
+         * @brief Set the cache of sessions for resuming by session ID. Only takes effect on the next `start()`.
+         *        By default, every server has its own cache. It can be shared just like `setTicketKeys`.
+         * @param cache The new cache. If `nullptr`, OpenSSL's internal cache is used, see `setCacheMode`.
+         */
+        inline void setSessionCache(const std::shared_ptr<SessionCache> &cache) {
+            sessionCache = cache;
+        }
+
+        /**
+         * @brief Get the cache of sessions for resuming by session ID, i.e. to share it or to change its limits.
+         * @return The cache. May be `nullptr`, see `setSessionCache`.
+         */
+        inline std::shared_ptr<SessionCache> getSessionCache() {
+            return sessionCache;
+        }
+
+        /**
+         * @brief Limit how many sessions are cached and how long sessions (including tickets) can be resumed for.
+         * @param maxSessions Max number of sessions in the `SessionCache`. Defaults to `sessionCacheSize`.
+         * @param ttl Seconds a session can be resumed for. Defaults to `sessionCacheTtl`.
+         */
+        void setSessionLimits(std::size_t maxSessions, unsigned ttl);
+
+        /**
+         * @brief Get counters of resumed and full handshakes, and of the `SessionCache`.
+         * @return Stats since the server was constructed. See `SessionStats::resumptionRate`.
+         */
+        SessionStats getSessionStats();
+
+        /**
+         * @brief Get the traffic counters of all clients together, the durations of all handshakes, and the current
+         *        number of clients, handshakes & queued messages. See `MetricsExporter` for exporting them.
+         * @return Snapshot of the counters since the server was constructed. Counting is lock-free, but the gauges
+         *         are summed over all clients, so don't call this in a hot loop.
+         */
+        MetricsSnapshot getMetrics();
+
+        /**
+         * @brief Keep separate counters for each client as well (off by default). Only applies to clients that finish
+         *        their handshake afterwards. Costs 1 allocation per client and a 2nd atomic add per count.
+         * @param enable If true, clients get their own counters. See `getClientMetrics`
+         */
+        inline void setClientMetrics(bool enable) {
+            clientMetrics = enable;
+        }
+
+        /**
+         * @brief Get the counters of a single client. See `setClientMetrics`
+         * @param cli UUID of the client
+         * @param out Snapshot to write the counters to. `connections` is 1.
+         * @return False if `cli` doesn't exist or has no counters of its own.
+         */
+        bool getClientMetrics(const UUID &cli, MetricsSnapshot &out);
+
+        /**
+         * @brief Get the counters of every client that has its own. See `setClientMetrics`
+         * @return Pairs of client UUIDs and their counters. Empty if `setClientMetrics` is off.
+         */
+        std::vector<std::pair<UUID, MetricsSnapshot>> getClientMetrics();
+
+        /**
+         * @brief Set the new `writableCallback`. See documentation for `stms::SSLServer::writableCallback`
+         * @param newCb The new callback to replace the old one
+         */
+        inline void setWritableCallback(const std::function<void(const UUID &)> &newCb) {
+            writableCallback = newCb;
+        }
+
         /**
          * @brief Replace the client's UUID with a newly generated UUIDv4
          * @param client Client UUID to replace
@@ -214,17 +615,25 @@ namespace stms {
          */
         std::vector<UUID> getClientUuids();
 
+        /**
+         * @brief Query if a client is connected
+         * @param cli UUID of the client to look for
+         * @return True if a client with the UUID `cli` is connected.
+         */
+        bool hasClient(const UUID &cli);
+
         /**
          * @brief Get the number of currently connected clients
          * @return Number of clients
          */
         inline std::size_t getNumClients() {
-            std::lock_guard<std::mutex> lg(clientsMtx);
             return clients.size();
         };
 
         /**
          * @brief Block until there is data to be read, will block at maximum `timeoutMs` milliseconds.
+         *        With `IOBackend::eEpoll`, this waits on the `EventLoop` and the ready sockets are handled in the
+         *        next `tick()`. Otherwise, every client is `poll`ed.
          * @param timeoutMs Maximum amount of time to block for, in milliseconds
          */
         void waitEvents(int timeoutMs) override;
@@ -245,6 +654,42 @@ namespace stms {
          */
         void kickClient(const UUID &cliId);
 
+        /**
+         * @brief Control how messages queued to a client are merged. Every client has a queue drained by a single
+         *        writer task, and small messages that pile up in it are merged into one `SSL_write` (and TLS record).
+         *        **DTLS messages are never merged**, as that would change where the peer sees message boundaries.
+         * @param maxBytes Maximum number of bytes to merge into one write. Defaults to `sendCoalesceMax`, the
+         *                 largest TLS record. Messages larger than this are written on their own.
+         * @param flushDelay Maximum time in milliseconds a message waits for more to be queued before being written.
+         *                   If 0, writing starts immediately and only messages queued during a write are merged.
+         *                   Otherwise, it is enforced in `tick()`, so tick at least this often.
+         */
+        inline void setSendCoalescing(int maxBytes, unsigned flushDelay) {
+            coalesceMax = maxBytes;
+            flushDelayMs = flushDelay;
+        }
+
+        /**
+         * @brief Bound how much data may be queued to a single client. Once more than `high` bytes are waiting to be
+         *        written to a client, `send()` refuses further messages to it with -4, until the client drains to
+         *        `low` bytes and `writableCallback` is called. A message is always accepted if nothing is queued,
+         *        even if it is larger than `high`.
+         * @param high Max number of queued bytes. Defaults to `sendHighWatermark`.
+         * @param low Number of queued bytes at which the client is writable again. Must not exceed `high`.
+         *            Defaults to `sendLowWatermark`.
+         */
+        inline void setSendWatermarks(std::size_t high, std::size_t low) {
+            highWatermark = high;
+            lowWatermark = low;
+        }
+
+        /**
+         * @brief Get the number of bytes queued to a client that haven't been handed to `SSL_write` yet.
+         * @param cli UUID of the client to query
+         * @return Number of bytes, or 0 if `cli` doesn't exist.
+         */
+        std::size_t getQueuedBytes(const UUID &cli);
+
         /**
          * @brief Send an message (in the form of an array of `uint8_t`s) to a client.
          * @param clientUuid UUID of the client to send this message to.
@@ -256,10 +701,34 @@ namespace stms {
          *         If `clientUuid` is invalid, 0 is returned. If the server was stopped, -1 is returned; you must
          *         first start the server before calling `send()`. If there was a fatal SSL error, -2 is returned and
          *         the client is kicked. If the operation timed out, -3 is returned and the client is kicked.
-         *         Otherwise, the number of bytes sent is returned.
+         *         Otherwise, the number of bytes sent is returned. Messages to the same client are written in order.
+         *         If the client disconnects before the message is written, -1 is returned. If the client's queue is
+         *         over the high watermark, -4 is returned immediately and the message is dropped; wait for
+         *         `writableCallback` before sending to it again. See `setSendWatermarks`.
          */
         std::future<int> send(const UUID &clientUuid, const uint8_t *const msg, int msgLen, bool cpy = false);
 
+        /**
+         * @brief Send part of a file to a client. If kTLS is active for the client (see `setKernelTls`), the file is
+         *        sent with `SSL_sendfile` and never copied into user space. Otherwise, it is read and `SSL_write`n in
+         *        chunks of `sendFileChunk` bytes. Only supported on TCP/TLS.
+         * @param clientUuid The UUID of the client to send the file to
+         * @param fd File descriptor of the file. It must stay open until the returned future is ready.
+         * @param offset Offset into the file to start at
+         * @param len Number of bytes to send
+         * @return Same as `send()`, except that -5 is returned if the file couldn't be read (in which case part of it
+         *         may have been sent already), `len` or `offset` is negative, or this is a DTLS server. Files are
+         *         sent in order with messages from `send()`, and count towards the watermarks until they are sent.
+         */
+        std::future<int> sendFile(const UUID &clientUuid, int fd, off_t offset, int len);
+
+        /**
+         * @brief Query if kTLS is active for sending to a client. See `setKernelTls`
+         * @param cli UUID of the client to query
+         * @return True if records to `cli` are encrypted by the kernel, false otherwise or if `cli` doesn't exist.
+         */
+        bool isKernelTls(const UUID &cli);
+
         /**
          * @brief Accept incoming client connections & receive data asynchronously. To be called at a regular interval.
          *        Usually, this function will not block. However, if a client disconnects, it will block until
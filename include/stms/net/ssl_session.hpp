@@ -0,0 +1,226 @@
+/**
+ * @file stms/net/ssl_session.hpp
+ * @brief Provides TLS session resumption for `SSLServer`: Rotating session ticket keys (`SessionTicketKeys`) and a
+ *        server-side session cache (`SessionCache`). You shouldn't have to include this manually.
+ */
+
+#pragma once
+
+#ifndef __STONEMASON_NET_SSL_SESSION_HPP
+#define __STONEMASON_NET_SSL_SESSION_HPP
+//!< Include guard
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+
+#include "openssl/ssl.h"
+#include "stms/config.hpp"
+
+namespace stms {
+    /// Counters of how often TLS sessions were resumed instead of doing a full handshake.
+    struct SessionStats {
+        uint64_t fullHandshakes = 0; //!< Number of handshakes that didn't resume a session.
+        uint64_t resumedHandshakes = 0; //!< Number of handshakes that resumed a session (from a ticket or the cache)
+        uint64_t cacheHits = 0; //!< Number of session IDs found in the `SessionCache`. Server only.
+        uint64_t cacheMisses = 0; //!< Number of session IDs not found in (or expired from) the `SessionCache`. Server only.
+        uint64_t cacheEvictions = 0; //!< Number of sessions dropped from a full `SessionCache`. Server only.
+        std::size_t cacheSize = 0; //!< Number of sessions currently in the `SessionCache`. Server only.
+
+        /**
+         * @brief Get the fraction of handshakes that were resumed.
+         * @return `resumedHandshakes / (fullHandshakes + resumedHandshakes)`, or 0 if there were no handshakes.
+         */
+        [[nodiscard]] inline double resumptionRate() const {
+            uint64_t total = fullHandshakes + resumedHandshakes;
+            return total == 0 ? 0 : static_cast<double>(resumedHandshakes) / static_cast<double>(total);
+        }
+    };
+
+    /**
+     * @brief Keys used to encrypt (AES-256-CBC) and authenticate (HMAC-SHA256) stateless TLS session tickets, so that
+     *        the server doesn't have to keep any state for resumable sessions. A new key is generated every `lifetime`
+     *        seconds; tickets from the `history` keys before that are still accepted, but are replaced with a ticket
+     *        from the current key. Tickets from older keys fall back to a full handshake.
+     *
+     *        Can be shared between several servers (i.e. the shards of a `ShardedSSLServer`) so that a client can
+     *        resume with any of them.
+     */
+    class SessionTicketKeys {
+    private:
+        /// A single ticket key
+        struct Key {
+            uint8_t name[16]{}; //!< Identifies the key. Sent in the clear as part of the ticket.
+            uint8_t aesKey[32]{}; //!< Key for encrypting the ticket.
+            uint8_t hmacKey[32]{}; //!< Key for authenticating the ticket.
+            std::chrono::steady_clock::time_point created; //!< Time this key was generated
+        };
+
+        std::deque<Key> keys; //!< Current key at the front, followed by older keys still accepted for decryption.
+        std::shared_mutex keysMtx; //!< Guards `keys`
+        unsigned lifetimeSecs = ticketKeyLifetime; //!< See `setRotation`
+        std::size_t history = ticketKeyHistory; //!< See `setRotation`
+
+        void rotateLocked(); //!< Generate a new key and drop keys past `history`. Requires `keysMtx`.
+
+    public:
+        SessionTicketKeys(); //!< Constructor. Generates the first key.
+
+        ~SessionTicketKeys(); //!< Destructor. Wipes the keys from memory.
+
+        SessionTicketKeys(const SessionTicketKeys &rhs) = delete; //!< Deleted copy constructor
+        SessionTicketKeys &operator=(const SessionTicketKeys &rhs) = delete; //!< Deleted copy assignment operator
+
+        /**
+         * @brief Configure key rotation
+         * @param lifetime Number of seconds a key is used to issue new tickets before it is replaced. If 0, keys are
+         *                 only replaced by `rotate()`. Defaults to `ticketKeyLifetime`.
+         * @param numOld Number of replaced keys to still accept tickets from. Defaults to `ticketKeyHistory`.
+         */
+        void setRotation(unsigned lifetime, std::size_t numOld);
+
+        void rotate(); //!< Replace the current key right away, i.e. if it may have been leaked.
+
+        /**
+         * @brief OpenSSL callback. Internal impl detail. See `SSL_CTX_set_tlsext_ticket_key_evp_cb`
+         * @return 1 if successful, 2 if successful but a new ticket should be issued, 0 if the key wasn't found,
+         *         and -1 on error.
+         */
+        int handleTicket(uint8_t *keyName, uint8_t *iv, void *cipherCtx, void *macCtx, int enc);
+
+        /**
+         * @brief Make `ctx` use `keys` for session tickets. Internal impl detail, called by `SSLServer`.
+         * @param ctx OpenSSL context of a server. It keeps a reference to `keys` until it is freed.
+         * @param keys Keys to use
+         */
+        static void install(SSL_CTX *ctx, const std::shared_ptr<SessionTicketKeys> &keys);
+    };
+
+    /**
+     * @brief Thread-safe cache of TLS sessions for resuming by session ID. This is used for clients that don't support
+     *        session tickets, or for all clients if tickets are disabled (see `SSLServer::setSessionTickets`).
+     *
+     *        Like `StripedMap`, the cache is split into independently locked stripes. Each stripe holds at most
+     *        `maxSessions / numStripes` sessions and evicts the oldest ones first. Sessions also expire `ttl` seconds
+     *        after they're added.
+     *
+     *        Can be shared between several servers, see `SessionTicketKeys`.
+     */
+    class SessionCache {
+    private:
+        /// A cached session
+        struct Entry {
+            SSL_SESSION *sess = nullptr; //!< The session. This holds a reference to it.
+            std::chrono::steady_clock::time_point expiry; //!< When the session stops being resumable.
+            uint64_t seq = 0; //!< Position in `Stripe::order`, to tell it apart from removed sessions with the same ID.
+        };
+
+        /// Sessions whose ID falls in this stripe, and the order they were added for eviction.
+        struct alignas(64) Stripe {
+            std::mutex mtx; //!< Guards `entries` and `order`.
+            std::unordered_map<std::string, Entry> entries; //!< Sessions by ID
+            std::deque<std::pair<uint64_t, std::string>> order; //!< `seq` & ID of sessions, oldest first. May be stale.
+            uint64_t nextSeq = 0; //!< `seq` of the next session added
+        };
+
+        std::size_t numStripes{}; //!< Number of entries in `stripes`
+        std::unique_ptr<Stripe[]> stripes; //!< The stripes
+
+        std::atomic<std::size_t> maxPerStripe{}; //!< Max number of sessions per stripe. See `setLimits`
+        std::atomic<unsigned> ttlSecs{}; //!< Seconds sessions can be resumed for. See `setLimits`
+
+        std::atomic<uint64_t> hits{0}; //!< See `SessionStats::cacheHits`
+        std::atomic<uint64_t> misses{0}; //!< See `SessionStats::cacheMisses`
+        std::atomic<uint64_t> evictions{0}; //!< See `SessionStats::cacheEvictions`
+        std::atomic<std::size_t> count{0}; //!< See `SessionStats::cacheSize`
+
+        /**
+         * @brief Get the stripe a session ID belongs to. Internal impl detail.
+         * @param id Session ID
+         * @return Reference to the stripe.
+         */
+        Stripe &stripeOf(const std::string &id);
+
+        /**
+         * @brief Evict sessions in a stripe until there's room for 1 more. Requires `stripe.mtx`. Internal impl detail.
+         * @param stripe Stripe to make room in
+         */
+        void makeRoom(Stripe &stripe);
+
+    public:
+        /**
+         * @brief Construct an empty cache.
+         * @param maxSessions Max number of sessions. If 0, nothing is cached. Defaults to `sessionCacheSize`.
+         * @param ttl Number of seconds a session can be resumed for. Defaults to `sessionCacheTtl`.
+         * @param stripeCount Number of stripes. Defaults to `clientTableStripes`.
+         */
+        explicit SessionCache(std::size_t maxSessions = sessionCacheSize, unsigned ttl = sessionCacheTtl,
+                              std::size_t stripeCount = clientTableStripes);
+
+        ~SessionCache(); //!< Destructor. Releases all the cached sessions.
+
+        SessionCache(const SessionCache &rhs) = delete; //!< Deleted copy constructor
+        SessionCache &operator=(const SessionCache &rhs) = delete; //!< Deleted copy assignment operator
+
+        /**
+         * @brief Change the size and TTL limits. Only applies to sessions added afterwards.
+         * @param maxSessions Max number of sessions
+         * @param ttl Number of seconds a session can be resumed for.
+         */
+        void setLimits(std::size_t maxSessions, unsigned ttl);
+
+        /**
+         * @brief Add a session to the cache, evicting the oldest session in its stripe if it is full.
+         * @param sess Session to add. A new reference is taken, so the caller keeps theirs.
+         */
+        void add(SSL_SESSION *sess);
+
+        /**
+         * @brief Look up a session by ID. Expired sessions are removed.
+         * @param id Session ID
+         * @param len Length of `id` in bytes
+         * @return New reference to the session, which the caller must free, or `nullptr` if it wasn't found.
+         */
+        SSL_SESSION *get(const uint8_t *id, unsigned len);
+
+        /**
+         * @brief Remove a session by ID.
+         * @param id Session ID
+         * @param len Length of `id` in bytes
+         */
+        void remove(const uint8_t *id, unsigned len);
+
+        void flushExpired(); //!< Remove every expired session.
+
+        void clear(); //!< Remove every session.
+
+        /**
+         * @brief Get the number of sessions in the cache.
+         * @return Number of sessions
+         */
+        [[nodiscard]] inline std::size_t size() const {
+            return count.load(std::memory_order_relaxed);
+        }
+
+        /**
+         * @brief Add the cache counters to `stats`.
+         * @param stats Stats to fill in `cacheHits`, `cacheMisses`, `cacheEvictions` and `cacheSize` of.
+         */
+        void addStats(SessionStats &stats) const;
+
+        /**
+         * @brief Make `ctx` use `cache` instead of OpenSSL's internal cache. Internal impl detail.
+         * @param ctx OpenSSL context of a server. It keeps a reference to `cache` until it is freed, as sessions
+         *            may be removed from the cache when `SSL` objects outliving the server are freed.
+         * @param cache Cache to use
+         */
+        static void install(SSL_CTX *ctx, const std::shared_ptr<SessionCache> &cache);
+    };
+}
+
+#endif //__STONEMASON_NET_SSL_SESSION_HPP
@@ -0,0 +1,290 @@
+/**
+ * @file stms/net/uring.hpp
+ * @brief Provides `IOUring`, a minimal wrapper around the Linux `io_uring` interface used by the
+ *        `IOBackend::eIOUring` backend. You should not have to include this manually.
+ */
+
+#pragma once
+
+#ifndef __STONEMASON_NET_URING_HPP
+#define __STONEMASON_NET_URING_HPP
+//!< Include guard
+
+#include <vector>
+#include <mutex>
+#include <cstdint>
+
+#include <sys/socket.h>
+
+#include "stms/config.hpp"
+
+namespace stms {
+
+    /// A single completion returned by `IOUring::reap`. Mirrors `io_uring_cqe`.
+    struct UringCompletion {
+        uint64_t userData; //!< `userData` passed to the `prep*` call this completes
+        int32_t res; //!< Result of the operation. Negative `errno` values indicate errors.
+        uint32_t flags; //!< `IORING_CQE_F_*` flags. Use `IOUring::hasMore` and `IOUring::getBufId` to inspect them.
+    };
+
+    /**
+     * @brief Reserved `userData` values for requests submitted by `_stms_PlainBase` and its subclasses.
+     *        Any other `userData` is either a pointer or built with `uringFdTag`.
+     */
+    enum UringTag : uint64_t {
+        eUringWake = 1, //!< Poll on the eventfd used to wake up `waitEvents()` from other threads.
+        eUringRecv = 2, //!< Multishot `recvmsg` on the main socket.
+        eUringAccept = 3, //!< Multishot `accept` on the listening socket.
+        eUringListen = 4, //!< Multishot poll on the listening socket.
+        eUringCancel = 5, //!< Cancellation request submitted in `stop()`.
+        eUringFdPoll = 6 //!< Multishot poll on some other fd. The fd is stored in the upper bits. See `uringFdTag`.
+    };
+
+    /**
+     * @brief Build a `userData` value that identifies a multishot poll on `fd`.
+     * @param fd File descriptor that is being polled
+     * @return `userData` value
+     */
+    inline uint64_t uringFdTag(int fd) {
+        return (static_cast<uint64_t>(fd) << 8u) | eUringFdPoll;
+    }
+
+    /**
+     * @brief Minimal wrapper around an `io_uring` instance, using raw syscalls so that there is no dependency
+     *        on liburing. Requires Linux 6.0+ for multishot `recvmsg`; `isValid()` is false if the ring couldn't be
+     *        created (older kernel, seccomp, `io_uring_disabled` sysctl, non-Linux platform, etc).
+     *
+     *        **Not thread safe**: Calls to `prep*`, `submit` and `reap` must be serialized by the caller.
+     *        Only `recycleBuf` and `wait` may be called concurrently with them.
+     */
+    class IOUring {
+    private:
+        int ringFd = -1; //!< `io_uring` file descriptor. -1 if it isn't valid.
+
+        void *sqPtr = nullptr; //!< Mapping of the submission queue ring
+        void *cqPtr = nullptr; //!< Mapping of the completion queue ring. May be the same as `sqPtr`
+        void *sqesPtr = nullptr; //!< Mapping of the submission queue entries
+        std::size_t sqLen = 0; //!< Size of the `sqPtr` mapping
+        std::size_t cqLen = 0; //!< Size of the `cqPtr` mapping
+        std::size_t sqesLen = 0; //!< Size of the `sqesPtr` mapping
+
+        unsigned *sqHead = nullptr; //!< Kernel-owned head of the submission queue
+        unsigned *sqTail = nullptr; //!< User-owned tail of the submission queue
+        unsigned sqMask = 0; //!< Mask to turn submission indices into array indices
+        unsigned sqEntries = 0; //!< Number of entries in the submission queue
+        unsigned sqeTail = 0; //!< Local tail; Entries up to here have been handed out by `getSqe`
+
+        unsigned *cqHead = nullptr; //!< User-owned head of the completion queue
+        unsigned *cqTail = nullptr; //!< Kernel-owned tail of the completion queue
+        unsigned cqMask = 0; //!< Mask to turn completion indices into array indices
+        void *cqes = nullptr; //!< Array of `io_uring_cqe`
+
+        void *bufRing = nullptr; //!< Provided buffer ring (`io_uring_buf_ring`) registered with the kernel
+        std::size_t bufRingLen = 0; //!< Size of the `bufRing` mapping
+        uint8_t *bufBase = nullptr; //!< Backing memory for the provided buffers.
+        unsigned bufCount = 0; //!< Number of provided buffers. Always a power of 2.
+        unsigned bufSize = 0; //!< Size of each provided buffer in bytes.
+        uint16_t bufTail = 0; //!< Local tail of `bufRing`. Guarded by `bufMtx`
+        std::mutex bufMtx; //!< Mutex for returning buffers to `bufRing` from multiple threads.
+
+        void *getSqe(); //!< Get the next free `io_uring_sqe`, or `nullptr` if the queue is full. Internal impl detail.
+        void pushBuf(uint16_t bid); //!< Add a buffer to `bufRing` without publishing it. Internal impl detail.
+
+    public:
+        /**
+         * @brief Create a new `io_uring` instance.
+         * @param entries Number of submission queue entries. Rounded up to a power of 2 by the kernel.
+         */
+        explicit IOUring(unsigned entries = uringEntries);
+
+        ~IOUring(); //!< Unmaps and closes the ring. All pending requests are cancelled by the kernel.
+
+        IOUring(const IOUring &rhs) = delete; //!< Deleted copy constructor
+        IOUring &operator=(const IOUring &rhs) = delete; //!< Deleted copy assignment operator
+
+        /**
+         * @brief Register file descriptors with the ring, so requests may refer to them by index (`fixed == true`)
+         *        instead of looking up the fd every time.
+         * @param fds Array of file descriptors. `fds[i]` will be index `i`.
+         * @param num Number of elements in `fds`
+         * @return True if successful, false otherwise.
+         */
+        bool registerFiles(const int *fds, unsigned num);
+
+        /**
+         * @brief Unregister all files registered with `registerFiles`, dropping the ring's references to them.
+         * @return True if successful, false otherwise.
+         */
+        bool unregisterFiles();
+
+        /**
+         * @brief Set up a ring of buffers that the kernel picks from for multishot receives (buffer group 0).
+         * @param count Number of buffers. Must be a power of 2, no larger than 32768.
+         * @param size Size of each buffer in bytes.
+         * @return True if successful, false otherwise (i.e. the kernel is older than 5.19).
+         */
+        bool setupBufRing(unsigned count, unsigned size);
+
+        /**
+         * @brief Get a pointer to a provided buffer.
+         * @param bid Buffer ID, from `getBufId`
+         * @return Pointer to the start of the buffer, which is `getBufSize()` bytes long.
+         */
+        [[nodiscard]] inline uint8_t *getBuf(uint16_t bid) const {
+            return bufBase + static_cast<std::size_t>(bid) * bufSize;
+        }
+
+        /**
+         * @brief Get the size of each provided buffer
+         * @return Size in bytes, as passed to `setupBufRing`
+         */
+        [[nodiscard]] inline unsigned getBufSize() const {
+            return bufSize;
+        }
+
+        /**
+         * @brief Hand a provided buffer back to the kernel once its contents are no longer needed. Thread-safe.
+         * @param bid Buffer ID, from `getBufId`
+         */
+        void recycleBuf(uint16_t bid);
+
+        /**
+         * @brief Queue a multishot `recvmsg` that fills buffers from `setupBufRing`. Each datagram produces a
+         *        completion with a buffer laid out as described by `parseRecvMsg`.
+         * @param fd File descriptor, or index of a registered file if `fixed` is true.
+         * @param fixed If true, `fd` is an index into the files registered with `registerFiles`
+         * @param hdr Template `msghdr`. Only `msg_namelen` and `msg_controllen` are used. Must remain valid until
+         *            the next `submit`.
+         * @param userData Value identifying this request in completions.
+         * @return True if queued, false if the submission queue is full.
+         */
+        bool prepRecvMsgMultishot(int fd, bool fixed, msghdr *hdr, uint64_t userData);
+
+        /**
+         * @brief Queue a `sendmsg`.
+         * @param fd File descriptor, or index of a registered file if `fixed` is true.
+         * @param fixed If true, `fd` is an index into the files registered with `registerFiles`
+         * @param hdr Message to send. It and everything it points to must remain valid until it completes.
+         * @param userData Value identifying this request in completions.
+         * @return True if queued, false if the submission queue is full.
+         */
+        bool prepSendMsg(int fd, bool fixed, const msghdr *hdr, uint64_t userData);
+
+        /**
+         * @brief Queue a multishot poll. A completion is posted every time `fd` becomes ready.
+         * @param fd File descriptor, or index of a registered file if `fixed` is true.
+         * @param fixed If true, `fd` is an index into the files registered with `registerFiles`
+         * @param events `poll` events to watch for (`POLLIN`, etc)
+         * @param userData Value identifying this request in completions.
+         * @return True if queued, false if the submission queue is full.
+         */
+        bool prepPollMultishot(int fd, bool fixed, uint32_t events, uint64_t userData);
+
+        /**
+         * @brief Queue a single-shot poll. 1 completion is posted when `fd` becomes ready.
+         * @param fd File descriptor, or index of a registered file if `fixed` is true.
+         * @param fixed If true, `fd` is an index into the files registered with `registerFiles`
+         * @param events `poll` events to watch for (`POLLIN`, etc)
+         * @param userData Value identifying this request in completions.
+         * @return True if queued, false if the submission queue is full.
+         */
+        bool prepPoll(int fd, bool fixed, uint32_t events, uint64_t userData);
+
+        /**
+         * @brief Queue the removal of a poll queued with `prepPollMultishot` or `prepPoll`
+         * @param target `userData` of the poll to remove
+         * @param userData Value identifying this request in completions.
+         * @return True if queued, false if the submission queue is full.
+         */
+        bool prepPollRemove(uint64_t target, uint64_t userData);
+
+        /**
+         * @brief Queue a multishot `accept`. Each accepted connection produces a completion with the new fd as `res`.
+         *        Accepted sockets are non-blocking and close-on-exec.
+         * @param fd File descriptor, or index of a registered file if `fixed` is true.
+         * @param fixed If true, `fd` is an index into the files registered with `registerFiles`
+         * @param userData Value identifying this request in completions.
+         * @return True if queued, false if the submission queue is full.
+         */
+        bool prepAcceptMultishot(int fd, bool fixed, uint64_t userData);
+
+        /**
+         * @brief Queue the cancellation of every pending request on this ring.
+         * @param userData Value identifying this request in completions.
+         * @return True if queued, false if the submission queue is full.
+         */
+        bool prepCancelAll(uint64_t userData);
+
+        /**
+         * @brief Submit all queued requests to the kernel without waiting for any of them.
+         * @return Number of requests submitted, or -1 on error.
+         */
+        int submit();
+
+        /**
+         * @brief Block until at least 1 completion is available or until `timeoutMs` runs out.
+         *        Doesn't submit anything, so it's safe to call while another thread is queueing requests.
+         * @param timeoutMs Maximum number of milliseconds to block. -1 blocks forever.
+         * @return True if there are completions to `reap`.
+         */
+        bool wait(int timeoutMs);
+
+        /**
+         * @brief Append all available completions to `out`.
+         * @param out Vector to append the completions to
+         * @return Number of completions appended
+         */
+        unsigned reap(std::vector<UringCompletion> &out);
+
+        /**
+         * @brief Query if there are queued requests that haven't been `submit`ted.
+         * @return True if `submit` has work to do.
+         */
+        [[nodiscard]] bool hasUnsubmitted() const;
+
+        /**
+         * @brief Query if there are completions that can be `reap`ed without blocking.
+         * @return True if `reap` will return something.
+         */
+        [[nodiscard]] bool hasCompletions() const;
+
+        /**
+         * @brief Query if the ring was successfully created.
+         * @return True if this `IOUring` can be used
+         */
+        [[nodiscard]] inline bool isValid() const {
+            return ringFd != -1;
+        }
+
+        /**
+         * @brief Query if a multishot request will post more completions after this one.
+         *        If false, the request has terminated and must be queued again.
+         * @param c Completion to inspect
+         * @return True if the request is still active
+         */
+        static bool hasMore(const UringCompletion &c);
+
+        /**
+         * @brief Get the ID of the provided buffer a completion filled.
+         * @param c Completion to inspect
+         * @return Buffer ID, or -1 if the completion didn't use a provided buffer.
+         */
+        static int getBufId(const UringCompletion &c);
+
+        /**
+         * @brief Locate the parts of a datagram received with `prepRecvMsgMultishot`
+         * @param buf Provided buffer the datagram was received into
+         * @param len `res` of the completion (number of bytes of `buf` used)
+         * @param hdr The template `msghdr` passed to `prepRecvMsgMultishot`
+         * @param addr Set to the address of the sender.
+         * @param addrLen Set to the length of `*addr`.
+         * @param payload Set to the start of the datagram's data.
+         * @param payloadLen Set to the length of the datagram's data.
+         * @return False if the datagram was truncated or malformed and should be dropped.
+         */
+        static bool parseRecvMsg(uint8_t *buf, int32_t len, const msghdr *hdr, sockaddr **addr, socklen_t *addrLen,
+                                 uint8_t **payload, std::size_t *payloadLen);
+    };
+}
+
+#endif //__STONEMASON_NET_URING_HPP
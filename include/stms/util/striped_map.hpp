@@ -0,0 +1,219 @@
+/**
+ * @file stms/util/striped_map.hpp
+ * @brief Provides `StripedMap`, a hash map split into independently locked stripes for read-mostly tables.
+ */
+
+#pragma once
+
+#ifndef __STONEMASON_STRIPED_MAP_HPP
+#define __STONEMASON_STRIPED_MAP_HPP
+//!< Include guard
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+
+namespace stms {
+    /**
+     * @brief Thread-safe hash map split into `numStripes` sub-maps, each with its own `std::shared_mutex`.
+     *        Lookups only take a shared lock on 1 stripe, so they never block each other and only wait for writers
+     *        to the same stripe. Intended for tables that are read far more often than they are modified.
+     * @tparam K Key type
+     * @tparam V Value type. Values are returned by copy, so this should be cheap to copy (i.e. a `std::shared_ptr`)
+     * @tparam Hash Hash function for `K`
+     */
+    template<typename K, typename V, typename Hash = std::hash<K>>
+    class StripedMap {
+    private:
+        /// A sub-map and the lock guarding it. Aligned so that neighbouring locks don't share a cache line.
+        struct alignas(64) Stripe {
+            mutable std::shared_mutex mtx; //!< Lock for `map`
+            std::unordered_map<K, V, Hash> map; //!< Entries whose hash falls in this stripe
+        };
+
+        std::size_t numStripes{}; //!< Number of entries in `stripes`
+        std::unique_ptr<Stripe[]> stripes; //!< The stripes
+        std::atomic<std::size_t> count{0}; //!< Total number of entries across all stripes
+
+        /**
+         * @brief Get the index of the stripe a key belongs to. Internal impl detail.
+         * @param key Key to look up
+         * @return Index into `stripes`
+         */
+        inline std::size_t stripeOf(const K &key) const {
+            std::size_t h = Hash{}(key);
+            return (h ^ (h >> 16u)) % numStripes; // The low bits pick the bucket within the stripe, so mix in others
+        }
+
+    public:
+        /**
+         * @brief Construct an empty map.
+         * @param stripeCount Number of stripes. More stripes means less contention between writers, but makes
+         *                    `forEach` and `clear` slower. If 0, 1 stripe is used.
+         */
+        explicit StripedMap(std::size_t stripeCount) : numStripes(stripeCount == 0 ? 1 : stripeCount),
+                                                       stripes(std::make_unique<Stripe[]>(numStripes)) {}
+
+        StripedMap(const StripedMap &rhs) = delete; //!< Deleted copy constructor
+        StripedMap &operator=(const StripedMap &rhs) = delete; //!< Deleted copy assignment operator
+
+        /**
+         * @brief Move assignment operator. **Not thread safe**: Neither map may be in use by another thread.
+         * @param rhs Right Hand Side of the `std::move`
+         * @return A reference to `this`
+         */
+        StripedMap &operator=(StripedMap &&rhs) noexcept {
+            if (this == &rhs) {
+                return *this;
+            }
+
+            std::swap(numStripes, rhs.numStripes);
+            std::swap(stripes, rhs.stripes);
+            count = rhs.count.exchange(count.load());
+            return *this;
+        }
+
+        /**
+         * @brief Move constructor. **Not thread safe**: `rhs` may not be in use by another thread.
+         * @param rhs Right Hand Side of the `std::move`. It is left empty, with 1 stripe.
+         */
+        StripedMap(StripedMap &&rhs) noexcept : StripedMap(1) {
+            *this = std::move(rhs);
+        }
+
+        /**
+         * @brief Look up a key.
+         * @param key Key to look up
+         * @param out Set to a copy of the value if the key is present. Untouched otherwise.
+         * @return True if the key is present.
+         */
+        bool find(const K &key, V &out) const {
+            const Stripe &stripe = stripes[stripeOf(key)];
+            std::shared_lock<std::shared_mutex> lg(stripe.mtx);
+            auto it = stripe.map.find(key);
+            if (it == stripe.map.end()) {
+                return false;
+            }
+            out = it->second;
+            return true;
+        }
+
+        /**
+         * @brief Query if a key is present.
+         * @param key Key to look up
+         * @return True if the key is present.
+         */
+        bool contains(const K &key) const {
+            const Stripe &stripe = stripes[stripeOf(key)];
+            std::shared_lock<std::shared_mutex> lg(stripe.mtx);
+            return stripe.map.find(key) != stripe.map.end();
+        }
+
+        /**
+         * @brief Insert a value, replacing the old value if the key is already present.
+         * @param key Key to insert
+         * @param val Value to insert
+         */
+        void insert(const K &key, V val) {
+            Stripe &stripe = stripes[stripeOf(key)];
+            std::unique_lock<std::shared_mutex> lg(stripe.mtx);
+            if (stripe.map.insert_or_assign(key, std::move(val)).second) {
+                count++;
+            }
+        }
+
+        /**
+         * @brief Remove a key. The value is destroyed after the stripe is unlocked, so slow destructors don't block
+         *        lookups.
+         * @param key Key to remove
+         * @return True if the key was present.
+         */
+        bool erase(const K &key) {
+            [[maybe_unused]] V val; // Keeps the value alive until the lock is released
+            {
+                Stripe &stripe = stripes[stripeOf(key)];
+                std::unique_lock<std::shared_mutex> lg(stripe.mtx);
+                auto it = stripe.map.find(key);
+                if (it == stripe.map.end()) {
+                    return false;
+                }
+                val = std::move(it->second);
+                stripe.map.erase(it);
+                count--;
+            }
+            return true;
+        }
+
+        /**
+         * @brief Move a value from one key to another. Other threads never see both keys missing at once.
+         * @param old Key the value is at. Nothing happens if it isn't present.
+         * @param newKey Key to move the value to. If it is already present, its value is replaced.
+         * @return True if `old` was present and the value was moved.
+         */
+        bool rekey(const K &old, const K &newKey) {
+            std::size_t oldIdx = stripeOf(old);
+            std::size_t newIdx = stripeOf(newKey);
+
+            // Lock in index order so that 2 concurrent `rekey`s can't deadlock.
+            std::unique_lock<std::shared_mutex> firstLg(stripes[std::min(oldIdx, newIdx)].mtx);
+            std::unique_lock<std::shared_mutex> secondLg;
+            if (oldIdx != newIdx) {
+                secondLg = std::unique_lock<std::shared_mutex>(stripes[std::max(oldIdx, newIdx)].mtx);
+            }
+
+            auto &oldMap = stripes[oldIdx].map;
+            auto it = oldMap.find(old);
+            if (it == oldMap.end()) {
+                return false;
+            }
+
+            V val = std::move(it->second);
+            oldMap.erase(it);
+            if (!stripes[newIdx].map.insert_or_assign(newKey, std::move(val)).second) {
+                count--; // `newKey` was overwritten
+            }
+            return true;
+        }
+
+        /**
+         * @brief Call a function on every entry. Each stripe is shared-locked while its entries are visited, so `fn`
+         *        may look up other keys, but must not modify this map. Entries inserted or removed concurrently
+         *        may or may not be visited.
+         * @param fn Function taking `(const K &, const V &)`
+         */
+        template<typename F>
+        void forEach(F &&fn) const {
+            for (std::size_t i = 0; i < numStripes; i++) {
+                std::shared_lock<std::shared_mutex> lg(stripes[i].mtx);
+                for (const auto &pair : stripes[i].map) {
+                    fn(pair.first, pair.second);
+                }
+            }
+        }
+
+        /// Remove every entry. Like `erase`, values are destroyed outside of the locks.
+        void clear() {
+            for (std::size_t i = 0; i < numStripes; i++) {
+                std::unordered_map<K, V, Hash> removed;
+                {
+                    std::unique_lock<std::shared_mutex> lg(stripes[i].mtx);
+                    removed.swap(stripes[i].map);
+                    count -= removed.size();
+                }
+            }
+        }
+
+        /**
+         * @brief Get the number of entries. Only a snapshot if other threads are modifying the map.
+         * @return Number of entries
+         */
+        [[nodiscard]] inline std::size_t size() const {
+            return count.load(std::memory_order_relaxed);
+        }
+    };
+}
+
+#endif //__STONEMASON_STRIPED_MAP_HPP
@@ -0,0 +1,172 @@
+/**
+ * @file stms/util/timing_wheel.hpp
+ * @brief Provides `TimingWheel`, a hierarchical timing wheel for tracking large numbers of coarse deadlines.
+ */
+
+#pragma once
+
+#ifndef __STONEMASON_TIMING_WHEEL_HPP
+#define __STONEMASON_TIMING_WHEEL_HPP
+//!< Include guard
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace stms {
+    /**
+     * @brief Hierarchical timing wheel. Scheduling an item is O(1), and `advance` only touches items that are due (plus
+     *        an amortized O(1) per item for moving it down a level as its deadline gets closer), so it costs the same
+     *        with 10 items as with 100000. Deadlines are rounded up to a multiple of `resolution`.
+     *
+     *        There are `numLevels` wheels of `slotsPerLevel` slots. Each slot of level `l` spans
+     *        `slotsPerLevel^l` ticks, so with 64 slots and 4 levels, a 10ms resolution covers ~4.6 days. Items that
+     *        are further out are parked in the last slot and rescheduled when they come around.
+     *
+     *        Items can't be cancelled. Instead, whoever handles an expired item checks if it is still relevant
+     *        (i.e. if the deadline was pushed back in the meantime), and `schedule`s it again if needed.
+     *        Not thread-safe.
+     * @tparam T Type of the items. Should be cheap to move.
+     */
+    template<typename T>
+    class TimingWheel {
+    public:
+        using Clock = std::chrono::steady_clock; //!< Clock deadlines are measured with
+
+    private:
+        static constexpr unsigned levelBits = 6; //!< log2 of `slotsPerLevel`
+        static constexpr std::size_t slotsPerLevel = std::size_t{1} << levelBits; //!< Number of slots of each level
+        static constexpr std::size_t numLevels = 4; //!< Number of levels
+
+        /// An item and the tick it is due at.
+        struct Entry {
+            T item; //!< The item
+            uint64_t due; //!< Tick it is due at
+        };
+
+        Clock::duration resolution; //!< Length of 1 tick
+        Clock::time_point epoch; //!< Time of tick 0
+        uint64_t current = 0; //!< Last tick `advance` expired
+        std::size_t numItems = 0; //!< See `size`
+        std::array<std::array<std::vector<Entry>, slotsPerLevel>, numLevels> wheels; //!< The slots of each level
+
+        /// Get the tick `time` falls in, rounded up.
+        [[nodiscard]] uint64_t tickOf(Clock::time_point time) const {
+            if (time <= epoch) {
+                return 0;
+            }
+            return static_cast<uint64_t>((time - epoch + resolution - Clock::duration(1)) / resolution);
+        }
+
+        /**
+         * @brief Put an entry into the slot for its `due` tick, relative to `current`.
+         * @param entry Entry to place
+         * @param cascading True if called from `cascade`, which runs before the slot of `current` is expired.
+         */
+        void place(Entry &&entry, bool cascading) {
+            if (entry.due < current || (entry.due == current && !cascading)) {
+                entry.due = current + 1; // Overdue: Expire on the next tick
+            }
+
+            uint64_t delta = entry.due - current;
+            for (std::size_t level = 0; level < numLevels; level++) {
+                if (delta < (uint64_t{1} << (levelBits * (level + 1)))) {
+                    auto slot = static_cast<std::size_t>(entry.due >> (levelBits * level)) & (slotsPerLevel - 1);
+                    wheels[level][slot].emplace_back(std::move(entry));
+                    return;
+                }
+            }
+
+            // Beyond the last level. Park it in the slot that comes around last, and try again from there.
+            auto slot = static_cast<std::size_t>((current >> (levelBits * (numLevels - 1))) - 1) & (slotsPerLevel - 1);
+            wheels[numLevels - 1][slot].emplace_back(std::move(entry));
+        }
+
+        /// Move the entries of a slot that is coming up down to the lower levels.
+        void cascade(std::size_t level) {
+            auto slot = static_cast<std::size_t>(current >> (levelBits * level)) & (slotsPerLevel - 1);
+            std::vector<Entry> entries;
+            std::swap(entries, wheels[level][slot]);
+            for (auto &entry : entries) {
+                place(std::move(entry), true);
+            }
+        }
+
+    public:
+        /**
+         * @brief Constructor
+         * @param res Granularity of deadlines. Also the largest amount an item can expire late by, if `advance` is
+         *            called often enough.
+         * @param start Time to measure deadlines from. Deadlines before this expire on the first `advance`.
+         */
+        explicit TimingWheel(Clock::duration res, Clock::time_point start = Clock::now()) : resolution(res),
+                                                                                            epoch(start) {}
+
+        /**
+         * @brief Schedule an item to expire at a deadline
+         * @param item Item to pass to the callback of `advance` once `deadline` passed
+         * @param deadline Time the item is due. If it is already past, it expires on the next `advance`.
+         */
+        void schedule(T item, Clock::time_point deadline) {
+            place(Entry{std::move(item), tickOf(deadline)}, false);
+            numItems++;
+        }
+
+        /**
+         * @brief Expire every item whose deadline is at or before `now`.
+         * @param now Current time
+         * @param onExpired Called with each expired item (as `T &&`), roughly in order of deadline. It may `schedule`
+         *                  items again.
+         */
+        template<typename F>
+        void advance(Clock::time_point now, F &&onExpired) {
+            uint64_t target = tickOf(now);
+            if (numItems == 0 && target > current) {
+                current = target; // Nothing to expire or cascade on the way
+                return;
+            }
+
+            std::vector<Entry> expired;
+            while (current < target) {
+                current++;
+
+                // A level only wraps around when the level below it does.
+                for (std::size_t level = 1; level < numLevels; level++) {
+                    if ((current & ((uint64_t{1} << (levelBits * level)) - 1)) != 0) {
+                        break;
+                    }
+                    cascade(level);
+                }
+
+                expired.clear();
+                std::swap(expired, wheels[0][static_cast<std::size_t>(current) & (slotsPerLevel - 1)]);
+                numItems -= expired.size();
+                for (auto &entry : expired) {
+                    onExpired(std::move(entry.item));
+                }
+            }
+        }
+
+        /**
+         * @brief Get the number of items that haven't expired yet.
+         * @return Number of items
+         */
+        [[nodiscard]] inline std::size_t size() const {
+            return numItems;
+        }
+
+        /// Drop every item without expiring it.
+        void clear() {
+            for (auto &wheel : wheels) {
+                for (auto &slot : wheel) {
+                    slot.clear();
+                }
+            }
+            numItems = 0;
+        }
+    };
+}
+
+#endif //__STONEMASON_TIMING_WHEEL_HPP
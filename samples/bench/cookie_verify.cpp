@@ -0,0 +1,105 @@
+// DTLS cookies generated and verified per second: The one-shot `HMAC()` the server used to call for every cookie, against
+// `CookieKeys`, which clones a pre-keyed MAC context once per thread. Every cookie is checked against a different
+// peer address, like a flood of spoofed ClientHellos would be.
+// Usage: stms_cookie_bench [verifications per thread, default 2000000] [threads, default 1,2,4,...,#cores]
+
+#include "stms/net/dtls_cookie.hpp"
+#include "stms/logging.hpp"
+#include "stms/stms.hpp"
+#include "stms/util/timers.hpp"
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+
+#include "openssl/hmac.h"
+#include "openssl/rand.h"
+
+namespace {
+    /// Address of the `i`th fake peer.
+    sockaddr_in peerAddr(uint32_t i) {
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(static_cast<uint16_t>(1024 + i % 60000));
+        addr.sin_addr.s_addr = htonl(0x0a000000u | (i & 0xffffffu));
+        return addr;
+    }
+
+    /// Run `verify(peer index)` `numVerifies` times on each of `numThreads` threads, and return verifications/s.
+    template<typename F>
+    double runThreads(unsigned numThreads, long numVerifies, F verify) {
+        std::atomic<uint64_t> numOk{0};
+        std::vector<std::thread> threads;
+
+        stms::Stopwatch sw;
+        sw.start();
+        for (unsigned t = 0; t < numThreads; t++) {
+            threads.emplace_back([&, t]() {
+                uint64_t ok = 0;
+                for (long i = 0; i < numVerifies; i++) {
+                    ok += verify(static_cast<uint32_t>(t * numVerifies + i)) ? 1 : 0;
+                }
+                numOk += ok;
+            });
+        }
+        for (auto &thread : threads) {
+            thread.join();
+        }
+        float ms = sw.getTime();
+
+        if (numOk != static_cast<uint64_t>(numVerifies) * numThreads) {
+            STMS_ERROR("Only {} of {} cookies verified!", numOk.load(), static_cast<uint64_t>(numVerifies) * numThreads);
+        }
+        return static_cast<double>(numVerifies) * numThreads / (ms / 1000.0);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    stms::initAll();
+
+    long numVerifies = argc > 1 ? std::strtol(argv[1], nullptr, 10) : 2000000;
+    long maxThreads = argc > 2 ? std::strtol(argv[2], nullptr, 10) : std::max(std::thread::hardware_concurrency(), 1u);
+    if (numVerifies <= 0 || maxThreads <= 0 || maxThreads > 1024) {
+        STMS_FATAL("The verification count must be positive, and the thread count between 1 and 1024!");
+        return 1;
+    }
+
+    // The real cookie for every peer is the correct answer, so that both sides do the full comparison.
+    uint8_t secret[stms::secretCookieLen];
+    RAND_bytes(secret, sizeof(secret));
+    auto oneShot = [&](uint32_t i) {
+        sockaddr_in addr = peerAddr(i);
+        uint8_t cookie[DTLS1_COOKIE_LENGTH - 1];
+        uint8_t expected[DTLS1_COOKIE_LENGTH - 1];
+        unsigned len = sizeof(cookie);
+        unsigned expectedLen = sizeof(expected);
+
+        // What the client echoes back, and what the server computes to compare against
+        HMAC(EVP_sha1(), secret, sizeof(secret), reinterpret_cast<uint8_t *>(&addr), sizeof(addr), cookie, &len);
+        HMAC(EVP_sha1(), secret, sizeof(secret), reinterpret_cast<uint8_t *>(&addr), sizeof(addr), expected,
+             &expectedLen);
+        return len == expectedLen && CRYPTO_memcmp(cookie, expected, len) == 0;
+    };
+
+    stms::CookieKeys keys;
+    auto keyed = [&](uint32_t i) {
+        sockaddr_in addr = peerAddr(i);
+        uint8_t cookie[DTLS1_COOKIE_LENGTH - 1];
+        unsigned len = keys.generate(reinterpret_cast<sockaddr *>(&addr), cookie);
+        return keys.verify(reinterpret_cast<sockaddr *>(&addr), cookie, len);
+    };
+
+    STMS_INFO("Cookie generations + verifications per second, {} per thread:", numVerifies);
+    for (long numThreads = 1; numThreads <= maxThreads; numThreads *= 2) {
+        auto t = static_cast<unsigned>(numThreads);
+        double oneShotRate = runThreads(t, numVerifies, oneShot);
+        double keyedRate = runThreads(t, numVerifies, keyed);
+        STMS_INFO("    {:>4} threads: one-shot HMAC {:>11.0f}/s | CookieKeys {:>11.0f}/s | {:.2f}x", t, oneShotRate,
+                  keyedRate, keyedRate / oneShotRate);
+    }
+    return 0;
+}
@@ -0,0 +1,159 @@
+// Loopback throughput of a client uploading a file to an `SSLServer`, with `send()` and `sendFile()`, and with and
+// without kernel TLS. Run from the repo root (for `./res/ssl`). Usage: stms_ktls_bench [MiB to send, default 256]
+
+#include "stms/net/ssl_server.hpp"
+#include "stms/net/ssl_client.hpp"
+#include "stms/stms.hpp"
+#include "stms/util/timers.hpp"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <vector>
+
+namespace {
+    constexpr int sendCallLen = 1024 * 1024; // Bytes passed to each `send()` call when not using `sendFile()`.
+
+    /// Upload `fileLen` bytes of `fd` to a new server, and return the throughput in MiB/s (or 0 on failure).
+    double runUpload(int fd, int fileLen, bool kernelTls, bool useSendFile, bool &kernelTlsActive) {
+        stms::ThreadPool pool{};
+        pool.start();
+
+        stms::SSLServer serv{&pool, false};
+        serv.setHostAddr("3000", "127.0.0.1");
+        serv.setIPv6(false);
+        serv.setCertAuth("./res/ssl/legit/ca-pub-cert.pem", "");
+        serv.setPublicCert("./res/ssl/legit/serv-pub-cert.pem");
+        serv.setPrivateKey("./res/ssl/legit/serv-priv-key.pem");
+        serv.setKernelTls(kernelTls);
+        serv.setIoBackend(stms::IOBackend::eEpoll); // Drain the socket on every wakeup instead of 1 record per tick
+
+        std::atomic<std::size_t> received{0};
+        serv.setRecvCallback([&](const stms::UUID &, const sockaddr *const, uint8_t *, int size) {
+            received += static_cast<std::size_t>(size);
+        });
+        serv.start();
+        if (!serv.isRunning()) {
+            return 0;
+        }
+
+        std::thread servThread([&]() {
+            while (serv.isRunning() && serv.tick()) {
+                serv.waitEvents(16);
+            }
+        });
+
+        stms::ThreadPool cliPool{};
+        cliPool.start();
+        stms::SSLClient cli{&cliPool, false};
+        cli.setHostAddr("3000", "127.0.0.1");
+        cli.setIPv6(false);
+        cli.setCertAuth("./res/ssl/legit/ca-pub-cert.pem", "");
+        cli.setPublicCert("./res/ssl/legit/cli-pub-cert.pem");
+        cli.setPrivateKey("./res/ssl/legit/cli-priv-key.pem");
+        cli.setKernelTls(kernelTls);
+        cli.setSendWatermarks(static_cast<std::size_t>(fileLen) + 1, 0);
+        cli.start();
+
+        double mibPerSec = 0;
+        if (cli.isRunning()) {
+            kernelTlsActive = cli.isKernelTls();
+
+            std::vector<uint8_t> contents;
+            if (!useSendFile) { // `send()` needs the file in memory. That copy isn't timed.
+                contents.resize(static_cast<std::size_t>(fileLen));
+                if (pread(fd, contents.data(), contents.size(), 0) != fileLen) {
+                    STMS_ERROR("Failed to read the benchmark file!");
+                }
+            }
+
+            stms::Stopwatch sw;
+            sw.start();
+            if (useSendFile) {
+                cli.sendFile(fd, 0, fileLen).get();
+            } else {
+                // Each `send()` is written by its own pool task, so wait for one before the next to keep them in order.
+                for (int i = 0; i < fileLen; i += sendCallLen) {
+                    cli.send(contents.data() + i, std::min(sendCallLen, fileLen - i)).get();
+                }
+            }
+
+            while (received < static_cast<std::size_t>(fileLen) && serv.isRunning() && sw.getTime() < 60000) {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+            float ms = sw.getTime();
+
+            if (received == static_cast<std::size_t>(fileLen)) {
+                mibPerSec = static_cast<double>(fileLen) / (1024.0 * 1024.0) / (ms / 1000.0);
+            }
+
+            cliPool.waitIdle(0);
+            cli.stop();
+        }
+
+        serv.stop();
+        servThread.join();
+        pool.waitIdle(0);
+        pool.stop(true);
+        cliPool.stop(true);
+        return mibPerSec;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    stms::initAll();
+
+    long mib = argc > 1 ? std::strtol(argv[1], nullptr, 10) : 256;
+    if (mib <= 0 || mib > 2047) {
+        STMS_FATAL("The size to send must be between 1 and 2047 MiB!");
+        return 1;
+    }
+    int fileLen = static_cast<int>(mib * 1024 * 1024);
+
+    char path[] = "/tmp/stms_ktls_bench_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        STMS_FATAL("Failed to create the benchmark file!");
+        return 1;
+    }
+    unlink(path);
+
+    std::vector<uint8_t> block(sendCallLen);
+    for (std::size_t i = 0; i < block.size(); i++) {
+        block[i] = static_cast<uint8_t>(i * 7u);
+    }
+    for (int i = 0; i < fileLen; i += sendCallLen) {
+        if (write(fd, block.data(), block.size()) != static_cast<ssize_t>(block.size())) {
+            STMS_FATAL("Failed to write the benchmark file!");
+            return 1;
+        }
+    }
+
+    struct Mode {
+        bool kernelTls;
+        bool useSendFile;
+        const char *name;
+    } modes[] = {
+            {false, false, "user-space TLS, send()    "},
+            {false, true,  "user-space TLS, sendFile()"},
+            {true,  false, "kernel TLS,     send()    "},
+            {true,  true,  "kernel TLS,     sendFile()"},
+    };
+
+    std::vector<std::string> results;
+    for (const auto &mode : modes) {
+        bool active = false;
+        double mibPerSec = runUpload(fd, fileLen, mode.kernelTls, mode.useSendFile, active);
+        results.emplace_back(fmt::format("{}: {:>9.1f} MiB/s (kTLS {})", mode.name, mibPerSec,
+                                         active ? "active" : "inactive"));
+    }
+    close(fd);
+
+    STMS_INFO("Uploaded {} MiB over loopback:", mib);
+    for (const auto &line : results) {
+        STMS_INFO("    {}", line);
+    }
+    return 0;
+}
@@ -0,0 +1,526 @@
+// Load generator for the network transports: `TCPServer` (tcp), `SSLServer` over TCP (tls) and DTLS (dtls), and
+// `UDPPeer` (udp). For each transport, N clients connect to a server on loopback and send messages of a given size
+// at a given rate, which the server echoes back. Reports handshakes/s (connects/s for tcp), echoed messages/s and
+// payload bytes/s, round trip latency percentiles and the CPU time (of the whole process, so both ends) spent per
+// message. The results are also written as JSON, to track regressions. Run from the repo root (for `./res/ssl`).
+// Usage: stms_net_bench [clients, default 16] [message bytes, default 64] [msgs/s per client, 0 (default) for as
+//                       fast as possible] [seconds per transport, default 5] [report path, default net_bench.json]
+//                       [transports, default tcp,tls,udp,dtls]
+
+#include "stms/net/framing.hpp"
+#include "stms/net/plain_tcp.hpp"
+#include "stms/net/plain_udp.hpp"
+#include "stms/net/ssl_server.hpp"
+#include "stms/net/ssl_client.hpp"
+#include "stms/stms.hpp"
+#include "stms/util/timers.hpp"
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+namespace {
+    using Clock = std::chrono::steady_clock;
+
+    constexpr int maxInFlight = 16; // Messages a client may have sent without getting the echo back.
+    constexpr int maxDatagramLen = 1200; // Largest message sent over udp/dtls, to stay below the path MTU.
+    constexpr auto lossTimeout = std::chrono::milliseconds(200); // Datagrams not echoed in this long count as lost.
+    constexpr auto drainTimeout = std::chrono::seconds(1); // Time to wait for the last echoes after the run.
+
+    enum class Transport {
+        eTcp, eTls, eUdp, eDtls
+    };
+
+    const char *transportName(Transport t) {
+        switch (t) {
+            case Transport::eTcp:
+                return "tcp";
+            case Transport::eTls:
+                return "tls";
+            case Transport::eUdp:
+                return "udp";
+            case Transport::eDtls:
+                return "dtls";
+        }
+        return "?";
+    }
+
+    bool isDatagram(Transport t) {
+        return t == Transport::eUdp || t == Transport::eDtls;
+    }
+
+    bool isFramed(Transport t) {
+        return t == Transport::eTcp || t == Transport::eTls;
+    }
+
+    struct Settings {
+        int clients;
+        int msgLen; // Payload bytes of each message, not counting the frame header on stream transports.
+        long rate; // Messages per second per client, or 0 for as fast as `maxInFlight` allows.
+        long seconds;
+    };
+
+    struct Result {
+        Transport transport;
+        double handshakesPerSec = 0; // 0 for udp, which has no handshake.
+        double msgsPerSec = 0;
+        double bytesPerSec = 0;
+        double p50Us = 0, p99Us = 0, p999Us = 0;
+        double cpuUsPerMsg = 0;
+        uint64_t messages = 0;
+        uint64_t lost = 0;
+        bool ok = false;
+    };
+
+    /// The calls a benchmark makes on a client or server, so every transport can be driven the same way.
+    struct Endpoint {
+        std::shared_ptr<void> owner; // Keeps the actual `SSLClient` etc. alive
+        std::function<void()> start;
+        std::function<void()> stop;
+        std::function<bool()> isRunning;
+        std::function<bool()> tick;
+        std::function<void(int)> waitEvents;
+        std::function<std::future<int>(const uint8_t *, int)> send;
+    };
+
+    template<typename T>
+    Endpoint wrap(const std::shared_ptr<T> &obj) {
+        Endpoint ret;
+        ret.owner = obj;
+        ret.start = [obj]() { obj->start(); };
+        ret.stop = [obj]() { obj->stop(); };
+        ret.isRunning = [obj]() { return obj->isRunning(); };
+        ret.tick = [obj]() { return obj->tick(); };
+        ret.waitEvents = [obj](int to) { obj->waitEvents(to); };
+        return ret;
+    }
+
+    template<typename T>
+    void setCerts(T &obj, bool serv) {
+        obj.setCertAuth("./res/ssl/legit/ca-pub-cert.pem", "");
+        obj.setPublicCert(serv ? "./res/ssl/legit/serv-pub-cert.pem" : "./res/ssl/legit/cli-pub-cert.pem");
+        obj.setPrivateKey(serv ? "./res/ssl/legit/serv-priv-key.pem" : "./res/ssl/legit/cli-priv-key.pem");
+    }
+
+    /// Copy `msg` behind a frame header, for echoing a framed message back.
+    std::vector<uint8_t> reframe(const uint8_t *msg, int len) {
+        std::vector<uint8_t> ret(stms::frameHeaderLen + static_cast<std::size_t>(len));
+        auto hdr = stms::encodeFrameHeader(static_cast<uint32_t>(len));
+        std::copy(hdr.begin(), hdr.end(), ret.begin());
+        std::copy(msg, msg + len, ret.begin() + stms::frameHeaderLen);
+        return ret;
+    }
+
+    /// Make a server on 127.0.0.1:3000 that echoes every message back to the client it came from.
+    Endpoint makeServer(Transport t, stms::ThreadPool *pool) {
+        switch (t) {
+            case Transport::eTcp: {
+                auto serv = std::make_shared<stms::TCPServer>(pool);
+                serv->setHostAddr("3000", "127.0.0.1");
+                serv->setIPv6(false);
+                stms::TCPServer *raw = serv.get();
+                serv->setFramedRecvCallback([raw](const stms::UUID &uuid, const sockaddr *const, uint8_t *msg, int len) {
+                    auto hdr = stms::encodeFrameHeader(static_cast<uint32_t>(len));
+                    iovec iov[2] = {{hdr.data(), hdr.size()}, {msg, static_cast<std::size_t>(len)}};
+                    raw->sendv(uuid, iov, 2, true);
+                });
+                return wrap(serv);
+            }
+            case Transport::eTls:
+            case Transport::eDtls: {
+                auto serv = std::make_shared<stms::SSLServer>(pool, t == Transport::eDtls);
+                serv->setHostAddr("3000", "127.0.0.1");
+                serv->setIPv6(false);
+                setCerts(*serv, true);
+                stms::SSLServer *raw = serv.get();
+                if (t == Transport::eTls) {
+                    serv->setIoBackend(stms::IOBackend::eEpoll); // Drain the socket on every wakeup
+                    serv->setFramedRecvCallback([raw](const stms::UUID &uuid, const sockaddr *const, uint8_t *msg, int len) {
+                        auto framed = reframe(msg, len);
+                        raw->send(uuid, framed.data(), static_cast<int>(framed.size()), true);
+                    });
+                } else {
+                    serv->setRecvCallback([raw](const stms::UUID &uuid, const sockaddr *const, uint8_t *msg, int len) {
+                        raw->send(uuid, msg, len, true);
+                    });
+                }
+                return wrap(serv);
+            }
+            case Transport::eUdp: {
+                auto serv = std::make_shared<stms::UDPPeer>(true, pool);
+                serv->setHostAddr("3000", "127.0.0.1");
+                serv->setIPv6(false);
+                stms::UDPPeer *raw = serv.get();
+                serv->setRecvCallback([raw](const sockaddr *const addr, socklen_t addrLen, uint8_t *msg, ssize_t len) {
+                    raw->sendTo(addr, addrLen, msg, static_cast<std::size_t>(len), true);
+                });
+                return wrap(serv);
+            }
+        }
+        return {};
+    }
+
+    /// Make a client of the server from `makeServer`, calling `onEcho` with the payload of every echo.
+    Endpoint makeClient(Transport t, stms::ThreadPool *pool, const std::function<void(const uint8_t *)> &onEcho) {
+        switch (t) {
+            case Transport::eTcp: {
+                auto cli = std::make_shared<stms::TCPClient>(pool);
+                cli->setHostAddr("3000", "127.0.0.1");
+                cli->setIPv6(false);
+                cli->setFramedRecvCallback([onEcho](uint8_t *msg, size_t) { onEcho(msg); });
+                Endpoint ret = wrap(cli);
+                ret.send = [cli](const uint8_t *msg, int len) { return cli->send(msg, len, true); };
+                return ret;
+            }
+            case Transport::eTls:
+            case Transport::eDtls: {
+                auto cli = std::make_shared<stms::SSLClient>(pool, t == Transport::eDtls);
+                cli->setHostAddr("3000", "127.0.0.1");
+                cli->setIPv6(false);
+                setCerts(*cli, false);
+                if (t == Transport::eTls) {
+                    cli->setFramedRecvCallback([onEcho](uint8_t *msg, size_t) { onEcho(msg); });
+                } else {
+                    cli->setRecvCallback([onEcho](uint8_t *msg, size_t) { onEcho(msg); });
+                }
+                Endpoint ret = wrap(cli);
+                ret.send = [cli](const uint8_t *msg, int len) { return cli->send(msg, len, true); };
+                return ret;
+            }
+            case Transport::eUdp: {
+                auto cli = std::make_shared<stms::UDPPeer>(false, pool);
+                cli->setHostAddr("3000", "127.0.0.1");
+                cli->setIPv6(false);
+                cli->setRecvCallback([onEcho](const sockaddr *const, socklen_t, uint8_t *msg, ssize_t) { onEcho(msg); });
+                Endpoint ret = wrap(cli);
+                ret.send = [cli](const uint8_t *msg, int len) {
+                    return cli->send(msg, static_cast<std::size_t>(len), true);
+                };
+                return ret;
+            }
+        }
+        return {};
+    }
+
+    int64_t nowNs() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+    }
+
+    double cpuSeconds() {
+        rusage usage{};
+        getrusage(RUSAGE_SELF, &usage);
+        return static_cast<double>(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+               static_cast<double>(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    }
+
+    /// Load generated by 1 client. The payload of each message starts with the time it was sent, in ns.
+    struct LoadClient {
+        Endpoint ep;
+        std::atomic<int> inFlight{0};
+        std::atomic<int64_t> lastEchoNs{0};
+        std::atomic<uint64_t> echoed{0};
+        uint64_t lost = 0; // Only touched by the driver thread
+
+        std::mutex latencyMtx;
+        std::vector<int64_t> latenciesNs; // Guarded by `latencyMtx`
+
+        void onEcho(const uint8_t *msg) {
+            int64_t sent;
+            std::memcpy(&sent, msg, sizeof(sent));
+            int64_t now = nowNs();
+            {
+                std::lock_guard<std::mutex> lg(latencyMtx);
+                latenciesNs.emplace_back(now - sent);
+            }
+
+            // A datagram that was already counted as lost can still show up, so don't go below 0.
+            int expected = inFlight.load();
+            while (expected > 0 && !inFlight.compare_exchange_weak(expected, expected - 1)) {}
+            lastEchoNs = now;
+            echoed++;
+        }
+
+        /// Send messages until `end`, at `rate` per second (or as fast as possible).
+        void drive(Transport t, const Settings &settings, Clock::time_point end) {
+            std::size_t hdrLen = isFramed(t) ? stms::frameHeaderLen : 0;
+            std::vector<uint8_t> buf(hdrLen + static_cast<std::size_t>(settings.msgLen));
+            for (std::size_t i = hdrLen; i < buf.size(); i++) {
+                buf[i] = static_cast<uint8_t>(i * 7u);
+            }
+            if (hdrLen > 0) {
+                auto hdr = stms::encodeFrameHeader(static_cast<uint32_t>(settings.msgLen));
+                std::copy(hdr.begin(), hdr.end(), buf.begin());
+            }
+
+            auto interval = settings.rate > 0 ? std::chrono::nanoseconds(1000000000 / settings.rate)
+                                              : std::chrono::nanoseconds(0);
+            auto next = Clock::now();
+            lastEchoNs = nowNs();
+
+            while (ep.isRunning()) {
+                auto now = Clock::now();
+                if (now >= end) {
+                    break;
+                }
+                if (now < next) {
+                    std::this_thread::sleep_until(std::min(next, end));
+                    continue;
+                }
+
+                if (inFlight >= maxInFlight) {
+                    if (isDatagram(t) && nowNs() - lastEchoNs > std::chrono::nanoseconds(lossTimeout).count()) {
+                        lost += static_cast<uint64_t>(inFlight.exchange(0));
+                        lastEchoNs = nowNs();
+                    } else {
+                        std::this_thread::sleep_for(std::chrono::microseconds(20));
+                    }
+                    continue;
+                }
+
+                int64_t sent = nowNs();
+                std::memcpy(buf.data() + hdrLen, &sent, sizeof(sent));
+                inFlight++;
+                ep.send(buf.data(), static_cast<int>(buf.size()));
+                next += interval;
+            }
+        }
+    };
+
+    double percentileUs(const std::vector<int64_t> &sorted, double q) {
+        if (sorted.empty()) {
+            return 0;
+        }
+        auto idx = std::min(sorted.size() - 1, static_cast<std::size_t>(q * static_cast<double>(sorted.size())));
+        return static_cast<double>(sorted[idx]) / 1000.0;
+    }
+
+    /// Run `settings.clients` clients against a server of type `t` for `settings.seconds`.
+    Result runLoad(Transport t, const Settings &settings) {
+        Result res;
+        res.transport = t;
+
+        // Reads and writes that have to wait for the socket block their pool thread, so don't let a few of those
+        // starve everyone else. That's at most 1 of each per client.
+        unsigned poolThreads = 2 * static_cast<unsigned>(settings.clients) + std::max(std::thread::hardware_concurrency(), 1u);
+        stms::ThreadPool pool{};
+        pool.start(poolThreads);
+        Endpoint serv = makeServer(t, &pool);
+        serv.start();
+        if (!serv.isRunning()) {
+            STMS_ERROR("Failed to start the {} server!", transportName(t));
+            pool.stop(true);
+            return res;
+        }
+
+        std::thread servThread([&]() {
+            while (serv.isRunning() && serv.tick()) {
+                serv.waitEvents(16);
+            }
+        });
+
+        stms::ThreadPool cliPool{};
+        cliPool.start(poolThreads);
+        std::vector<std::unique_ptr<LoadClient>> clients;
+        for (int i = 0; i < settings.clients; i++) {
+            clients.emplace_back(std::make_unique<LoadClient>());
+            LoadClient *cli = clients.back().get();
+            cli->ep = makeClient(t, &cliPool, [cli](const uint8_t *msg) { cli->onEcho(msg); });
+        }
+
+        stms::Stopwatch sw;
+        sw.start();
+        for (auto &cli : clients) {
+            cli->ep.start();
+        }
+        float connectMs = sw.getTime();
+
+        std::size_t connected = 0;
+        for (auto &cli : clients) {
+            connected += cli->ep.isRunning() ? 1 : 0;
+        }
+        if (connected != clients.size()) {
+            STMS_ERROR("Only {} of {} {} clients connected!", connected, clients.size(), transportName(t));
+        }
+        if (t != Transport::eUdp) {
+            res.handshakesPerSec = static_cast<double>(connected) / (std::max(connectMs, 0.001f) / 1000.0);
+        }
+
+        std::atomic<bool> ticking{true};
+        std::vector<std::thread> tickers;
+        for (auto &cli : clients) {
+            tickers.emplace_back([&ticking, &cli]() {
+                while (ticking && cli->ep.isRunning() && cli->ep.tick()) {
+                    cli->ep.waitEvents(16);
+                }
+            });
+        }
+
+        double cpuStart = cpuSeconds();
+        auto start = Clock::now();
+        auto end = start + std::chrono::seconds(settings.seconds);
+        std::vector<std::thread> drivers;
+        for (auto &cli : clients) {
+            drivers.emplace_back([&t, &settings, &cli, end]() { cli->drive(t, settings, end); });
+        }
+        for (auto &th : drivers) {
+            th.join();
+        }
+
+        double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+        double cpuUsed = cpuSeconds() - cpuStart;
+        uint64_t echoed = 0;
+        for (auto &cli : clients) {
+            echoed += cli->echoed;
+        }
+
+        // Let the last echoes arrive so they count towards the latency, but not towards the rates.
+        auto drainEnd = Clock::now() + drainTimeout;
+        auto allDrained = [&]() {
+            return std::all_of(clients.begin(), clients.end(), [](const std::unique_ptr<LoadClient> &cli) {
+                return cli->inFlight == 0 || !cli->ep.isRunning();
+            });
+        };
+        while (!allDrained() && Clock::now() < drainEnd) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        // Stop the server first, while the clients are still ticking to answer its goodbye. Clients that get it stop
+        // themselves from their read task. Stopping one from here while its read task waits on the socket would free
+        // the `SSL` under it.
+        serv.stop();
+        servThread.join();
+        pool.waitIdle(0);
+
+        auto stopEnd = Clock::now() + drainTimeout;
+        for (auto &cli : clients) {
+            while (t != Transport::eUdp && cli->ep.isRunning() && Clock::now() < stopEnd) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+
+        ticking = false;
+        for (auto &th : tickers) {
+            th.join();
+        }
+        for (auto &cli : clients) {
+            if (cli->ep.isRunning()) {
+                cli->ep.stop();
+            }
+        }
+        cliPool.waitIdle(0);
+
+        std::vector<int64_t> latencies;
+        for (auto &cli : clients) {
+            res.lost += cli->lost + static_cast<uint64_t>(cli->inFlight.load());
+            std::lock_guard<std::mutex> lg(cli->latencyMtx);
+            latencies.insert(latencies.end(), cli->latenciesNs.begin(), cli->latenciesNs.end());
+        }
+        std::sort(latencies.begin(), latencies.end());
+
+        pool.stop(true);
+        cliPool.stop(true);
+
+        res.messages = echoed;
+        res.msgsPerSec = static_cast<double>(echoed) / elapsed;
+        res.bytesPerSec = res.msgsPerSec * settings.msgLen;
+        res.p50Us = percentileUs(latencies, 0.5);
+        res.p99Us = percentileUs(latencies, 0.99);
+        res.p999Us = percentileUs(latencies, 0.999);
+        res.cpuUsPerMsg = echoed == 0 ? 0 : cpuUsed * 1e6 / static_cast<double>(echoed);
+        res.ok = connected == clients.size() && echoed > 0;
+        return res;
+    }
+
+    void writeReport(const std::string &path, const Settings &settings, const std::vector<Result> &results) {
+        std::ofstream out(path);
+        if (!out) {
+            STMS_ERROR("Failed to open {} to write the report!", path);
+            return;
+        }
+
+        out << "{\n  \"clients\": " << settings.clients << ",\n  \"messageBytes\": " << settings.msgLen
+            << ",\n  \"ratePerClient\": " << settings.rate << ",\n  \"seconds\": " << settings.seconds
+            << ",\n  \"results\": [";
+        for (std::size_t i = 0; i < results.size(); i++) {
+            const Result &r = results[i];
+            out << (i == 0 ? "\n" : ",\n") << "    {\"transport\": \"" << transportName(r.transport)
+                << "\", \"ok\": " << (r.ok ? "true" : "false")
+                << ", \"handshakesPerSec\": " << r.handshakesPerSec << ", \"messagesPerSec\": " << r.msgsPerSec
+                << ", \"bytesPerSec\": " << r.bytesPerSec << ", \"latencyP50Us\": " << r.p50Us
+                << ", \"latencyP99Us\": " << r.p99Us << ", \"latencyP999Us\": " << r.p999Us
+                << ", \"cpuUsPerMessage\": " << r.cpuUsPerMsg << ", \"messages\": " << r.messages
+                << ", \"lost\": " << r.lost << "}";
+        }
+        out << "\n  ]\n}\n";
+    }
+
+    bool parseTransports(const std::string &list, std::vector<Transport> &out) {
+        std::stringstream ss(list);
+        std::string name;
+        while (std::getline(ss, name, ',')) {
+            bool found = false;
+            for (Transport t : {Transport::eTcp, Transport::eTls, Transport::eUdp, Transport::eDtls}) {
+                if (name == transportName(t)) {
+                    out.emplace_back(t);
+                    found = true;
+                }
+            }
+            if (!found) {
+                return false;
+            }
+        }
+        return !out.empty();
+    }
+}
+
+int main(int argc, char *argv[]) {
+    stms::initAll();
+
+    Settings settings{};
+    settings.clients = static_cast<int>(argc > 1 ? std::strtol(argv[1], nullptr, 10) : 16);
+    settings.msgLen = static_cast<int>(argc > 2 ? std::strtol(argv[2], nullptr, 10) : 64);
+    settings.rate = argc > 3 ? std::strtol(argv[3], nullptr, 10) : 0;
+    settings.seconds = argc > 4 ? std::strtol(argv[4], nullptr, 10) : 5;
+    std::string reportPath = argc > 5 ? argv[5] : "net_bench.json";
+
+    std::vector<Transport> transports;
+    if (settings.clients <= 0 || settings.clients > 512 || settings.msgLen < static_cast<int>(sizeof(int64_t)) ||
+        settings.msgLen > 16 * 1024 * 1024 || settings.rate < 0 || settings.rate > 1000000 ||
+        settings.seconds <= 0 || settings.seconds > 3600 ||
+        !parseTransports(argc > 6 ? argv[6] : "tcp,tls,udp,dtls", transports)) {
+        STMS_FATAL("The client count must be between 1 and 512, the message size between 8 bytes and 16 MiB, the rate "
+                   "between 0 and 1000000, the duration between 1 and 3600 seconds, and the transports a comma "
+                   "separated list of tcp, tls, udp and dtls!");
+        return 1;
+    }
+
+    std::vector<Result> results;
+    for (Transport t : transports) {
+        if (isDatagram(t) && settings.msgLen > maxDatagramLen) {
+            STMS_WARN("Skipping {}: Messages over {} bytes don't fit in a datagram!", transportName(t), maxDatagramLen);
+            continue;
+        }
+        results.emplace_back(runLoad(t, settings));
+    }
+
+    STMS_INFO("{} clients sending {} byte messages at {} over loopback for {}s:", settings.clients, settings.msgLen,
+              settings.rate > 0 ? std::to_string(settings.rate) + " msgs/s each" : std::string("full speed"),
+              settings.seconds);
+    for (const Result &r : results) {
+        STMS_INFO("    {:>4}: {:>9.0f} handshakes/s {:>10.0f} msgs/s {:>9.1f} MiB/s | p50 {:>8.1f}us p99 {:>8.1f}us "
+                  "p999 {:>8.1f}us | {:>6.2f}us CPU/msg | {} lost{}", transportName(r.transport), r.handshakesPerSec,
+                  r.msgsPerSec, r.bytesPerSec / (1024.0 * 1024.0), r.p50Us, r.p99Us, r.p999Us, r.cpuUsPerMsg,
+                  r.lost, r.ok ? "" : " (FAILED)");
+    }
+
+    writeReport(reportPath, settings, results);
+    STMS_INFO("Wrote the report to {}", reportPath);
+    return 0;
+}
@@ -0,0 +1,175 @@
+// Small TLS messages processed per second, like the read loops of `SSLServer` and `SSLClient` do: Read until OpenSSL
+// says WANT_READ. Compares the status codes of `getSslStatus` against catching exceptions like the loops used to.
+// The warning `handleSslGetErr` also logs for every WANT_READ is left out, so the real difference was larger.
+// The connections are in-memory BIO pairs, so this only measures the CPU cost and not the network.
+// Run from the repo root (for `./res/ssl`).
+// Usage: stms_ssl_status_bench [messages per thread, default 100000] [threads, default 1,2,4,...,#cores]
+
+#include "stms/net/ssl.hpp"
+#include "stms/logging.hpp"
+#include "stms/stms.hpp"
+#include "stms/util/timers.hpp"
+
+#include <atomic>
+#include <cstdlib>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "openssl/ssl.h"
+
+namespace {
+    constexpr int messageLen = 64; // Bytes in each message
+
+    /// `handleSslGetErr`, without the logging.
+    int throwOnly(SSL *ssl, int ret) {
+        switch (stms::getSslStatus(ssl, ret)) {
+            case stms::SSLStatus::eOk:
+                return ret;
+            case stms::SSLStatus::eWantRead:
+                throw stms::SSLWantReadException();
+            case stms::SSLStatus::eWantWrite:
+                throw stms::SSLWantWriteException();
+            case stms::SSLStatus::eRetry:
+                throw stms::SSLException();
+            default:
+                throw stms::SSLFatalException();
+        }
+    }
+
+    /// A client and server connected by a BIO pair, with the handshake done.
+    struct Pair {
+        SSL *cli = nullptr;
+        SSL *serv = nullptr;
+
+        Pair(SSL_CTX *cliCtx, SSL_CTX *servCtx) : cli(SSL_new(cliCtx)), serv(SSL_new(servCtx)) {
+            BIO *cliBio;
+            BIO *servBio;
+            BIO_new_bio_pair(&cliBio, 0, &servBio, 0);
+            SSL_set_bio(cli, cliBio, cliBio);
+            SSL_set_bio(serv, servBio, servBio);
+            SSL_set_connect_state(cli);
+            SSL_set_accept_state(serv);
+
+            bool cliDone = false;
+            bool servDone = false;
+            for (int i = 0; i < 100 && !(cliDone && servDone); i++) {
+                cliDone = cliDone || SSL_do_handshake(cli) == 1;
+                servDone = servDone || SSL_do_handshake(serv) == 1;
+            }
+            if (!cliDone || !servDone) {
+                STMS_ERROR("Handshake over the BIO pair failed!");
+                stms::flushSSLErrors();
+            }
+        }
+
+        ~Pair() {
+            SSL_free(cli);
+            SSL_free(serv);
+        }
+
+        Pair(const Pair &) = delete;
+        Pair &operator=(const Pair &) = delete;
+    };
+
+    /**
+     * Send `numMessages` messages on each of `numThreads` pairs, reading each with `read(ssl, buf, len)` until it
+     * returns 0 (WANT_READ). Returns messages/s.
+     */
+    template<typename F>
+    double runThreads(SSL_CTX *cliCtx, SSL_CTX *servCtx, unsigned numThreads, long numMessages, F read) {
+        std::atomic<uint64_t> numOk{0};
+        std::vector<std::unique_ptr<Pair>> pairs;
+        for (unsigned t = 0; t < numThreads; t++) {
+            pairs.emplace_back(std::make_unique<Pair>(cliCtx, servCtx));
+        }
+
+        std::vector<std::thread> threads;
+        stms::Stopwatch sw;
+        sw.start();
+        for (unsigned t = 0; t < numThreads; t++) {
+            threads.emplace_back([&, capPair{pairs[t].get()}]() {
+                uint8_t msg[messageLen]{};
+                uint8_t buf[4096];
+                uint64_t ok = 0;
+                for (long i = 0; i < numMessages; i++) {
+                    if (SSL_write(capPair->cli, msg, messageLen) != messageLen) {
+                        break;
+                    }
+
+                    int got = 0;
+                    int ret;
+                    while ((ret = read(capPair->serv, buf, static_cast<int>(sizeof(buf)))) > 0) {
+                        got += ret;
+                    }
+                    if (ret < 0 || got != messageLen) {
+                        break;
+                    }
+                    ok++;
+                }
+                numOk += ok;
+            });
+        }
+        for (auto &thread : threads) {
+            thread.join();
+        }
+        float ms = sw.getTime();
+
+        if (numOk != static_cast<uint64_t>(numMessages) * numThreads) {
+            STMS_ERROR("Only {} of {} messages arrived!", numOk.load(), static_cast<uint64_t>(numMessages) * numThreads);
+        }
+        return static_cast<double>(numOk) / (ms / 1000.0);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    stms::initAll();
+
+    long numMessages = argc > 1 ? std::strtol(argv[1], nullptr, 10) : 100000;
+    long maxThreads = argc > 2 ? std::strtol(argv[2], nullptr, 10) : std::max(std::thread::hardware_concurrency(), 1u);
+    if (numMessages <= 0 || maxThreads <= 0 || maxThreads > 1024) {
+        STMS_FATAL("The message count must be positive, and the thread count between 1 and 1024!");
+        return 1;
+    }
+
+    SSL_CTX *servCtx = SSL_CTX_new(TLS_server_method());
+    SSL_CTX *cliCtx = SSL_CTX_new(TLS_client_method());
+    if (SSL_CTX_use_certificate_file(servCtx, "./res/ssl/legit/serv-pub-cert.pem", SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_use_PrivateKey_file(servCtx, "./res/ssl/legit/serv-priv-key.pem", SSL_FILETYPE_PEM) != 1) {
+        STMS_FATAL("Failed to load ./res/ssl/legit! Run this from the repo root.");
+        stms::flushSSLErrors();
+        return 1;
+    }
+    SSL_CTX_set_verify(cliCtx, SSL_VERIFY_NONE, nullptr);
+
+    auto viaExceptions = [](SSL *ssl, uint8_t *buf, int len) {
+        try {
+            return throwOnly(ssl, SSL_read(ssl, buf, len));
+        } catch (stms::SSLWantReadException &) {
+            return 0;
+        } catch (std::exception &) {
+            return -1;
+        }
+    };
+
+    auto viaStatus = [](SSL *ssl, uint8_t *buf, int len) {
+        int ret = SSL_read(ssl, buf, len);
+        if (ret > 0) {
+            return ret;
+        }
+        return stms::getSslStatus(ssl, ret) == stms::SSLStatus::eWantRead ? 0 : -1;
+    };
+
+    STMS_INFO("{}-byte TLS messages processed per second, {} per thread:", messageLen, numMessages);
+    for (long numThreads = 1; numThreads <= maxThreads; numThreads *= 2) {
+        auto t = static_cast<unsigned>(numThreads);
+        double throwRate = runThreads(cliCtx, servCtx, t, numMessages, viaExceptions);
+        double statusRate = runThreads(cliCtx, servCtx, t, numMessages, viaStatus);
+        STMS_INFO("    {:>4} threads: exceptions {:>10.0f}/s | SSLStatus {:>10.0f}/s | {:.2f}x", t, throwRate, statusRate,
+                  statusRate / throwRate);
+    }
+
+    SSL_CTX_free(cliCtx);
+    SSL_CTX_free(servCtx);
+    return 0;
+}
@@ -0,0 +1,188 @@
+// Loopback throughput of a client uploading to a server, with the plain `TCPServer`/`TCPClient` and with
+// `SSLServer`/`SSLClient`, for bulk and for small messages. Run from the repo root (for `./res/ssl`).
+// Usage: stms_tcp_bench [MiB to send in bulk, default 256] [small messages to send, default 200000]
+
+#include "stms/net/plain_tcp.hpp"
+#include "stms/net/ssl_server.hpp"
+#include "stms/net/ssl_client.hpp"
+#include "stms/stms.hpp"
+#include "stms/util/timers.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <vector>
+
+namespace {
+    constexpr int bulkSendLen = 64 * 1024; // Bytes passed to each `send()` call when sending in bulk.
+    constexpr int smallSendLen = 64; // Bytes passed to each `send()` call when sending small messages.
+
+    /// Wait for the server to receive `total` bytes, and return the throughput in MiB/s (or 0 on timeout).
+    double waitReceived(const std::atomic<std::size_t> &received, std::size_t total, stms::Stopwatch &sw) {
+        while (received < total && sw.getTime() < 60000) {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        float ms = sw.getTime();
+
+        if (received != total) {
+            STMS_ERROR("Only {} of {} bytes arrived!", received.load(), total);
+            return 0;
+        }
+        return static_cast<double>(total) / (1024.0 * 1024.0) / (ms / 1000.0);
+    }
+
+    /// Upload `numSends` messages of `sendLen` bytes to a `TCPServer`, and return the throughput in MiB/s.
+    double runPlain(const std::vector<uint8_t> &contents, int sendLen, int numSends) {
+        stms::ThreadPool pool{};
+        pool.start();
+
+        stms::TCPServer serv{&pool};
+        serv.setHostAddr("3000", "127.0.0.1");
+        serv.setIPv6(false);
+
+        std::atomic<std::size_t> received{0};
+        serv.setRecvCallback([&](const stms::UUID &, const sockaddr *const, uint8_t *, int size) {
+            received += static_cast<std::size_t>(size);
+        });
+        serv.start();
+        if (!serv.isRunning()) {
+            return 0;
+        }
+
+        std::thread servThread([&]() {
+            while (serv.isRunning() && serv.tick()) {
+                serv.waitEvents(16);
+            }
+        });
+
+        stms::ThreadPool cliPool{};
+        cliPool.start();
+        stms::TCPClient cli{&cliPool};
+        cli.setHostAddr("3000", "127.0.0.1");
+        cli.setIPv6(false);
+        std::size_t total = static_cast<std::size_t>(sendLen) * numSends;
+        cli.setSendWatermarks(total + 1, 0);
+        cli.start();
+
+        double mibPerSec = 0;
+        if (cli.isRunning()) {
+            stms::Stopwatch sw;
+            sw.start();
+
+            // Sends to the same peer are written in order, so there's no need to wait for each one.
+            std::future<int> last;
+            for (int i = 0; i < numSends; i++) {
+                last = cli.send(contents.data() + (static_cast<std::size_t>(i) * sendLen) % contents.size(), sendLen);
+            }
+            last.get();
+            mibPerSec = waitReceived(received, total, sw);
+
+            cliPool.waitIdle(0);
+            cli.stop();
+        }
+
+        serv.stop();
+        servThread.join();
+        pool.waitIdle(0);
+        pool.stop(true);
+        cliPool.stop(true);
+        return mibPerSec;
+    }
+
+    /// Upload `numSends` messages of `sendLen` bytes to an `SSLServer`, and return the throughput in MiB/s.
+    double runTls(const std::vector<uint8_t> &contents, int sendLen, int numSends) {
+        stms::ThreadPool pool{};
+        pool.start();
+
+        stms::SSLServer serv{&pool, false};
+        serv.setHostAddr("3000", "127.0.0.1");
+        serv.setIPv6(false);
+        serv.setCertAuth("./res/ssl/legit/ca-pub-cert.pem", "");
+        serv.setPublicCert("./res/ssl/legit/serv-pub-cert.pem");
+        serv.setPrivateKey("./res/ssl/legit/serv-priv-key.pem");
+        serv.setIoBackend(stms::IOBackend::eEpoll); // Drain the socket on every wakeup instead of 1 record per tick
+
+        std::atomic<std::size_t> received{0};
+        serv.setRecvCallback([&](const stms::UUID &, const sockaddr *const, uint8_t *, int size) {
+            received += static_cast<std::size_t>(size);
+        });
+        serv.start();
+        if (!serv.isRunning()) {
+            return 0;
+        }
+
+        std::thread servThread([&]() {
+            while (serv.isRunning() && serv.tick()) {
+                serv.waitEvents(16);
+            }
+        });
+
+        stms::ThreadPool cliPool{};
+        cliPool.start();
+        stms::SSLClient cli{&cliPool, false};
+        cli.setHostAddr("3000", "127.0.0.1");
+        cli.setIPv6(false);
+        cli.setCertAuth("./res/ssl/legit/ca-pub-cert.pem", "");
+        cli.setPublicCert("./res/ssl/legit/cli-pub-cert.pem");
+        cli.setPrivateKey("./res/ssl/legit/cli-priv-key.pem");
+        std::size_t total = static_cast<std::size_t>(sendLen) * numSends;
+        cli.setSendWatermarks(total + 1, 0);
+        cli.start();
+
+        double mibPerSec = 0;
+        if (cli.isRunning()) {
+            stms::Stopwatch sw;
+            sw.start();
+
+            // Each `send()` is written by its own pool task, so wait for one before the next to keep them in order.
+            for (int i = 0; i < numSends; i++) {
+                cli.send(contents.data() + (static_cast<std::size_t>(i) * sendLen) % contents.size(), sendLen).get();
+            }
+            mibPerSec = waitReceived(received, total, sw);
+
+            cliPool.waitIdle(0);
+            cli.stop();
+        }
+
+        serv.stop();
+        servThread.join();
+        pool.waitIdle(0);
+        pool.stop(true);
+        cliPool.stop(true);
+        return mibPerSec;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    stms::initAll();
+
+    long mib = argc > 1 ? std::strtol(argv[1], nullptr, 10) : 256;
+    long numSmall = argc > 2 ? std::strtol(argv[2], nullptr, 10) : 200000;
+    if (mib <= 0 || mib > 2047 || numSmall <= 0 || numSmall > 10000000) {
+        STMS_FATAL("The size to send must be between 1 and 2047 MiB, and the message count between 1 and 10000000!");
+        return 1;
+    }
+
+    std::vector<uint8_t> contents(bulkSendLen);
+    for (std::size_t i = 0; i < contents.size(); i++) {
+        contents[i] = static_cast<uint8_t>(i * 7u);
+    }
+
+    int numBulk = static_cast<int>(mib * 1024 * 1024 / bulkSendLen);
+    double plainBulk = runPlain(contents, bulkSendLen, numBulk);
+    double tlsBulk = runTls(contents, bulkSendLen, numBulk);
+    double plainSmall = runPlain(contents, smallSendLen, static_cast<int>(numSmall));
+    double tlsSmall = runTls(contents, smallSendLen, static_cast<int>(numSmall));
+
+    auto msgsPerSec = [](double mibPerSec, int sendLen) {
+        return mibPerSec * 1024.0 * 1024.0 / sendLen;
+    };
+
+    STMS_INFO("Uploaded {} MiB in {} byte sends over loopback:", mib, bulkSendLen);
+    STMS_INFO("    TCPServer: {:>9.1f} MiB/s", plainBulk);
+    STMS_INFO("    SSLServer: {:>9.1f} MiB/s", tlsBulk);
+    STMS_INFO("Uploaded {} messages of {} bytes over loopback:", numSmall, smallSendLen);
+    STMS_INFO("    TCPServer: {:>11.0f} msgs/s", msgsPerSec(plainSmall, smallSendLen));
+    STMS_INFO("    SSLServer: {:>11.0f} msgs/s", msgsPerSec(tlsSmall, smallSendLen));
+    return 0;
+}
@@ -5,13 +5,76 @@
 #include "stms/logging.hpp"
 
 #include <chrono>
+#include <thread>
+#include <algorithm>
+#include <condition_variable>
+#include <ctime>
 #include <sys/stat.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#   include <x86intrin.h>
+#endif
+
 namespace stms {
 
     LogRecord::LogRecord(LogLevel lvl, std::chrono::system_clock::time_point iTime, const char *iFile, unsigned int iLine)
                             : level(lvl), time(iTime), file(iFile), line(iLine) {}
 
+    static inline uint64_t readTsc() {
+#   if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#   else
+        return std::chrono::steady_clock::now().time_since_epoch().count();
+#   endif
+    }
+
+    /// Maps cycle counter values to wall clock time. Immutable once published, see `getTscCalibration`.
+    struct TscCalibration {
+        uint64_t tscBase; //!< Cycle count at `wallBase`
+        std::chrono::system_clock::time_point wallBase; //!< Wall time at `tscBase`
+        double nsPerTick; //!< Length of one cycle in nanoseconds.
+    };
+
+    /// Calibrations are never freed, so consumers can keep using the one they loaded without any locks.
+    static inline std::atomic<const TscCalibration *> &getTscCalibration() {
+        static std::atomic<const TscCalibration *> val{nullptr};
+        return val;
+    }
+
+    static std::atomic<LogTimestampMode> logTimestampMode{LogTimestampMode::eWallClock};
+
+    static std::chrono::system_clock::time_point tscToWallClock(uint64_t tsc) {
+        const TscCalibration *cal = getTscCalibration().load(std::memory_order_acquire);
+        auto ns = static_cast<int64_t>(static_cast<double>(static_cast<int64_t>(tsc - cal->tscBase)) * cal->nsPerTick);
+        return cal->wallBase + std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                std::chrono::nanoseconds(ns));
+    }
+
+    void setLogTimestampMode(LogTimestampMode mode) {
+        if (mode == LogTimestampMode::eTsc) {
+            auto *cal = new TscCalibration{};
+
+            auto steadyStart = std::chrono::steady_clock::now();
+            cal->wallBase = std::chrono::system_clock::now();
+            cal->tscBase = readTsc();
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+            uint64_t tscEnd = readTsc();
+            auto steadyNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - steadyStart).count();
+            cal->nsPerTick = static_cast<double>(steadyNs) / static_cast<double>(tscEnd - cal->tscBase);
+
+            getTscCalibration().store(cal, std::memory_order_release);
+        }
+
+        logTimestampMode = mode;
+    }
+
+    LogTimestampMode getLogTimestampMode() {
+        return logTimestampMode;
+    }
+
 #   ifdef STMS_ENABLE_LOGGING
     static FILE *&getLatestLogFile() {
         static FILE *fp = nullptr;
@@ -23,7 +86,17 @@ namespace stms {
         return fp;
     }
 
+    static void stopLogFlusher();
+
     void quitLogging() {
+        getLogBuffering() = false; // Records logged from here on are handed off directly.
+        stopLogFlusher();
+        flushLogBuffers();
+
+        getLogPool()->waitIdle(1000); // make sure all in-flight log records are processed!
+        getLogPool()->stop(false);
+
+        // Close the files only after in-flight records are processed, otherwise the hooks write to closed files.
         if (logToLatestLog) {
             std::fclose(getLatestLogFile());
         }
@@ -31,9 +104,6 @@ namespace stms {
         if (logToUniqueFile) {
             std::fclose(getUniqueLogFile());
         }
-
-        getLogPool()->waitIdle(1000); // make sure all in-flight log records are processed!
-        getLogPool()->stop(false);
     }
 
     void initLogging() {
@@ -96,11 +166,80 @@ namespace stms {
     static volatile bool logConsuming = false;
     static std::mutex logQMtx = std::mutex();
 
-    static inline std::queue<std::unique_ptr<LogRecord>> &getLogQueue() {
-        static std::queue<std::unique_ptr<LogRecord>> queue;
+    /// Entry of the log queue. `seq` breaks ties between records with identical timestamps (insertion order).
+    struct QueuedLogRecord {
+        std::unique_ptr<LogRecord> rec;
+        uint64_t seq;
+    };
+
+    /// Heap comparator for the log queue: `lhs` is consumed after `rhs`. Makes the queue a min-heap on time.
+    static inline bool consumedAfter(const QueuedLogRecord &lhs, const QueuedLogRecord &rhs) {
+        if (lhs.rec->tsc != 0 && rhs.rec->tsc != 0) {
+            if (lhs.rec->tsc != rhs.rec->tsc) {
+                return lhs.rec->tsc > rhs.rec->tsc;
+            }
+        } else {
+            auto lhsTime = lhs.rec->tsc != 0 ? tscToWallClock(lhs.rec->tsc) : lhs.rec->time;
+            auto rhsTime = rhs.rec->tsc != 0 ? tscToWallClock(rhs.rec->tsc) : rhs.rec->time;
+            if (lhsTime != rhsTime) {
+                return lhsTime > rhsTime;
+            }
+        }
+        return lhs.seq > rhs.seq;
+    }
+
+    /// Queue of records waiting to be consumed, kept as a heap ordered by `consumedAfter`. Guarded by `logQMtx`.
+    static inline std::vector<QueuedLogRecord> &getLogQueue() {
+        static std::vector<QueuedLogRecord> queue;
         return queue;
     }
 
+    static uint64_t logQueueSeq = 0; //!< Insertion counter for `QueuedLogRecord::seq`. Guarded by `logQMtx`.
+
+    /// Per-consumer-thread cache of the rendered time of day, so `localtime` only runs every `tzCacheSecs` seconds.
+    struct LogTimeCache {
+        /// UTC offsets only change on quarter-hour boundaries, so the offset is re-queried once per quarter-hour.
+        static constexpr time_t tzCacheSecs = 900;
+
+        time_t second = -1; //!< The second `timeOfDay` was rendered for.
+        char timeOfDay[8]{}; //!< `HH:MM:SS` for `second`. Not null-terminated.
+        time_t tzWindow = -1; //!< Which `tzCacheSecs`-long window `utcOffset` is valid for.
+        long utcOffset = 0; //!< Offset of local time from UTC, in seconds.
+    };
+
+    /**
+     * @brief Get the local time of day of `second` as `HH:MM:SS`, re-rendering it only if the second changed.
+     * @param cache Cache of the consumer thread.
+     * @param second Seconds since the UNIX epoch.
+     * @return String view of `HH:MM:SS` pointing into `cache`.
+     */
+    static fmt::string_view renderTimeOfDay(LogTimeCache &cache, time_t second) {
+        if (second == cache.second) {
+            return {cache.timeOfDay, sizeof(cache.timeOfDay)};
+        }
+
+        time_t window = second / LogTimeCache::tzCacheSecs;
+        if (window != cache.tzWindow) {
+            tm local{};
+            localtime_r(&second, &local);
+            cache.utcOffset = local.tm_gmtoff;
+            cache.tzWindow = window;
+        }
+
+        auto secOfDay = static_cast<unsigned>(((second + cache.utcOffset) % 86400 + 86400) % 86400);
+        unsigned fields[3] = {secOfDay / 3600, (secOfDay / 60) % 60, secOfDay % 60};
+        for (int i = 0; i < 3; i++) {
+            cache.timeOfDay[i * 3] = static_cast<char>('0' + fields[i] / 10);
+            cache.timeOfDay[i * 3 + 1] = static_cast<char>('0' + fields[i] % 10);
+            if (i < 2) {
+                cache.timeOfDay[i * 3 + 2] = ':';
+            }
+        }
+
+        cache.second = second;
+        return {cache.timeOfDay, sizeof(cache.timeOfDay)};
+    }
+
     static inline const char *logLevelToString(const LogLevel &lvl) {
         switch (lvl) {
             case (LogLevel::eTrace):
@@ -126,21 +265,27 @@ namespace stms {
 
         bool empty = getLogQueue().empty();
         if (!empty) {
-            std::unique_ptr<LogRecord> top = std::move(getLogQueue().front());
-            getLogQueue().pop();
+            std::pop_heap(getLogQueue().begin(), getLogQueue().end(), consumedAfter);
+            std::unique_ptr<LogRecord> top = std::move(getLogQueue().back().rec);
+            getLogQueue().pop_back();
 
             lg.unlock();
 
+            if (top->tsc != 0) {
+                top->time = tscToWallClock(top->tsc);
+            }
+
             fmt::memory_buffer fileUrl;
             fmt::format_to(fileUrl, "file://{}:{}", top->file, top->line);
 
-            time_t localtimeReady = std::chrono::system_clock::to_time_t(top->time);
+            static thread_local LogTimeCache timeCache;
             auto seconds = std::chrono::time_point_cast<std::chrono::seconds>(top->time);
-            auto ms = std::chrono::duration_cast<std::chrono::nanoseconds>(top->time - seconds);
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(top->time - seconds);
+            fmt::string_view timeOfDay = renderTimeOfDay(timeCache, seconds.time_since_epoch().count());
 
             fmt::memory_buffer logMsg;
-            fmt::format_to(logMsg, "[{0:%T}.{1:<12}] [{2:^72}] [{3:<8}]: {4}", *std::localtime(&localtimeReady),
-                           ms.count(), fmt::to_string(fileUrl), logLevelToString(top->level), fmt::to_string(top->msg));
+            fmt::format_to(logMsg, "[{0}.{1:<12}] [{2:^72}] [{3:<8}]: {4}", timeOfDay,
+                           ns.count(), fmt::to_string(fileUrl), logLevelToString(top->level), fmt::to_string(top->msg));
 
             std::string finalMsg = fmt::to_string(logMsg); // don't flush!
 
@@ -164,10 +309,14 @@ namespace stms {
         }
     }
 
-    void insertImpl(std::unique_ptr<LogRecord> rec) {
+    /// Push a batch of records onto the log queue (with only 1 lock) and start a consume task if there isn't one.
+    static void handOffLogs(std::unique_ptr<LogRecord> *recs, std::size_t num) {
         std::unique_lock<std::mutex> lg(logQMtx);
 
-        getLogQueue().emplace(std::move(rec));
+        for (std::size_t i = 0; i < num; i++) {
+            getLogQueue().emplace_back(QueuedLogRecord{std::move(recs[i]), logQueueSeq++});
+            std::push_heap(getLogQueue().begin(), getLogQueue().end(), consumedAfter);
+        }
 
         if (!logConsuming) {
             logConsuming = true;
@@ -185,8 +334,167 @@ namespace stms {
         }
     }
 
+    /// A thread's private batch of log records. See `getLogBuffering`.
+    struct ThreadLogBuffer {
+        /// Only contended when `flushLogBuffers` steals the batch from another thread.
+        std::mutex mtx;
+        std::vector<std::unique_ptr<LogRecord>> records;
+        std::chrono::system_clock::time_point lastHandOff = std::chrono::system_clock::now();
+
+        ThreadLogBuffer();
+        ~ThreadLogBuffer(); //!< Hands off any leftover records when the thread exits.
+
+        /// Hand off the whole batch. `lg` must hold `mtx`, and is unlocked before the records are queued.
+        void handOff(std::unique_lock<std::mutex> &lg);
+    };
+
+    static std::mutex logBufRegistryMtx = std::mutex();
+
+    /// Every live `ThreadLogBuffer`, so that buffers of idle threads can be flushed. Guarded by `logBufRegistryMtx`.
+    static inline std::vector<ThreadLogBuffer *> &getLogBufRegistry() {
+        static std::vector<ThreadLogBuffer *> registry;
+        return registry;
+    }
+
+    /// Set once this thread's `ThreadLogBuffer` is destroyed, so logging during thread exit bypasses the buffer.
+    static thread_local bool threadLogBufferDead = false;
+
+    ThreadLogBuffer::ThreadLogBuffer() {
+        records.reserve(logThreadBufferLen);
+
+        std::lock_guard<std::mutex> lg(logBufRegistryMtx);
+        getLogBufRegistry().emplace_back(this);
+    }
+
+    ThreadLogBuffer::~ThreadLogBuffer() {
+        {
+            std::lock_guard<std::mutex> lg(logBufRegistryMtx);
+            auto &registry = getLogBufRegistry();
+            registry.erase(std::remove(registry.begin(), registry.end(), this), registry.end());
+        }
+
+        threadLogBufferDead = true;
+
+        std::unique_lock<std::mutex> lg(mtx);
+        handOff(lg);
+    }
+
+    void ThreadLogBuffer::handOff(std::unique_lock<std::mutex> &lg) {
+        std::vector<std::unique_ptr<LogRecord>> batch;
+        batch.reserve(logThreadBufferLen);
+        batch.swap(records);
+        lastHandOff = std::chrono::system_clock::now();
+        lg.unlock();
+
+        if (!batch.empty()) {
+            handOffLogs(batch.data(), batch.size());
+        }
+    }
+
+    static inline ThreadLogBuffer &getThreadLogBuffer() {
+        static thread_local ThreadLogBuffer buf;
+        return buf;
+    }
+
+    void flushLogBuffers() {
+        std::lock_guard<std::mutex> rlg(logBufRegistryMtx);
+        for (ThreadLogBuffer *buf : getLogBufRegistry()) {
+            std::unique_lock<std::mutex> lg(buf->mtx);
+            if (!buf->records.empty()) {
+                buf->handOff(lg);
+            }
+        }
+    }
+
+    /// State of the thread that periodically flushes the log buffers. See `getLogFlusher`.
+    struct LogFlusher {
+        std::mutex mtx;
+        std::condition_variable cv;
+        std::thread thread;
+        std::atomic_bool running{false};
+    };
+
+    /// Deliberately leaked so that it is still alive when `quitLogging` runs during static destruction.
+    static inline LogFlusher &getLogFlusher() {
+        static auto *val = new LogFlusher();
+        return *val;
+    }
+
+    /// Periodically flush the buffers, so that records from threads that stopped logging don't linger forever.
+    static void logFlusherFunc() {
+        LogFlusher &flusher = getLogFlusher();
+
+        std::unique_lock<std::mutex> lg(flusher.mtx);
+        while (flusher.running) {
+            flusher.cv.wait_for(lg, std::chrono::milliseconds(logThreadFlushMs));
+
+            lg.unlock();
+            flushLogBuffers();
+            lg.lock();
+        }
+    }
+
+    static void startLogFlusher() {
+        LogFlusher &flusher = getLogFlusher();
+
+        std::lock_guard<std::mutex> lg(flusher.mtx);
+        if (!flusher.running) {
+            flusher.running = true;
+            flusher.thread = std::thread(logFlusherFunc);
+        }
+    }
+
+    static void stopLogFlusher() {
+        LogFlusher &flusher = getLogFlusher();
+
+        {
+            std::lock_guard<std::mutex> lg(flusher.mtx);
+            flusher.running = false;
+            flusher.cv.notify_all();
+        }
+
+        if (flusher.thread.joinable()) {
+            flusher.thread.join();
+        }
+    }
+
+    std::unique_ptr<LogRecord> newLogRecord(LogLevel lvl, const char *file, unsigned line) {
+        if (logTimestampMode.load(std::memory_order_relaxed) == LogTimestampMode::eTsc) {
+            auto ret = std::make_unique<LogRecord>(lvl, std::chrono::system_clock::time_point{}, file, line);
+            ret->tsc = readTsc();
+            return ret;
+        }
+
+        return std::make_unique<LogRecord>(lvl, std::chrono::system_clock::now(), file, line);
+    }
+
+    void insertImpl(std::unique_ptr<LogRecord> rec) {
+        if (!getLogBuffering() || threadLogBufferDead) {
+            handOffLogs(&rec, 1);
+            return;
+        }
+
+        if (!getLogFlusher().running) {
+            startLogFlusher();
+        }
+
+        ThreadLogBuffer &buf = getThreadLogBuffer();
+        std::unique_lock<std::mutex> lg(buf.mtx);
+
+        // Use the record's own timestamp so that buffering doesn't cost an extra clock read. Records timestamped
+        // with the cycle counter have no wall time yet, so those rely on the flusher thread instead.
+        bool urgent = rec->level == LogLevel::eError || rec->level == LogLevel::eFatal;
+        bool stale = rec->tsc == 0 && rec->time - buf.lastHandOff >= std::chrono::milliseconds(logThreadFlushMs);
+        buf.records.emplace_back(std::move(rec));
+
+        if (urgent || stale || buf.records.size() >= logThreadBufferLen) {
+            buf.handOff(lg);
+        }
+    }
+
 #   else // STMS_ENABLE_LOGGING
     void consumeLogs() {};
+    void flushLogBuffers() {};
     void initLogging() {};
     void quitLogging() {};
 #   endif //STMS_ENABLE_LOGGING
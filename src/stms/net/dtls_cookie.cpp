@@ -0,0 +1,288 @@
+#include "stms/net/dtls_cookie.hpp"
+#include "stms/logging.hpp"
+
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <stdexcept>
+
+#include <netinet/in.h>
+
+#include "openssl/crypto.h"
+#include "openssl/evp.h"
+#include "openssl/rand.h"
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#   include "openssl/core_names.h"
+#else
+#   include "openssl/hmac.h"
+#endif
+
+namespace stms {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    using MacCtx = EVP_MAC_CTX;
+#else
+    using MacCtx = HMAC_CTX;
+#endif
+
+    static void freeMac(MacCtx *ctx) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        EVP_MAC_CTX_free(ctx);
+#else
+        HMAC_CTX_free(ctx);
+#endif
+    }
+
+    struct CookieKeys::Key {
+        uint64_t id; //!< Unique among all keys of all `CookieKeys`. Identifies the key in `ThreadMacs`.
+        MacCtx *ctx; //!< Keyed with the secret. Never used directly, only cloned.
+        std::chrono::steady_clock::time_point created; //!< Time this key was generated
+
+        ~Key() {
+            freeMac(ctx);
+        }
+    };
+
+    /// MAC contexts this thread cloned from `CookieKeys::Key::ctx`, so that a cookie only needs a reset of one.
+    struct ThreadMacs {
+        struct Slot {
+            uint64_t keyId = 0; //!< `CookieKeys::Key::id` `ctx` was cloned from. 0 if unused.
+            MacCtx *ctx = nullptr; //!< The clone
+        };
+
+        std::array<Slot, cookieMacCacheLen> slots; //!< Replaced round-robin
+        std::size_t nextSlot = 0; //!< Slot to replace next
+
+        ~ThreadMacs() {
+            for (auto &slot : slots) {
+                freeMac(slot.ctx);
+            }
+        }
+
+        MacCtx *get(uint64_t keyId, const MacCtx *keyed) {
+            for (auto &slot : slots) {
+                if (slot.keyId == keyId) {
+                    return slot.ctx;
+                }
+            }
+
+            Slot &slot = slots[nextSlot];
+            nextSlot = (nextSlot + 1) % slots.size();
+            freeMac(slot.ctx);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+            slot.ctx = EVP_MAC_CTX_dup(keyed);
+#else
+            slot.ctx = HMAC_CTX_new();
+            if (slot.ctx != nullptr && HMAC_CTX_copy(slot.ctx, const_cast<HMAC_CTX *>(keyed)) != 1) {
+                HMAC_CTX_free(slot.ctx);
+                slot.ctx = nullptr;
+            }
+#endif
+            slot.keyId = slot.ctx == nullptr ? 0 : keyId;
+            return slot.ctx;
+        }
+    };
+
+    static thread_local ThreadMacs threadMacs;
+
+    /**
+     * @brief Compute a cookie with a key.
+     * @return Length of the cookie, or 0 on error.
+     */
+    static unsigned computeCookie(uint64_t keyId, const MacCtx *keyed, const sockaddr *peer, uint8_t *out) {
+        uint8_t canon[1 + sizeof(in_port_t) + sizeof(in6_addr)];
+        std::size_t canonLen;
+        if (peer->sa_family == AF_INET6) {
+            const auto *v6Addr = reinterpret_cast<const sockaddr_in6 *>(peer);
+            canon[0] = 6;
+            std::memcpy(canon + 1, &v6Addr->sin6_port, sizeof(in_port_t));
+            std::memcpy(canon + 1 + sizeof(in_port_t), &v6Addr->sin6_addr, sizeof(in6_addr));
+            canonLen = 1 + sizeof(in_port_t) + sizeof(in6_addr);
+        } else {
+            const auto *v4Addr = reinterpret_cast<const sockaddr_in *>(peer);
+            canon[0] = 4;
+            std::memcpy(canon + 1, &v4Addr->sin_port, sizeof(in_port_t));
+            std::memcpy(canon + 1 + sizeof(in_port_t), &v4Addr->sin_addr, sizeof(in_addr));
+            canonLen = 1 + sizeof(in_port_t) + sizeof(in_addr);
+        }
+
+        MacCtx *ctx = threadMacs.get(keyId, keyed);
+        if (ctx == nullptr) {
+            return 0;
+        }
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        // Without a key, `EVP_MAC_init` only resets the context to the pads derived when it was keyed.
+        std::size_t len = 0;
+        if (EVP_MAC_init(ctx, nullptr, 0, nullptr) != 1 || EVP_MAC_update(ctx, canon, canonLen) != 1 ||
+            EVP_MAC_final(ctx, out, &len, DTLS1_COOKIE_LENGTH - 1) != 1) {
+            return 0;
+        }
+        return static_cast<unsigned>(len);
+#else
+        unsigned len = 0;
+        if (HMAC_Init_ex(ctx, nullptr, 0, nullptr, nullptr) != 1 || HMAC_Update(ctx, canon, canonLen) != 1 ||
+            HMAC_Final(ctx, out, &len) != 1) {
+            return 0;
+        }
+        return len;
+#endif
+    }
+
+    CookieKeys::CookieKeys() {
+        rotateLocked();
+        if (!current) { // `rotateLocked` had no old secret to fall back to
+            throw std::runtime_error("Failed to generate the first DTLS cookie secret!");
+        }
+        previous.reset(); // There's nothing to give grace to yet.
+    }
+
+    CookieKeys::~CookieKeys() = default;
+
+    void CookieKeys::rotateLocked() {
+        static std::atomic<uint64_t> nextKeyId{1};
+
+        uint8_t secret[secretCookieLen];
+        if (RAND_bytes(secret, sizeof(secret)) != 1) {
+            STMS_ERROR("OpenSSL RNG failed to generate a DTLS cookie secret! Keeping the old secret!");
+            return;
+        }
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        static EVP_MAC *hmac = EVP_MAC_fetch(nullptr, "HMAC", nullptr);
+        MacCtx *ctx = hmac == nullptr ? nullptr : EVP_MAC_CTX_new(hmac);
+        OSSL_PARAM params[2];
+        params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, const_cast<char *>("SHA1"), 0);
+        params[1] = OSSL_PARAM_construct_end();
+        bool keyed = ctx != nullptr && EVP_MAC_init(ctx, secret, sizeof(secret), params) == 1;
+#else
+        MacCtx *ctx = HMAC_CTX_new();
+        bool keyed = ctx != nullptr && HMAC_Init_ex(ctx, secret, sizeof(secret), EVP_sha1(), nullptr) == 1;
+#endif
+        OPENSSL_cleanse(secret, sizeof(secret));
+
+        if (!keyed) {
+            STMS_ERROR("Failed to key the DTLS cookie MAC! Keeping the old secret!");
+            freeMac(ctx);
+            return;
+        }
+
+        auto key = std::make_shared<Key>();
+        key->id = nextKeyId++;
+        key->ctx = ctx;
+        key->created = std::chrono::steady_clock::now();
+
+        previous = std::move(current);
+        current = std::move(key);
+        rotatedAt = std::chrono::steady_clock::now();
+    }
+
+    void CookieKeys::rotateIfDue(std::shared_lock<std::shared_mutex> &lg) {
+        auto isDue = [&]() {
+            return lifetimeSecs > 0 &&
+                   std::chrono::steady_clock::now() - current->created >= std::chrono::seconds(lifetimeSecs);
+        };
+
+        if (!isDue()) {
+            return;
+        }
+
+        lg.unlock();
+        {
+            std::unique_lock<std::shared_mutex> rotateLg(keysMtx);
+            if (isDue()) { // Another thread may have rotated in the meantime
+                STMS_INFO("Rotating DTLS cookie secret");
+                rotateLocked();
+            }
+        }
+        lg.lock();
+    }
+
+    void CookieKeys::setRotation(unsigned lifetime, unsigned grace) {
+        std::unique_lock<std::shared_mutex> lg(keysMtx);
+        lifetimeSecs = lifetime;
+        graceSecs = grace;
+    }
+
+    void CookieKeys::rotate() {
+        std::unique_lock<std::shared_mutex> lg(keysMtx);
+        rotateLocked();
+    }
+
+    unsigned CookieKeys::generate(const sockaddr *peer, uint8_t *out) {
+        std::shared_lock<std::shared_mutex> lg(keysMtx);
+        rotateIfDue(lg);
+        return computeCookie(current->id, current->ctx, peer, out);
+    }
+
+    bool CookieKeys::verify(const sockaddr *peer, const uint8_t *cookie, unsigned len) {
+        uint8_t expected[DTLS1_COOKIE_LENGTH - 1];
+
+        std::shared_lock<std::shared_mutex> lg(keysMtx);
+        unsigned expectedLen = computeCookie(current->id, current->ctx, peer, expected);
+        if (expectedLen > 0 && len == expectedLen && CRYPTO_memcmp(expected, cookie, len) == 0) {
+            return true;
+        }
+
+        if (!previous || std::chrono::steady_clock::now() - rotatedAt >= std::chrono::seconds(graceSecs)) {
+            return false;
+        }
+        expectedLen = computeCookie(previous->id, previous->ctx, peer, expected);
+        return expectedLen > 0 && len == expectedLen && CRYPTO_memcmp(expected, cookie, len) == 0;
+    }
+
+    /// `SSL_CTX` ex data index the `std::shared_ptr<CookieKeys>` from `CookieKeys::install` is stored at.
+    static int cookieKeysIndex() {
+        static int idx = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr,
+                                                  [](void *, void *ptr, CRYPTO_EX_DATA *, int, long, void *) {
+                                                      delete static_cast<std::shared_ptr<CookieKeys> *>(ptr);
+                                                  });
+        return idx;
+    }
+
+    /// Get the keys installed on the context of `ssl` and the address of its peer, if both are there.
+    static CookieKeys *getPeer(SSL *ssl, sockaddr_storage &peer) {
+        auto *holder = static_cast<std::shared_ptr<CookieKeys> *>(
+                SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), cookieKeysIndex()));
+        if (holder == nullptr || !*holder) {
+            return nullptr;
+        }
+
+        BIO_dgram_get_peer(SSL_get_rbio(ssl), &peer);
+        if (peer.ss_family != AF_INET && peer.ss_family != AF_INET6) {
+            return nullptr;
+        }
+        return holder->get();
+    }
+
+    static int genCookie(SSL *ssl, unsigned char *cookie, unsigned int *cookieLen) {
+        sockaddr_storage peer{};
+        CookieKeys *keys = getPeer(ssl, peer);
+        if (keys == nullptr) {
+            return 0;
+        }
+
+        *cookieLen = keys->generate(reinterpret_cast<sockaddr *>(&peer), cookie);
+        return *cookieLen > 0 ? 1 : 0;
+    }
+
+    static int verifyCookie(SSL *ssl, const unsigned char *cookie, unsigned int cookieLen) {
+        sockaddr_storage peer{};
+        CookieKeys *keys = getPeer(ssl, peer);
+        if (keys != nullptr && keys->verify(reinterpret_cast<sockaddr *>(&peer), cookie, cookieLen)) {
+            return 1;
+        }
+
+        STMS_WARN("Received an invalid cookie! Are you under a DDoS attack?");
+        return 0;
+    }
+
+    void CookieKeys::install(SSL_CTX *ctx, const std::shared_ptr<CookieKeys> &keys) {
+        auto *old = static_cast<std::shared_ptr<CookieKeys> *>(SSL_CTX_get_ex_data(ctx, cookieKeysIndex()));
+        SSL_CTX_set_ex_data(ctx, cookieKeysIndex(), keys ? new std::shared_ptr<CookieKeys>(keys) : nullptr);
+        delete old;
+
+        SSL_CTX_set_cookie_generate_cb(ctx, genCookie);
+        SSL_CTX_set_cookie_verify_cb(ctx, verifyCookie);
+    }
+}
@@ -0,0 +1,110 @@
+#include "stms/net/event_loop.hpp"
+
+#include "stms/logging.hpp"
+
+#include <unistd.h>
+#include <cstring>
+
+#ifdef __linux__
+#   include <sys/epoll.h>
+#endif
+
+namespace stms {
+#ifdef __linux__
+    EventLoop::EventLoop() {
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (epollFd == -1) {
+            STMS_ERROR("Failed to create epoll instance: {}", strerror(errno));
+        }
+    }
+
+    bool EventLoop::add(int fd, uint32_t events) {
+        epoll_event ev{};
+        ev.events = events;
+        ev.data.fd = fd;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            STMS_WARN("Failed to add fd {} to epoll: {}", fd, strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    bool EventLoop::modify(int fd, uint32_t events) {
+        epoll_event ev{};
+        ev.events = events;
+        ev.data.fd = fd;
+        if (epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+            // ENOENT/EBADF just means the fd was closed (and thus implicitly removed) in the meantime.
+            if (errno != ENOENT && errno != EBADF) {
+                STMS_WARN("Failed to modify fd {} in epoll: {}", fd, strerror(errno));
+            }
+            return false;
+        }
+        return true;
+    }
+
+    bool EventLoop::remove(int fd) {
+        epoll_event ev{}; // Pre-2.6.9 kernels require a non-null event for EPOLL_CTL_DEL.
+        if (epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, &ev) == -1) {
+            if (errno != ENOENT && errno != EBADF) {
+                STMS_WARN("Failed to remove fd {} from epoll: {}", fd, strerror(errno));
+            }
+            return false;
+        }
+        return true;
+    }
+
+    int EventLoop::wait(int timeoutMs, std::vector<FDEvent> &out) {
+        epoll_event evs[eventLoopMaxEvents];
+        int numEvents = epoll_wait(epollFd, evs, eventLoopMaxEvents, timeoutMs);
+        if (numEvents == -1) {
+            if (errno != EINTR) {
+                STMS_WARN("epoll_wait() failed: {}", strerror(errno));
+            }
+            return -1;
+        }
+
+        out.reserve(out.size() + numEvents);
+        for (int i = 0; i < numEvents; i++) {
+            out.emplace_back(FDEvent{evs[i].data.fd, evs[i].events});
+        }
+        return numEvents;
+    }
+#else
+    EventLoop::EventLoop() {
+        STMS_ERROR("EventLoop is only supported on Linux (epoll is unavailable)!");
+    }
+
+    bool EventLoop::add(int, uint32_t) { return false; }
+
+    bool EventLoop::modify(int, uint32_t) { return false; }
+
+    bool EventLoop::remove(int) { return false; }
+
+    int EventLoop::wait(int, std::vector<FDEvent> &) { return -1; }
+#endif
+
+    EventLoop::~EventLoop() {
+        if (epollFd != -1 && close(epollFd) == -1) {
+            STMS_WARN("Failed to close epoll instance: {}", strerror(errno));
+        }
+    }
+
+    EventLoop::EventLoop(EventLoop &&rhs) noexcept {
+        *this = std::move(rhs);
+    }
+
+    EventLoop &EventLoop::operator=(EventLoop &&rhs) noexcept {
+        if (this == &rhs) {
+            return *this;
+        }
+
+        if (epollFd != -1) {
+            close(epollFd);
+        }
+
+        epollFd = rhs.epollFd;
+        rhs.epollFd = -1;
+        return *this;
+    }
+}
@@ -0,0 +1,99 @@
+#include "stms/net/framing.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace stms {
+    MessageFramer::MessageFramer(std::size_t maxMessageLen, std::size_t initialCapacity)
+            : capacity(std::max(initialCapacity, frameHeaderLen * 2)), maxMsgLen(maxMessageLen) {
+        ring = std::make_unique<uint8_t[]>(capacity);
+    }
+
+    void MessageFramer::copyOut(std::size_t from, uint8_t *dst, std::size_t len) const {
+        std::size_t firstLen = std::min(len, capacity - from);
+        std::memcpy(dst, ring.get() + from, firstLen);
+        std::memcpy(dst + firstLen, ring.get(), len - firstLen);
+    }
+
+    void MessageFramer::grow(std::size_t minCapacity) {
+        std::size_t newCapacity = capacity;
+        while (newCapacity < minCapacity) {
+            newCapacity *= 2;
+        }
+
+        auto newRing = std::make_unique<uint8_t[]>(newCapacity);
+        copyOut(head, newRing.get(), used);
+        ring = std::move(newRing);
+        capacity = newCapacity;
+        head = 0;
+    }
+
+    std::pair<uint8_t *, std::size_t> MessageFramer::writeSpan() {
+        if (used == capacity) {
+            grow(capacity * 2); // Only happens if `commit` couldn't read the length of the message yet.
+        }
+
+        std::size_t tail = (head + used) % capacity;
+        std::size_t spanLen = (tail < head) ? head - tail : capacity - tail;
+        return {ring.get() + tail, spanLen};
+    }
+
+    bool MessageFramer::commit(std::size_t len, const std::function<void(uint8_t *, std::size_t)> &onMessage) {
+        used += len;
+
+        while (used >= frameHeaderLen) {
+            uint8_t hdr[frameHeaderLen];
+            copyOut(head, hdr, frameHeaderLen);
+            std::size_t msgLen = (static_cast<std::size_t>(hdr[0]) << 24U) | (static_cast<std::size_t>(hdr[1]) << 16U) |
+                                 (static_cast<std::size_t>(hdr[2]) << 8U) | static_cast<std::size_t>(hdr[3]);
+            if (msgLen > maxMsgLen) {
+                return false;
+            }
+
+            std::size_t frameLen = frameHeaderLen + msgLen;
+            if (frameLen > capacity) {
+                grow(frameLen); // The rest of it can't have arrived yet, as it wouldn't have fit.
+                break;
+            }
+            if (used < frameLen) {
+                break;
+            }
+
+            std::size_t start = (head + frameHeaderLen) % capacity;
+            if (start + msgLen <= capacity) {
+                onMessage(ring.get() + start, msgLen);
+            } else { // Crosses the end of the ring, so make it contiguous with the 1 copy it takes.
+                if (scratchLen < msgLen) {
+                    scratch = std::make_unique<uint8_t[]>(msgLen);
+                    scratchLen = msgLen;
+                }
+                copyOut(start, scratch.get(), msgLen);
+                onMessage(scratch.get(), msgLen);
+            }
+
+            head = (head + frameLen) % capacity;
+            used -= frameLen;
+        }
+
+        if (used == 0) {
+            head = 0; // Start over at the beginning to make the next `writeSpan` as big as possible
+        }
+        return true;
+    }
+
+    bool MessageFramer::feed(const uint8_t *data, std::size_t len,
+                             const std::function<void(uint8_t *, std::size_t)> &onMessage) {
+        while (len > 0) {
+            auto span = writeSpan();
+            std::size_t toCopy = std::min(span.second, len);
+            std::memcpy(span.first, data, toCopy);
+            if (!commit(toCopy, onMessage)) {
+                return false;
+            }
+
+            data += toCopy;
+            len -= toCopy;
+        }
+        return true;
+    }
+}
@@ -0,0 +1,264 @@
+#include "stms/net/impairment.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include "stms/logging.hpp"
+
+namespace stms {
+    /// Data of a BIO made by `NetImpairment::wrapBio`.
+    struct ImpairedBioData {
+        std::shared_ptr<NetImpairment> imp; //!< Shim to send through
+        int sharedFd; //!< See `NetImpairment::wrapBio`
+    };
+
+    static int impairedBioWrite(BIO *bio, const char *data, int len) {
+        auto *bioData = static_cast<ImpairedBioData *>(BIO_get_data(bio));
+        BIO *next = BIO_next(bio);
+        BIO_clear_retry_flags(bio);
+        if (next == nullptr) {
+            return -1;
+        }
+
+        int fd = -1;
+        BIO_get_fd(next, &fd);
+
+        // Send to wherever the dgram BIO would have. Before `DTLSv1_listen` is done, that is the last sender.
+        sockaddr_storage peer{};
+        auto peerLen = static_cast<socklen_t>(BIO_dgram_get_peer(next, &peer));
+        bool hasPeer = peer.ss_family == AF_INET || peer.ss_family == AF_INET6;
+
+        ssize_t ret = bioData->imp->sendto(fd, data, static_cast<std::size_t>(len), 0,
+                                           hasPeer ? reinterpret_cast<sockaddr *>(&peer) : nullptr,
+                                           hasPeer ? peerLen : 0);
+        if (ret < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                BIO_set_retry_write(bio);
+            }
+            return -1;
+        }
+        return len;
+    }
+
+    static int impairedBioRead(BIO *bio, char *out, int outLen) {
+        BIO *next = BIO_next(bio);
+        BIO_clear_retry_flags(bio);
+        if (next == nullptr) {
+            return -1;
+        }
+
+        int ret = BIO_read(next, out, outLen);
+        BIO_copy_next_retry(bio);
+        return ret;
+    }
+
+    static long impairedBioCtrl(BIO *bio, int cmd, long num, void *ptr) {
+        BIO *next = BIO_next(bio);
+        return next == nullptr ? 0 : BIO_ctrl(next, cmd, num, ptr);
+    }
+
+    static int impairedBioDestroy(BIO *bio) {
+        auto *bioData = static_cast<ImpairedBioData *>(BIO_get_data(bio));
+        if (bioData == nullptr) {
+            return 1;
+        }
+
+        // `BIO_free_all` frees us before `next`, so its socket is still around. It is closed right after.
+        int fd = -1;
+        if (BIO_next(bio) != nullptr && BIO_get_fd(BIO_next(bio), &fd) > 0 && fd != bioData->sharedFd) {
+            bioData->imp->flush(fd);
+        }
+
+        delete bioData;
+        BIO_set_data(bio, nullptr);
+        return 1;
+    }
+
+    static BIO_METHOD *getImpairedBioMethod() {
+        static BIO_METHOD *meth = []() {
+            BIO_METHOD *ret = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_FILTER, "stms impairment");
+            BIO_meth_set_write(ret, impairedBioWrite);
+            BIO_meth_set_read(ret, impairedBioRead);
+            BIO_meth_set_ctrl(ret, impairedBioCtrl);
+            BIO_meth_set_create(ret, [](BIO *bio) -> int {
+                BIO_set_init(bio, 1);
+                return 1;
+            });
+            BIO_meth_set_destroy(ret, impairedBioDestroy);
+            return ret;
+        }();
+        return meth;
+    }
+
+    NetImpairment::NetImpairment(const ImpairmentConfig &cfg) : config(cfg), rng(cfg.seed) {}
+
+    NetImpairment::~NetImpairment() {
+        {
+            std::lock_guard<std::mutex> lg(mtx);
+            stopping = true;
+        }
+        cv.notify_all();
+
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    double NetImpairment::uniform() {
+        return std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+    }
+
+    ssize_t NetImpairment::sendNow(int fd, const void *data, std::size_t len, int flags, const sockaddr *addr,
+                                   socklen_t addrLen) {
+        ssize_t ret = ::sendto(fd, data, len, flags, addr, addrLen);
+        if (ret >= 0) {
+            stats.sent++;
+        }
+        return ret;
+    }
+
+    ssize_t NetImpairment::sendto(int fd, const void *data, std::size_t len, int flags, const sockaddr *addr,
+                                  socklen_t addrLen) {
+        std::unique_lock<std::mutex> lg(mtx);
+        stats.datagrams++;
+
+        // Draw every decision up front, so that the sequence of draws doesn't depend on the outcome.
+        bool lose = uniform() < config.lossRate;
+        int copies = uniform() < config.duplicateRate ? 2 : 1;
+        double jitter[2] = {uniform(), uniform()};
+        bool reorder[2] = {uniform() < config.reorderRate, uniform() < config.reorderRate};
+        if (lose) {
+            stats.lost++;
+            return static_cast<ssize_t>(len);
+        }
+        if (copies > 1) {
+            stats.duplicated++;
+        }
+
+        auto now = Clock::now();
+        ssize_t ret = static_cast<ssize_t>(len);
+        bool queued = false;
+        for (int i = 0; i < copies; i++) {
+            double delayMs = config.latencyMs + jitter[i] * config.jitterMs;
+            if (reorder[i]) {
+                delayMs += config.reorderDelayMs;
+                stats.reordered++;
+            }
+
+            auto delay = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double, std::milli>(delayMs));
+            if (config.bandwidthBytesPerSec > 0) {
+                // The datagram leaves once everything ahead of it has been serialized onto the link.
+                auto start = std::max(linkFreeAt, now);
+                double backlog = std::chrono::duration<double>(start - now).count() * config.bandwidthBytesPerSec;
+                if (backlog + len > config.queueLimitBytes) {
+                    stats.overflowed++;
+                    continue;
+                }
+
+                linkFreeAt = start + std::chrono::duration_cast<Clock::duration>(
+                        std::chrono::duration<double>(static_cast<double>(len) / config.bandwidthBytesPerSec));
+                delay += linkFreeAt - now;
+            }
+
+            if (delay <= Clock::duration::zero()) {
+                ret = sendNow(fd, data, len, flags, addr, addrLen);
+                continue;
+            }
+
+            Pending item{fd, {}, 0, PacketBuffer::copyOf(static_cast<const uint8_t *>(data), len)};
+            if (addr != nullptr && addrLen <= sizeof(sockaddr_storage)) {
+                std::memcpy(&item.addr, addr, addrLen);
+                item.addrLen = addrLen;
+            }
+            pending.emplace(std::make_pair(now + delay, nextOrder++), std::move(item));
+            stats.delayed++;
+            queued = true;
+        }
+
+        if (queued) {
+            if (!worker.joinable()) {
+                worker = std::thread(&NetImpairment::run, this);
+            }
+            lg.unlock();
+            cv.notify_all();
+        }
+        return ret;
+    }
+
+    ssize_t NetImpairment::sendmsg(int fd, const msghdr *hdr, int flags) {
+        std::size_t len = 0;
+        for (std::size_t i = 0; i < hdr->msg_iovlen; i++) {
+            len += hdr->msg_iov[i].iov_len;
+        }
+
+        const uint8_t *data = nullptr;
+        PacketBuffer gathered;
+        if (hdr->msg_iovlen == 1) {
+            data = static_cast<const uint8_t *>(hdr->msg_iov[0].iov_base);
+        } else {
+            gathered = PacketBuffer::alloc(len);
+            uint8_t *dst = gathered.data();
+            for (std::size_t i = 0; i < hdr->msg_iovlen; i++) {
+                dst = std::copy(static_cast<const uint8_t *>(hdr->msg_iov[i].iov_base),
+                                static_cast<const uint8_t *>(hdr->msg_iov[i].iov_base) + hdr->msg_iov[i].iov_len, dst);
+            }
+            data = gathered.data();
+        }
+
+        return sendto(fd, data, len, flags, static_cast<const sockaddr *>(hdr->msg_name), hdr->msg_namelen);
+    }
+
+    void NetImpairment::run() {
+        std::unique_lock<std::mutex> lg(mtx);
+        while (!stopping) {
+            if (pending.empty()) {
+                cv.wait(lg);
+                continue;
+            }
+
+            auto due = pending.begin()->first.first;
+            if (Clock::now() < due) {
+                cv.wait_until(lg, due);
+                continue;
+            }
+
+            // Sent while holding `mtx`, so `flush` returning means nothing is sent from the fd anymore.
+            auto now = Clock::now();
+            while (!pending.empty() && pending.begin()->first.first <= now) {
+                Pending &item = pending.begin()->second;
+                if (sendNow(item.fd, item.data.data(), item.data.size(), 0,
+                            item.addrLen == 0 ? nullptr : reinterpret_cast<sockaddr *>(&item.addr), item.addrLen) < 0
+                    && errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS && errno != ECONNREFUSED) {
+                    STMS_WARN("Delayed datagram couldn't be sent: {}", strerror(errno));
+                }
+                pending.erase(pending.begin());
+            }
+        }
+    }
+
+    void NetImpairment::flush(int fd) {
+        std::lock_guard<std::mutex> lg(mtx);
+        for (auto it = pending.begin(); it != pending.end();) {
+            if (it->second.fd != fd) {
+                ++it;
+                continue;
+            }
+
+            Pending &item = it->second;
+            sendNow(item.fd, item.data.data(), item.data.size(), 0,
+                    item.addrLen == 0 ? nullptr : reinterpret_cast<sockaddr *>(&item.addr), item.addrLen);
+            it = pending.erase(it);
+        }
+    }
+
+    BIO *NetImpairment::wrapBio(const std::shared_ptr<NetImpairment> &imp, BIO *next, int sharedFd) {
+        BIO *filter = BIO_new(getImpairedBioMethod());
+        BIO_set_data(filter, new ImpairedBioData{imp, sharedFd});
+        return BIO_push(filter, next);
+    }
+
+    ImpairmentStats NetImpairment::getStats() {
+        std::lock_guard<std::mutex> lg(mtx);
+        return stats;
+    }
+}
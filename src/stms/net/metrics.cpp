@@ -0,0 +1,424 @@
+#include "stms/net/metrics.hpp"
+#include "stms/net/plain_udp.hpp"
+#include "stms/net/sharded_ssl_server.hpp"
+#include "stms/net/ssl_client.hpp"
+#include "stms/net/ssl_server.hpp"
+#include "stms/logging.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace stms {
+    MetricsSnapshot &MetricsSnapshot::operator+=(const MetricsSnapshot &rhs) {
+        bytesIn += rhs.bytesIn;
+        bytesOut += rhs.bytesOut;
+        messagesIn += rhs.messagesIn;
+        messagesOut += rhs.messagesOut;
+        wantReadRetries += rhs.wantReadRetries;
+        wantWriteRetries += rhs.wantWriteRetries;
+        timeouts += rhs.timeouts;
+        kicks += rhs.kicks;
+        handshakes += rhs.handshakes;
+        handshakeFailures += rhs.handshakeFailures;
+        handshakeMicros += rhs.handshakeMicros;
+        for (std::size_t i = 0; i < handshakeBuckets.size(); i++) {
+            handshakeBuckets[i] += rhs.handshakeBuckets[i];
+        }
+
+        connections += rhs.connections;
+        handshaking += rhs.handshaking;
+        queuedBytes += rhs.queuedBytes;
+        queuedMessages += rhs.queuedMessages;
+        if (rhs.mtu != 0 && (mtu == 0 || rhs.mtu < mtu)) {
+            mtu = rhs.mtu;
+        }
+        return *this;
+    }
+
+    void NetMetrics::addHandshake(float durationMs) {
+        std::size_t bucket = 0;
+        while (bucket < handshakeBucketsMs.size() && durationMs > static_cast<float>(handshakeBucketsMs[bucket])) {
+            bucket++;
+        }
+        handshakeBuckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        handshakeMicros.fetch_add(static_cast<uint64_t>(std::max(durationMs, 0.0f) * 1000.0f),
+                                  std::memory_order_relaxed);
+    }
+
+    void NetMetrics::addTo(MetricsSnapshot &out) const {
+        out.bytesIn = bytesIn.load(std::memory_order_relaxed);
+        out.bytesOut = bytesOut.load(std::memory_order_relaxed);
+        out.messagesIn = messagesIn.load(std::memory_order_relaxed);
+        out.messagesOut = messagesOut.load(std::memory_order_relaxed);
+        out.wantReadRetries = wantReadRetries.load(std::memory_order_relaxed);
+        out.wantWriteRetries = wantWriteRetries.load(std::memory_order_relaxed);
+        out.timeouts = timeouts.load(std::memory_order_relaxed);
+        out.kicks = kicks.load(std::memory_order_relaxed);
+        out.handshakeFailures = handshakeFailures.load(std::memory_order_relaxed);
+        out.handshakeMicros = handshakeMicros.load(std::memory_order_relaxed);
+
+        out.handshakes = 0;
+        for (std::size_t i = 0; i < handshakeBuckets.size(); i++) {
+            out.handshakeBuckets[i] = handshakeBuckets[i].load(std::memory_order_relaxed);
+            out.handshakes += out.handshakeBuckets[i];
+        }
+    }
+
+    void NetMetrics::copyFrom(const NetMetrics &rhs) {
+        auto copy = [](std::atomic<uint64_t> &dst, const std::atomic<uint64_t> &src) {
+            dst.store(src.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        };
+
+        copy(bytesIn, rhs.bytesIn);
+        copy(bytesOut, rhs.bytesOut);
+        copy(messagesIn, rhs.messagesIn);
+        copy(messagesOut, rhs.messagesOut);
+        copy(wantReadRetries, rhs.wantReadRetries);
+        copy(wantWriteRetries, rhs.wantWriteRetries);
+        copy(timeouts, rhs.timeouts);
+        copy(kicks, rhs.kicks);
+        copy(handshakeFailures, rhs.handshakeFailures);
+        copy(handshakeMicros, rhs.handshakeMicros);
+        for (std::size_t i = 0; i < handshakeBuckets.size(); i++) {
+            copy(handshakeBuckets[i], rhs.handshakeBuckets[i]);
+        }
+    }
+
+    /// Escape a label value as required by the text format.
+    static std::string escapeLabel(const std::string &val) {
+        std::string ret;
+        ret.reserve(val.size());
+        for (char c : val) {
+            if (c == '\\' || c == '"') {
+                ret += '\\';
+                ret += c;
+            } else if (c == '\n') {
+                ret += "\\n";
+            } else {
+                ret += c;
+            }
+        }
+        return ret;
+    }
+
+    /// Format a number of milliseconds as seconds without trailing zeros, i.e. 250 -> "0.25"
+    static std::string msToSecs(unsigned ms) {
+        std::string ret = std::to_string(ms / 1000);
+        if (ms % 1000 != 0) {
+            char frac[8];
+            std::snprintf(frac, sizeof(frac), "%03u", ms % 1000);
+            std::string fracStr = frac;
+            fracStr.erase(fracStr.find_last_not_of('0') + 1);
+            ret += "." + fracStr;
+        }
+        return ret;
+    }
+
+    void MetricsExporter::addSource(const std::string &name, const Source &totals, const ClientSource &clients) {
+        std::lock_guard<std::mutex> lg(sourcesMtx);
+        auto it = std::find_if(sources.begin(), sources.end(), [&](const SourceEntry &s) { return s.name == name; });
+        if (it != sources.end()) {
+            it->totals = totals;
+            it->clients = clients;
+        } else {
+            sources.emplace_back(SourceEntry{name, totals, clients});
+        }
+    }
+
+    /// Label the per-client snapshots of a `SSLServer` or `ShardedSSLServer` with their UUIDs.
+    template<typename S>
+    static std::vector<std::pair<std::string, MetricsSnapshot>> labelClients(S &serv) {
+        std::vector<std::pair<std::string, MetricsSnapshot>> ret;
+        for (auto &cli : serv.getClientMetrics()) {
+            ret.emplace_back(cli.first.buildStr(), cli.second);
+        }
+        return ret;
+    }
+
+    void MetricsExporter::addSource(const std::string &name, SSLServer &serv) {
+        addSource(name, [&serv]() { return serv.getMetrics(); }, [&serv]() { return labelClients(serv); });
+    }
+
+    void MetricsExporter::addSource(const std::string &name, ShardedSSLServer &serv) {
+        addSource(name, [&serv]() { return serv.getMetrics(); }, [&serv]() { return labelClients(serv); });
+    }
+
+    void MetricsExporter::addSource(const std::string &name, SSLClient &cli) {
+        addSource(name, [&cli]() { return cli.getMetrics(); });
+    }
+
+    void MetricsExporter::addSource(const std::string &name, UDPPeer &peer) {
+        addSource(name, [&peer]() { return peer.getMetrics(); });
+    }
+
+    void MetricsExporter::removeSource(const std::string &name) {
+        std::lock_guard<std::mutex> lg(sourcesMtx);
+        sources.erase(std::remove_if(sources.begin(), sources.end(), [&](const SourceEntry &s) {
+            return s.name == name;
+        }), sources.end());
+    }
+
+    std::string MetricsExporter::render() {
+        // (labels, snapshot) of every series, so each metric family can be written in one block.
+        std::vector<std::pair<std::string, MetricsSnapshot>> rows;
+        {
+            std::lock_guard<std::mutex> lg(sourcesMtx);
+            for (const auto &src : sources) {
+                std::string srcLabel = "source=\"" + escapeLabel(src.name) + "\"";
+                rows.emplace_back(srcLabel, src.totals());
+                if (src.clients) {
+                    for (auto &cli : src.clients()) {
+                        rows.emplace_back(srcLabel + ",client=\"" + escapeLabel(cli.first) + "\"", cli.second);
+                    }
+                }
+            }
+        }
+
+        struct Family {
+            const char *name;
+            const char *type;
+            const char *help;
+            uint64_t (*get)(const MetricsSnapshot &);
+        };
+        static const Family families[] = {
+                {"stms_received_bytes_total", "counter", "Bytes of application data received",
+                        [](const MetricsSnapshot &s) { return s.bytesIn; }},
+                {"stms_sent_bytes_total", "counter", "Bytes of application data sent",
+                        [](const MetricsSnapshot &s) { return s.bytesOut; }},
+                {"stms_received_messages_total", "counter", "Messages received",
+                        [](const MetricsSnapshot &s) { return s.messagesIn; }},
+                {"stms_sent_messages_total", "counter", "Messages sent",
+                        [](const MetricsSnapshot &s) { return s.messagesOut; }},
+                {"stms_want_read_retries_total", "counter", "IO retried because it wanted to read",
+                        [](const MetricsSnapshot &s) { return s.wantReadRetries; }},
+                {"stms_want_write_retries_total", "counter", "IO retried because it wanted to write",
+                        [](const MetricsSnapshot &s) { return s.wantWriteRetries; }},
+                {"stms_timeouts_total", "counter", "Connections or operations that timed out",
+                        [](const MetricsSnapshot &s) { return s.timeouts; }},
+                {"stms_kicks_total", "counter", "Clients kicked by the application",
+                        [](const MetricsSnapshot &s) { return s.kicks; }},
+                {"stms_handshake_failures_total", "counter", "Handshakes that failed or timed out",
+                        [](const MetricsSnapshot &s) { return s.handshakeFailures; }},
+                {"stms_connections", "gauge", "Connected clients",
+                        [](const MetricsSnapshot &s) { return static_cast<uint64_t>(s.connections); }},
+                {"stms_handshakes_in_progress", "gauge", "Handshakes in progress",
+                        [](const MetricsSnapshot &s) { return static_cast<uint64_t>(s.handshaking); }},
+                {"stms_send_queue_bytes", "gauge", "Bytes waiting to be sent",
+                        [](const MetricsSnapshot &s) { return static_cast<uint64_t>(s.queuedBytes); }},
+                {"stms_send_queue_messages", "gauge", "Messages waiting to be sent",
+                        [](const MetricsSnapshot &s) { return static_cast<uint64_t>(s.queuedMessages); }},
+                {"stms_mtu_bytes", "gauge", "Current DTLS path MTU (0 if unknown)",
+                        [](const MetricsSnapshot &s) { return static_cast<uint64_t>(s.mtu); }},
+        };
+
+        std::string out;
+        for (const auto &family : families) {
+            out += std::string("# HELP ") + family.name + " " + family.help + "\n";
+            out += std::string("# TYPE ") + family.name + " " + family.type + "\n";
+            for (const auto &row : rows) {
+                out += std::string(family.name) + "{" + row.first + "} " + std::to_string(family.get(row.second)) + "\n";
+            }
+        }
+
+        out += "# HELP stms_handshake_duration_seconds Duration of completed handshakes\n";
+        out += "# TYPE stms_handshake_duration_seconds histogram\n";
+        for (const auto &row : rows) {
+            const MetricsSnapshot &snap = row.second;
+            uint64_t cumulative = 0;
+            for (std::size_t i = 0; i < snap.handshakeBuckets.size(); i++) {
+                cumulative += snap.handshakeBuckets[i];
+                std::string le = i < handshakeBucketsMs.size() ? msToSecs(handshakeBucketsMs[i]) : "+Inf";
+                out += "stms_handshake_duration_seconds_bucket{" + row.first + ",le=\"" + le + "\"} " +
+                       std::to_string(cumulative) + "\n";
+            }
+
+            char sum[32];
+            std::snprintf(sum, sizeof(sum), "%.6f", static_cast<double>(snap.handshakeMicros) / 1000000.0);
+            out += "stms_handshake_duration_seconds_sum{" + row.first + "} " + sum + "\n";
+            out += "stms_handshake_duration_seconds_count{" + row.first + "} " + std::to_string(snap.handshakes) + "\n";
+        }
+        return out;
+    }
+
+    bool MetricsExporter::writeFile(const std::string &path) {
+        std::string tmpPath = path + ".tmp";
+        {
+            std::ofstream file(tmpPath, std::ios::out | std::ios::trunc | std::ios::binary);
+            if (!file) {
+                STMS_ERROR("Failed to open '{}' for writing metrics: {}", tmpPath, strerror(errno));
+                return false;
+            }
+
+            file << render();
+            if (!file.flush()) {
+                STMS_ERROR("Failed to write metrics to '{}'!", tmpPath);
+                return false;
+            }
+        }
+
+        if (std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+            STMS_ERROR("Failed to move metrics from '{}' to '{}': {}", tmpPath, path, strerror(errno));
+            std::remove(tmpPath.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    bool MetricsExporter::listen(const std::string &path) {
+        close();
+
+        sockaddr_un addr{};
+        if (path.size() >= sizeof(addr.sun_path)) {
+            STMS_ERROR("Metrics socket path '{}' is too long!", path);
+            return false;
+        }
+        addr.sun_family = AF_UNIX;
+        std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+        struct stat st{};
+        if (stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+            unlink(path.c_str()); // Left behind by a previous run
+        }
+
+        listenSock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listenSock == -1 || bind(listenSock, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+            ::listen(listenSock, metricsMaxPending) != 0) {
+            STMS_ERROR("Failed to serve metrics on '{}': {}", path, strerror(errno));
+            close();
+            return false;
+        }
+
+        unixPath = path;
+        STMS_INFO("Serving metrics on {}", path);
+        return true;
+    }
+
+    bool MetricsExporter::listen(uint16_t port) {
+        close();
+
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        int on = 1;
+        listenSock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listenSock == -1 || setsockopt(listenSock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+            bind(listenSock, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+            ::listen(listenSock, metricsMaxPending) != 0) {
+            STMS_ERROR("Failed to serve metrics on 127.0.0.1:{}: {}", port, strerror(errno));
+            close();
+            return false;
+        }
+
+        STMS_INFO("Serving metrics on 127.0.0.1:{}", port);
+        return true;
+    }
+
+    void MetricsExporter::respond(const PendingConn &conn) {
+        // Raw clients (i.e. `nc -U`) don't send anything and just get the metrics.
+        bool isHttp = conn.request.rfind("GET ", 0) == 0 || conn.request.rfind("HEAD ", 0) == 0;
+        std::string body = render();
+        std::string resp;
+        if (isHttp) {
+            resp = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                   std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n";
+        }
+        if (!isHttp || conn.request.rfind("HEAD ", 0) != 0) {
+            resp += body;
+        }
+
+        // The socket is non-blocking, so wait for room if the response doesn't fit in the send buffer.
+        std::size_t sent = 0;
+        while (sent < resp.size()) {
+            ssize_t ret = ::send(conn.fd, resp.data() + sent, resp.size() - sent, MSG_NOSIGNAL);
+            if (ret > 0) {
+                sent += static_cast<std::size_t>(ret);
+                continue;
+            }
+
+            pollfd pfd{conn.fd, POLLOUT, 0};
+            if (ret == 0 || (errno != EAGAIN && errno != EWOULDBLOCK) ||
+                poll(&pfd, 1, static_cast<int>(metricsRequestWaitMs)) <= 0) {
+                STMS_WARN("Failed to send metrics to a scraper! {}/{} bytes sent", sent, resp.size());
+                break;
+            }
+        }
+
+        shutdown(conn.fd, SHUT_WR);
+        ::close(conn.fd);
+    }
+
+    void MetricsExporter::tick() {
+        if (listenSock == -1) {
+            return;
+        }
+
+        while (pending.size() < static_cast<std::size_t>(metricsMaxPending)) {
+            int fd = accept4(listenSock, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd == -1) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    STMS_WARN("Failed to accept a metrics scraper: {}", strerror(errno));
+                }
+                break;
+            }
+            pending.emplace_back(PendingConn{fd, std::chrono::steady_clock::now(), {}});
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        auto it = pending.begin();
+        while (it != pending.end()) {
+            char buf[1024];
+            ssize_t got;
+            while ((got = recv(it->fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0 && it->request.size() < 8192) {
+                it->request.append(buf, static_cast<std::size_t>(got));
+            }
+
+            bool gotRequest = it->request.find("\r\n\r\n") != std::string::npos ||
+                              it->request.find("\n\n") != std::string::npos || it->request.size() >= 8192;
+            bool waited = now - it->accepted >= std::chrono::milliseconds(metricsRequestWaitMs);
+            if (got == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                ::close(it->fd); // The scraper went away
+            } else if (gotRequest || got == 0 || waited) {
+                respond(*it);
+            } else {
+                ++it;
+                continue;
+            }
+            it = pending.erase(it);
+        }
+    }
+
+    void MetricsExporter::close() {
+        for (const auto &conn : pending) {
+            ::close(conn.fd);
+        }
+        pending.clear();
+
+        if (listenSock != -1) {
+            ::close(listenSock);
+            listenSock = -1;
+        }
+
+        if (!unixPath.empty()) {
+            unlink(unixPath.c_str());
+            unixPath.clear();
+        }
+    }
+
+    MetricsExporter::~MetricsExporter() {
+        close();
+    }
+}
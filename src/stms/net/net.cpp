@@ -8,6 +8,11 @@
 #include <netdb.h>
 #include <sys/unistd.h>
 #include <sys/fcntl.h>
+#include <algorithm>
+
+#ifdef __linux__
+#   include <sys/eventfd.h>
+#endif
 
 namespace stms {
     std::string getAddrStr(const sockaddr *const addr) {
@@ -60,8 +65,16 @@ namespace stms {
         sock = rhs->sock;
         timeoutMs = rhs->timeoutMs;
         maxTimeouts = rhs->maxTimeouts;
+        listenBacklog = rhs->listenBacklog;
         running = rhs->running;
         pPool = rhs->pPool;
+        ioBackend = rhs->ioBackend;
+        edgeTriggered = rhs->edgeTriggered;
+        uring = std::move(rhs->uring);
+        uringWakeFd = rhs->uringWakeFd;
+        impairment = std::move(rhs->impairment);
+
+        rhs->uringWakeFd = -1;
 
         rhs->pAddr = nullptr;
         rhs->pAddrCandidates = nullptr;
@@ -101,6 +114,10 @@ namespace stms {
             pPool->start();
         }
 
+        if (impairment && !isUdp) {
+            STMS_WARN("Network impairment only applies to UDP! It will be ignored for this TCP server/client.");
+        }
+
         int acc = 0, i = 0;
         pAddr = nullptr;
         for (addrinfo *p = pAddrCandidates; p != nullptr; p = p->ai_next) {
@@ -177,7 +194,7 @@ namespace stms {
 
             if (!isUdp) {
                 STMS_INFO("listen");
-                if (listen(sock, tcpListenBacklog) == -1) {
+                if (listen(sock, listenBacklog) == -1) {
                     STMS_WARN("Candidate {}: listen() failed: {}", num, strerror(errno));
                 }
             }
@@ -239,11 +256,15 @@ namespace stms {
 
         running = false;
         onStop();
+        stopUring();
         if (sock == 0) {
             STMS_INFO("Server/client stopped. Resources freed. (Skipped socket as fd was 0)");
             return;
         }
 
+        if (impairment) {
+            impairment->flush(sock);
+        }
         if (close(sock) == -1) {
             STMS_INFO("Failed to close server/client socket: {}", strerror(errno));
         }
@@ -251,4 +272,122 @@ namespace stms {
         STMS_INFO("Server/client stopped. Resources freed.");
     }
 
-}
\ No newline at end of file
+    BIO *_stms_PlainBase::impairBio(BIO *bio, int sharedFd) {
+        if (!impairment || !isUdp) {
+            return bio;
+        }
+        return NetImpairment::wrapBio(impairment, bio, sharedFd);
+    }
+
+    bool _stms_PlainBase::startUring(unsigned numBufs, unsigned bufSize) {
+#ifdef __linux__
+        auto ring = std::make_shared<IOUring>();
+        if (!ring->isValid() || !ring->registerFiles(&sock, 1)) {
+            return false;
+        }
+
+        if (numBufs > 0 && !ring->setupBufRing(numBufs, bufSize)) {
+            return false;
+        }
+
+        int wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wakeFd == -1) {
+            STMS_WARN("Failed to create eventfd for io_uring: {}", strerror(errno));
+            return false;
+        }
+
+        if (!ring->prepPollMultishot(wakeFd, false, POLLIN, eUringWake) || ring->submit() < 0) {
+            close(wakeFd);
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lg(uringMtx);
+        uring = std::move(ring);
+        uringWakeFd = wakeFd;
+        return true;
+#else
+        (void) numBufs;
+        (void) bufSize;
+        return false;
+#endif
+    }
+
+    void _stms_PlainBase::stopUring() {
+        std::lock_guard<std::mutex> lg(uringMtx);
+        if (!uring) {
+            return;
+        }
+
+        // Pending requests (and registered files) hold references to our sockets, which would stop them from
+        // actually being closed (and the port from being freed) until the ring is torn down.
+        if (uring->prepCancelAll(eUringCancel)) {
+            uring->submit();
+        }
+        uring->unregisterFiles();
+        uring.reset();
+
+        close(uringWakeFd);
+        uringWakeFd = -1;
+    }
+
+    void _stms_PlainBase::wakeUring() {
+        uint64_t one = 1;
+        if (uringWakeFd != -1 && write(uringWakeFd, &one, sizeof(uint64_t)) == -1 && errno != EAGAIN) {
+            STMS_WARN("Failed to wake up io_uring: {}", strerror(errno));
+        }
+    }
+
+    bool _stms_PlainBase::reapUring(std::vector<UringCompletion> &out) {
+        std::lock_guard<std::mutex> lg(uringMtx);
+        if (!uring) {
+            return false;
+        }
+
+        if (uring->hasUnsubmitted()) {
+            uring->submit();
+        }
+
+        std::size_t first = out.size();
+        uring->reap(out);
+
+        // Filter out wake-ups (and the completion of the cancellation in `stopUring`, just in case).
+        auto newEnd = std::remove_if(out.begin() + static_cast<long>(first), out.end(), [&](const UringCompletion &c) {
+            if (c.userData != eUringWake) {
+                return c.userData == eUringCancel;
+            }
+
+            uint64_t count;
+            while (read(uringWakeFd, &count, sizeof(uint64_t)) > 0) {}
+
+            if (!IOUring::hasMore(c)) {
+                uring->prepPollMultishot(uringWakeFd, false, POLLIN, eUringWake);
+            }
+            return true;
+        });
+        out.erase(newEnd, out.end());
+        return true;
+    }
+
+    bool _stms_PlainBase::waitUring(int toMs) {
+        std::shared_ptr<IOUring> ring;
+        uringWaiting = true;
+        {
+            std::lock_guard<std::mutex> lg(uringMtx);
+            if (!uring) {
+                uringWaiting = false;
+                return false;
+            }
+
+            if (uring->hasUnsubmitted()) {
+                uring->submit();
+            }
+            ring = uring; // Keep it alive even if we are stopped while waiting
+        }
+
+        // Waiting doesn't touch the submission queue, so other threads can keep queueing requests meanwhile.
+        // They call `wakeUring` if they see `uringWaiting`, and if they don't, we submit their requests above.
+        ring->wait(toMs);
+        uringWaiting = false;
+        return true;
+    }
+}
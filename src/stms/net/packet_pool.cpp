@@ -0,0 +1,260 @@
+#include "stms/net/packet_pool.hpp"
+
+#include <new>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <vector>
+#include <algorithm>
+
+namespace stms {
+    namespace {
+        constexpr uint8_t packetHeapClass = 0xFF;
+
+        constexpr unsigned log2(std::size_t n) {
+            return n <= 1 ? 0 : 1 + log2(n >> 1u);
+        }
+
+        constexpr unsigned numSizeClasses = log2(packetPoolMaxSize) - log2(packetPoolMinSize) + 1;
+
+        static_assert((packetPoolMinSize & (packetPoolMinSize - 1)) == 0, "packetPoolMinSize must be a power of 2!");
+        static_assert(numSizeClasses < packetHeapClass, "Too many PacketBuffer size classes!");
+
+        inline std::size_t classSize(unsigned cls) {
+            return packetPoolMinSize << cls;
+        }
+
+        inline unsigned sizeClassOf(std::size_t capacity) {
+            unsigned cls = 0;
+            while (classSize(cls) < capacity) {
+                cls++;
+            }
+            return cls;
+        }
+
+        /// Memory that `PacketBuffer`s are carved out of: `count` buffers, `stride` bytes apart, header included.
+        struct PacketRange {
+            std::size_t stride;
+            std::size_t count;
+        };
+
+        /// Shared free lists, refilled from slabs that are kept until exit. Threads only touch this in batches.
+        class GlobalPacketPool {
+        private:
+            std::mutex mtx[numSizeClasses];
+            std::vector<_stms_PacketHeader *> freeList[numSizeClasses];
+            // `slabs` and `ranges` are shared by every size class, so they can't be guarded by `mtx`.
+            std::shared_mutex slabMtx;
+            std::vector<uint8_t *> slabs;
+            std::map<uintptr_t, PacketRange> ranges; // Every slab and heap buffer, by start address
+
+        public:
+            ~GlobalPacketPool() {
+                for (auto *slab : slabs) {
+                    delete[] slab;
+                }
+            }
+
+            void take(unsigned cls, std::vector<_stms_PacketHeader *> &out, unsigned num) {
+                std::lock_guard<std::mutex> lg(mtx[cls]);
+                if (freeList[cls].empty()) {
+                    std::size_t stride = sizeof(_stms_PacketHeader) + classSize(cls);
+                    auto *slab = new uint8_t[stride * packetPoolSlabBuffers];
+                    {
+                        std::unique_lock<std::shared_mutex> slabLg(slabMtx);
+                        slabs.emplace_back(slab);
+                        ranges.emplace(reinterpret_cast<uintptr_t>(slab), PacketRange{stride, packetPoolSlabBuffers});
+                    }
+
+                    for (unsigned i = 0; i < packetPoolSlabBuffers; i++) {
+                        auto *hdr = new (slab + stride * i) _stms_PacketHeader{};
+                        hdr->capacity = static_cast<uint32_t>(classSize(cls));
+                        hdr->sizeClass = static_cast<uint8_t>(cls);
+                        freeList[cls].emplace_back(hdr);
+                    }
+                }
+
+                std::size_t n = std::min<std::size_t>(num, freeList[cls].size());
+                out.insert(out.end(), freeList[cls].end() - n, freeList[cls].end());
+                freeList[cls].resize(freeList[cls].size() - n);
+            }
+
+            void give(unsigned cls, _stms_PacketHeader *const *hdrs, std::size_t num) {
+                std::lock_guard<std::mutex> lg(mtx[cls]);
+                freeList[cls].insert(freeList[cls].end(), hdrs, hdrs + num);
+            }
+
+            void addHeapBuffer(_stms_PacketHeader *hdr) {
+                std::unique_lock<std::shared_mutex> slabLg(slabMtx);
+                ranges.emplace(reinterpret_cast<uintptr_t>(hdr),
+                               PacketRange{sizeof(_stms_PacketHeader) + hdr->capacity, 1});
+            }
+
+            // Must come before the buffer is freed, so that `retain` can't find it anymore.
+            void removeHeapBuffer(_stms_PacketHeader *hdr) {
+                std::unique_lock<std::shared_mutex> slabLg(slabMtx);
+                ranges.erase(reinterpret_cast<uintptr_t>(hdr));
+            }
+
+            // Take a reference to the buffer `data` is the start of, without ever dereferencing pointers that aren't.
+            _stms_PacketHeader *retain(const uint8_t *data) {
+                auto addr = reinterpret_cast<uintptr_t>(data);
+
+                // Shared, so heap buffers can't be removed and freed while we take the reference.
+                std::shared_lock<std::shared_mutex> slabLg(slabMtx);
+                auto it = ranges.upper_bound(addr);
+                if (it == ranges.begin()) {
+                    return nullptr;
+                }
+                --it;
+
+                uintptr_t offset = addr - it->first;
+                if (offset >= it->second.stride * it->second.count ||
+                    offset % it->second.stride != sizeof(_stms_PacketHeader)) {
+                    return nullptr;
+                }
+
+                auto *hdr = reinterpret_cast<_stms_PacketHeader *>(const_cast<uint8_t *>(data)) - 1;
+                uint32_t refs = hdr->refs.load(std::memory_order_relaxed);
+                do {
+                    if (refs == 0) { // Free, or its last reference is being dropped right now
+                        return nullptr;
+                    }
+                } while (!hdr->refs.compare_exchange_weak(refs, refs + 1, std::memory_order_relaxed));
+                return hdr;
+            }
+        };
+
+        GlobalPacketPool &globalPool() {
+            // Function-local so that it is constructed before, and destroyed after, every thread's cache.
+            static GlobalPacketPool pool;
+            return pool;
+        }
+
+        /// Per-thread free lists. Returned to the global pool when the thread exits.
+        struct PacketThreadCache {
+            std::vector<_stms_PacketHeader *> freeList[numSizeClasses];
+
+            PacketThreadCache() {
+                globalPool();
+            }
+
+            ~PacketThreadCache() {
+                for (unsigned cls = 0; cls < numSizeClasses; cls++) {
+                    globalPool().give(cls, freeList[cls].data(), freeList[cls].size());
+                }
+            }
+
+            _stms_PacketHeader *pop(unsigned cls) {
+                auto &list = freeList[cls];
+                if (list.empty()) {
+                    globalPool().take(cls, list, packetPoolThreadCache / 2 + 1);
+                }
+
+                auto *ret = list.back();
+                list.pop_back();
+                return ret;
+            }
+
+            void push(_stms_PacketHeader *hdr) {
+                auto &list = freeList[hdr->sizeClass];
+                list.emplace_back(hdr);
+
+                if (list.size() > packetPoolThreadCache) {
+                    // Buffers that are received on one thread and released on another accumulate here, so give half
+                    // of them back for the other threads to use.
+                    std::size_t half = list.size() / 2;
+                    globalPool().give(hdr->sizeClass, list.data() + list.size() - half, half);
+                    list.resize(list.size() - half);
+                }
+            }
+        };
+
+        PacketThreadCache &threadCache() {
+            thread_local PacketThreadCache cache;
+            return cache;
+        }
+    }
+
+    PacketBuffer::PacketBuffer(const PacketBuffer &rhs) noexcept : hdr(rhs.hdr) {
+        if (hdr != nullptr) {
+            hdr->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    PacketBuffer &PacketBuffer::operator=(const PacketBuffer &rhs) noexcept {
+        if (this == &rhs || hdr == rhs.hdr) {
+            return *this;
+        }
+
+        release();
+        hdr = rhs.hdr;
+        if (hdr != nullptr) {
+            hdr->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+        return *this;
+    }
+
+    PacketBuffer::PacketBuffer(PacketBuffer &&rhs) noexcept : hdr(rhs.hdr) {
+        rhs.hdr = nullptr;
+    }
+
+    PacketBuffer &PacketBuffer::operator=(PacketBuffer &&rhs) noexcept {
+        if (this == &rhs) {
+            return *this;
+        }
+
+        release();
+        hdr = rhs.hdr;
+        rhs.hdr = nullptr;
+        return *this;
+    }
+
+    void PacketBuffer::release() {
+        if (hdr == nullptr) {
+            return;
+        }
+
+        if (hdr->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            if (hdr->sizeClass == packetHeapClass) {
+                globalPool().removeHeapBuffer(hdr);
+                hdr->~_stms_PacketHeader();
+                delete[] reinterpret_cast<uint8_t *>(hdr);
+            } else {
+                threadCache().push(hdr);
+            }
+        }
+        hdr = nullptr;
+    }
+
+    PacketBuffer PacketBuffer::alloc(std::size_t capacity) {
+        _stms_PacketHeader *hdr;
+        if (capacity > packetPoolMaxSize) {
+            hdr = new (new uint8_t[sizeof(_stms_PacketHeader) + capacity]) _stms_PacketHeader{};
+            hdr->capacity = static_cast<uint32_t>(capacity);
+            hdr->sizeClass = packetHeapClass;
+            hdr->refs.store(1, std::memory_order_relaxed);
+            globalPool().addHeapBuffer(hdr);
+        } else {
+            hdr = threadCache().pop(sizeClassOf(capacity));
+        }
+
+        hdr->refs.store(1, std::memory_order_relaxed);
+        hdr->size = static_cast<uint32_t>(capacity);
+        return PacketBuffer(hdr);
+    }
+
+    PacketBuffer PacketBuffer::copyOf(const uint8_t *src, std::size_t len) {
+        PacketBuffer ret = alloc(len);
+        std::copy(src, src + len, ret.data());
+        return ret;
+    }
+
+    PacketBuffer PacketBuffer::retain(const uint8_t *data) {
+        if (data == nullptr) {
+            return PacketBuffer();
+        }
+
+        return PacketBuffer(globalPool().retain(data));
+    }
+}
@@ -0,0 +1,780 @@
+//
+// Created by grant on 4/22/21.
+//
+
+#include "stms/net/plain_tcp.hpp"
+#include "stms/logging.hpp"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <cstring>
+#include <numeric>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#ifdef __linux__
+#   include <sys/epoll.h>
+#endif
+
+namespace stms {
+#ifdef __linux__
+    /// Client sockets are one-shot, so each is drained by at most 1 task and re-armed once it's empty.
+    static constexpr uint32_t tcpClientEvents = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+#endif
+
+    /**
+     * @brief Set `TCP_CORK` (or `TCP_NOPUSH` on BSDs) on a socket.
+     * @param fd Socket to cork
+     * @param cork If true, cork. Otherwise, uncork, which flushes any partial segment.
+     * @return False if it failed or isn't supported on this platform.
+     */
+    static bool corkSocket(int fd, bool cork) {
+        int val = cork ? 1 : 0;
+#if defined(TCP_CORK)
+        if (setsockopt(fd, IPPROTO_TCP, TCP_CORK, &val, sizeof(val)) == 0) {
+            return true;
+        }
+#elif defined(TCP_NOPUSH)
+        if (setsockopt(fd, IPPROTO_TCP, TCP_NOPUSH, &val, sizeof(val)) == 0) {
+            return true;
+        }
+#else
+        errno = ENOTSUP;
+#endif
+        STMS_WARN("Failed to {} socket: {}", cork ? "cork" : "uncork", strerror(errno));
+        return false;
+    }
+
+    /// Set `TCP_NODELAY` on a socket, logging failures.
+    static void setSocketNoDelay(int fd) {
+        int on = 1;
+        if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) == -1) {
+            STMS_WARN("Failed to set TCP_NODELAY: {}", strerror(errno));
+        }
+    }
+
+    TCPConnection::~TCPConnection() {
+        {
+            std::lock_guard<std::mutex> lg(sendMtx);
+            failPendingSends(-1);
+        }
+
+        if (sock != -1 && close(sock) == -1) {
+            STMS_WARN("Failed to close TCP socket: {}", strerror(errno));
+        }
+    }
+
+    void TCPConnection::failPendingSends(int code) {
+        for (auto &pending : sendQueue) {
+            pending.prom->set_value(code);
+        }
+        sendQueue.clear();
+        queuedBytes = 0;
+        frontWritten = 0;
+    }
+
+    bool TCPConnection::queue(const iovec *iov, std::size_t iovCnt, bool copy, std::size_t high,
+                              const std::shared_ptr<std::promise<int>> &prom) {
+        std::size_t len = std::accumulate(iov, iov + iovCnt, std::size_t{0}, [](std::size_t sum, const iovec &part) {
+            return sum + part.iov_len;
+        });
+
+        PendingWrite pending;
+        pending.len = len;
+        pending.prom = prom;
+        if (copy) { // Copy outside of the lock
+            pending.buf = PacketBuffer::alloc(len);
+            uint8_t *dst = pending.buf.data();
+            for (std::size_t i = 0; i < iovCnt; i++) {
+                dst = std::copy(static_cast<const uint8_t *>(iov[i].iov_base),
+                                static_cast<const uint8_t *>(iov[i].iov_base) + iov[i].iov_len, dst);
+            }
+            pending.iov = iovec{pending.buf.data(), len};
+        } else if (iovCnt == 1) {
+            pending.iov = iov[0];
+        } else {
+            pending.iovs.assign(iov, iov + iovCnt);
+        }
+
+        std::lock_guard<std::mutex> lg(sendMtx);
+        if (queuedBytes > 0 && queuedBytes + len > high) {
+            wantWritable = true;
+            prom->set_value(-4);
+            return false;
+        }
+
+        sendQueue.emplace_back(std::move(pending));
+        queuedBytes += len;
+        if (writerActive) {
+            return false; // The active writer picks it up before it exits.
+        }
+        writerActive = true;
+        return true;
+    }
+
+    int TCPConnection::writeQueued(unsigned ioTimeoutMs, int maxTimeouts, std::size_t low,
+                                   const std::function<void()> &onWritable) {
+        iovec batch[tcpWriteBatch];
+        int numTimeouts = 0;
+
+        while (true) {
+            std::size_t numIovs = 0;
+            {
+                std::unique_lock<std::mutex> lg(sendMtx);
+                if (sendQueue.empty()) {
+                    writerActive = false;
+                    return 0;
+                }
+
+                // Gather as much of the queue as fits, skipping what a previous short write already sent.
+                // Entries are only popped by this thread, so their buffers stay valid after unlocking.
+                std::size_t skip = frontWritten;
+                for (const auto &pending : sendQueue) {
+                    const iovec *parts = pending.iovs.empty() ? &pending.iov : pending.iovs.data();
+                    std::size_t numParts = pending.iovs.empty() ? 1 : pending.iovs.size();
+                    for (std::size_t i = 0; i < numParts && numIovs < tcpWriteBatch; i++) {
+                        if (skip >= parts[i].iov_len) {
+                            skip -= parts[i].iov_len;
+                            continue;
+                        }
+
+                        batch[numIovs].iov_base = static_cast<uint8_t *>(parts[i].iov_base) + skip;
+                        batch[numIovs].iov_len = parts[i].iov_len - skip;
+                        skip = 0;
+                        numIovs++;
+                    }
+
+                    if (numIovs >= tcpWriteBatch) {
+                        break;
+                    }
+                }
+            }
+
+            ssize_t sent = 0;
+            if (numIovs > 0) {
+                msghdr hdr{};
+                hdr.msg_iov = batch;
+                hdr.msg_iovlen = numIovs;
+                sent = sendmsg(sock, &hdr, MSG_NOSIGNAL);
+            }
+
+            if (sent == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                int code = -2;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    pollfd params{};
+                    params.fd = sock;
+                    params.events = POLLOUT;
+                    if (poll(&params, 1, static_cast<int>(ioTimeoutMs < minIoTimeout ? minIoTimeout : ioTimeoutMs)) > 0
+                        || ++numTimeouts < maxTimeouts) {
+                        continue;
+                    }
+
+                    STMS_WARN("TCP sendmsg() to {} timed out completely!", addrStr);
+                    code = -3;
+                } else {
+                    STMS_WARN("TCP sendmsg() to {} failed: {}", addrStr, strerror(errno));
+                }
+
+                std::lock_guard<std::mutex> lg(sendMtx);
+                failPendingSends(code);
+                writerActive = false;
+                return code;
+            }
+            numTimeouts = 0;
+
+            bool notifyWritable = false;
+            {
+                std::lock_guard<std::mutex> lg(sendMtx);
+                auto left = static_cast<std::size_t>(sent);
+                while (!sendQueue.empty()) {
+                    std::size_t remaining = sendQueue.front().len - frontWritten;
+                    if (left < remaining) {
+                        frontWritten += left;
+                        queuedBytes -= left;
+                        break;
+                    }
+
+                    left -= remaining;
+                    queuedBytes -= remaining;
+                    frontWritten = 0;
+                    sendQueue.front().prom->set_value(static_cast<int>(sendQueue.front().len));
+                    sendQueue.pop_front();
+                }
+
+                if (wantWritable && queuedBytes <= low) {
+                    wantWritable = false;
+                    notifyWritable = true;
+                }
+            }
+
+            if (notifyWritable) {
+                onWritable();
+            }
+        }
+    }
+
+    TCPServer::TCPServer(stms::PoolLike *pool) : _stms_PlainBase(true, pool, false) {}
+
+    TCPServer::~TCPServer() {
+        if (running) {
+            STMS_ERROR("TCPServer destroyed whilst it was still running! Stopping it now...");
+            stop();
+        }
+    }
+
+    void TCPServer::onStart() {
+        readyEvents.clear();
+        loop = std::make_unique<EventLoop>();
+#ifdef __linux__
+        if (loop->isValid() && loop->add(sock, EPOLLIN)) {
+            return;
+        }
+#endif
+
+        STMS_WARN("epoll is unavailable! TCPServer falling back to poll()");
+        loop.reset();
+    }
+
+    void TCPServer::onStop() {
+        std::vector<std::pair<UUID, std::shared_ptr<TCPConnection>>> toDrop;
+        {
+            std::lock_guard<std::mutex> lg(clientsMtx);
+            clients.forEach([&](const UUID &uuid, const std::shared_ptr<TCPConnection> &cli) {
+                toDrop.emplace_back(uuid, cli);
+            });
+
+            for (const auto &pair : toDrop) {
+                dropClient(pair.first, pair.second);
+            }
+        }
+
+        for (const auto &pair : toDrop) {
+            disconnectCallback(pair.first, reinterpret_cast<sockaddr *>(&pair.second->addr));
+        }
+
+        {
+            std::lock_guard<std::mutex> lg(deadMtx);
+            deadClients = std::queue<UUID>();
+        }
+        loop.reset();
+    }
+
+    void TCPServer::acceptClients() {
+        while (running) {
+            auto cli = std::make_shared<TCPConnection>();
+            cli->addrLen = sizeof(sockaddr_storage);
+#ifdef __linux__
+            int fd = accept4(sock, reinterpret_cast<sockaddr *>(&cli->addr), &cli->addrLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+            int fd = accept(sock, reinterpret_cast<sockaddr *>(&cli->addr), &cli->addrLen);
+            if (fd != -1 && fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+                STMS_WARN("Failed to set client socket to non-blocking: {}", strerror(errno));
+            }
+#endif
+            if (fd == -1) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    STMS_WARN("accept() failed: {}", strerror(errno));
+                }
+                return;
+            }
+
+            cli->sock = fd;
+            cli->addrStr = getAddrStr(reinterpret_cast<sockaddr *>(&cli->addr));
+            cli->touch();
+            if (framedRecvCallback) {
+                cli->framer = std::make_unique<MessageFramer>(maxFramedLen);
+            }
+            if (noDelay) {
+                setSocketNoDelay(fd);
+            }
+
+            UUID uuid(UUIDType::eUuid4);
+            {
+                std::lock_guard<std::mutex> lg(clientsMtx);
+                clients.insert(uuid, cli);
+                fdClients[fd] = uuid;
+#ifdef __linux__
+                if (loop && !loop->add(fd, tcpClientEvents)) {
+                    STMS_WARN("Failed to add client {} to the event loop! It won't be read from.", cli->addrStr);
+                }
+#endif
+            }
+
+            STMS_INFO("Client (addr='{}', uuid='{}') connected", cli->addrStr, uuid.buildStr());
+            connectCallback(uuid, reinterpret_cast<sockaddr *>(&cli->addr));
+        }
+    }
+
+    void TCPServer::dispatchRead(const std::shared_ptr<TCPConnection> &cli, const UUID &uuid) {
+        uint8_t expected = 0;
+        if (!cli->readState.compare_exchange_strong(expected, 1)) {
+            return; // A task is already draining this client.
+        }
+
+        // lambda captures validated
+        pPool->submitTask([&, capCli = std::shared_ptr<TCPConnection>(cli), capUuid = UUID{uuid}]() {
+            this->drainClient(capCli, capUuid);
+        });
+    }
+
+    void TCPServer::drainClient(const std::shared_ptr<TCPConnection> &cli, const UUID &uuid) {
+        PacketBuffer recvBuf = PacketBuffer::alloc(maxPlainRecvLen);
+        int numReads = 0;
+
+        while (running) {
+            if (recvBuf.useCount() > 1) {
+                recvBuf = PacketBuffer::alloc(maxPlainRecvLen); // The callback kept the last one with `PacketBuffer::retain`
+            }
+
+            auto target = cli->framer ? cli->framer->writeSpan() : std::make_pair(recvBuf.data(), std::size_t{maxPlainRecvLen});
+            ssize_t got = recv(cli->sock, target.first, target.second, 0);
+            if (got > 0) {
+                cli->touch();
+                if (!cli->framer) {
+                    recvBuf.setSize(static_cast<std::size_t>(got));
+                    recvCallback(uuid, reinterpret_cast<sockaddr *>(&cli->addr), recvBuf.data(), static_cast<int>(got));
+                } else if (!cli->framer->commit(static_cast<std::size_t>(got), [&](uint8_t *msg, std::size_t msgLen) {
+                    framedRecvCallback(uuid, reinterpret_cast<sockaddr *>(&cli->addr), msg, static_cast<int>(msgLen));
+                })) {
+                    STMS_WARN("Client {} sent a message longer than {} bytes! Dropping connection!", uuid.buildStr(), maxFramedLen);
+                    markDead(uuid);
+                    return;
+                }
+
+                if (++numReads >= reactorMaxReadsPerTask) {
+                    // Don't hog this worker. `readState` stays set, so no other task will be started meanwhile.
+                    // lambda captures validated
+                    pPool->submitTask([&, capCli = std::shared_ptr<TCPConnection>(cli), capUuid = UUID{uuid}]() {
+                        this->drainClient(capCli, capUuid);
+                    });
+                    return;
+                }
+                continue;
+            }
+
+            if (got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                cli->readState = 0;
+#ifdef __linux__
+                if (loop) {
+                    loop->modify(cli->sock, tcpClientEvents);
+                }
+#endif
+                return;
+            }
+
+            if (got == -1 && errno == EINTR) {
+                continue;
+            }
+
+            if (got == 0) {
+                STMS_INFO("Client {} closed the connection", uuid.buildStr());
+            } else {
+                STMS_WARN("recv() from client {} failed: {}", uuid.buildStr(), strerror(errno));
+            }
+
+            // `readState` is left set, so that no more reads are dispatched to this client before it's reaped.
+            markDead(uuid);
+            return;
+        }
+    }
+
+    void TCPServer::flushClient(const std::shared_ptr<TCPConnection> &cli, const UUID &uuid) {
+        int ret = cli->writeQueued(timeoutMs, maxTimeouts, lowWatermark, [&]() {
+            writableCallback(uuid);
+        });
+
+        if (ret < 0) {
+            markDead(uuid);
+        }
+    }
+
+    void TCPServer::markDead(const UUID &uuid) {
+        std::lock_guard<std::mutex> lg(deadMtx);
+        deadClients.push(uuid);
+    }
+
+    void TCPServer::dropClient(const UUID &uuid, const std::shared_ptr<TCPConnection> &cli) {
+        clients.erase(uuid);
+        fdClients.erase(cli->sock);
+#ifdef __linux__
+        if (loop) {
+            loop->remove(cli->sock);
+        }
+#endif
+
+        // Tasks still holding `cli` may be using the fd, so it's only closed once they let go of it.
+        // Shutting it down makes their `recv` & `sendmsg` calls return right away.
+        shutdown(cli->sock, SHUT_RDWR);
+        std::lock_guard<std::mutex> lg(cli->sendMtx);
+        cli->failPendingSends(-1);
+    }
+
+    bool TCPServer::setCork(const UUID &cli, bool cork) {
+        std::shared_ptr<TCPConnection> cliObj;
+        if (!clients.find(cli, cliObj)) {
+            return false;
+        }
+        return corkSocket(cliObj->sock, cork);
+    }
+
+    std::size_t TCPServer::getQueuedBytes(const UUID &cli) {
+        std::shared_ptr<TCPConnection> cliObj;
+        if (!clients.find(cli, cliObj)) {
+            return 0;
+        }
+
+        std::lock_guard<std::mutex> lg(cliObj->sendMtx);
+        return cliObj->queuedBytes;
+    }
+
+    UUID TCPServer::refreshUuid(const UUID &client) {
+        UUID newUuid(UUIDType::eUuid4);
+
+        if (!setNewUuid(client, newUuid)) {
+            return UUID{}; // return empty uuid as the client doesnt exist
+        }
+
+        return newUuid;
+    }
+
+    bool TCPServer::setNewUuid(const UUID &old, const UUID &newUuid) {
+        std::lock_guard<std::mutex> lg(clientsMtx);
+        std::shared_ptr<TCPConnection> cli;
+        if (!clients.find(old, cli) || !clients.rekey(old, newUuid)) {
+            STMS_WARN("Requested uuid edit {} -> {} failed: Client non-existent.", old.buildStr(), newUuid.buildStr());
+            return false;
+        }
+
+        fdClients[cli->sock] = newUuid;
+        return true;
+    }
+
+    std::vector<UUID> TCPServer::getClientUuids() {
+        std::vector<UUID> ret;
+        ret.reserve(clients.size());
+        clients.forEach([&](const UUID &uuid, const std::shared_ptr<TCPConnection> &) {
+            ret.emplace_back(uuid);
+        });
+        return ret;
+    }
+
+    bool TCPServer::hasClient(const UUID &cli) {
+        return clients.contains(cli);
+    }
+
+    void TCPServer::kickClient(const UUID &cliId) {
+        if (!clients.contains(cliId)) {
+            STMS_WARN("TCPServer::kickClient() called with invalid client uuid '{}'. Ignoring!", cliId.buildStr());
+            return;
+        }
+
+        markDead(cliId);
+    }
+
+    std::future<int> TCPServer::sendv(const UUID &clientUuid, const iovec *iov, std::size_t iovCnt, bool cpy) {
+        std::shared_ptr<std::promise<int>> prom = std::make_shared<std::promise<int>>();
+        if (!running) {
+            STMS_ERROR("TCPServer::send() called when stopped! Dropping message!");
+            prom->set_value(-1);
+            return prom->get_future();
+        }
+
+        std::shared_ptr<TCPConnection> cli;
+        if (!clients.find(clientUuid, cli)) {
+            STMS_ERROR("TCPServer::send() called with invalid client uuid '{}'. Dropping message!", clientUuid.buildStr());
+            prom->set_value(0);
+            return prom->get_future();
+        }
+
+        if (cli->queue(iov, iovCnt, cpy, highWatermark, prom)) {
+            // lambda captures validated
+            pPool->submitTask([&, capCli = std::shared_ptr<TCPConnection>(cli), capUuid = UUID{clientUuid}]() {
+                this->flushClient(capCli, capUuid);
+            });
+        }
+
+        return prom->get_future();
+    }
+
+    void TCPServer::waitEvents(int toMs) {
+        if (loop) {
+            // Don't block if there are still unhandled events from a previous call.
+            loop->wait(readyEvents.empty() ? toMs : 0, readyEvents);
+            return;
+        }
+
+        std::vector<pollfd> toPoll;
+        toPoll.reserve(getNumClients() + 1);
+
+        pollfd servPollFd{};
+        servPollFd.events = POLLIN;
+        servPollFd.fd = sock;
+        toPoll.emplace_back(servPollFd);
+
+        clients.forEach([&](const UUID &, const std::shared_ptr<TCPConnection> &c) {
+            if (c->readState == 0) { // Clients being drained would just wake us up again
+                pollfd cliPollFd{};
+                cliPollFd.events = POLLIN;
+                cliPollFd.fd = c->sock;
+                toPoll.push_back(cliPollFd);
+            }
+        });
+
+        if (poll(toPoll.data(), toPoll.size(), toMs) < 1) {
+            return;
+        }
+
+        for (const auto &pfd : toPoll) {
+            if (pfd.revents != 0) {
+                readyEvents.emplace_back(FDEvent{pfd.fd, static_cast<uint32_t>(pfd.revents)});
+            }
+        }
+    }
+
+    bool TCPServer::tick() {
+        if (!running) {
+            STMS_WARN("TCPServer::tick() called when stopped! Ignoring invocation!");
+            return false;
+        }
+
+        for (const auto &event : readyEvents) {
+            if (event.fd == sock) {
+                acceptClients();
+                continue;
+            }
+
+            UUID uuid;
+            {
+                std::lock_guard<std::mutex> lg(clientsMtx);
+                auto it = fdClients.find(event.fd);
+                if (it == fdClients.end()) {
+                    continue; // Dropped after the event was reported.
+                }
+                uuid = it->second;
+            }
+
+            // Hang-ups and errors are also handled by the read task, as `recv` reports them.
+            std::shared_ptr<TCPConnection> cli;
+            if (clients.find(uuid, cli)) {
+                dispatchRead(cli, uuid);
+            }
+        }
+        readyEvents.clear();
+
+        if (timeoutMs > 0) {
+            clients.forEach([&](const UUID &uuid, const std::shared_ptr<TCPConnection> &cli) {
+                if (cli->isIdleFor(timeoutMs)) {
+                    STMS_INFO("Client {} timed out! Dropping connection!", uuid.buildStr());
+                    markDead(uuid);
+                }
+            });
+        }
+
+        std::queue<UUID> toReap;
+        {
+            std::lock_guard<std::mutex> lg(deadMtx);
+            std::swap(toReap, deadClients);
+        }
+
+        while (!toReap.empty()) {
+            UUID uuid = toReap.front();
+            toReap.pop();
+
+            std::shared_ptr<TCPConnection> cli;
+            {
+                std::lock_guard<std::mutex> lg(clientsMtx);
+                if (!clients.find(uuid, cli)) {
+                    continue; // Already reaped
+                }
+                dropClient(uuid, cli);
+            }
+
+            STMS_INFO("Client (addr='{}', uuid='{}') disconnected", cli->addrStr, uuid.buildStr());
+            disconnectCallback(uuid, reinterpret_cast<sockaddr *>(&cli->addr));
+        }
+
+        return running;
+    }
+
+    TCPClient::TCPClient(stms::PoolLike *pool) : _stms_PlainBase(false, pool, false) {}
+
+    TCPClient::~TCPClient() {
+        if (running) {
+            STMS_ERROR("TCPClient destroyed whilst it was still running! Stopping it now...");
+            stop();
+        }
+    }
+
+    void TCPClient::onStart() {
+        peerClosed = false;
+        if (noDelay) {
+            setSocketNoDelay(sock);
+        }
+
+        auto newConn = std::make_shared<TCPConnection>();
+        newConn->sock = sock;
+        newConn->addrStr = addrStr;
+        newConn->addrLen = static_cast<socklen_t>(pAddr->ai_addrlen);
+        std::copy(reinterpret_cast<const uint8_t *>(pAddr->ai_addr),
+                  reinterpret_cast<const uint8_t *>(pAddr->ai_addr) + pAddr->ai_addrlen,
+                  reinterpret_cast<uint8_t *>(&newConn->addr));
+        newConn->touch();
+        if (framedRecvCallback) {
+            newConn->framer = std::make_unique<MessageFramer>(maxFramedLen);
+        }
+        std::atomic_store(&conn, newConn);
+
+        STMS_INFO("Connected to server at {}", addrStr);
+    }
+
+    void TCPClient::onStop() {
+        std::shared_ptr<TCPConnection> oldConn = std::atomic_exchange(&conn, std::shared_ptr<TCPConnection>());
+        if (!oldConn) {
+            return;
+        }
+
+        // The connection owns the fd from here on, and closes it once no task is using it anymore.
+        shutdown(oldConn->sock, SHUT_RDWR);
+        sock = 0;
+
+        std::lock_guard<std::mutex> lg(oldConn->sendMtx);
+        oldConn->failPendingSends(-1);
+    }
+
+    void TCPClient::drain(const std::shared_ptr<TCPConnection> &c) {
+        PacketBuffer recvBuf = PacketBuffer::alloc(maxPlainRecvLen);
+
+        for (int numReads = 0; numReads < reactorMaxReadsPerTask; numReads++) {
+            if (recvBuf.useCount() > 1) {
+                recvBuf = PacketBuffer::alloc(maxPlainRecvLen); // The callback kept the last one with `PacketBuffer::retain`
+            }
+
+            auto target = c->framer ? c->framer->writeSpan() : std::make_pair(recvBuf.data(), std::size_t{maxPlainRecvLen});
+            ssize_t got = recv(c->sock, target.first, target.second, 0);
+            if (got > 0) {
+                c->touch();
+                if (!c->framer) {
+                    recvBuf.setSize(static_cast<std::size_t>(got));
+                    recvCallback(recvBuf.data(), static_cast<std::size_t>(got));
+                } else if (!c->framer->commit(static_cast<std::size_t>(got), framedRecvCallback)) {
+                    STMS_WARN("Server sent a message longer than {} bytes! Dropping connection!", maxFramedLen);
+                    peerClosed = true;
+                    return;
+                }
+                continue;
+            }
+
+            if (got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                break;
+            }
+
+            if (got == 0) {
+                STMS_INFO("Server at {} closed the connection", c->addrStr);
+            } else {
+                STMS_WARN("recv() from server at {} failed: {}", c->addrStr, strerror(errno));
+            }
+            peerClosed = true; // `readState` stays set, so that no more reads are started before `tick` stops.
+            return;
+        }
+
+        c->readState = 0;
+    }
+
+    void TCPClient::flush(const std::shared_ptr<TCPConnection> &c) {
+        if (c->writeQueued(timeoutMs, maxTimeouts, lowWatermark, writableCallback) < 0) {
+            peerClosed = true;
+        }
+    }
+
+    bool TCPClient::setCork(bool cork) {
+        std::shared_ptr<TCPConnection> c = std::atomic_load(&conn);
+        return c && corkSocket(c->sock, cork);
+    }
+
+    std::size_t TCPClient::getQueuedBytes() {
+        std::shared_ptr<TCPConnection> c = std::atomic_load(&conn);
+        if (!c) {
+            return 0;
+        }
+
+        std::lock_guard<std::mutex> lg(c->sendMtx);
+        return c->queuedBytes;
+    }
+
+    std::future<int> TCPClient::sendv(const iovec *iov, std::size_t iovCnt, bool copy) {
+        std::shared_ptr<std::promise<int>> prom = std::make_shared<std::promise<int>>();
+        std::shared_ptr<TCPConnection> c = std::atomic_load(&conn);
+        if (!running || !c) {
+            STMS_ERROR("TCPClient::send called when not connected! Message dropped!");
+            prom->set_value(-1);
+            return prom->get_future();
+        }
+
+        if (c->queue(iov, iovCnt, copy, highWatermark, prom)) {
+            // lambda captures validated
+            pPool->submitTask([&, capConn{c}]() {
+                this->flush(capConn);
+            });
+        }
+
+        return prom->get_future();
+    }
+
+    void TCPClient::waitEvents(int pollTimeoutMs) {
+        pollfd servPollFd{};
+        servPollFd.events = POLLIN;
+        servPollFd.fd = sock;
+
+        poll(&servPollFd, 1, pollTimeoutMs);
+    }
+
+    bool TCPClient::tick() {
+        if (!running) {
+            STMS_WARN("TCPClient::tick() called when stopped! Ignoring invocation!");
+            return false;
+        }
+
+        if (peerClosed) {
+            stop();
+            return false;
+        }
+
+        std::shared_ptr<TCPConnection> c = std::atomic_load(&conn);
+        if (!c) {
+            return false; // Stopped by a send task or another thread
+        }
+
+        if (timeoutMs > 0 && c->isIdleFor(timeoutMs)) {
+            STMS_INFO("Connection to server timed out! Dropping connection!");
+            stop();
+            return false;
+        }
+
+        if (c->readState != 0) {
+            return running; // The read task will pick up anything that arrives while it's running.
+        }
+
+        uint8_t peekByte;
+        if (recv(sock, &peekByte, 1, MSG_PEEK | MSG_DONTWAIT) == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return running; // No data could be read
+        }
+
+        c->readState = 1;
+        // lambda captures validated
+        pPool->submitTask([&, capConn{c}]() {
+            this->drain(capConn);
+        });
+
+        return running;
+    }
+}
@@ -2,9 +2,82 @@
 
 #include <sys/socket.h>
 #include <poll.h>
+#include <numeric>
 #include "stms/logging.hpp"
+#include "stms/util/timers.hpp"
+
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#   include <netinet/in.h>
+#   include <linux/errqueue.h>
+#   define STMS_ZEROCOPY_SUPPORTED //!< Defined if sockets support `MSG_ZEROCOPY`
+#endif
+
+#if !defined(__linux__) && !defined(__FreeBSD__)
+namespace {
+    // Platforms without `recvmmsg`/`sendmmsg` get a loop of `recvmsg`/`sendmsg` instead.
+    struct mmsghdr {
+        msghdr msg_hdr;
+        unsigned msg_len;
+    };
+
+    int recvmmsg(int fd, mmsghdr *msgs, unsigned num, int flags, timespec *) {
+        unsigned i = 0;
+        for (; i < num; i++) {
+            ssize_t r = recvmsg(fd, &msgs[i].msg_hdr, flags);
+            if (r == -1) {
+                break;
+            }
+            msgs[i].msg_len = static_cast<unsigned>(r);
+        }
+        return i == 0 ? -1 : static_cast<int>(i);
+    }
+
+    int sendmmsg(int fd, mmsghdr *msgs, unsigned num, int flags) {
+        unsigned i = 0;
+        for (; i < num; i++) {
+            ssize_t r = sendmsg(fd, &msgs[i].msg_hdr, flags);
+            if (r == -1) {
+                break;
+            }
+            msgs[i].msg_len = static_cast<unsigned>(r);
+        }
+        return i == 0 ? -1 : static_cast<int>(i);
+    }
+}
+#endif
 
 namespace stms {
+    // `sendmmsg`, but through a `NetImpairment`, one datagram at a time.
+    static int impairedSendmmsg(NetImpairment &imp, int fd, mmsghdr *msgs, unsigned num) {
+        unsigned i = 0;
+        for (; i < num; i++) {
+            ssize_t r = imp.sendmsg(fd, &msgs[i].msg_hdr, 0);
+            if (r == -1) {
+                break;
+            }
+            msgs[i].msg_len = static_cast<unsigned>(r);
+        }
+        return i == 0 && num > 0 ? -1 : static_cast<int>(i);
+    }
+
+    /// A batch of datagrams for `UDPPeer::sendToMany`. Everything `sendmmsg` reads must live until it completes.
+    struct MMsgSendReq {
+        std::vector<mmsghdr> hdrs; //!< One header per datagram
+        std::vector<iovec> iovs; //!< One iovec per datagram
+        std::vector<sockaddr_storage> addrs; //!< Copies of the destination addresses
+        PacketBuffer data; //!< Copy of all the data, if `copy` was true
+    };
+
+    /// A single `sendmsg` from `UDPPeer::sendToV`. Everything the kernel reads must live until it completes.
+    struct UDPSendReq {
+        msghdr hdr{}; //!< Message header passed to `sendmsg`
+        iovec iov{}; //!< Single iovec pointing at the data, if there's only 1 buffer (or it was copied)
+        std::vector<iovec> iovs; //!< Copy of the caller's iovecs, if there's more than 1 buffer
+        sockaddr_storage addr{}; //!< Copy of the destination address
+        PacketBuffer buf; //!< Copy of the data to send, if `copy` was true
+        std::shared_ptr<std::promise<int>> prom; //!< Promise to fulfil on completion
+    };
+
     UDPPeer::UDPPeer(bool is, PoolLike *p) : _stms_PlainBase(is, p, true) {};
 
     UDPPeer::UDPPeer(UDPPeer &&rhs) noexcept {
@@ -18,90 +91,472 @@ namespace stms {
         
         isReading = rhs.isReading;
         recvCallback = rhs.recvCallback;
+        batchRecvCallback = rhs.batchRecvCallback;
+        uringRecvHdr = rhs.uringRecvHdr;
+        uringRecvArmed = rhs.uringRecvArmed;
+        uringSendsInFlight = rhs.uringSendsInFlight.load();
+        zeroCopy = rhs.zeroCopy;
+        zeroCopyMin = rhs.zeroCopyMin;
+        zeroCopyActive = rhs.zeroCopyActive;
+        zeroCopySeq = rhs.zeroCopySeq;
+        zeroCopyPending = std::move(rhs.zeroCopyPending);
+        zeroCopyCopied = rhs.zeroCopyCopied.load();
+        metrics.copyFrom(rhs.metrics);
         movePlain(&rhs);
 
         return *this;
     }
 
+    void UDPPeer::onStart() {
+        uringRecvArmed = false;
+        zeroCopyActive = false;
+        zeroCopySeq = 0; // Each socket counts `MSG_ZEROCOPY` sends from 0
+        if (ioBackend != IOBackend::eIOUring) {
+            if (zeroCopy) {
+#ifdef STMS_ZEROCOPY_SUPPORTED
+                int on = 1;
+                zeroCopyActive = setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0;
+                if (!zeroCopyActive) {
+                    STMS_WARN("Failed to enable SO_ZEROCOPY: {}. Large sends will be copied.", strerror(errno));
+                }
+#else
+                STMS_WARN("MSG_ZEROCOPY isn't supported on this platform! Large sends will be copied.");
+#endif
+            }
+            return;
+        }
+
+        uringRecvHdr = msghdr{};
+        uringRecvHdr.msg_namelen = sizeof(sockaddr_storage);
+
+        if (startUring(uringRecvBufs, uringRecvBufSize)) {
+            STMS_INFO("UDPPeer using io_uring with {} x {} byte receive buffers", uringRecvBufs, uringRecvBufSize);
+        } else {
+            STMS_WARN("io_uring is unavailable! UDPPeer falling back to IOBackend::ePoll");
+        }
+    }
+
+    void UDPPeer::onStop() {
+        if (zeroCopyActive) {
+            // The socket is about to be closed, so this is the last chance to find out when the kernel is done.
+            Stopwatch stopTimer;
+            stopTimer.start();
+            std::unique_lock<std::mutex> zcLg(zeroCopyMtx);
+            while (!zeroCopyPending.empty() && stopTimer.getTime() < static_cast<float>(maxStopBlock)) {
+                zcLg.unlock();
+                pollfd params{};
+                params.fd = sock;
+                poll(&params, 1, static_cast<int>(minIoTimeout)); // POLLERR is always reported
+                reapZeroCopy();
+                zcLg.lock();
+            }
+
+            if (!zeroCopyPending.empty()) {
+                STMS_ERROR("{} MSG_ZEROCOPY sends were never completed! Their buffers may still be in use.",
+                           zeroCopyPending.size());
+                for (auto &pending : zeroCopyPending) {
+                    pending.prom->set_value(-1);
+                }
+                zeroCopyPending.clear();
+            }
+        }
+
+        std::lock_guard<std::mutex> lg(uringMtx);
+        if (!uring) {
+            return;
+        }
+
+        // Cancel whatever we can and wait for the rest of the sends, so that none of the futures are left hanging.
+        if (uring->prepCancelAll(eUringCancel)) {
+            uring->submit();
+        }
+
+        Stopwatch stopTimer;
+        stopTimer.start();
+        std::vector<UringCompletion> comps;
+        while (uringSendsInFlight > 0 && stopTimer.getTime() < static_cast<float>(maxStopBlock)) {
+            uring->wait(static_cast<int>(minIoTimeout));
+
+            comps.clear();
+            uring->reap(comps);
+            for (const auto &c : comps) {
+                if (c.userData > eUringFdPoll) {
+                    completeUringSend(c);
+                } else if (IOUring::getBufId(c) >= 0) {
+                    uring->recycleBuf(static_cast<uint16_t>(IOUring::getBufId(c)));
+                }
+            }
+        }
+
+        if (uringSendsInFlight > 0) {
+            STMS_ERROR("{} io_uring sends never completed! Their futures will never be set!", uringSendsInFlight);
+        }
+    }
+
+    void UDPPeer::completeUringSend(const UringCompletion &c) {
+        auto *req = reinterpret_cast<UDPSendReq *>(c.userData);
+
+        if (c.res >= 0) {
+            metrics.addOut(static_cast<std::size_t>(c.res));
+            req->prom->set_value(c.res);
+        } else if (c.res == -ECANCELED) {
+            STMS_WARN("UDPPeer::sendTo() cancelled as the UDPPeer was stopped! Datagram dropped.");
+            req->prom->set_value(-1);
+        } else {
+            STMS_WARN("UDPPeer::sendTo() failed with errno {}: {}", -c.res, strerror(-c.res));
+            req->prom->set_value(-2);
+        }
+
+        delete req;
+        uringSendsInFlight--;
+    }
+
+    bool UDPPeer::tickUring() {
+        std::shared_ptr<IOUring> ring;
+        {
+            std::lock_guard<std::mutex> lg(uringMtx);
+            if (!uring) {
+                return false;
+            }
+
+            if (!uringRecvArmed) {
+                uringRecvArmed = uring->prepRecvMsgMultishot(0, true, &uringRecvHdr, eUringRecv);
+            }
+            ring = uring;
+        }
+
+        uringCompletions.clear();
+        reapUring(uringCompletions);
+
+        for (const auto &c : uringCompletions) {
+            if (c.userData != eUringRecv) {
+                completeUringSend(c);
+                continue;
+            }
+
+            if (!IOUring::hasMore(c)) {
+                uringRecvArmed = false; // Re-armed on the next tick.
+            }
+
+            if (c.res < 0) {
+                // ENOBUFS just means every buffer is still being processed by the read task.
+                if (c.res != -ENOBUFS) {
+                    STMS_WARN("io_uring recvmsg failed with errno {}: {}", -c.res, strerror(-c.res));
+                }
+                continue;
+            }
+
+            if (IOUring::getBufId(c) >= 0) {
+                uringRecvPending.emplace_back(c);
+            }
+        }
+
+        if (!uringRecvPending.empty() && !isReading) {
+            isReading = true;
+            pPool->submitTask([&, capThis{this}, capRing{ring}, capBatch{std::move(uringRecvPending)}]() {
+                capThis->recvMsgs.clear();
+                for (const auto &c : capBatch) {
+                    auto bid = static_cast<uint16_t>(IOUring::getBufId(c));
+
+                    sockaddr *addr;
+                    socklen_t addrLen;
+                    uint8_t *payload;
+                    std::size_t payloadLen;
+                    if (IOUring::parseRecvMsg(capRing->getBuf(bid), c.res, &capThis->uringRecvHdr, &addr, &addrLen,
+                                              &payload, &payloadLen)) {
+                        capThis->recvMsgs.emplace_back(UDPMessage{addr, addrLen, payload, static_cast<ssize_t>(payloadLen)});
+                    }
+                }
+
+                capThis->deliverBatch(capThis->recvMsgs.data(), capThis->recvMsgs.size());
+                for (const auto &c : capBatch) {
+                    capRing->recycleBuf(static_cast<uint16_t>(IOUring::getBufId(c)));
+                }
+
+                capThis->isReading = false;
+            });
+            uringRecvPending.clear();
+        }
+
+        return true;
+    }
+
+    int UDPPeer::recvBatch(int fd) {
+        if (recvBufs.empty()) {
+            recvBufs.resize(udpBatchSize);
+            recvAddrs.resize(udpBatchSize);
+        }
+
+        mmsghdr hdrs[udpBatchSize]{};
+        iovec iovs[udpBatchSize]{};
+        for (unsigned i = 0; i < udpBatchSize; i++) {
+            if (recvBufs[i].useCount() != 1) {
+                // Either it's the first read, or a callback kept the previous buffer with `PacketBuffer::retain`.
+                recvBufs[i] = PacketBuffer::alloc(maxPlainRecvLen);
+            }
+
+            iovs[i].iov_base = recvBufs[i].data();
+            iovs[i].iov_len = maxPlainRecvLen;
+            hdrs[i].msg_hdr.msg_iov = &iovs[i];
+            hdrs[i].msg_hdr.msg_iovlen = 1;
+            hdrs[i].msg_hdr.msg_name = &recvAddrs[i];
+            hdrs[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+        }
+
+        int num = recvmmsg(fd, hdrs, udpBatchSize, MSG_DONTWAIT, nullptr);
+        if (num == -1) {
+            return -1;
+        }
+
+        recvMsgs.clear();
+        for (int i = 0; i < num; i++) {
+            recvBufs[i].setSize(hdrs[i].msg_len);
+            recvMsgs.emplace_back(UDPMessage{reinterpret_cast<sockaddr *>(&recvAddrs[i]), hdrs[i].msg_hdr.msg_namelen,
+                                             static_cast<uint8_t *>(iovs[i].iov_base), static_cast<ssize_t>(hdrs[i].msg_len)});
+        }
+        return num;
+    }
+
+    ssize_t UDPPeer::sendZeroCopy(int fd, const UDPSendReq &req) {
+#ifdef STMS_ZEROCOPY_SUPPORTED
+        // The kernel numbers `MSG_ZEROCOPY` sends in the order they're made, so that has to match `zeroCopySeq`.
+        std::lock_guard<std::mutex> lg(zeroCopyMtx);
+        ssize_t sent = ::sendmsg(fd, &req.hdr, MSG_ZEROCOPY);
+        if (sent == -1 && errno == ENOBUFS) {
+            // Out of memory for pinning pages (see `optmem_max`). Fall back to a regular, copying send.
+            sent = ::sendmsg(fd, &req.hdr, 0);
+            if (sent != -1) {
+                req.prom->set_value(static_cast<int>(sent));
+            }
+            return sent;
+        }
+
+        if (sent != -1) {
+            zeroCopyPending.emplace_back(ZeroCopySend{zeroCopySeq++, static_cast<int>(sent), req.prom});
+        }
+        return sent;
+#else
+        ssize_t sent = ::sendmsg(fd, &req.hdr, 0);
+        if (sent != -1) {
+            req.prom->set_value(static_cast<int>(sent));
+        }
+        return sent;
+#endif
+    }
+
+    void UDPPeer::reapZeroCopy() {
+#ifdef STMS_ZEROCOPY_SUPPORTED
+        std::lock_guard<std::mutex> lg(zeroCopyMtx);
+        while (!zeroCopyPending.empty()) {
+            uint8_t control[CMSG_SPACE(sizeof(sock_extended_err) + sizeof(sockaddr_in6))];
+            msghdr msg{};
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+                return; // Nothing else has completed yet
+            }
+
+            for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+                    !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+                    continue;
+                }
+
+                auto *err = reinterpret_cast<sock_extended_err *>(CMSG_DATA(cmsg));
+                if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                    continue;
+                }
+
+                // Each notification completes the (wrapping) range of sends `ee_info` to `ee_data`.
+                uint32_t first = err->ee_info;
+                uint32_t span = err->ee_data - first;
+                uint32_t numCompleted = 0;
+                for (auto it = zeroCopyPending.begin(); it != zeroCopyPending.end();) {
+                    if (it->seq - first <= span) {
+                        it->prom->set_value(it->sent);
+                        it = zeroCopyPending.erase(it);
+                        numCompleted++;
+                    } else {
+                        ++it;
+                    }
+                }
+
+                if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                    zeroCopyCopied += numCompleted;
+                }
+            }
+        }
+#endif
+    }
+
+    void UDPPeer::deliverBatch(UDPMessage *msgs, std::size_t num) {
+        if (num == 0) {
+            return;
+        }
+
+        std::size_t bytes = 0;
+        for (std::size_t i = 0; i < num; i++) {
+            bytes += static_cast<std::size_t>(msgs[i].size);
+        }
+        metrics.addIn(bytes, num);
+
+        if (batchRecvCallback) {
+            batchRecvCallback(msgs, num);
+            return;
+        }
+
+        for (std::size_t i = 0; i < num; i++) {
+            recvCallback(msgs[i].addr, msgs[i].addrLen, msgs[i].data, msgs[i].size);
+        }
+    }
+
     bool UDPPeer::tick() {
         if (!running) {
             STMS_WARN("UDPPeer::tick() called when stopped! Ignoring invocation.");
             return false;
         }
 
+        if (ioBackend == IOBackend::eIOUring && tickUring()) {
+            return running;
+        }
+
+        if (zeroCopyActive) {
+            reapZeroCopy();
+        }
+
+        // Check `isReading` before peeking: A read task finishing in between could drain the data we peeked,
+        // leaving the next task waiting on an empty socket.
+        if (isReading) {
+            return running;
+        }
+
         if (recvfrom(sock, nullptr, 0, MSG_PEEK, nullptr, nullptr) == -1
              && (errno == EAGAIN || errno == EWOULDBLOCK)) {
             return running;  // No data could be read
         }
 
-        if (!isReading) {
-            isReading = true;
-            pPool->submitTask([&, capThis{this}, capSock{sock}]() {
-
-                int numTries = 0;
-                while (numTries < maxTimeouts) {
-                    numTries++;
-
-                    sockaddr_storage fromAddr{};
-                    socklen_t addrSize = sizeof(sockaddr_storage);
+        isReading = true;
+        pPool->submitTask([&, capThis{this}, capSock{sock}]() {
 
-                    uint8_t buf[maxPlainRecvLen];
-                    ssize_t recv = recvfrom(capSock, buf, maxPlainRecvLen, MSG_WAITALL, reinterpret_cast<sockaddr *>(&fromAddr), &addrSize);
-                    if (recv == -1) {
-                        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                            STMS_INFO("Read operation failed: EAGAIN/EWOULDBLOCK. Retrying (Attempt #{}).", numTries);
-                            pollfd params{};
-                            params.fd = capSock;
-                            params.events = POLLIN;
+            int numTries = 0;
+            while (numTries < maxTimeouts) {
+                numTries++;
 
-                            poll(&params, 1, static_cast<int>(timeoutMs < minIoTimeout ? minIoTimeout : timeoutMs));
-                            continue;
-                        }
+                int recv = capThis->recvBatch(capSock);
+                if (recv == -1) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        STMS_INFO("Read operation failed: EAGAIN/EWOULDBLOCK. Retrying (Attempt #{}).", numTries);
+                        pollfd params{};
+                        params.fd = capSock;
+                        params.events = POLLIN;
 
-                        STMS_WARN("recvfrom failed with errno {}: {}", errno, strerror(errno));
-                    } else {
-                        capThis->recvCallback(reinterpret_cast<sockaddr *>(&fromAddr), addrSize, buf, recv);
-                        numTries = 0;
-                        break;
+                        poll(&params, 1, static_cast<int>(timeoutMs < minIoTimeout ? minIoTimeout : timeoutMs));
+                        continue;
                     }
-                }
 
-                if (numTries >= maxTimeouts) {
-                    STMS_WARN("Read operation failed completely!");
+                    STMS_WARN("recvmmsg failed with errno {}: {}", errno, strerror(errno));
+                } else {
+                    capThis->deliverBatch(capThis->recvMsgs.data(), capThis->recvMsgs.size());
+                    numTries = 0;
+                    break;
                 }
+            }
 
-                capThis->isReading = false;
-            });
-        }
+            if (numTries >= maxTimeouts) {
+                STMS_WARN("Read operation failed completely!");
+                capThis->metrics.addTimeout();
+            }
+
+            capThis->isReading = false;
+        });
 
         return running;
     }
 
     std::future<int> UDPPeer::sendTo(const sockaddr *const addr, socklen_t addrlen, const uint8_t *const data, size_t size, bool copy) {
+        iovec iov{const_cast<uint8_t *>(data), size};
+        return sendToV(addr, addrlen, &iov, 1, copy);
+    }
+
+    std::future<int> UDPPeer::sendToV(const sockaddr *const addr, socklen_t addrlen, const iovec *iov, std::size_t iovCnt,
+                                      bool copy) {
         std::shared_ptr<std::promise<int>> pProm = std::make_shared<std::promise<int>>();
+        std::size_t size = std::accumulate(iov, iov + iovCnt, std::size_t{0}, [](std::size_t sum, const iovec &part) {
+            return sum + part.iov_len;
+        });
         if (!running) {
             STMS_ERROR("UDPPeer::sendTo called when stopped! {} bytes dropped.", size);
             pProm->set_value(-1);
             return pProm->get_future();
         }
 
-        uint8_t *cpdata = const_cast<uint8_t *>(data);
+        auto *req = new UDPSendReq{};
+        req->prom = pProm;
         if (copy) {
-            cpdata = new uint8_t[size];
-            std::copy(data, data + size, cpdata);
+            req->buf = PacketBuffer::alloc(size);
+            uint8_t *dst = req->buf.data();
+            for (std::size_t i = 0; i < iovCnt; i++) {
+                dst = std::copy(static_cast<const uint8_t *>(iov[i].iov_base),
+                                static_cast<const uint8_t *>(iov[i].iov_base) + iov[i].iov_len, dst);
+            }
+            req->iov = iovec{req->buf.data(), size};
+        } else if (iovCnt == 1) {
+            req->iov = iov[0];
+        } else {
+            req->iovs.assign(iov, iov + iovCnt);
+        }
+
+        req->hdr.msg_iov = req->iovs.empty() ? &req->iov : req->iovs.data();
+        req->hdr.msg_iovlen = req->iovs.empty() ? 1 : req->iovs.size();
+        if (addr != nullptr) {
+            std::copy(reinterpret_cast<const uint8_t *>(addr), reinterpret_cast<const uint8_t *>(addr) + addrlen,
+                      reinterpret_cast<uint8_t *>(&req->addr));
+            req->hdr.msg_name = &req->addr;
+            req->hdr.msg_namelen = addrlen;
+        }
+
+        if (ioBackend == IOBackend::eIOUring && !impairment) {
+            std::unique_lock<std::mutex> lg(uringMtx);
+            if (uring && running) {
+                auto userData = reinterpret_cast<uint64_t>(req);
+                if (!uring->prepSendMsg(0, true, &req->hdr, userData)) {
+                    uring->submit(); // Submission queue is full. Flush it and try again
+                    if (!uring->prepSendMsg(0, true, &req->hdr, userData)) {
+                        STMS_ERROR("io_uring submission queue is full! {} bytes dropped.", size);
+                        pProm->set_value(-2);
+                        delete req;
+                        return pProm->get_future();
+                    }
+                }
+                uringSendsInFlight++;
+                lg.unlock();
+
+                // The request is submitted in batches by the ticking thread. Only wake it up if it's asleep.
+                if (uringWaiting) {
+                    wakeUring();
+                }
+                return pProm->get_future();
+            }
         }
 
-        pPool->submitTask([&, capData{cpdata}, capCpy(copy), capSize{size}, capSock{sock},
-                           capAddr{addr}, capLen{addrlen}, capProm{pProm}]() {
+        bool useZeroCopy = zeroCopyActive && !copy && size >= zeroCopyMin && !impairment;
+        pPool->submitTask([&, capReq{std::shared_ptr<UDPSendReq>(req)}, capSock{sock}, capZeroCopy{useZeroCopy},
+                           capImp{impairment}]() {
 
             int numTries = 0;
             while (numTries < maxTimeouts) {
                 numTries++;
 
-                int sent = ::sendto(capSock, capData, capSize, 0, capAddr, capLen);
+                ssize_t sent;
+                if (capZeroCopy) {
+                    sent = sendZeroCopy(capSock, *capReq);
+                } else {
+                    sent = capImp ? capImp->sendmsg(capSock, &capReq->hdr, 0) : ::sendmsg(capSock, &capReq->hdr, 0);
+                }
                 if (sent == -1) {
                     if (errno == EAGAIN || errno == EWOULDBLOCK) {
                         STMS_INFO("UDPPeer::sendTo() failed: EAGAIN/EWOULDBLOCK. Retrying (Attempt #{}).", numTries);
+                        metrics.addWantWrite();
                         pollfd params{};
                         params.fd = capSock;
                         params.events = POLLOUT;
@@ -112,26 +567,139 @@ namespace stms {
 
                     STMS_WARN("UDPPeer::sendTo() failed with errno {}: {}", errno, strerror(errno));
                 } else {
-                    capProm->set_value(sent);
+                    metrics.addOut(static_cast<std::size_t>(sent));
+                    if (!capZeroCopy) { // Otherwise, this is done once the kernel is done with the data.
+                        capReq->prom->set_value(static_cast<int>(sent));
+                    }
                     numTries = 0;
                     break;
                 }
             }
 
-            if (capCpy) {
-                delete[] capData;
-            }
-
             if (numTries >= maxTimeouts) {
                 STMS_WARN("UDPPeer::sendTo() timed out completely!");
+                metrics.addTimeout();
+                capReq->prom->set_value(-3);
+            }
+        });
+
+        return pProm->get_future();
+    }
+
+    std::future<int> UDPPeer::sendToMany(const UDPMessage *msgs, std::size_t num, bool copy) {
+        std::shared_ptr<std::promise<int>> pProm = std::make_shared<std::promise<int>>();
+        if (!running) {
+            STMS_ERROR("UDPPeer::sendToMany called when stopped! {} datagrams dropped.", num);
+            pProm->set_value(-1);
+            return pProm->get_future();
+        }
+
+        if (num == 0) {
+            pProm->set_value(0);
+            return pProm->get_future();
+        }
+
+        auto req = std::make_shared<MMsgSendReq>();
+        req->hdrs.resize(num);
+        req->iovs.resize(num);
+        req->addrs.resize(num);
+
+        if (copy) {
+            std::size_t total = 0;
+            for (std::size_t i = 0; i < num; i++) {
+                total += static_cast<std::size_t>(msgs[i].size);
+            }
+            req->data = PacketBuffer::alloc(total);
+        }
+
+        std::size_t offset = 0;
+        for (std::size_t i = 0; i < num; i++) {
+            uint8_t *data = msgs[i].data;
+            if (copy) {
+                data = req->data.data() + offset;
+                std::copy(msgs[i].data, msgs[i].data + msgs[i].size, data);
+                offset += static_cast<std::size_t>(msgs[i].size);
+            }
+
+            req->iovs[i].iov_base = data;
+            req->iovs[i].iov_len = static_cast<std::size_t>(msgs[i].size);
+            req->hdrs[i].msg_hdr.msg_iov = &req->iovs[i];
+            req->hdrs[i].msg_hdr.msg_iovlen = 1;
+
+            if (msgs[i].addr != nullptr) {
+                std::copy(reinterpret_cast<const uint8_t *>(msgs[i].addr),
+                          reinterpret_cast<const uint8_t *>(msgs[i].addr) + msgs[i].addrLen,
+                          reinterpret_cast<uint8_t *>(&req->addrs[i]));
+                req->hdrs[i].msg_hdr.msg_name = &req->addrs[i];
+                req->hdrs[i].msg_hdr.msg_namelen = msgs[i].addrLen;
+            }
+        }
+
+        pPool->submitTask([&, capReq{req}, capSock{sock}, capProm{pProm}, capImp{impairment}]() {
+            std::size_t sent = 0;
+            std::size_t total = capReq->hdrs.size();
+
+            int numTries = 0;
+            while (sent < total && numTries < maxTimeouts) {
+                numTries++;
+
+                int ret = capImp ? impairedSendmmsg(*capImp, capSock, capReq->hdrs.data() + sent,
+                                                    static_cast<unsigned>(total - sent))
+                                 : sendmmsg(capSock, capReq->hdrs.data() + sent, static_cast<unsigned>(total - sent), 0);
+                if (ret == -1) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        STMS_INFO("UDPPeer::sendToMany() failed: EAGAIN/EWOULDBLOCK. Retrying (Attempt #{}).", numTries);
+                        metrics.addWantWrite();
+                        pollfd params{};
+                        params.fd = capSock;
+                        params.events = POLLOUT;
+
+                        poll(&params, 1, static_cast<int>(timeoutMs < minIoTimeout ? minIoTimeout : timeoutMs));
+                        continue;
+                    }
+
+                    STMS_WARN("UDPPeer::sendToMany() failed with errno {}: {}. {}/{} datagrams sent.",
+                              errno, strerror(errno), sent, total);
+                    capProm->set_value(-2);
+                    return;
+                }
+
+                std::size_t bytes = 0;
+                for (std::size_t i = sent; i < sent + static_cast<std::size_t>(ret); i++) {
+                    bytes += capReq->iovs[i].iov_len;
+                }
+                metrics.addOut(bytes, static_cast<std::size_t>(ret));
+
+                sent += static_cast<std::size_t>(ret);
+                numTries = 0;
+            }
+
+            if (sent < total) {
+                STMS_WARN("UDPPeer::sendToMany() timed out completely! {}/{} datagrams sent.", sent, total);
+                metrics.addTimeout();
                 capProm->set_value(-3);
+                return;
             }
+
+            capProm->set_value(static_cast<int>(sent));
         });
 
         return pProm->get_future();
     }
 
+    MetricsSnapshot UDPPeer::getMetrics() const {
+        MetricsSnapshot ret;
+        metrics.addTo(ret);
+        ret.connections = running ? 1 : 0;
+        ret.queuedMessages = uringSendsInFlight.load();
+        return ret;
+    }
+
     void UDPPeer::waitEvents(int toMs) {
+        if (ioBackend == IOBackend::eIOUring && waitUring(toMs)) {
+            return;
+        }
+
         pollfd params{};
         params.fd = sock;
         params.events = POLLIN;
@@ -0,0 +1,748 @@
+#include "stms/net/reliable_udp.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include "stms/logging.hpp"
+
+namespace stms {
+    // Data packet: [kind][channel][seq u32][msg id u32][frag index u16][frag count u16][msg len u32][payload]
+    // Ack packet:  [kind][largest seq u32][bitmap u64]
+    // All integers are big-endian.
+    static constexpr uint8_t dataKind = 0xA1;
+    static constexpr uint8_t ackKind = 0xA2;
+    static constexpr std::size_t dataHeaderLen = 18;
+    static constexpr std::size_t ackLen = 13;
+
+    static void put16(uint8_t *dst, uint16_t v) {
+        dst[0] = static_cast<uint8_t>(v >> 8U);
+        dst[1] = static_cast<uint8_t>(v);
+    }
+
+    static void put32(uint8_t *dst, uint32_t v) {
+        for (int i = 3; i >= 0; i--) {
+            dst[i] = static_cast<uint8_t>(v);
+            v >>= 8U;
+        }
+    }
+
+    static void put64(uint8_t *dst, uint64_t v) {
+        for (int i = 7; i >= 0; i--) {
+            dst[i] = static_cast<uint8_t>(v);
+            v >>= 8U;
+        }
+    }
+
+    static uint16_t get16(const uint8_t *src) {
+        return static_cast<uint16_t>((src[0] << 8U) | src[1]);
+    }
+
+    static uint32_t get32(const uint8_t *src) {
+        uint32_t ret = 0;
+        for (int i = 0; i < 4; i++) {
+            ret = (ret << 8U) | src[i];
+        }
+        return ret;
+    }
+
+    static uint64_t get64(const uint8_t *src) {
+        uint64_t ret = 0;
+        for (int i = 0; i < 8; i++) {
+            ret = (ret << 8U) | src[i];
+        }
+        return ret;
+    }
+
+    // Recover a full sequence number from its low 32 bits, picking the value closest to `near`.
+    static uint64_t expandSeq(uint32_t low, uint64_t near) {
+        uint64_t full = (near & ~0xFFFFFFFFULL) | low;
+        if (full > near + (1ULL << 31U) && full >= (1ULL << 32U)) {
+            full -= 1ULL << 32U;
+        } else if (full + (1ULL << 31U) < near) {
+            full += 1ULL << 32U;
+        }
+        return full;
+    }
+
+    // Shift a 64-bit "received before the newest" window forward by `diff` ids. The old newest id becomes bit `diff-1`.
+    static uint64_t advanceWindow(uint64_t bits, int32_t diff) {
+        if (diff > 64) {
+            return 0;
+        } else if (diff == 64) {
+            return 1ULL << 63U;
+        }
+        return (bits << static_cast<unsigned>(diff)) | (1ULL << static_cast<unsigned>(diff - 1));
+    }
+
+    ReliablePeer::Clock::duration ReliablePeer::rto() const {
+        double ms = srttMs > 0 ? srttMs + 4 * rttVarMs : reliableInitialRtoMs;
+        ms = std::clamp(ms, static_cast<double>(reliableMinRtoMs), static_cast<double>(reliableMaxRtoMs));
+        ms = std::min(ms * rtoBackoff, static_cast<double>(reliableMaxRtoMs));
+        return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double, std::milli>(ms));
+    }
+
+    void ReliablePeer::failPendingSends(int code) {
+        auto fail = [&](const std::shared_ptr<OutMessage> &msg) {
+            if (msg && msg->fragsLeft > 0) {
+                msg->fragsLeft = 0;
+                msg->prom->set_value(code);
+            }
+        };
+
+        for (auto &frag : sendQueue) {
+            fail(frag.msg);
+        }
+        for (auto &pair : inFlight) {
+            fail(pair.second.frag.msg);
+        }
+        sendQueue.clear();
+        unreliableQueue.clear();
+        inFlight.clear();
+        queuedBytes = 0;
+        unreliableBytes = 0;
+    }
+
+    ReliableUDP::ReliableUDP(UDPPeer *transport) : peer(transport) {
+        peer->setRecvCallback([&](const sockaddr *const addr, socklen_t addrLen, uint8_t *data, ssize_t size) {
+            if (size > 0) {
+                onDatagram(addr, addrLen, data, static_cast<std::size_t>(size));
+            }
+        });
+    }
+
+    ReliableUDP::~ReliableUDP() {
+        peer->setRecvCallback([](const sockaddr *const, socklen_t, uint8_t *, ssize_t) {});
+
+        std::lock_guard<std::mutex> lg(peersMtx);
+        for (auto &pair : peers) {
+            pair.second->failPendingSends(-1);
+        }
+    }
+
+    uint8_t ReliableUDP::addChannel(ChannelType type) {
+        if (channels.size() >= 256) {
+            STMS_ERROR("ReliableUDP can't have more than 256 channels! The channel will not be added!");
+            return 255;
+        }
+        channels.emplace_back(type);
+        return static_cast<uint8_t>(channels.size() - 1);
+    }
+
+    std::string ReliableUDP::peerKey(const sockaddr *addr, socklen_t addrLen) const {
+        if (!peer->isServer() || addr == nullptr) {
+            return ""; // A client only ever talks to its server.
+        }
+        return std::string(reinterpret_cast<const char *>(addr), addrLen);
+    }
+
+    ReliablePeer *ReliableUDP::getPeer(const std::string &key, const sockaddr *addr, socklen_t addrLen, bool remote) {
+        auto it = peers.find(key);
+        if (it == peers.end()) {
+            if (remote && peers.size() >= maxPeers) {
+                return nullptr;
+            }
+            it = peers.emplace(key, nullptr).first;
+        }
+
+        auto &ptr = it->second;
+        if (!ptr) {
+            ptr = std::make_unique<ReliablePeer>();
+            ptr->lastRecv = ReliablePeer::Clock::now();
+            ptr->nextSendTime = ptr->lastRecv;
+        }
+
+        if (ptr->addrLen == 0 && addr != nullptr && addrLen <= sizeof(sockaddr_storage)) {
+            std::memcpy(&ptr->addr, addr, addrLen);
+            ptr->addrLen = addrLen;
+        }
+        if (ptr->inChannels.size() < channels.size()) {
+            ptr->inChannels.resize(channels.size());
+            ptr->nextMsgId.resize(channels.size(), 0);
+        }
+        return ptr.get();
+    }
+
+    std::future<int> ReliableUDP::sendTo(const sockaddr *const addr, socklen_t addrLen, uint8_t channel,
+                                         const uint8_t *data, std::size_t len) {
+        auto prom = std::make_shared<std::promise<int>>();
+        auto ret = prom->get_future();
+
+        if (!peer->isRunning()) {
+            STMS_ERROR("ReliableUDP::sendTo() called on a stopped UDPPeer! Ignoring invocation!");
+            prom->set_value(-1);
+            return ret;
+        }
+        if (channel >= channels.size()) {
+            STMS_ERROR("ReliableUDP::sendTo() called with channel {}, but only {} exist! Ignoring invocation!",
+                       channel, channels.size());
+            prom->set_value(-2);
+            return ret;
+        }
+        if (peer->isServer() && addr == nullptr) {
+            STMS_ERROR("ReliableUDP::sendTo() called without an address on a server! Ignoring invocation!");
+            prom->set_value(-2);
+            return ret;
+        }
+
+        if (len > maxMessageLen) {
+            STMS_ERROR("ReliableUDP::sendTo() called with {} bytes, but the max message length is {}! "
+                       "Ignoring invocation!", len, maxMessageLen);
+            prom->set_value(-2);
+            return ret;
+        }
+
+        std::size_t fragLen = mtu > dataHeaderLen ? mtu - dataHeaderLen : 0;
+        std::size_t numFrags = len == 0 ? 1 : (fragLen == 0 ? 0 : (len + fragLen - 1) / fragLen);
+        if (numFrags == 0 || numFrags > 0xFFFF || len > 0xFFFFFFFFULL) {
+            STMS_ERROR("ReliableUDP::sendTo() called with {} bytes, which can't be fragmented to an MTU of {}! "
+                       "Ignoring invocation!", len, mtu);
+            prom->set_value(-2);
+            return ret;
+        }
+
+        bool reliable = channels[channel] != ChannelType::eUnreliable;
+
+        // Build the fragments before locking. The sequence number and message id are filled in later.
+        std::vector<ReliablePeer::Fragment> frags(numFrags);
+        for (std::size_t i = 0; i < numFrags; i++) {
+            std::size_t offset = i * fragLen;
+            std::size_t chunk = std::min(fragLen, len - offset);
+
+            auto &frag = frags[i];
+            frag.wire = PacketBuffer::alloc(dataHeaderLen + chunk);
+            frag.reliable = reliable;
+
+            uint8_t *wire = frag.wire.data();
+            wire[0] = dataKind;
+            wire[1] = channel;
+            put32(wire + 2, 0);
+            put32(wire + 6, 0);
+            put16(wire + 10, static_cast<uint16_t>(i));
+            put16(wire + 12, static_cast<uint16_t>(numFrags));
+            put32(wire + 14, static_cast<uint32_t>(len));
+            if (chunk > 0) {
+                std::memcpy(wire + dataHeaderLen, data + offset, chunk);
+            }
+        }
+
+        std::string key = peerKey(addr, addrLen);
+        std::vector<UDPMessage> out;
+        std::vector<PacketBuffer> keep;
+        {
+            std::lock_guard<std::mutex> lg(peersMtx);
+            ReliablePeer &p = *getPeer(key, addr, addrLen, false);
+
+            if (reliable && p.queuedBytes > 0 && p.queuedBytes + len > highWatermark) {
+                STMS_WARN("ReliableUDP::sendTo() refused {} bytes: {} bytes are already queued to the peer!",
+                          len, p.queuedBytes);
+                prom->set_value(-4);
+                return ret;
+            }
+
+            uint32_t msgId = p.nextMsgId[channel]++;
+            std::shared_ptr<ReliablePeer::OutMessage> msg;
+            if (reliable) {
+                msg = std::make_shared<ReliablePeer::OutMessage>();
+                msg->prom = prom;
+                msg->len = len;
+                msg->fragsLeft = static_cast<uint32_t>(numFrags);
+                p.queuedBytes += len;
+            }
+
+            if (!reliable) {
+                // Stale unreliable data is worth less than fresh data, so make room by dropping the oldest.
+                while (p.unreliableBytes > 0 && p.unreliableBytes + len > highWatermark) {
+                    p.unreliableBytes -= p.unreliableQueue.front().wire.size() - dataHeaderLen;
+                    p.unreliableQueue.pop_front();
+                }
+                p.unreliableBytes += len;
+            }
+
+            auto &queue = reliable ? p.sendQueue : p.unreliableQueue;
+            for (auto &frag : frags) {
+                put32(frag.wire.data() + 6, msgId);
+                frag.msg = msg;
+                queue.emplace_back(std::move(frag));
+            }
+
+            flushPeer(p, ReliablePeer::Clock::now(), true, out, keep);
+            sendCollected(out);
+        }
+
+        if (!reliable) {
+            prom->set_value(static_cast<int>(len));
+        }
+        return ret;
+    }
+
+    void ReliableUDP::onDatagram(const sockaddr *addr, socklen_t addrLen, uint8_t *data, std::size_t len) {
+        if (data[0] != dataKind && data[0] != ackKind) {
+            STMS_WARN("ReliableUDP dropped a datagram of unknown kind {}", data[0]);
+            return;
+        }
+
+        auto now = ReliablePeer::Clock::now();
+        std::vector<Delivery> deliveries;
+        std::vector<UDPMessage> out;
+        std::vector<PacketBuffer> keep;
+        bool dropped = false;
+        {
+            std::lock_guard<std::mutex> lg(peersMtx);
+            std::string key = peerKey(addr, addrLen);
+            ReliablePeer *found = nullptr;
+            if (data[0] == dataKind) {
+                found = getPeer(key, addr, addrLen, true);
+            } else if (peers.count(key) != 0) {
+                found = getPeer(key, addr, addrLen, false); // Acks only ever answer our own data packets.
+            }
+            if (found == nullptr) {
+                return;
+            }
+
+            ReliablePeer &p = *found;
+            p.lastRecv = now;
+
+            if (data[0] == ackKind) {
+                if (handleAck(p, data, len, now)) {
+                    dropped = !detectLosses(p, now);
+                }
+            } else {
+                handleData(p, data, len, deliveries);
+            }
+
+            if (dropped) {
+                STMS_WARN("ReliableUDP dropped a peer: A packet was sent {} times without being acked!",
+                          reliableMaxTransmissions);
+                p.failPendingSends(-3);
+                peers.erase(key);
+            } else {
+                flushPeer(p, now, true, out, keep);
+                sendCollected(out);
+            }
+        }
+
+        for (auto &d : deliveries) {
+            recvCallback(addr, addrLen, d.channel, d.data, d.len);
+        }
+        if (dropped) {
+            disconnectCallback(addr, addrLen);
+        }
+    }
+
+    bool ReliableUDP::handleAck(ReliablePeer &p, const uint8_t *data, std::size_t len,
+                                ReliablePeer::Clock::time_point now) {
+        if (len < ackLen) {
+            STMS_WARN("ReliableUDP dropped a truncated ack of {} bytes", len);
+            return false;
+        }
+
+        uint64_t largest = expandSeq(get32(data + 1), p.nextSeq);
+        uint64_t bits = get64(data + 5);
+        if (largest >= p.nextSeq) {
+            STMS_WARN("ReliableUDP dropped an ack for a packet that was never sent");
+            return false;
+        }
+
+        bool newlyAcked = false;
+        auto it = p.inFlight.lower_bound(largest >= 64 ? largest - 64 : 0);
+        while (it != p.inFlight.end() && it->first <= largest) {
+            uint64_t seq = it->first;
+            if (seq != largest && ((bits >> (largest - 1 - seq)) & 1U) == 0) {
+                ++it;
+                continue;
+            }
+
+            if (seq == largest) {
+                // RFC 6298. Every transmission gets a new sequence number, so the sample is never ambiguous.
+                double sample = std::chrono::duration<double, std::milli>(now - it->second.sentAt).count();
+                if (p.srttMs == 0) {
+                    p.srttMs = sample;
+                    p.rttVarMs = sample / 2;
+                } else {
+                    p.rttVarMs = 0.75 * p.rttVarMs + 0.25 * std::abs(p.srttMs - sample);
+                    p.srttMs = 0.875 * p.srttMs + 0.125 * sample;
+                }
+            }
+
+            auto &msg = it->second.frag.msg;
+            if (msg && msg->fragsLeft > 0 && --msg->fragsLeft == 0) {
+                p.queuedBytes -= std::min(p.queuedBytes, msg->len);
+                msg->prom->set_value(static_cast<int>(msg->len));
+            }
+
+            // Slow start below `ssthresh`, then additive increase of 1 packet per window.
+            p.cwnd += p.cwnd < p.ssthresh ? 1.0 : 1.0 / p.cwnd;
+            p.cwnd = std::min(p.cwnd, reliableMaxCwnd);
+
+            it = p.inFlight.erase(it);
+            newlyAcked = true;
+        }
+
+        p.largestAcked = std::max(p.largestAcked, largest + 1);
+        if (newlyAcked) {
+            p.rtoBackoff = 1;
+        }
+        return newlyAcked;
+    }
+
+    bool ReliableUDP::detectLosses(ReliablePeer &p, ReliablePeer::Clock::time_point now) {
+        auto rto = p.rto();
+        bool timedOut = false;
+        bool congestion = false;
+        std::vector<ReliablePeer::Fragment> lost;
+
+        for (auto it = p.inFlight.begin(); it != p.inFlight.end();) {
+            bool isLost = it->first + reliableReorderThreshold < p.largestAcked;
+            if (!isLost && now - it->second.sentAt >= rto) {
+                isLost = true;
+                timedOut = true;
+            }
+            if (!isLost) {
+                ++it;
+                continue;
+            }
+
+            if (it->second.frag.transmissions >= reliableMaxTransmissions) {
+                return false;
+            }
+            // Only the first loss of a round trip shrinks the window.
+            if (it->second.sentAt >= p.recoveryStart) {
+                congestion = true;
+            }
+
+            p.retransmits++;
+            lost.emplace_back(std::move(it->second.frag));
+            it = p.inFlight.erase(it);
+        }
+
+        // Resend in the original order, ahead of anything new.
+        for (auto it = lost.rbegin(); it != lost.rend(); ++it) {
+            p.sendQueue.emplace_front(std::move(*it));
+        }
+
+        if (congestion) {
+            p.ssthresh = std::max(p.cwnd / 2, 2.0);
+            p.cwnd = p.ssthresh;
+            p.recoveryStart = now;
+        }
+        if (timedOut) {
+            p.rtoBackoff = std::min(p.rtoBackoff * 2, 64U);
+        }
+        return true;
+    }
+
+    void ReliableUDP::handleData(ReliablePeer &p, uint8_t *data, std::size_t len, std::vector<Delivery> &out) {
+        if (len < dataHeaderLen) {
+            STMS_WARN("ReliableUDP dropped a truncated data packet of {} bytes", len);
+            return;
+        }
+
+        uint8_t channel = data[1];
+        uint32_t seq = get32(data + 2);
+        uint32_t msgId = get32(data + 6);
+        uint16_t fragIndex = get16(data + 10);
+        uint16_t fragCount = get16(data + 12);
+        uint32_t msgLen = get32(data + 14);
+        uint8_t *payload = data + dataHeaderLen;
+        std::size_t payloadLen = len - dataHeaderLen;
+
+        if (channel >= channels.size()) {
+            STMS_WARN("ReliableUDP dropped a packet for channel {}, but only {} exist!", channel, channels.size());
+            return;
+        }
+        // Every fragment carries at least 1 byte, so `fragCount` can't make us allocate more than `msgLen`.
+        if (fragCount == 0 || fragIndex >= fragCount || payloadLen > msgLen || msgLen > maxMessageLen ||
+            (fragCount == 1 && payloadLen != msgLen) || (fragCount > 1 && (payloadLen == 0 || fragCount > msgLen)) ||
+            msgLen > static_cast<uint64_t>(fragCount) * mtu) {
+            STMS_WARN("ReliableUDP dropped a malformed fragment");
+            return;
+        }
+
+        auto &ch = p.inChannels[channel];
+        ChannelType type = channels[channel];
+        bool duplicate = false;
+        if (type == ChannelType::eUnreliable) {
+            if (ch.seenAny) {
+                auto diff = static_cast<int32_t>(msgId - ch.newestId);
+                duplicate = diff == 0 || diff < -64 ||
+                            (diff < 0 && ((ch.seenBits >> static_cast<unsigned>(-diff - 1)) & 1U) != 0);
+            }
+        } else {
+            auto ahead = static_cast<int32_t>(msgId - ch.nextId);
+            duplicate = ahead < 0 ||
+                        (type == ChannelType::eReliableOrdered && ch.ready.count(msgId) != 0) ||
+                        (type == ChannelType::eReliableUnordered && ch.deliveredAbove.count(msgId) != 0);
+            if (!duplicate && static_cast<uint32_t>(ahead) >= reliableMaxIdWindow) {
+                return; // Not acked, so it is resent once the messages before it arrived.
+            }
+        }
+
+        // Bytes this packet adds to `partials` or `ready`. Anything that doesn't fit is refused without an ack.
+        bool isNew = !duplicate && (fragCount == 1 || ch.partials.count(msgId) == 0);
+        std::size_t grows = 0;
+        if (isNew && (fragCount > 1 || (type == ChannelType::eReliableOrdered && msgId != ch.nextId))) {
+            grows = msgLen;
+        }
+        if (isNew && fragCount > 1 && ch.partials.size() >= reliableMaxPartials) {
+            if (type != ChannelType::eUnreliable) {
+                return;
+            }
+            clearPartials(p, ch); // Fragments of lost unreliable messages would otherwise pile up forever.
+        }
+        if (grows > 0 && p.recvBytes + grows > recvBufferLen) {
+            if (type == ChannelType::eUnreliable) {
+                clearPartials(p, ch);
+            }
+            if (p.recvBytes + grows > recvBufferLen) {
+                return;
+            }
+        }
+
+        // Ack bookkeeping happens for every accepted packet, even duplicates, so that lost acks are repaired.
+        if (!p.recvAny) {
+            p.recvAny = true;
+            p.largestRecv = seq;
+            p.recvBits = 0;
+        } else {
+            auto diff = static_cast<int32_t>(seq - p.largestRecv);
+            if (diff > 0) {
+                p.ackNow = p.ackNow || diff != 1;
+                p.recvBits = advanceWindow(p.recvBits, diff);
+                p.largestRecv = seq;
+            } else {
+                p.ackNow = true;
+                if (diff < 0 && diff >= -64) {
+                    p.recvBits |= 1ULL << static_cast<unsigned>(-diff - 1);
+                }
+            }
+        }
+        p.unackedRecv++;
+
+        if (duplicate) {
+            return;
+        }
+
+        if (fragCount == 1) {
+            completeMessage(p, channel, msgId, Delivery{channel, payload, payloadLen, {}}, out);
+            return;
+        }
+
+        auto &part = ch.partials[msgId];
+        if (part.have.empty()) {
+            part.data.resize(msgLen);
+            part.have.assign(fragCount, false);
+            p.recvBytes += msgLen;
+        }
+        if (part.have.size() != fragCount || part.data.size() != msgLen) {
+            STMS_WARN("ReliableUDP dropped a fragment that doesn't match the others of its message");
+            return;
+        }
+        if (part.have[fragIndex]) {
+            return;
+        }
+
+        // Every fragment but the last has the same length, and the last one ends at the end of the message.
+        std::size_t offset = fragIndex + 1U == fragCount ? msgLen - payloadLen : fragIndex * payloadLen;
+        if (offset + payloadLen > msgLen) {
+            STMS_WARN("ReliableUDP dropped a fragment that doesn't fit in its message");
+            return;
+        }
+        std::memcpy(part.data.data() + offset, payload, payloadLen);
+        part.have[fragIndex] = true;
+        if (++part.numHave < fragCount) {
+            return;
+        }
+
+        Delivery msg{channel, nullptr, msgLen, std::move(part.data)};
+        msg.data = msg.owned.data();
+        ch.partials.erase(msgId);
+        p.recvBytes -= msgLen;
+        completeMessage(p, channel, msgId, std::move(msg), out);
+    }
+
+    void ReliableUDP::clearPartials(ReliablePeer &p, ReliablePeer::InChannel &ch) {
+        for (auto &pair : ch.partials) {
+            p.recvBytes -= pair.second.data.size();
+        }
+        ch.partials.clear();
+    }
+
+    void ReliableUDP::completeMessage(ReliablePeer &p, uint8_t channel, uint32_t msgId, Delivery &&msg,
+                                      std::vector<Delivery> &out) {
+        auto &ch = p.inChannels[channel];
+        switch (channels[channel]) {
+            case ChannelType::eUnreliable: {
+                if (!ch.seenAny) {
+                    ch.seenAny = true;
+                    ch.newestId = msgId;
+                    ch.seenBits = 0;
+                } else {
+                    auto diff = static_cast<int32_t>(msgId - ch.newestId);
+                    if (diff > 0) {
+                        ch.seenBits = advanceWindow(ch.seenBits, diff);
+                        ch.newestId = msgId;
+                    } else {
+                        ch.seenBits |= 1ULL << static_cast<unsigned>(-diff - 1);
+                    }
+                }
+                out.emplace_back(std::move(msg));
+                break;
+            }
+
+            case ChannelType::eReliableUnordered: {
+                if (msgId == ch.nextId) {
+                    ch.nextId++;
+                    while (ch.deliveredAbove.erase(ch.nextId) != 0) {
+                        ch.nextId++;
+                    }
+                } else {
+                    ch.deliveredAbove.insert(msgId);
+                }
+                out.emplace_back(std::move(msg));
+                break;
+            }
+
+            case ChannelType::eReliableOrdered: {
+                if (msgId != ch.nextId) {
+                    if (msg.owned.empty()) {
+                        msg.owned.assign(msg.data, msg.data + msg.len); // The datagram is only valid until we return
+                    }
+                    p.recvBytes += msg.len;
+                    ch.ready.emplace(msgId, std::move(msg.owned));
+                    break;
+                }
+
+                out.emplace_back(std::move(msg));
+                ch.nextId++;
+                for (auto it = ch.ready.find(ch.nextId); it != ch.ready.end(); it = ch.ready.find(ch.nextId)) {
+                    Delivery next{channel, nullptr, it->second.size(), std::move(it->second)};
+                    next.data = next.owned.data();
+                    out.emplace_back(std::move(next));
+                    p.recvBytes -= out.back().len;
+                    ch.ready.erase(it);
+                    ch.nextId++;
+                }
+                break;
+            }
+        }
+    }
+
+    void ReliableUDP::flushPeer(ReliablePeer &p, ReliablePeer::Clock::time_point now, bool delayAck,
+                                std::vector<UDPMessage> &out, std::vector<PacketBuffer> &keep) {
+        const sockaddr *dst = peer->isServer() ? reinterpret_cast<const sockaddr *>(&p.addr) : nullptr;
+        socklen_t dstLen = peer->isServer() ? p.addrLen : 0;
+
+        if (p.unackedRecv > 0 && (!delayAck || p.ackNow || p.unackedRecv >= 2)) {
+            PacketBuffer ack = PacketBuffer::alloc(ackLen);
+            ack.data()[0] = ackKind;
+            put32(ack.data() + 1, p.largestRecv);
+            put64(ack.data() + 5, p.recvBits);
+            out.emplace_back(UDPMessage{dst, dstLen, ack.data(), static_cast<ssize_t>(ackLen)});
+            keep.emplace_back(std::move(ack));
+            p.unackedRecv = 0;
+            p.ackNow = false;
+        }
+
+        // Spread a window of packets over a round trip. Before the first sample, the initial window goes out at once.
+        auto interval = std::chrono::duration_cast<ReliablePeer::Clock::duration>(
+                std::chrono::duration<double, std::milli>(p.srttMs / p.cwnd));
+        p.nextSendTime = std::max(p.nextSendTime, now - interval * reliablePacingBurst);
+
+        while (p.nextSendTime <= now) {
+            // Reliable fragments go first while the window has room. Otherwise, unreliable ones don't wait for acks.
+            bool windowOpen = static_cast<double>(p.inFlight.size()) < p.cwnd;
+            bool useReliable = !p.sendQueue.empty() && windowOpen;
+            if (!useReliable && p.unreliableQueue.empty()) {
+                break;
+            }
+
+            auto &queue = useReliable ? p.sendQueue : p.unreliableQueue;
+            auto &front = queue.front();
+
+            uint64_t seq = p.nextSeq++;
+            put32(front.wire.data() + 2, static_cast<uint32_t>(seq));
+            front.transmissions++;
+            out.emplace_back(UDPMessage{dst, dstLen, front.wire.data(), static_cast<ssize_t>(front.wire.size())});
+            p.packetsSent++;
+            p.nextSendTime += interval;
+
+            if (front.reliable) {
+                p.inFlight.emplace(seq, ReliablePeer::InFlight{std::move(front), now});
+            } else {
+                p.unreliableBytes -= front.wire.size() - dataHeaderLen;
+                keep.emplace_back(std::move(front.wire));
+            }
+            queue.pop_front();
+        }
+    }
+
+    void ReliableUDP::sendCollected(std::vector<UDPMessage> &out) {
+        if (!out.empty()) {
+            peer->sendToMany(out, true);
+            out.clear();
+        }
+    }
+
+    void ReliableUDP::tick() {
+        auto now = ReliablePeer::Clock::now();
+        std::vector<std::pair<sockaddr_storage, socklen_t>> dropped;
+        std::vector<UDPMessage> out;
+        std::vector<PacketBuffer> keep;
+        {
+            std::lock_guard<std::mutex> lg(peersMtx);
+            for (auto it = peers.begin(); it != peers.end();) {
+                ReliablePeer &p = *it->second;
+
+                bool idle = peer->getTimeout() > 0 && now - p.lastRecv > std::chrono::milliseconds(peer->getTimeout());
+                if (idle || !detectLosses(p, now)) {
+                    STMS_WARN("ReliableUDP dropped a peer: {}", idle ? "Timed out" : "A packet was never acked");
+                    p.failPendingSends(-3);
+                    dropped.emplace_back(p.addr, p.addrLen);
+                    it = peers.erase(it);
+                    continue;
+                }
+
+                flushPeer(p, now, false, out, keep);
+                ++it;
+            }
+            sendCollected(out);
+        }
+
+        for (auto &pair : dropped) {
+            disconnectCallback(pair.second == 0 ? nullptr : reinterpret_cast<const sockaddr *>(&pair.first),
+                               pair.second);
+        }
+    }
+
+    void ReliableUDP::dropPeer(const sockaddr *const addr, socklen_t addrLen) {
+        std::lock_guard<std::mutex> lg(peersMtx);
+        auto it = peers.find(peerKey(addr, addrLen));
+        if (it == peers.end()) {
+            STMS_WARN("ReliableUDP::dropPeer() called for an unknown peer! Ignoring invocation!");
+            return;
+        }
+        it->second->failPendingSends(-1);
+        peers.erase(it);
+    }
+
+    std::size_t ReliableUDP::getNumPeers() {
+        std::lock_guard<std::mutex> lg(peersMtx);
+        return peers.size();
+    }
+
+    bool ReliableUDP::getStats(const sockaddr *const addr, socklen_t addrLen, ReliableStats &out) {
+        std::lock_guard<std::mutex> lg(peersMtx);
+        auto it = peers.find(peerKey(addr, addrLen));
+        if (it == peers.end()) {
+            return false;
+        }
+
+        const ReliablePeer &p = *it->second;
+        out.srttMs = p.srttMs;
+        out.cwnd = p.cwnd;
+        out.inFlight = p.inFlight.size();
+        out.queuedBytes = p.queuedBytes;
+        out.packetsSent = p.packetsSent;
+        out.retransmits = p.retransmits;
+        return true;
+    }
+}
@@ -0,0 +1,287 @@
+#include "stms/net/sharded_ssl_server.hpp"
+#include "stms/logging.hpp"
+
+#include <algorithm>
+
+#ifdef __linux__
+#   include <pthread.h>
+#   include <sched.h>
+#endif
+
+namespace stms {
+    ShardedSSLServer::ShardedSSLServer(stms::PoolLike *pool, bool isUdp, unsigned numShards) {
+        if (numShards == 0) {
+            numShards = std::max(std::thread::hardware_concurrency(), 1u);
+        }
+
+        shards.resize(numShards);
+        for (std::size_t i = 0; i < shards.size(); i++) {
+            shards[i].serv = std::make_unique<SSLServer>(pool, isUdp);
+            if (i > 0) { // Share tickets, cached sessions & cookies, as the kernel may route a reconnect to any shard.
+                shards[i].serv->setTicketKeys(shards[0].serv->getTicketKeys());
+                shards[i].serv->setSessionCache(shards[0].serv->getSessionCache());
+                shards[i].serv->setCookieKeys(shards[0].serv->getCookieKeys());
+            }
+
+            // lambda captures validated
+            shards[i].serv->setConnectCallback([&, i](const UUID &cli, const sockaddr *const addr) {
+                {
+                    std::lock_guard<std::mutex> lg(routesMtx);
+                    routes[cli] = i;
+                }
+                connectCallback(cli, addr);
+            });
+
+            shards[i].serv->setDisconnectCallback([&](const UUID &cli, const sockaddr *const addr) {
+                {
+                    std::lock_guard<std::mutex> lg(routesMtx);
+                    routes.erase(cli);
+                }
+                disconnectCallback(cli, addr);
+            });
+        }
+    }
+
+    ShardedSSLServer::~ShardedSSLServer() {
+        stop();
+    }
+
+    void ShardedSSLServer::configure(const std::function<void(SSLServer &)> &fn) {
+        for (auto &shard : shards) {
+            fn(*shard.serv);
+        }
+    }
+
+    void ShardedSSLServer::setRecvCallback(
+            const std::function<void(const UUID &, const sockaddr *const, uint8_t *, int)> &newCb) {
+        for (auto &shard : shards) {
+            shard.serv->setRecvCallback(newCb);
+        }
+    }
+
+    void ShardedSSLServer::setFramedRecvCallback(
+            const std::function<void(const UUID &, const sockaddr *const, uint8_t *, int)> &newCb,
+            std::size_t maxMessageLen) {
+        for (auto &shard : shards) {
+            shard.serv->setFramedRecvCallback(newCb, maxMessageLen);
+        }
+    }
+
+    void ShardedSSLServer::setWritableCallback(const std::function<void(const UUID &)> &newCb) {
+        for (auto &shard : shards) {
+            shard.serv->setWritableCallback(newCb);
+        }
+    }
+
+    void ShardedSSLServer::shardLoop(std::size_t index) {
+        SSLServer *serv = shards[index].serv.get();
+
+#ifdef __linux__
+        if (pinThreads) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(index % std::max(std::thread::hardware_concurrency(), 1u), &cpus);
+            if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus) != 0) {
+                STMS_WARN("Failed to pin shard {} to a core! Continuing unpinned.", index);
+            }
+        }
+#endif
+
+        while (serv->isRunning() && serv->tick()) {
+            serv->waitEvents(shardTickWaitMs);
+        }
+    }
+
+    void ShardedSSLServer::start() {
+        if (isRunning()) {
+            STMS_WARN("ShardedSSLServer::start() called when already running! Ignoring invocation!");
+            return;
+        }
+        stop(); // Join threads of shards that stopped on their own
+
+        for (std::size_t i = 0; i < shards.size(); i++) {
+            // Every shard binds the same address. This works as sockets are created with `SO_REUSEPORT`.
+            shards[i].serv->start();
+            if (!shards[i].serv->isRunning()) {
+                STMS_ERROR("Failed to start shard {}!", i);
+                continue;
+            }
+
+            shards[i].thread = std::thread(&ShardedSSLServer::shardLoop, this, i);
+        }
+
+        STMS_INFO("ShardedSSLServer started with {} shards", shards.size());
+    }
+
+    void ShardedSSLServer::stop() {
+        for (auto &shard : shards) {
+            if (shard.serv->isRunning()) {
+                shard.serv->stop();
+            }
+        }
+
+        for (auto &shard : shards) {
+            if (shard.thread.joinable() && shard.thread.get_id() != std::this_thread::get_id()) {
+                shard.thread.join();
+            }
+        }
+    }
+
+    bool ShardedSSLServer::isRunning() const {
+        for (const auto &shard : shards) {
+            if (shard.serv->isRunning()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    SSLServer *ShardedSSLServer::findShard(const UUID &cli) {
+        {
+            std::lock_guard<std::mutex> lg(routesMtx);
+            auto routeIt = routes.find(cli);
+            if (routeIt != routes.end() && shards[routeIt->second].serv->hasClient(cli)) {
+                return shards[routeIt->second].serv.get();
+            }
+        }
+
+        // The connect callback hasn't run yet, or the UUID was changed directly on the shard.
+        for (std::size_t i = 0; i < shards.size(); i++) {
+            if (shards[i].serv->hasClient(cli)) {
+                std::lock_guard<std::mutex> lg(routesMtx);
+                routes[cli] = i;
+                return shards[i].serv.get();
+            }
+        }
+        return nullptr;
+    }
+
+    std::size_t ShardedSSLServer::getNumClients() {
+        std::size_t ret = 0;
+        for (auto &shard : shards) {
+            ret += shard.serv->getNumClients();
+        }
+        return ret;
+    }
+
+    std::vector<UUID> ShardedSSLServer::getClientUuids() {
+        std::vector<UUID> ret;
+        for (auto &shard : shards) {
+            auto shardUuids = shard.serv->getClientUuids();
+            ret.insert(ret.end(), shardUuids.begin(), shardUuids.end());
+        }
+        return ret;
+    }
+
+    std::future<int> ShardedSSLServer::send(const UUID &clientUuid, const uint8_t *const msg, int msgLen, bool cpy) {
+        SSLServer *shard = findShard(clientUuid);
+        if (shard == nullptr) {
+            STMS_ERROR("ShardedSSLServer::send() called with invalid client uuid '{}'. Dropping {} bytes!",
+                       clientUuid.buildStr(), msgLen);
+            std::promise<int> prom;
+            prom.set_value(0);
+            return prom.get_future();
+        }
+
+        return shard->send(clientUuid, msg, msgLen, cpy);
+    }
+
+    std::future<int> ShardedSSLServer::sendFile(const UUID &clientUuid, int fd, off_t offset, int len) {
+        SSLServer *shard = findShard(clientUuid);
+        if (shard == nullptr) {
+            STMS_ERROR("ShardedSSLServer::sendFile() called with invalid client uuid '{}'. Dropping {} bytes!",
+                       clientUuid.buildStr(), len);
+            std::promise<int> prom;
+            prom.set_value(0);
+            return prom.get_future();
+        }
+
+        return shard->sendFile(clientUuid, fd, offset, len);
+    }
+
+    void ShardedSSLServer::kickClient(const UUID &cliId) {
+        SSLServer *shard = findShard(cliId);
+        if (shard == nullptr) {
+            STMS_WARN("ShardedSSLServer::kickClient() called with invalid client uuid '{}'. Ignoring!", cliId.buildStr());
+            return;
+        }
+
+        shard->kickClient(cliId);
+    }
+
+    bool ShardedSSLServer::setNewUuid(const UUID &old, const UUID &newUuid) {
+        SSLServer *shard = findShard(old);
+        if (shard == nullptr || !shard->setNewUuid(old, newUuid)) {
+            STMS_WARN("Requested uuid edit {} -> {} failed: Client non-existent.", old.buildStr(), newUuid.buildStr());
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lg(routesMtx);
+        auto routeIt = routes.find(old);
+        if (routeIt != routes.end()) {
+            std::size_t index = routeIt->second;
+            routes.erase(routeIt);
+            routes[newUuid] = index;
+        }
+        return true;
+    }
+
+    UUID ShardedSSLServer::refreshUuid(const UUID &client) {
+        UUID newUuid(UUIDType::eUuid4);
+
+        if (!setNewUuid(client, newUuid)) {
+            return UUID{}; // return empty uuid as the client doesnt exist
+        }
+
+        return newUuid;
+    }
+
+    size_t ShardedSSLServer::getMtu(const UUID &cli) {
+        SSLServer *shard = findShard(cli);
+        return shard == nullptr ? 0 : shard->getMtu(cli);
+    }
+
+    std::size_t ShardedSSLServer::getQueuedBytes(const UUID &cli) {
+        SSLServer *shard = findShard(cli);
+        return shard == nullptr ? 0 : shard->getQueuedBytes(cli);
+    }
+
+    SessionStats ShardedSSLServer::getSessionStats() {
+        SessionStats ret;
+        std::unordered_set<SessionCache *> seenCaches;
+        for (auto &shard : shards) {
+            SessionStats shardStats = shard.serv->getSessionStats();
+            ret.fullHandshakes += shardStats.fullHandshakes;
+            ret.resumedHandshakes += shardStats.resumedHandshakes;
+
+            auto cache = shard.serv->getSessionCache();
+            if (cache && seenCaches.insert(cache.get()).second) {
+                cache->addStats(ret);
+            }
+        }
+        return ret;
+    }
+
+    MetricsSnapshot ShardedSSLServer::getMetrics() {
+        MetricsSnapshot ret;
+        for (auto &shard : shards) {
+            ret += shard.serv->getMetrics();
+        }
+        return ret;
+    }
+
+    void ShardedSSLServer::setClientMetrics(bool enable) {
+        for (auto &shard : shards) {
+            shard.serv->setClientMetrics(enable);
+        }
+    }
+
+    std::vector<std::pair<UUID, MetricsSnapshot>> ShardedSSLServer::getClientMetrics() {
+        std::vector<std::pair<UUID, MetricsSnapshot>> ret;
+        for (auto &shard : shards) {
+            auto shardClients = shard.serv->getClientMetrics();
+            ret.insert(ret.end(), shardClients.begin(), shardClients.end());
+        }
+        return ret;
+    }
+}
@@ -10,6 +10,8 @@
 #include <fcntl.h>
 #include <poll.h>
 
+#include <algorithm>
+
 #include "stms/stms.hpp"
 #include "stms/util/util.hpp"
 #include "stms/logging.hpp"
@@ -18,6 +20,10 @@
 #include "openssl/err.h"
 #include "openssl/conf.h"
 
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined(OPENSSL_NO_KTLS)
+#   define STMS_KTLS_SUPPORTED //!< Defined if OpenSSL can offload TLS records to the kernel.
+#endif
+
 namespace stms {
     unsigned long handleSSLError() {
         unsigned long ret = ERR_get_error();
@@ -29,60 +35,80 @@ namespace stms {
         return ret;
     }
 
-    int handleSslGetErr(SSL *ssl, int ret) {
+    SSLStatus getSslStatus(SSL *ssl, int ret) {
         switch (SSL_get_error(ssl, ret)) {
             case SSL_ERROR_NONE: {
-                return ret;
+                return SSLStatus::eOk;
             }
             case SSL_ERROR_ZERO_RETURN: {
                 STMS_ERROR("Tried to preform SSL IO, but peer has closed the connection! Don't try to read more data!");
                 flushSSLErrors();
-                throw SSLFatalException();
+                return SSLStatus::eFatal;
             }
             case SSL_ERROR_WANT_WRITE: {
-                STMS_WARN("Unable to complete OpenSSL call: Want Write. Please retry. (Auto Retry is on!)");
-                throw SSLWantWriteException();
+                return SSLStatus::eWantWrite;
             }
             case SSL_ERROR_WANT_READ: {
-                STMS_WARN("Unable to complete OpenSSL call: Want Read. Please retry. (Auto Retry is on!)");
-                throw SSLWantReadException();
+                return SSLStatus::eWantRead;
             }
             case SSL_ERROR_SYSCALL: {
                 STMS_ERROR("System Error from OpenSSL call: {}", strerror(errno));
                 flushSSLErrors();
-                throw SSLFatalException();
+                return SSLStatus::eFatal;
             }
             case SSL_ERROR_SSL: {
                 STMS_ERROR("Fatal OpenSSL error occurred!");
                 flushSSLErrors();
-                throw SSLFatalException();
+                return SSLStatus::eFatal;
             }
             case SSL_ERROR_WANT_CONNECT: {
                 STMS_WARN("Unable to complete OpenSSL call: SSL hasn't been connected! Retry later!");
-                throw SSLException();
+                return SSLStatus::eRetry;
             }
             case SSL_ERROR_WANT_ACCEPT: {
                 STMS_WARN("Unable to complete OpenSSL call: SSL hasn't been accepted! Retry later!");
-                throw SSLException();
+                return SSLStatus::eRetry;
             }
             case SSL_ERROR_WANT_X509_LOOKUP: {
                 STMS_WARN("The X509 Lookup callback asked to be recalled! Retry later!");
-                throw SSLException();
+                return SSLStatus::eRetry;
             }
             case SSL_ERROR_WANT_ASYNC: {
                 STMS_WARN("Cannot complete OpenSSL call: Async operation in progress. Retry later!");
-                throw SSLException();
+                return SSLStatus::eRetry;
             }
             case SSL_ERROR_WANT_ASYNC_JOB: {
                 STMS_WARN("Cannot complete OpenSSL call: Async thread pool is overloaded! Retry later!");
-                throw SSLException();
+                return SSLStatus::eRetry;
             }
             case SSL_ERROR_WANT_CLIENT_HELLO_CB: {
                 STMS_WARN("ClientHello callback asked to be recalled! Retry Later!");
-                throw SSLException();
+                return SSLStatus::eRetry;
             }
             default: {
                 STMS_ERROR("Got an Undefined error from `SSL_get_error()`! This should be impossible!");
+                return SSLStatus::eFatal;
+            }
+        }
+    }
+
+    int handleSslGetErr(SSL *ssl, int ret) {
+        switch (getSslStatus(ssl, ret)) {
+            case SSLStatus::eOk: {
+                return ret;
+            }
+            case SSLStatus::eWantWrite: {
+                STMS_WARN("Unable to complete OpenSSL call: Want Write. Please retry. (Auto Retry is on!)");
+                throw SSLWantWriteException();
+            }
+            case SSLStatus::eWantRead: {
+                STMS_WARN("Unable to complete OpenSSL call: Want Read. Please retry. (Auto Retry is on!)");
+                throw SSLWantReadException();
+            }
+            case SSLStatus::eRetry: {
+                throw SSLException();
+            }
+            default: {
                 throw SSLFatalException();
             }
         }
@@ -186,6 +212,86 @@ namespace stms {
         SSL_CTX_clear_options(pCtx, SSL_OP_NO_COMPRESSION);
     }
 
+    bool isKernelTlsSend(SSL *ssl) {
+#ifdef STMS_KTLS_SUPPORTED
+        return ssl != nullptr && BIO_get_ktls_send(SSL_get_wbio(ssl));
+#else
+        return false;
+#endif
+    }
+
+    FileSender::FileSender(SSL *connection, int file, off_t start, std::size_t len)
+            : ssl(connection), fd(file), offset(start), remaining(len), useSendfile(isKernelTlsSend(connection)) {
+        if (!useSendfile) {
+            chunk = std::make_unique<uint8_t[]>(std::min(len, static_cast<std::size_t>(sendFileChunk)));
+        }
+    }
+
+    long FileSender::step() {
+#ifdef STMS_KTLS_SUPPORTED
+        if (useSendfile) {
+            ossl_ssize_t ret = SSL_sendfile(ssl, fd, offset, remaining, 0);
+            if (ret <= 0) {
+                status = getSslStatus(ssl, static_cast<int>(ret));
+                if (status == SSLStatus::eOk) {
+                    status = SSLStatus::eRetry; // SSL_ERROR_NONE, which shouldn't happen. Retry.
+                }
+                return 0;
+            }
+            status = SSLStatus::eOk;
+
+            offset += static_cast<off_t>(ret);
+            remaining -= static_cast<std::size_t>(ret);
+            return static_cast<long>(ret);
+        }
+#endif
+
+        if (chunkLen == 0) {
+            std::size_t toRead = std::min(remaining, static_cast<std::size_t>(sendFileChunk));
+            ssize_t got = pread(fd, chunk.get(), toRead, offset);
+            if (got <= 0) {
+                STMS_ERROR("Failed to read file to send: {}", got == 0 ? "Unexpected end of file" : strerror(errno));
+                return -1;
+            }
+            chunkLen = static_cast<int>(got);
+        }
+
+        // `SSL_write` must be retried with the same arguments, so `chunk` is only refilled once it has been written.
+        int ret = SSL_write(ssl, chunk.get(), chunkLen);
+        if (ret <= 0) {
+            status = getSslStatus(ssl, ret);
+            if (status == SSLStatus::eOk) {
+                status = SSLStatus::eRetry;
+            }
+            return 0;
+        }
+        status = SSLStatus::eOk;
+
+        offset += ret;
+        remaining -= static_cast<std::size_t>(ret);
+        chunkLen = 0;
+        return ret;
+    }
+
+    bool _stms_SSLBase::setKernelTls(bool enable) {
+#ifdef STMS_KTLS_SUPPORTED
+        if (!isUdp) {
+            if (enable) {
+                SSL_CTX_set_options(pCtx, SSL_OP_ENABLE_KTLS);
+            } else {
+                SSL_CTX_clear_options(pCtx, SSL_OP_ENABLE_KTLS);
+            }
+            return true;
+        }
+#endif
+
+        if (enable) {
+            STMS_WARN("Kernel TLS is unavailable {}! Using user-space TLS.",
+                      isUdp ? "for DTLS" : "(OpenSSL was built without it)");
+        }
+        return false;
+    }
+
     void _stms_SSLBase::setVerifyMode(int mode) {
         SSL_CTX_set_verify(pCtx, mode, verifyCert);
     }
@@ -4,21 +4,50 @@
 
 #include <stms/logging.hpp>
 #include <poll.h>
+#include <algorithm>
 #include "stms/net/ssl_client.hpp"
 
 namespace stms {
 
-    SSLClient::SSLClient(stms::PoolLike *pool, bool udp) : _stms_SSLBase(false, pool, udp) {}
+    SSLClient::SSLClient(stms::PoolLike *pool, bool udp) : _stms_SSLBase(false, pool, udp) {
+        // Sessions are kept in `session` by `onNewSession`, as OpenSSL never looks up client sessions by itself.
+        SSL_CTX_set_session_cache_mode(pCtx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(pCtx, onNewSession);
+    }
 
     SSLClient::~SSLClient() {
         if (running) {
             STMS_WARN("SSLClient destroyed whilst it was still running! Stopping it now...");
             stop();
         }
+        clearSession();
+    }
+
+    int SSLClient::onNewSession(SSL *ssl, SSL_SESSION *sess) {
+        auto *cli = static_cast<SSLClient *>(SSL_get_app_data(ssl));
+        if (cli == nullptr || !cli->resumeSessions) {
+            return 0;
+        }
+
+        // With TLS 1.3, this is called from `SSL_read` whenever the server sends a ticket.
+        std::lock_guard<std::mutex> lg(cli->sessionMtx);
+        SSL_SESSION_free(cli->session);
+        cli->session = sess;
+        return 1; // We keep the reference
+    }
+
+    void SSLClient::clearSession() {
+        std::lock_guard<std::mutex> lg(sessionMtx);
+        SSL_SESSION_free(session);
+        session = nullptr;
     }
 
     void SSLClient::onStart() {
         doShutdown = false;
+        framer.reset();
+        if (framedRecvCallback && !isUdp) {
+            framer = std::make_unique<MessageFramer>(maxFramedLen);
+        }
 
         if (isUdp) {
             pBio = BIO_new_dgram(sock, BIO_NOCLOSE);
@@ -33,6 +62,7 @@ namespace stms {
             }
 
             BIO_ctrl(pBio, BIO_CTRL_DGRAM_MTU_DISCOVER, 0, nullptr);
+            pBio = impairBio(pBio);
 
             pSsl = SSL_new(pCtx);
             SSL_set_bio(pSsl, pBio, pBio);
@@ -41,52 +71,70 @@ namespace stms {
             SSL_set_fd(pSsl, sock);
         }
 
+        SSL_set_app_data(pSsl, this);
+        if (resumeSessions) {
+            std::lock_guard<std::mutex> lg(sessionMtx);
+            if (session != nullptr && SSL_SESSION_is_resumable(session)) {
+                SSL_set_session(pSsl, session);
+            }
+        }
+
         STMS_INFO("DTLS/TLS client about to preform handshake!");
+        Stopwatch handshakeTimer;
+        handshakeTimer.start();
         int handshakeTimeouts = 0;
         while (handshakeTimeouts < maxTimeouts) {
             handshakeTimeouts++;
-            try {
-                int handshakeRet = handleSslGetErr(pSsl, SSL_connect(pSsl));
-                if (handshakeRet == 1) {
-                    STMS_INFO("Client handshake successful!");
-                    handshakeTimeouts = 0;
-                    break;
-                }
-            } catch (SSLWantReadException &) {
+            int handshakeRet = SSL_connect(pSsl);
+            if (handshakeRet == 1) {
+                STMS_INFO("Client handshake successful!");
+                handshakeTimeouts = 0;
+                break;
+            }
+
+            SSLStatus status = getSslStatus(pSsl, handshakeRet);
+            if (status == SSLStatus::eWantRead) {
                 STMS_INFO("WANT_READ returned from SSL_connect! Blocking until read-ready...");
                 blockUntilReady(sock, pSsl, POLLIN);
-            } catch (SSLWantWriteException &) {
+            } else if (status == SSLStatus::eWantWrite) {
                 STMS_INFO("WANT_WRITE returned from SSL_connect! Blocking until write-ready...");
                 blockUntilReady(sock, pSsl, POLLOUT);
-            } catch (SSLFatalException &) {
+            } else if (status == SSLStatus::eFatal) {
                 STMS_WARN("SSL_connect() error was fatal! Dropping connection!");
+                metrics.addHandshakeFailure();
                 stop();
                 return;
-            } catch (SSLException &) {
+            } else {
                 STMS_INFO("Retrying SSL_connect()!");
             }
         }
 
         if (handshakeTimeouts >= maxTimeouts) {
             STMS_WARN("SSL_connect timed out completely ({}/{})! Dropping connection!", handshakeTimeouts, maxTimeouts);
+            metrics.addTimeout();
+            metrics.addHandshakeFailure();
             stop();
             return;
         }
         doShutdown = true;
+        metrics.addHandshake(handshakeTimer.getTime());
 
         char certName[certAndCipherLen];
         char cipherName[certAndCipherLen];
 
-        auto peerCert = SSL_get_certificate(pSsl);
+        auto peerCert = SSL_get_certificate(pSsl); // Owned by `pSsl`, don't free
         X509_NAME_oneline(X509_get_subject_name(peerCert), certName, certAndCipherLen);
-        X509_free(peerCert);
 
         SSL_CIPHER_description(SSL_get_current_cipher(pSsl), cipherName, certAndCipherLen);
 
         const char *compression = SSL_COMP_get_name(SSL_get_current_compression(pSsl));
         const char *expansion = SSL_COMP_get_name(SSL_get_current_expansion(pSsl));
 
-        STMS_INFO("Connected to server at {}: {}", addrStr, SSL_state_string_long(pSsl));
+        sessionReused = SSL_session_reused(pSsl) == 1;
+        (sessionReused ? resumedHandshakes : fullHandshakes)++;
+
+        STMS_INFO("Connected to server at {}{}: {}", addrStr, sessionReused ? " (resumed session)" : "",
+                  SSL_state_string_long(pSsl));
         STMS_INFO("Connected with cert: {}", certName);
         STMS_INFO("Connected using cipher {}", cipherName);
         STMS_INFO("Connected using compression {} and expansion {}",
@@ -109,11 +157,18 @@ namespace stms {
         if (timeoutMs > 0 && timeoutTimer.getTime() >= static_cast<float>(timeoutMs)) {
             if (isUdp) { DTLSv1_handle_timeout(pSsl); }
             STMS_INFO("Connection to server timed out! Dropping connection!");
+            metrics.addTimeout();
             stop();
             return false;
         }
 
-        if (recvfrom(sock, nullptr, 0, MSG_PEEK, nullptr, nullptr) == -1
+        bool sslPending;
+        {
+            // A read that didn't fit in the framer's ring leaves the rest of the record buffered in `pSsl`.
+            std::lock_guard<std::mutex> sslLg(sslMtx);
+            sslPending = pSsl != nullptr && SSL_pending(pSsl) > 0;
+        }
+        if (!sslPending && recvfrom(sock, nullptr, 0, MSG_PEEK, nullptr, nullptr) == -1
              && (errno == EAGAIN || errno == EWOULDBLOCK)) {
             return running;  // No data could be read
         }
@@ -126,35 +181,71 @@ namespace stms {
                 while (readTimeouts < maxTimeouts) {
                     readTimeouts++;
 
-                    try {
-                        uint8_t recvBuf[maxRecvLen];
-                        int readLen = handleSslGetErr(pSsl, SSL_read(pSsl, recvBuf, maxRecvLen));
+                    PacketBuffer recvBuf;
+                    uint8_t *target;
+                    int targetLen = maxRecvLen;
+                    if (framer) { // Read straight into the ring buffer
+                        auto span = framer->writeSpan();
+                        target = span.first;
+                        targetLen = static_cast<int>(std::min(span.second, static_cast<std::size_t>(maxRecvLen)));
+                    } else {
+                        recvBuf = PacketBuffer::alloc(maxRecvLen);
+                        target = recvBuf.data();
+                    }
+                    std::unique_lock<std::mutex> sslLg(sslMtx);
+                    if (pSsl == nullptr) { // A send task stopped the client
+                        break;
+                    }
+                    int readLen = SSL_read(pSsl, target, targetLen);
+                    SSLStatus status = readLen > 0 ? SSLStatus::eOk : getSslStatus(pSsl, readLen);
+                    sslLg.unlock();
 
-                        if (readLen > 0) {
-                            readTimeouts = 0;
-                            timeoutTimer.reset();
-                            recvCallback(recvBuf, readLen);
+                    if (readLen > 0) {
+                        readTimeouts = 0;
+                        timeoutTimer.reset();
+                        if (!framer) {
+                            metrics.addIn(static_cast<std::size_t>(readLen));
+                            recvBuf.setSize(static_cast<std::size_t>(readLen));
+                            recvCallback(recvBuf.data(), readLen);
                             break;
                         }
-                    } catch (SSLWantReadException &) {
+
+                        std::size_t numMsgs = 0;
+                        bool ok = framer->commit(static_cast<std::size_t>(readLen), [&](uint8_t *msg, std::size_t msgLen) {
+                            numMsgs++;
+                            framedRecvCallback(msg, msgLen);
+                        });
+                        metrics.addIn(static_cast<std::size_t>(readLen), numMsgs);
+                        if (!ok) {
+                            STMS_WARN("Server sent a message longer than {} bytes! Dropping connection!", maxFramedLen);
+                            stop();
+                        }
+                        break;
+                    }
+
+                    if (status == SSLStatus::eWantRead) {
                         STMS_INFO("SSL_read() returned WANT_READ. Retrying!");
+                        metrics.addWantRead();
                         blockUntilReady(sock, pSsl, POLLIN);
-                    } catch (SSLWantWriteException &) {
+                    } else if (status == SSLStatus::eWantWrite) {
                         STMS_INFO("SSL_read() returned WANT_WRITE. Retrying!");
+                        metrics.addWantWrite();
                         blockUntilReady(sock, pSsl, POLLOUT);
-                    } catch (SSLFatalException &) {
-                        STMS_WARN("Connection to server closed forcefully due to SSL_read() exception!");
-                        doShutdown = false;
+                    } else if (status == SSLStatus::eFatal) {
+                        STMS_WARN("Connection to server closed forcefully due to SSL_read() error!");
+                        // Still answer a close_notify, as the server drops sessions that weren't shut down cleanly.
+                        doShutdown = (SSL_get_shutdown(pSsl) & SSL_RECEIVED_SHUTDOWN) != 0;
 
                         stop();
                         break;
-                    } catch (SSLException &) {
+                    } else {
                         STMS_INFO("SSL_read() failed! Retrying...");
                     }
                 }
 
                 if (readTimeouts >= maxTimeouts) {
                     STMS_WARN("SSL_read() timed out completely! Dropping connection!");
+                    metrics.addTimeout();
                     stop();
                 }
                 isReading = false;
@@ -169,24 +260,25 @@ namespace stms {
             int numTries = 0;
             while (numTries < sslShutdownMaxRetries) {
                 numTries++;
-                try {
-                    int shutdownRet = SSL_shutdown(pSsl);
-                    if (shutdownRet < 0) {
-                        handleSslGetErr(pSsl, shutdownRet);
-                    } else if (shutdownRet == 0) {
-                        STMS_INFO("Waiting to hear back after SSL_shutdown... retrying");
-                        continue;
-                    } else if (shutdownRet == 1) {
-                        break;
-                    }
-                } catch (SSLWantWriteException &) {
+                std::unique_lock<std::mutex> sslLg(sslMtx); // A read task may still be waiting on the socket
+                int shutdownRet = SSL_shutdown(pSsl);
+                if (shutdownRet == 0) {
+                    STMS_INFO("Waiting to hear back after SSL_shutdown... retrying");
+                    continue;
+                } else if (shutdownRet == 1) {
+                    break;
+                }
+
+                SSLStatus status = getSslStatus(pSsl, shutdownRet);
+                sslLg.unlock();
+                if (status == SSLStatus::eWantWrite) {
                     blockUntilReady(sock, pSsl, POLLOUT);
-                } catch (SSLWantReadException &) {
+                } else if (status == SSLStatus::eWantRead) {
                     blockUntilReady(sock, pSsl, POLLIN);
-                } catch (SSLFatalException &) {
-                    STMS_WARN("Skipping SSL_shutdown() because of fatal exception!");
+                } else if (status == SSLStatus::eFatal) {
+                    STMS_WARN("Skipping SSL_shutdown() because of fatal error!");
                     break; // give up *tableflip*
-                } catch (SSLException &) {
+                } else {
                     STMS_INFO("Retrying SSL_shutdown()!");
                 }
             }
@@ -197,6 +289,7 @@ namespace stms {
         }
         doShutdown = false;
 
+        std::lock_guard<std::mutex> sslLg(sslMtx);
         SSL_free(pSsl);
         pSsl = nullptr; // Don't double-free!
     }
@@ -209,10 +302,22 @@ namespace stms {
             return prom->get_future();
         }
 
+        {
+            std::lock_guard<std::mutex> lg(sendMtx);
+            if (queuedBytes > 0 && queuedBytes + static_cast<std::size_t>(msgLen) > highWatermark) {
+                wantWritable = true;
+                prom->set_value(-4);
+                return prom->get_future();
+            }
+            queuedBytes += static_cast<std::size_t>(msgLen);
+            queuedMessages++;
+        }
+
         uint8_t *passIn{};
+        PacketBuffer pooled;
         if (copy) {
-            passIn = new uint8_t[msgLen];
-            std::copy(msg, msg + msgLen, passIn);
+            pooled = PacketBuffer::copyOf(msg, msgLen);
+            passIn = pooled.data();
         } else {
             // I am forced to do this as std::copy would be impossible otherwise. We don't actually do anything with
             // the non-const-ness though.
@@ -220,52 +325,206 @@ namespace stms {
         }
 
         // lambda captures validated
-        pPool->submitTask([&, capProm{prom}, capMsg{passIn}, capLen{msgLen}, capCpy{copy}]() {
+        pPool->submitTask([&, capProm{prom}, capMsg{passIn}, capLen{msgLen}, capBuf{pooled}]() {
 
             int sendTimeouts = 0;
             while (sendTimeouts < maxTimeouts) {
                 sendTimeouts++;
 
-                try {
-                    int ret = handleSslGetErr(pSsl, SSL_write(pSsl, capMsg, capLen));
-                    if (ret > 0) {
-                        sendTimeouts = 0;
-                        timeoutTimer.reset();
-                        capProm->set_value(ret);
+                int ret;
+                SSLStatus status;
+                {
+                    std::lock_guard<std::mutex> sslLg(sslMtx);
+                    if (pSsl == nullptr) { // Stopped while this was queued
+                        capProm->set_value(-1);
                         break;
                     }
-                } catch (SSLWantReadException &) {
+                    ret = SSL_write(pSsl, capMsg, capLen);
+                    status = ret > 0 ? SSLStatus::eOk : getSslStatus(pSsl, ret);
+                }
+
+                if (ret > 0) {
+                    sendTimeouts = 0;
+                    timeoutTimer.reset();
+                    metrics.addOut(static_cast<std::size_t>(ret));
+                    capProm->set_value(ret);
+                    break;
+                } else if (status == SSLStatus::eWantRead) {
                     STMS_WARN("send() failed with WANT_READ! Retrying!");
+                    metrics.addWantRead();
                     blockUntilReady(sock, pSsl, POLLIN);
-                } catch (SSLWantWriteException &) {
+                } else if (status == SSLStatus::eWantWrite) {
                     STMS_WARN("send() failed with WANT_WRITE! Retrying!");
+                    metrics.addWantWrite();
                     blockUntilReady(sock, pSsl, POLLOUT);
-                } catch (SSLFatalException &) {
+                } else if (status == SSLStatus::eFatal) {
                     STMS_WARN("Connection to server at {} closed forcefully!", addrStr);
                     doShutdown = false;
 
                     stop();
                     capProm->set_value(-2);
                     break;
-                } catch (SSLException &) {
+                } else {
                     STMS_INFO("Retrying SSL_write!");
                 }
             }
 
-            if (capCpy) {
-                delete[] capMsg;
-            }
-
             if (sendTimeouts >= maxTimeouts) {
                 STMS_WARN("SSL_write() timed out completely! Dropping connection!");
+                metrics.addTimeout();
                 stop();
                 capProm->set_value(-3);
             }
+
+            bool notifyWritable = false;
+            {
+                std::lock_guard<std::mutex> lg(sendMtx);
+                queuedBytes -= static_cast<std::size_t>(capLen);
+                queuedMessages--;
+                if (wantWritable && queuedBytes <= lowWatermark) {
+                    wantWritable = false;
+                    notifyWritable = running;
+                }
+            }
+
+            if (notifyWritable) {
+                writableCallback();
+            }
         });
 
         return prom->get_future();
     }
 
+    std::future<int> SSLClient::sendFile(int fd, off_t offset, int len) {
+        std::shared_ptr<std::promise<int>> prom = std::make_shared<std::promise<int>>();
+        if (len < 0 || offset < 0) {
+            STMS_ERROR("SSLClient::sendFile called with negative len ({}) or offset ({})!", len, offset);
+            prom->set_value(-5);
+            return prom->get_future();
+        } else if (!running) {
+            STMS_ERROR("SSLClient::sendFile called when not connected! {} bytes dropped!", len);
+            prom->set_value(-1);
+            return prom->get_future();
+        } else if (isUdp) {
+            STMS_ERROR("SSLClient::sendFile is only supported on TCP! {} bytes dropped!", len);
+            prom->set_value(-5);
+            return prom->get_future();
+        }
+
+        {
+            std::lock_guard<std::mutex> lg(sendMtx);
+            if (queuedBytes > 0 && queuedBytes + static_cast<std::size_t>(len) > highWatermark) {
+                wantWritable = true;
+                prom->set_value(-4);
+                return prom->get_future();
+            }
+            queuedBytes += static_cast<std::size_t>(len);
+            queuedMessages++;
+        }
+
+        // lambda captures validated
+        pPool->submitTask([&, capProm{prom}, capFd{fd}, capOffset{offset}, capLen{len}]() {
+            std::unique_ptr<FileSender> sender;
+            SSL *ssl;
+            {
+                std::lock_guard<std::mutex> sslLg(sslMtx);
+                ssl = pSsl;
+                if (ssl != nullptr) {
+                    sender = std::make_unique<FileSender>(ssl, capFd, capOffset, static_cast<std::size_t>(capLen));
+                }
+            }
+
+            bool stopped = sender == nullptr; // Stopped while this was queued
+            int sendTimeouts = 0;
+            while (!stopped && !sender->done() && sendTimeouts < maxTimeouts) {
+                sendTimeouts++;
+
+                long sent;
+                {
+                    std::lock_guard<std::mutex> sslLg(sslMtx);
+                    if (pSsl != ssl) { // Stopped (and maybe reconnected) between two steps
+                        stopped = true;
+                        break;
+                    }
+                    sent = sender->step();
+                }
+
+                if (sent < 0) {
+                    break;
+                } else if (sent > 0) {
+                    sendTimeouts = 0;
+                    timeoutTimer.reset();
+                } else if (sender->getStatus() == SSLStatus::eWantRead) {
+                    STMS_WARN("sendFile() failed with WANT_READ! Retrying!");
+                    metrics.addWantRead();
+                    blockUntilReady(sock, pSsl, POLLIN);
+                } else if (sender->getStatus() == SSLStatus::eWantWrite) {
+                    metrics.addWantWrite();
+                    blockUntilReady(sock, pSsl, POLLOUT); // Expected for large files, so don't spam warnings
+                } else if (sender->getStatus() == SSLStatus::eFatal) {
+                    STMS_WARN("Connection to server at {} closed forcefully!", addrStr);
+                    doShutdown = false;
+
+                    stop();
+                    sendTimeouts = -1;
+                    break;
+                } else {
+                    STMS_INFO("Retrying sendFile()!");
+                }
+            }
+
+            if (stopped) {
+                capProm->set_value(-1);
+            } else if (sender->done()) {
+                metrics.addOut(static_cast<std::size_t>(capLen));
+                capProm->set_value(capLen);
+            } else if (sendTimeouts < 0) {
+                capProm->set_value(-2);
+            } else if (sendTimeouts >= maxTimeouts) {
+                STMS_WARN("sendFile() timed out completely! Dropping connection!");
+                metrics.addTimeout();
+                stop();
+                capProm->set_value(-3);
+            } else {
+                capProm->set_value(-5);
+            }
+
+            bool notifyWritable = false;
+            {
+                std::lock_guard<std::mutex> lg(sendMtx);
+                queuedBytes -= static_cast<std::size_t>(capLen);
+                queuedMessages--;
+                if (wantWritable && queuedBytes <= lowWatermark) {
+                    wantWritable = false;
+                    notifyWritable = running;
+                }
+            }
+
+            if (notifyWritable) {
+                writableCallback();
+            }
+        });
+
+        return prom->get_future();
+    }
+
+    MetricsSnapshot SSLClient::getMetrics() {
+        MetricsSnapshot ret;
+        metrics.addTo(ret);
+        ret.connections = running ? 1 : 0;
+        {
+            std::lock_guard<std::mutex> lg(sendMtx);
+            ret.queuedBytes = queuedBytes;
+            ret.queuedMessages = queuedMessages;
+        }
+
+        std::lock_guard<std::mutex> sslLg(sslMtx);
+        if (isUdp && running && pSsl != nullptr) {
+            ret.mtu = DTLS_get_data_mtu(pSsl);
+        }
+        return ret;
+    }
+
     void SSLClient::waitEvents(int pollTimeoutMs) {
         pollfd servPollFd{};
         servPollFd.events = POLLIN;
@@ -292,10 +551,24 @@ namespace stms {
         isReading = rhs.isReading;
         timeoutTimer = rhs.timeoutTimer;
         recvCallback = rhs.recvCallback;
+        writableCallback = rhs.writableCallback;
+        framedRecvCallback = rhs.framedRecvCallback;
+        maxFramedLen = rhs.maxFramedLen;
+        highWatermark = rhs.highWatermark;
+        lowWatermark = rhs.lowWatermark;
+        resumeSessions = rhs.resumeSessions;
+        sessionReused = rhs.sessionReused;
+        fullHandshakes = rhs.fullHandshakes;
+        resumedHandshakes = rhs.resumedHandshakes;
+        metrics.copyFrom(rhs.metrics);
         moveSslBase(&rhs);
 
+        clearSession();
+        session = rhs.session;
+
         rhs.pSsl = nullptr;
         rhs.pBio = nullptr;
+        rhs.session = nullptr;
 
         return *this;
     }
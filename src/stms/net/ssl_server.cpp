@@ -7,6 +7,7 @@
 #include "stms/logging.hpp"
 
 #include <unistd.h>
+#include <cstring>
 #include <unordered_map>
 #include <sys/socket.h>
 #include <arpa/inet.h>
@@ -14,76 +15,387 @@
 #include <fcntl.h>
 #include <poll.h>
 
+#ifdef __linux__
+#   include <sys/epoll.h>
+#endif
+
 #include "openssl/ssl.h"
 #include "openssl/rand.h"
 
 namespace stms {
 
-    static bool hashSSL(SSL *ssl, unsigned *len, unsigned char *result) {
-        sockaddr_storage peer{};
+    /// What to do with a datagram from a peer that isn't a client yet. See `screenClientHello`.
+    enum class HelloVerdict {
+        eDrop, //!< Not a ClientHello we could answer, or one with a bad cookie
+        eNeedCookie, //!< A ClientHello without a cookie. Answer with a HelloVerifyRequest.
+        eCookieOk //!< A ClientHello with a valid cookie. Worth allocating an `SSL` for.
+    };
 
-        auto addrSize = BIO_dgram_get_peer(SSL_get_rbio(ssl), &peer);
+    static constexpr std::size_t dtlsRecordHeaderLen = 13; //!< Type, version, epoch, sequence number & length
+    static constexpr std::size_t dtlsHandshakeHeaderLen = 12; //!< Type, length, message seq, fragment offset & length
 
-        *len = DTLS1_COOKIE_LENGTH - 1;
-        HMAC(EVP_sha1(), getSecretCookie(), secretCookieLen, (unsigned char *) &peer, addrSize, result, len);
-        return true;
+    static inline uint32_t readBe24(const uint8_t *p) {
+        return (static_cast<uint32_t>(p[0]) << 16u) | (static_cast<uint32_t>(p[1]) << 8u) | p[2];
     }
 
-    static int genCookie(SSL *ssl, unsigned char *cookie, unsigned int *cookieLen) {
-        if (!hashSSL(ssl, cookieLen, cookie)) {
-            return 0;
+    /**
+     * @brief Check the cookie of a datagram from an unknown peer, without touching OpenSSL. Runs before anything is
+     *        allocated for the peer, so a flood of spoofed or replayed ClientHellos costs 1 HMAC each and no memory.
+     *        Datagrams that get `HelloVerdict::eCookieOk` are still passed to `DTLSv1_listen`, which has the last word.
+     * @param dg Datagram
+     * @param len Length of `dg`
+     * @param peer Address `dg` came from
+     * @param keys Keys to check the cookie with
+     * @return What to do with it
+     */
+    static HelloVerdict screenClientHello(const uint8_t *dg, std::size_t len, const sockaddr *peer, CookieKeys &keys) {
+        // ClientHello body: client_version (2), random (32), session_id (1 + n), cookie (1 + n), ...
+        constexpr std::size_t bodyOffset = dtlsRecordHeaderLen + dtlsHandshakeHeaderLen;
+        if (len < bodyOffset + 2 + 32 + 1 + 1) {
+            return HelloVerdict::eDrop;
+        }
+
+        std::size_t recordLen = (static_cast<std::size_t>(dg[11]) << 8u) | dg[12];
+        bool isHandshake = dg[0] == SSL3_RT_HANDSHAKE && dg[1] == DTLS1_VERSION_MAJOR && dg[3] == 0 && dg[4] == 0;
+        if (!isHandshake || recordLen > len - dtlsRecordHeaderLen || dg[dtlsRecordHeaderLen] != SSL3_MT_CLIENT_HELLO) {
+            return HelloVerdict::eDrop;
+        }
+
+        // `DTLSv1_listen` doesn't take fragmented ClientHellos either.
+        const uint8_t *hs = dg + dtlsRecordHeaderLen;
+        uint32_t msgLen = readBe24(hs + 1);
+        if (readBe24(hs + 6) != 0 || readBe24(hs + 9) != msgLen || msgLen + dtlsHandshakeHeaderLen > recordLen) {
+            return HelloVerdict::eDrop;
+        }
+
+        const uint8_t *end = hs + dtlsHandshakeHeaderLen + msgLen;
+        const uint8_t *sessionId = dg + bodyOffset + 2 + 32;
+        const uint8_t *cookie = sessionId + 1 + *sessionId;
+        if (cookie >= end || cookie + 1 + *cookie > end) {
+            return HelloVerdict::eDrop;
+        }
+        if (*cookie == 0) {
+            return HelloVerdict::eNeedCookie;
+        }
+
+        if (keys.verify(peer, cookie + 1, *cookie)) {
+            return HelloVerdict::eCookieOk;
         }
 
-        return 1;
+        STMS_WARN("Received an invalid cookie! Are you under a DDoS attack?");
+        return HelloVerdict::eDrop;
     }
 
-    static int verifyCookie(SSL *ssl, const unsigned char *cookie, unsigned int cookieLen) {
-        unsigned expectedLen;
-        uint8_t result[DTLS1_COOKIE_LENGTH - 1];
-        if (!hashSSL(ssl, &expectedLen, result)) {
-            return 0;
+    /**
+     * @brief Answer a ClientHello that got `HelloVerdict::eNeedCookie` with a HelloVerifyRequest, built by hand the
+     *        same way `DTLSv1_listen` does, so that no `SSL` is needed for it. See RFC 6347 section 4.2.1.
+     * @param sock Socket to send from
+     * @param hello The ClientHello
+     * @param peer Address to send to
+     * @param peerLen Length of `peer`
+     * @param keys Keys to compute the cookie with
+     * @param imp Impairment shim to send through, or `nullptr`
+     */
+    static void sendHelloVerify(int sock, const uint8_t *hello, const sockaddr *peer, socklen_t peerLen,
+                                CookieKeys &keys, const std::shared_ptr<NetImpairment> &imp) {
+        uint8_t hvr[dtlsRecordHeaderLen + dtlsHandshakeHeaderLen + 3 + DTLS1_COOKIE_LENGTH]{};
+        uint8_t *hs = hvr + dtlsRecordHeaderLen;
+        uint8_t *body = hs + dtlsHandshakeHeaderLen;
+
+        unsigned cookieLen = keys.generate(peer, body + 3);
+        if (cookieLen == 0) {
+            return;
+        }
+        body[0] = DTLS1_VERSION >> 8u; // Always DTLS 1.0, whatever version is negotiated later.
+        body[1] = DTLS1_VERSION & 0xffu;
+        body[2] = static_cast<uint8_t>(cookieLen);
+        uint32_t bodyLen = 3 + cookieLen;
+
+        hs[0] = DTLS1_MT_HELLO_VERIFY_REQUEST;
+        hs[1] = hs[9] = 0; // Message length & fragment length. Message seq & fragment offset are 0.
+        hs[2] = hs[10] = static_cast<uint8_t>(bodyLen >> 8u);
+        hs[3] = hs[11] = static_cast<uint8_t>(bodyLen);
+
+        auto recordLen = static_cast<uint16_t>(dtlsHandshakeHeaderLen + bodyLen);
+        hvr[0] = SSL3_RT_HANDSHAKE;
+        hvr[1] = DTLS1_VERSION >> 8u;
+        hvr[2] = DTLS1_VERSION & 0xffu;
+        std::memcpy(hvr + 3, hello + 3, 8); // Epoch 0 and the record sequence number of the ClientHello
+        hvr[11] = static_cast<uint8_t>(recordLen >> 8u);
+        hvr[12] = static_cast<uint8_t>(recordLen);
+
+        std::size_t len = dtlsRecordHeaderLen + recordLen;
+        ssize_t sent = imp ? imp->sendto(sock, hvr, len, 0, peer, peerLen) : sendto(sock, hvr, len, 0, peer, peerLen);
+        if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS) {
+            STMS_WARN("Failed to send HelloVerifyRequest to {}: {}", getAddrStr(peer), strerror(errno));
+        }
+    }
+
+    // BIO used with `SSLServer::setDtlsDemux`. Reads are served from the client's inbox, one datagram at a time,
+    // and writes are sent straight out of the shared listening socket to the client's address.
+    static int demuxBioWrite(BIO *bio, const char *data, int len) {
+        auto *cli = static_cast<ClientRepresentation *>(BIO_get_data(bio));
+        BIO_clear_retry_flags(bio);
+
+        if (cli->dtls->demuxSock < 0) {
+            return -1; // The server was stopped.
+        }
+
+        const auto &imp = cli->serv->getImpairment();
+        ssize_t sent = imp ? imp->sendto(cli->dtls->demuxSock, data, static_cast<std::size_t>(len), 0, cli->pSockAddr,
+                                         cli->sockAddrLen)
+                           : sendto(cli->dtls->demuxSock, data, static_cast<std::size_t>(len), 0, cli->pSockAddr,
+                                    cli->sockAddrLen);
+        if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS) {
+            STMS_WARN("sendto() failed for DTLS client at {}: {}", cli->addrStr, strerror(errno));
+            return -1;
+        }
+        return len; // If the socket buffer is full the datagram is lost, as it would be on the network.
+    }
+
+    static int demuxBioRead(BIO *bio, char *out, int outLen) {
+        auto *cli = static_cast<ClientRepresentation *>(BIO_get_data(bio));
+        BIO_clear_retry_flags(bio);
+
+        std::lock_guard<std::mutex> lg(cli->dtls->inboxMtx);
+        if (cli->dtls->inbox.empty()) {
+            BIO_set_retry_read(bio);
+            return -1;
+        }
+
+        PacketBuffer datagram = std::move(cli->dtls->inbox.front());
+        cli->dtls->inbox.pop_front();
+
+        int len = std::min(outLen, static_cast<int>(datagram.size()));
+        std::copy(datagram.data(), datagram.data() + len, reinterpret_cast<uint8_t *>(out));
+        return len;
+    }
+
+    static long demuxBioCtrl(BIO *bio, int cmd, long num, void *ptr) {
+        auto *cli = static_cast<ClientRepresentation *>(BIO_get_data(bio));
+        switch (cmd) {
+            case BIO_CTRL_DGRAM_GET_PEER: {
+                // Same as the dgram BIO: `num` is the size of `ptr`, or 0 if it is large enough for any address.
+                if (num == 0 || num > static_cast<long>(cli->sockAddrLen)) {
+                    num = static_cast<long>(cli->sockAddrLen);
+                }
+                std::copy(reinterpret_cast<uint8_t *>(cli->pSockAddr),
+                          reinterpret_cast<uint8_t *>(cli->pSockAddr) + num, static_cast<uint8_t *>(ptr));
+                return num;
+            }
+            case BIO_CTRL_DGRAM_QUERY_MTU: {
+                return dtlsDemuxMtu - (cli->pSockAddr->sa_family == AF_INET6 ? 48 : 28);
+            }
+            case BIO_CTRL_DGRAM_GET_MTU_OVERHEAD: {
+                return cli->pSockAddr->sa_family == AF_INET6 ? 48 : 28; // IP + UDP headers
+            }
+            case BIO_CTRL_PENDING: {
+                std::lock_guard<std::mutex> lg(cli->dtls->inboxMtx);
+                return cli->dtls->inbox.empty() ? 0 : static_cast<long>(cli->dtls->inbox.front().size());
+            }
+            case BIO_CTRL_DGRAM_SET_PEER: // The peer is fixed
+            case BIO_CTRL_DGRAM_SET_CONNECTED:
+            case BIO_CTRL_FLUSH: {
+                return 1;
+            }
+            default: {
+                return 0;
+            }
+        }
+    }
+
+    static BIO_METHOD *getDemuxBioMethod() {
+        static struct DemuxBioMethod {
+            BIO_METHOD *meth;
+
+            DemuxBioMethod() {
+                meth = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "stms DTLS demux");
+                BIO_meth_set_write(meth, demuxBioWrite);
+                BIO_meth_set_read(meth, demuxBioRead);
+                BIO_meth_set_ctrl(meth, demuxBioCtrl);
+                BIO_meth_set_create(meth, [](BIO *bio) -> int {
+                    BIO_set_init(bio, 1);
+                    return 1;
+                });
+            }
+
+            ~DemuxBioMethod() {
+                BIO_meth_free(meth);
+            }
+        } method;
+
+        return method.meth;
+    }
+
+    /**
+     * @brief A close_notify from the client surfaces as a fatal `SSL_read()`, but isn't an error. It should be answered
+     *        in `shutdownClient()`, as OpenSSL drops sessions of connections that weren't shut down cleanly.
+     * @return True if the client sent close_notify.
+     */
+    static bool closedCleanly(ClientRepresentation *cli) {
+        std::lock_guard<std::mutex> lg(cli->sslMtx);
+        return (SSL_get_shutdown(cli->pSsl) & SSL_RECEIVED_SHUTDOWN) != 0;
+    }
+
+    void SSLServer::beginHandshake(const std::shared_ptr<ClientRepresentation> &cli) {
+        cli->handshakeTimer.start();
+
+        // The first step can't wait for readiness: For DTLS, `DTLSv1_listen` already consumed the ClientHello.
+        int status = stepHandshake(cli);
+        if (status == 1) {
+            finishHandshake(cli);
+            return;
+        } else if (status < 0) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lg(handshakeMtx);
+        if (!running) {
+            return;
         }
+        handshakes[cli->sock] = cli;
+        armHandshake(cli);
+    }
 
-        if (cookieLen == expectedLen && std::memcmp(result, cookie, expectedLen) == 0) {
+    int SSLServer::stepHandshake(const std::shared_ptr<ClientRepresentation> &cli) {
+        int ret = SSL_accept(cli->pSsl);
+        if (ret == 1) {
+            STMS_INFO("Handshake completed successfully with cli at {}", cli->addrStr);
             return 1;
         }
 
-        STMS_WARN("Received an invalid cookie! Are you under a DDoS attack?");
+        SSLStatus status = getSslStatus(cli->pSsl, ret);
+        if (status == SSLStatus::eWantRead || status == SSLStatus::eWantWrite) {
+            cli->handshakeEvents = status == SSLStatus::eWantRead ? POLLIN : POLLOUT;
+            return 0;
+        } else if (status == SSLStatus::eFatal) {
+            STMS_WARN("Dropping connection to client at {} because of fatal SSL_accept() error!", cli->addrStr);
+            metrics.addHandshakeFailure();
+            return -1;
+        }
+
+        STMS_WARN("Non-fatal Handshake error! Retrying!");
+        cli->handshakeEvents = POLLIN;
         return 0;
+    }
+
+    void SSLServer::armHandshake(const std::shared_ptr<ClientRepresentation> &cli) {
+        if (loop) {
+            uint32_t events = (cli->handshakeEvents & POLLOUT ? EPOLLOUT : EPOLLIN) | EPOLLRDHUP | EPOLLONESHOT;
+            if (cli->handshakeWatched) {
+                loop->modify(cli->sock, events);
+            } else {
+                cli->handshakeWatched = loop->add(cli->sock, events);
+            }
+            return;
+        }
+
+        // Single-shot, so that it isn't re-armed in `handleUringCompletions` (the fd isn't in `loopClients`)
+        std::lock_guard<std::mutex> lg(uringMtx);
+        if (uringReactor && uring) {
+            uring->prepPoll(cli->sock, false, static_cast<uint32_t>(cli->handshakeEvents) | POLLRDHUP,
+                            uringFdTag(cli->sock));
+            uring->submit();
+        }
 
+        // With `IOBackend::ePoll`, `advanceHandshakes` polls every handshake each tick.
     }
 
-    void SSLServer::doHandshake(const std::shared_ptr<ClientRepresentation> &cli) {
-        int handshakeTimeouts = 0;
-        while (handshakeTimeouts < maxTimeouts) {
-            handshakeTimeouts++;
-            try {
-                int ret = handleSslGetErr(cli->pSsl, SSL_accept(cli->pSsl));
+    void SSLServer::disarmHandshake(const std::shared_ptr<ClientRepresentation> &cli) {
+        if (loop) {
+            if (cli->handshakeWatched) {
+                loop->remove(cli->sock);
+                cli->handshakeWatched = false;
+            }
+            return;
+        }
 
-                if (ret == 1) {
-                    handshakeTimeouts = 0;
-                    STMS_INFO("Handshake completed successfully with cli at {}", cli->addrStr);
-                    break;
-                }
-            } catch (SSLWantReadException &) {
-                STMS_INFO("WANT_READ returned from SSL_accept! Blocking until read-ready and retrying.");
-                blockUntilReady(cli->sock, cli->pSsl, POLLIN);
-            } catch (SSLWantWriteException &) {
-                STMS_INFO("WANT_WRITE returned from SSL_accept! Blocking until write-ready and retrying.");
-                blockUntilReady(cli->sock, cli->pSsl, POLLOUT);
-            } catch (SSLFatalException &) {
-                STMS_WARN("Dropping connection to client because of fatal SSL_accept() error!");
+        std::lock_guard<std::mutex> lg(uringMtx);
+        if (uringReactor && uring) {
+            uring->prepPollRemove(uringFdTag(cli->sock), eUringCancel);
+            uring->submit();
+        }
+    }
+
+    void SSLServer::advanceHandshakes() {
+        std::vector<std::shared_ptr<ClientRepresentation>> ready;
+        {
+            std::lock_guard<std::mutex> lg(handshakeMtx);
+            if (handshakes.empty()) {
                 return;
-            } catch (SSLException &) {
-                STMS_WARN("Non-fatal Handshake error! Retrying!");
+            }
+
+            if (loop || uringReactor) {
+                auto evIt = readyEvents.begin();
+                while (evIt != readyEvents.end()) {
+                    auto hsIt = handshakes.find(evIt->fd);
+                    if (hsIt == handshakes.end()) {
+                        ++evIt;
+                        continue;
+                    }
+
+                    ready.emplace_back(std::move(hsIt->second));
+                    handshakes.erase(hsIt);
+                    evIt = readyEvents.erase(evIt);
+                }
+            } else {
+                std::vector<pollfd> toPoll;
+                toPoll.reserve(handshakes.size());
+                for (const auto &hs : handshakes) {
+                    pollfd hsPollFd{};
+                    hsPollFd.fd = hs.first;
+                    hsPollFd.events = hs.second->handshakeEvents;
+                    toPoll.emplace_back(hsPollFd);
+                }
+
+                if (poll(toPoll.data(), toPoll.size(), 0) > 0) {
+                    for (const auto &pfd : toPoll) {
+                        if (pfd.revents != 0) {
+                            auto hsIt = handshakes.find(pfd.fd);
+                            ready.emplace_back(std::move(hsIt->second));
+                            handshakes.erase(hsIt);
+                        }
+                    }
+                }
+            }
+
+            auto hsIt = handshakes.begin();
+            while (hsIt != handshakes.end()) {
+                auto &cli = hsIt->second;
+                if (timeoutMs > 0 && cli->handshakeTimer.getTime() >= static_cast<float>(timeoutMs)) {
+                    STMS_WARN("Handshake with client at {} timed out! Dropping connection", cli->addrStr);
+                    metrics.addTimeout();
+                    metrics.addHandshakeFailure();
+                    disarmHandshake(cli);
+                    hsIt = handshakes.erase(hsIt);
+                    continue;
+                }
+
+                // Retransmit lost DTLS handshake flights. Nothing is done if the retransmit timer hasn't expired.
+                if (isUdp) {
+                    DTLSv1_handle_timeout(cli->pSsl);
+                }
+                ++hsIt;
             }
         }
 
-        if (handshakeTimeouts >= maxTimeouts) {
-            STMS_WARN("DTLS server handshake timed out completely! Dropping connection");
-            return;
+        for (auto &cli : ready) {
+            int status = stepHandshake(cli);
+            if (status == 0) {
+                std::lock_guard<std::mutex> lg(handshakeMtx);
+                handshakes[cli->sock] = cli;
+                armHandshake(cli);
+                continue;
+            }
+
+            disarmHandshake(cli);
+            if (status == 1) {
+                finishHandshake(cli);
+            }
         }
+    }
 
+    UUID SSLServer::finishHandshake(const std::shared_ptr<ClientRepresentation> &cli) {
         cli->doShutdown = true; // Handshake completed, we can shutdown!
 
         if (isUdp && timeoutMs > 0) {
@@ -100,30 +412,216 @@ namespace stms {
         char certName[certAndCipherLen];
         char cipherName[certAndCipherLen];
 
-        auto peerCert = SSL_get_certificate(cli->pSsl);
-        X509_NAME_oneline(X509_get_subject_name(peerCert), certName, certAndCipherLen);
-        X509_free(peerCert); // beware dynamic allocation! why isn't this documented?!
+        // Unlike `SSL_get_certificate`, this returns a new reference that must be freed.
+        X509 *peerCert = SSL_get_peer_certificate(cli->pSsl);
+        if (peerCert != nullptr) {
+            X509_NAME_oneline(X509_get_subject_name(peerCert), certName, certAndCipherLen);
+            X509_free(peerCert);
+        } else {
+            std::strcpy(certName, "(none)");
+        }
 
         SSL_CIPHER_description(SSL_get_current_cipher(cli->pSsl), cipherName, certAndCipherLen);
 
         const char *compression = SSL_COMP_get_name(SSL_get_current_compression(cli->pSsl));
         const char *expansion = SSL_COMP_get_name(SSL_get_current_expansion(cli->pSsl));
 
+        bool resumed = SSL_session_reused(cli->pSsl) == 1;
+        (resumed ? resumedHandshakes : fullHandshakes)++;
+
         std::string uuidStr = uuid.buildStr();
-        STMS_INFO("Client (addr='{}', uuid='{}') connected: {}",
-                  cli->addrStr, uuidStr, SSL_state_string_long(cli->pSsl));
+        STMS_INFO("Client (addr='{}', uuid='{}') connected{}: {}", cli->addrStr, uuidStr,
+                  resumed ? " (resumed session)" : "", SSL_state_string_long(cli->pSsl));
         STMS_INFO("Client (addr='{}', uuid='{}') has cert of {}", cli->addrStr, uuidStr, certName);
         STMS_INFO("Client (addr='{}', uuid='{}') is using cipher {}", cli->addrStr, uuidStr, cipherName);
+        if (isKernelTlsSend(cli->pSsl)) {
+            STMS_INFO("Client (addr='{}', uuid='{}') is using kernel TLS", cli->addrStr, uuidStr);
+        }
         STMS_INFO("Client (addr='{}', uuid='{}') is using compression {} and expansion {}", cli->addrStr, uuidStr,
                   compression == nullptr ? "NULL" : compression,
                   expansion == nullptr ? "NULL" : expansion);
+        metrics.addHandshake(cli->handshakeTimer.getTime());
+        if (clientMetrics) {
+            cli->metrics = std::make_unique<NetMetrics>();
+        }
+
         {
-            cli->timeoutTimer.start();
+            cli->touch();
             std::lock_guard<std::mutex> lg(clientsMtx);
-            clients[uuid] = cli;
+            clients.insert(uuid, cli);
+            scheduleIdle(uuid, cli);
+
+            if (cli->dtls == nullptr || !cli->dtls->demuxed) {
+                watchClient(cli->sock, uuid);
+            }
+        }
+
+        // lambda captures validated
+        pPool->submitTask([&, capCli = std::shared_ptr<ClientRepresentation>(cli), capUuid = UUID{uuid}]() {
+            connectCallback(capUuid, capCli->pSockAddr);
+        });
+        return uuid;
+    }
+
+    void SSLServer::demuxDatagrams() {
+        for (int numRecvs = 0; numRecvs < eventLoopMaxEvents; numRecvs++) {
+            sockaddr_storage storage{};
+            socklen_t addrLen = sizeof(sockaddr_storage);
+            ssize_t recvLen = recvfrom(sock, demuxBuf.data(), demuxBuf.capacity(), MSG_DONTWAIT,
+                                       reinterpret_cast<sockaddr *>(&storage), &addrLen);
+            if (recvLen < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    STMS_WARN("recvfrom() failed on DTLS listening socket: {}", strerror(errno));
+                }
+                return;
+            }
+
+            if (storage.ss_family != AF_INET && storage.ss_family != AF_INET6) {
+                STMS_WARN("Dropping datagram from unsupported family {}!", storage.ss_family);
+                continue;
+            }
+
+            std::string key(reinterpret_cast<const char *>(&storage), addrLen);
+            PacketBuffer datagram = PacketBuffer::copyOf(demuxBuf.data(), static_cast<std::size_t>(recvLen));
+
+            DemuxEntry entry;
+            {
+                std::lock_guard<std::mutex> lg(demuxMtx);
+                auto entryIt = demuxClients.find(key);
+                if (entryIt != demuxClients.end()) {
+                    entry = entryIt->second;
+                }
+            }
+
+            if (!entry.cli) {
+                acceptDemuxClient(key, storage, addrLen, std::move(datagram));
+                continue;
+            }
+
+            {
+                std::lock_guard<std::mutex> lg(entry.cli->dtls->inboxMtx);
+                if (entry.cli->dtls->inbox.size() >= dtlsDemuxQueueLen) {
+                    STMS_WARN("Too many datagrams queued for DTLS client at {}! Dropping one.", entry.cli->addrStr);
+                    continue;
+                }
+                entry.cli->dtls->inbox.emplace_back(std::move(datagram));
+            }
+
+            if (entry.established) {
+                dispatchRead(entry.cli, entry.uuid);
+            } else {
+                stepDemuxHandshake(key, entry.cli);
+            }
+        }
+    }
+
+    void SSLServer::acceptDemuxClient(const std::string &key, const sockaddr_storage &storage, socklen_t addrLen,
+                                      PacketBuffer datagram) {
+        // No state is kept for a peer until it echoes back a valid cookie, so spoofed ClientHellos cost nothing.
+        const auto *peer = reinterpret_cast<const sockaddr *>(&storage);
+        HelloVerdict verdict = screenClientHello(datagram.data(), datagram.size(), peer, *cookieKeys);
+        if (verdict == HelloVerdict::eNeedCookie) {
+            sendHelloVerify(sock, datagram.data(), peer, addrLen, *cookieKeys, impairment);
+        }
+        if (verdict != HelloVerdict::eCookieOk) {
+            return;
+        }
+
+        std::shared_ptr<ClientRepresentation> cli = std::make_shared<ClientRepresentation>();
+        cli->serv = this;
+        cli->sock = -1; // Owned by the server
+        cli->sockAddrLen = addrLen;
+
+        if (storage.ss_family == AF_INET6) {
+            auto *v6Addr = new sockaddr_in6();
+            *v6Addr = *reinterpret_cast<const sockaddr_in6 *>(&storage);
+            cli->pSockAddr = reinterpret_cast<sockaddr *>(v6Addr);
+        } else {
+            auto *v4Addr = new sockaddr_in();
+            *v4Addr = *reinterpret_cast<const sockaddr_in *>(&storage);
+            cli->pSockAddr = reinterpret_cast<sockaddr *>(v4Addr);
+        }
+        cli->addrStr = getAddrStr(cli->pSockAddr);
+
+        cli->dtls = new ClientRepresentation::DTLSSpecific{};
+        cli->dtls->demuxed = true;
+        cli->dtls->demuxSock = sock;
+        cli->dtls->demuxKey = key;
+        cli->dtls->inbox.emplace_back(std::move(datagram));
+        cli->dtls->pBioAddr = BIO_ADDR_new();
+        cli->dtls->pBio = BIO_new(getDemuxBioMethod());
+        BIO_set_data(cli->dtls->pBio, cli.get());
+
+        cli->pSsl = SSL_new(pCtx);
+        SSL_set_bio(cli->pSsl, cli->dtls->pBio, cli->dtls->pBio);
+
+        SSL_set_options(cli->pSsl, SSL_OP_COOKIE_EXCHANGE);
+        SSL_clear_options(cli->pSsl, SSL_OP_NO_COMPRESSION);
+
+        int listenStatus = DTLSv1_listen(cli->pSsl, cli->dtls->pBioAddr);
+        if (listenStatus < 0) {
+            STMS_ERROR("Fatal error from DTLSv1_listen!");
+            flushSSLErrors();
+            return;
+        } else if (listenStatus == 0) {
+            return; // The cookie was fine, but OpenSSL found something else wrong with the ClientHello.
+        }
+
+        STMS_INFO("New client at {} is trying to connect.", cli->addrStr);
+        cli->handshakeTimer.start();
+        {
+            std::lock_guard<std::mutex> lg(demuxMtx);
+            demuxClients[key] = DemuxEntry{cli, UUID{}, false};
+        }
+
+        stepDemuxHandshake(key, cli);
+    }
+
+    void SSLServer::stepDemuxHandshake(const std::string &key, const std::shared_ptr<ClientRepresentation> &cli) {
+        int status = stepHandshake(cli);
+        if (status == 0) {
+            return;
+        } else if (status < 0) {
+            std::lock_guard<std::mutex> lg(demuxMtx);
+            demuxClients.erase(key);
+            return;
+        }
+
+        UUID uuid = finishHandshake(cli);
+        {
+            std::lock_guard<std::mutex> lg(demuxMtx);
+            auto entryIt = demuxClients.find(key);
+            if (entryIt == demuxClients.end() || entryIt->second.cli != cli) {
+                return;
+            }
+            entryIt->second.uuid = uuid;
+            entryIt->second.established = true;
         }
 
-        connectCallback(uuid, cli->pSockAddr);
+        dispatchRead(cli, uuid); // Data may have arrived right behind the end of the handshake.
+    }
+
+    void SSLServer::sweepDemuxHandshakes() {
+        std::lock_guard<std::mutex> lg(demuxMtx);
+        auto entryIt = demuxClients.begin();
+        while (entryIt != demuxClients.end()) {
+            if (entryIt->second.established) {
+                ++entryIt;
+                continue;
+            }
+
+            auto &cli = entryIt->second.cli;
+            if (timeoutMs > 0 && cli->handshakeTimer.getTime() >= static_cast<float>(timeoutMs)) {
+                STMS_WARN("Handshake with client at {} timed out! Dropping connection", cli->addrStr);
+                metrics.addTimeout();
+                metrics.addHandshakeFailure();
+                entryIt = demuxClients.erase(entryIt);
+                continue;
+            }
+
+            DTLSv1_handle_timeout(cli->pSsl);
+            ++entryIt;
+        }
     }
 
     void SSLServer::handleDtlsConnection(const std::shared_ptr<ClientRepresentation> &cli) {
@@ -191,228 +689,757 @@ namespace stms {
         BIO_set_fd(SSL_get_rbio(cli->pSsl), cli->sock, BIO_NOCLOSE);
         BIO_ctrl(SSL_get_rbio(cli->pSsl), BIO_CTRL_DGRAM_SET_CONNECTED, 0, cli->pSockAddr);
 
-        doHandshake(cli);
-    }
+        beginHandshake(cli);
+    }
+
+    SSLServer::SSLServer(stms::PoolLike *pool, bool udp) : _stms_SSLBase(true, pool, udp) {
+        // Sessions can't be resumed with `SSL_VERIFY_PEER` unless they are tied to a context.
+        static const uint8_t sessionIdCtx[] = "stms";
+        SSL_CTX_set_session_id_context(pCtx, sessionIdCtx, sizeof(sessionIdCtx) - 1);
+        SSL_CTX_set_timeout(pCtx, sessionCacheTtl);
+    }
+
+    void SSLServer::setSessionLimits(std::size_t maxSessions, unsigned ttl) {
+        SSL_CTX_set_timeout(pCtx, ttl);
+        if (sessionCache) {
+            sessionCache->setLimits(maxSessions, ttl);
+        }
+    }
+
+    SessionStats SSLServer::getSessionStats() {
+        SessionStats ret;
+        ret.fullHandshakes = fullHandshakes;
+        ret.resumedHandshakes = resumedHandshakes;
+        if (sessionCache) {
+            sessionCache->addStats(ret);
+        }
+        return ret;
+    }
+
+    void SSLServer::addClientGauges(ClientRepresentation &cli, MetricsSnapshot &out) {
+        {
+            std::lock_guard<std::mutex> lg(cli.sendMtx);
+            out.queuedBytes += cli.queuedBytes;
+            out.queuedMessages += cli.sendQueue.size();
+        }
+
+        if (isUdp) {
+            std::size_t mtu = DTLS_get_data_mtu(cli.pSsl);
+            if (mtu != 0 && (out.mtu == 0 || mtu < out.mtu)) {
+                out.mtu = mtu;
+            }
+        }
+    }
+
+    MetricsSnapshot SSLServer::getMetrics() {
+        MetricsSnapshot ret;
+        metrics.addTo(ret);
+        {
+            std::lock_guard<std::mutex> lg(clientsMtx);
+            ret.connections = clients.size();
+            clients.forEach([&](const UUID &, const std::shared_ptr<ClientRepresentation> &cli) {
+                addClientGauges(*cli, ret);
+            });
+        }
+
+        {
+            std::lock_guard<std::mutex> lg(handshakeMtx);
+            ret.handshaking = handshakes.size();
+        }
+
+        std::lock_guard<std::mutex> lg(demuxMtx);
+        for (const auto &entry : demuxClients) {
+            ret.handshaking += entry.second.established ? 0 : 1;
+        }
+        return ret;
+    }
+
+    bool SSLServer::getClientMetrics(const UUID &cli, MetricsSnapshot &out) {
+        std::shared_ptr<ClientRepresentation> cliObj;
+        if (!clients.find(cli, cliObj) || !cliObj->metrics) {
+            return false;
+        }
+
+        out = MetricsSnapshot{};
+        cliObj->metrics->addTo(out);
+        out.connections = 1;
+        addClientGauges(*cliObj, out);
+        return true;
+    }
+
+    std::vector<std::pair<UUID, MetricsSnapshot>> SSLServer::getClientMetrics() {
+        std::vector<std::pair<UUID, MetricsSnapshot>> ret;
+        std::lock_guard<std::mutex> lg(clientsMtx);
+        clients.forEach([&](const UUID &uuid, const std::shared_ptr<ClientRepresentation> &cli) {
+            if (!cli->metrics) {
+                return;
+            }
+
+            MetricsSnapshot snap;
+            cli->metrics->addTo(snap);
+            snap.connections = 1;
+            addClientGauges(*cli, snap);
+            ret.emplace_back(uuid, snap);
+        });
+        return ret;
+    }
+
+    SSLServer::~SSLServer() {
+        // We cannot throw from a destructor (bc that is a terrible idea) so we settle for this instead.
+        if (running) {
+            STMS_ERROR("SSLServer destroyed whilst it was still running! Stopping it now...");
+            stop();
+        }
+    }
+
+    void SSLServer::onStart() {
+        readyEvents.clear();
+        uringReactor = false;
+
+        SessionTicketKeys::install(pCtx, ticketKeys);
+        SessionCache::install(pCtx, sessionCache);
+        if (!cookieKeys) {
+            cookieKeys = std::make_shared<CookieKeys>();
+        }
+        CookieKeys::install(pCtx, cookieKeys);
+        if (sessionTickets) {
+            SSL_CTX_clear_options(pCtx, SSL_OP_NO_TICKET);
+        } else {
+            SSL_CTX_set_options(pCtx, SSL_OP_NO_TICKET);
+        }
+
+        demuxActive = isUdp && dtlsDemux;
+        if (isUdp) {
+            demuxBuf = PacketBuffer::alloc(maxPlainRecvLen);
+        }
+        if (demuxActive) {
+            STMS_INFO("SSLServer demultiplexing DTLS clients on the listening socket");
+        }
+
+        if (ioBackend == IOBackend::ePoll) {
+            loop.reset();
+            return;
+        }
+
+#ifdef __linux__
+        if (ioBackend == IOBackend::eIOUring && startUring()) {
+            // Multishot polls only fire when new data arrives, so clients have to be drained like edge-triggered.
+            // SSL still does its own socket IO; the ring replaces `accept()` and the readiness notifications.
+            clientEvents = POLLIN | POLLRDHUP;
+            edgeClients = true;
+
+            std::lock_guard<std::mutex> lg(uringMtx);
+            uringReactor = isUdp ? uring->prepPollMultishot(0, true, POLLIN, eUringListen)
+                                 : uring->prepAcceptMultishot(0, true, eUringAccept);
+            if (uringReactor && uring->submit() >= 0) {
+                STMS_INFO("SSLServer using io_uring reactor");
+                loop.reset();
+                return;
+            }
+            uringReactor = false;
+        }
+
+        if (ioBackend == IOBackend::eIOUring) {
+            STMS_WARN("Failed to set up io_uring reactor! Falling back to IOBackend::eEpoll");
+        }
+
+        // The listening socket is always level-triggered, since `DTLSv1_listen` can't tell us when it is drained.
+        // Clients are either edge-triggered and always drained, or level-triggered and re-armed after each drain
+        // so that a client with unread data isn't reported over and over while a task is already reading from it.
+        clientEvents = EPOLLIN | EPOLLRDHUP | (edgeTriggered ? EPOLLET : EPOLLONESHOT);
+        edgeClients = edgeTriggered;
+
+        if (!loop) {
+            loop = std::make_unique<EventLoop>();
+        }
+
+        if (loop->isValid() && loop->add(sock, EPOLLIN)) {
+            STMS_INFO("SSLServer using epoll reactor ({}-triggered)", edgeTriggered ? "edge" : "level");
+            return;
+        }
+#endif
+
+        STMS_WARN("Failed to set up epoll reactor! Falling back to IOBackend::ePoll");
+        loop.reset();
+    }
+
+    void SSLServer::watchClient(int fd, const UUID &uuid) {
+        if (loop) {
+            loopClients[fd] = uuid;
+            loop->add(fd, clientEvents);
+            return;
+        }
+
+        std::lock_guard<std::mutex> lg(uringMtx);
+        if (uringReactor && uring) {
+            loopClients[fd] = uuid;
+            uring->prepPollMultishot(fd, false, clientEvents, uringFdTag(fd));
+            uring->submit();
+        }
+    }
+
+    void SSLServer::unwatchClient(int fd) {
+        if (loopClients.erase(fd) == 0) {
+            return;
+        }
+
+        if (loop) {
+            loop->remove(fd);
+            return;
+        }
+
+        // Unlike epoll, a pending poll holds a reference to the socket, so it must be removed before the socket is
+        // actually closed. Submit right away so the connection isn't held open until the next tick.
+        std::lock_guard<std::mutex> lg(uringMtx);
+        if (uring) {
+            uring->prepPollRemove(uringFdTag(fd), eUringCancel);
+            uring->submit();
+        }
+    }
+
+    void SSLServer::handleUringCompletions() {
+        uringCompletions.clear();
+        reapUring(uringCompletions);
+
+        for (const auto &c : uringCompletions) {
+            if (c.userData == eUringAccept) {
+                if (c.res >= 0) {
+                    sockaddr_storage storage{};
+                    socklen_t addrLen = sizeof(sockaddr_storage);
+                    if (getpeername(c.res, reinterpret_cast<sockaddr *>(&storage), &addrLen) == -1) {
+                        STMS_WARN("getpeername() failed for accepted client: {}", strerror(errno));
+                        close(c.res);
+                    } else {
+                        setupTcpClient(c.res, storage, addrLen);
+                    }
+                } else {
+                    STMS_WARN("io_uring accept() failed: {}", strerror(-c.res));
+                }
+            } else if (c.userData == eUringListen) {
+                acceptClient(); // Drains several datagrams, as they may arrive for a single wake-up.
+            } else if ((c.userData & 0xffu) == eUringFdPoll && c.res >= 0) {
+                readyEvents.emplace_back(FDEvent{static_cast<int>(c.userData >> 8u), static_cast<uint32_t>(c.res)});
+            }
+
+            // Multishot requests can terminate (e.g. on overflow). Re-arm them unless they were removed.
+            if (!IOUring::hasMore(c) && c.res != -ECANCELED && c.res != -ENOENT) {
+                if (c.userData == eUringAccept || c.userData == eUringListen) {
+                    std::lock_guard<std::mutex> lg(uringMtx);
+                    if (uring) {
+                        isUdp ? uring->prepPollMultishot(0, true, POLLIN, eUringListen)
+                              : uring->prepAcceptMultishot(0, true, eUringAccept);
+                    }
+                } else if ((c.userData & 0xffu) == eUringFdPoll) {
+                    int fd = static_cast<int>(c.userData >> 8u);
+
+                    std::lock_guard<std::mutex> lg(clientsMtx);
+                    std::lock_guard<std::mutex> uringLg(uringMtx);
+                    if (uring && loopClients.find(fd) != loopClients.end()) {
+                        uring->prepPollMultishot(fd, false, clientEvents, c.userData);
+                    }
+                }
+            }
+        }
+    }
+
+    void SSLServer::onStop() {
+        std::lock_guard<std::mutex> lg(clientsMtx);
+        clients.forEach([&](const UUID &uuid, const std::shared_ptr<ClientRepresentation> &cli) {
+            auto *addrCpy = new sockaddr_storage{};
+            // STMS_FATAL("p = {}", stms::getAddrStr(cli->pSockAddr));
+
+            std::copy(reinterpret_cast<uint8_t *>(cli->pSockAddr),
+                      reinterpret_cast<uint8_t *>(cli->pSockAddr) + cli->sockAddrLen,
+                      reinterpret_cast<uint8_t *>(addrCpy));
+            // STMS_FATAL("p2 = {}", stms::getAddrStr(reinterpret_cast<const sockaddr *>(addrCpy)));
+
+            pPool->submitTask([&, capUuid = UUID{uuid},
+                                      capAddr{addrCpy}, this]() {
+                // STMS_FATAL("p3 = {}", stms::getAddrStr(reinterpret_cast<const sockaddr *>(capAddr)));
+                disconnectCallback(capUuid, reinterpret_cast<sockaddr *>(capAddr));
+                delete capAddr;
+            });
+        });
+        clients.clear();
+
+        // Client sockets are closed (and thus removed from `loop`) as their `ClientRepresentation`s are destroyed.
+        loopClients.clear();
+        idleWheel.clear();
+
+        std::lock_guard<std::mutex> flushLg(flushMtx);
+        pendingFlushes.clear();
+
+        std::lock_guard<std::mutex> handshakeLg(handshakeMtx);
+        handshakes.clear();
+
+        std::lock_guard<std::mutex> demuxLg(demuxMtx);
+        for (auto &entry : demuxClients) {
+            // Tasks may still hold on to the client after the listening socket is closed, so say goodbye now.
+            auto &cli = entry.second.cli;
+            std::lock_guard<std::mutex> sslLg(cli->sslMtx);
+            if (cli->doShutdown) {
+                SSL_shutdown(cli->pSsl);
+                cli->doShutdown = false;
+            }
+            cli->dtls->demuxSock = -1;
+        }
+        demuxClients.clear();
+    }
+
+    void SSLServer::acceptClient() {
+        if (!isUdp) {
+            // Drain the backlog, so a burst of connections doesn't take one tick per client.
+            // We use accept() instead of SSL_stateless as we are using TCP and source IPs are already validated
+            // in the tcp handshake. https://www.openssl.org/docs/man1.1.1/man3/SSL_stateless.html
+            for (int numAccepts = 0; numAccepts < acceptBatchLen && running; numAccepts++) {
+                auto storage = sockaddr_storage{};
+                socklen_t addrLen = sizeof(sockaddr_storage);
+#ifdef __linux__
+                int fd = accept4(sock, reinterpret_cast<sockaddr *>(&storage), &addrLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+                int fd = accept(sock, reinterpret_cast<sockaddr *>(&storage), &addrLen);
+                if (fd != -1 && fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+                    STMS_WARN("Failed to set client socket to non-blocking: {}. Refusing to connect.", strerror(errno));
+                    close(fd);
+                    continue;
+                }
+#endif
+                if (fd == -1) {
+                    if (errno == EINTR || errno == ECONNABORTED) {
+                        continue;
+                    }
+
+                    // if errno is one of these, then there's simply no client
+                    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                        STMS_WARN("accept() failed: {}", strerror(errno));
+                    }
+                    return;
+                }
+
+                setupTcpClient(fd, storage, addrLen);
+            }
+            return;
+        }
+
+        if (demuxActive) {
+            demuxDatagrams();
+            return;
+        }
+
+        for (int numListens = 0; numListens < acceptBatchLen && running; numListens++) {
+            // Look at the datagram before `DTLSv1_listen` reads it, so that nothing is allocated for peers that
+            // haven't proven they own their address yet.
+            sockaddr_storage storage{};
+            socklen_t addrLen = sizeof(sockaddr_storage);
+            ssize_t recvLen = recvfrom(sock, demuxBuf.data(), demuxBuf.capacity(), MSG_PEEK | MSG_DONTWAIT,
+                                       reinterpret_cast<sockaddr *>(&storage), &addrLen);
+            if (recvLen < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    STMS_WARN("recvfrom() failed on DTLS listening socket: {}", strerror(errno));
+                }
+                return;
+            }
+
+            HelloVerdict verdict = HelloVerdict::eDrop;
+            if (storage.ss_family == AF_INET || storage.ss_family == AF_INET6) {
+                verdict = screenClientHello(demuxBuf.data(), static_cast<std::size_t>(recvLen),
+                                            reinterpret_cast<sockaddr *>(&storage), *cookieKeys);
+            } else {
+                STMS_WARN("A client tried to connect with an unsupported family {}! Refusing to connect!",
+                          storage.ss_family);
+            }
+
+            if (verdict != HelloVerdict::eCookieOk) {
+                if (verdict == HelloVerdict::eNeedCookie) {
+                    sendHelloVerify(sock, demuxBuf.data(), reinterpret_cast<sockaddr *>(&storage), addrLen, *cookieKeys,
+                                    impairment);
+                }
+                recv(sock, nullptr, 0, MSG_DONTWAIT); // Discard it
+                continue;
+            }
+
+            listenDtlsClient();
+        }
+    }
+
+    void SSLServer::listenDtlsClient() {
+        std::shared_ptr<ClientRepresentation> cli = std::make_shared<ClientRepresentation>();
+        cli->serv = this;
+
+        cli->dtls = new ClientRepresentation::DTLSSpecific{};
+        cli->dtls->pBio = BIO_new_dgram(sock, BIO_NOCLOSE);
+
+        if (timeoutMs > 0) {
+            timeval timeout{};
+            timeout.tv_usec = (timeoutMs % 1000) * 1000;
+            timeout.tv_sec = timeoutMs / 1000;
+            BIO_ctrl(cli->dtls->pBio, BIO_CTRL_DGRAM_SET_RECV_TIMEOUT, 0, &timeout);
+            BIO_ctrl(cli->dtls->pBio, BIO_CTRL_DGRAM_SET_SEND_TIMEOUT, 0, &timeout);
+        }
+        cli->dtls->pBio = impairBio(cli->dtls->pBio, sock);
+
 
-    SSLServer::SSLServer(stms::PoolLike *pool, bool udp) : _stms_SSLBase(true, pool, udp) {
-        SSL_CTX_set_cookie_generate_cb(pCtx, genCookie);
-        SSL_CTX_set_cookie_verify_cb(pCtx, verifyCookie);
-    }
+        cli->pSsl = SSL_new(pCtx);
+        cli->dtls->pBioAddr = BIO_ADDR_new();
+        SSL_set_bio(cli->pSsl, cli->dtls->pBio, cli->dtls->pBio);
 
-    SSLServer::~SSLServer() {
-        // We cannot throw from a destructor (bc that is a terrible idea) so we settle for this instead.
-        if (running) {
-            STMS_ERROR("SSLServer destroyed whilst it was still running! Stopping it now...");
-            stop();
-        }
-    }
+        BIO_ctrl(cli->dtls->pBio, BIO_CTRL_DGRAM_MTU_DISCOVER, 0, nullptr);
 
-    void SSLServer::onStop() {
-        std::lock_guard<std::mutex> lg(clientsMtx);
-        for (auto &pair : clients) {
-            auto *addrCpy = new sockaddr_storage{};
-            // STMS_FATAL("p = {}", stms::getAddrStr(pair.second->pSockAddr));
+        SSL_set_options(cli->pSsl, SSL_OP_COOKIE_EXCHANGE);
+        SSL_clear_options(cli->pSsl, SSL_OP_NO_COMPRESSION);
 
-            std::copy(reinterpret_cast<uint8_t *>(pair.second->pSockAddr),
-                      reinterpret_cast<uint8_t *>(pair.second->pSockAddr) + pair.second->sockAddrLen,
-                      reinterpret_cast<uint8_t *>(addrCpy));
-            // STMS_FATAL("p2 = {}", stms::getAddrStr(reinterpret_cast<const sockaddr *>(addrCpy)));
+        int listenStatus = DTLSv1_listen(cli->pSsl, cli->dtls->pBioAddr);
 
-            pPool->submitTask([&, capUuid = UUID{pair.first},
-                                      capAddr{addrCpy}, this]() {
-                // STMS_FATAL("p3 = {}", stms::getAddrStr(reinterpret_cast<const sockaddr *>(capAddr)));
-                disconnectCallback(capUuid, reinterpret_cast<sockaddr *>(capAddr));
-                delete capAddr;
+        // The cookie was already checked, so 0 means OpenSSL found something else wrong with the ClientHello.
+        if (listenStatus < 0) {
+            STMS_ERROR("Fatal error from DTLSv1_listen!");
+            flushSSLErrors();
+        } else if (listenStatus >= 1) {
+            // Lambda captures validated
+            pPool->submitTask([&, capCli{cli}]() {
+                this->handleDtlsConnection(capCli);
             });
         }
-        clients.clear();
     }
 
-    bool SSLServer::tick() {
-        if (!running) {
-            STMS_WARN("SSLServer::tick() called when stopped! Ignoring invocation!");
-            return false;
-        }
-
+    void SSLServer::setupTcpClient(int fd, const sockaddr_storage &storage, socklen_t addrLen) {
         std::shared_ptr<ClientRepresentation> cli = std::make_shared<ClientRepresentation>();
         cli->serv = this;
+        cli->sock = fd;
+        cli->sockAddrLen = addrLen;
 
-        if (isUdp) {
-            cli->dtls = new ClientRepresentation::DTLSSpecific{};
-            cli->dtls->pBio = BIO_new_dgram(sock, BIO_NOCLOSE);
+        // Prayin' that this works.
+        if (storage.ss_family == AF_INET) {
+            auto in4Addr = new sockaddr_in();
+            *in4Addr = *reinterpret_cast<const sockaddr_in *>(&storage);
+            cli->pSockAddr = reinterpret_cast<sockaddr *>(in4Addr);
+
+            if (cli->pSockAddr->sa_family != AF_INET) {
+                throw std::runtime_error("family mismatch");
+            }
 
-            if (timeoutMs > 0) {
-                timeval timeout{};
-                timeout.tv_usec = (timeoutMs % 1000) * 1000;
-                timeout.tv_sec = timeoutMs / 1000;
-                BIO_ctrl(cli->dtls->pBio, BIO_CTRL_DGRAM_SET_RECV_TIMEOUT, 0, &timeout);
-                BIO_ctrl(cli->dtls->pBio, BIO_CTRL_DGRAM_SET_SEND_TIMEOUT, 0, &timeout);
+        } else if (storage.ss_family == AF_INET6) {
+            auto in6Addr = new sockaddr_in6();
+            *in6Addr = *reinterpret_cast<const sockaddr_in6 *>(&storage);
+            cli->pSockAddr = reinterpret_cast<sockaddr *>(in6Addr);
+            if (cli->pSockAddr->sa_family != AF_INET6) {
+                throw std::runtime_error("family mismatch");
             }
+        } else {
+            STMS_WARN("Client tried to connect with bad proto {}! Dropping connection!", storage.ss_family);
+            return;
+        }
 
+        cli->addrStr = getAddrStr(cli->pSockAddr);
+        STMS_INFO("New TCP client at {} is trying to connect.", cli->addrStr);
 
-            cli->pSsl = SSL_new(pCtx);
-            cli->dtls->pBioAddr = BIO_ADDR_new();
-            SSL_set_bio(cli->pSsl, cli->dtls->pBio, cli->dtls->pBio);
+        cli->pSsl = SSL_new(pCtx);
+        SSL_set_fd(cli->pSsl, cli->sock);
 
-            BIO_ctrl(cli->dtls->pBio, BIO_CTRL_DGRAM_MTU_DISCOVER, 0, nullptr);
+        beginHandshake(cli);
+    }
 
-            SSL_set_options(cli->pSsl, SSL_OP_COOKIE_EXCHANGE);
-            SSL_clear_options(cli->pSsl, SSL_OP_NO_COMPRESSION);
+    void SSLServer::dispatchRead(const std::shared_ptr<ClientRepresentation> &cli, const UUID &uuid) {
+        uint8_t state = cli->readState.load();
+        while (true) {
+            if (state == 0 && cli->readState.compare_exchange_weak(state, 1)) {
+                // lambda captures validated
+                pPool->submitTask([&, capCli = std::shared_ptr<ClientRepresentation>(cli), capUuid = UUID{uuid}]() {
+                    this->drainClient(capCli, capUuid);
+                });
+                return;
+            }
 
-            int listenStatus = DTLSv1_listen(cli->pSsl, cli->dtls->pBioAddr);
+            // A task is already draining this client. Make sure it goes around again to pick up the new data.
+            if (state == 1 && cli->readState.compare_exchange_weak(state, 2)) {
+                return;
+            }
 
-            // If it returns 0 it means no clients have tried to connect.
-            if (listenStatus < 0) {
-                STMS_ERROR("Fatal error from DTLSv1_listen!");
-                flushSSLErrors();
-            } else if (listenStatus >= 1) {
-                if (BIO_ADDR_family(cli->dtls->pBioAddr) != AF_INET6 &&
-                    BIO_ADDR_family(cli->dtls->pBioAddr) != AF_INET) {
-                    STMS_WARN("A client tried to connect with an unsupported family {}! Refusing to connect!",
-                                      BIO_ADDR_family(cli->dtls->pBioAddr));
-                } else {
-                    // Lambda captures validated
-                    pPool->submitTask([&, capCli{cli}]() {
-                        this->handleDtlsConnection(capCli);
-                    });
-                }
+            if (state == 2) {
+                return;
             }
-        } else {
+        }
+    }
 
-            auto storage = sockaddr_storage{};
-            cli->sockAddrLen = sizeof(sockaddr_storage);
+    void SSLServer::drainClient(const std::shared_ptr<ClientRepresentation> &cli, const UUID &uuid) {
+        PacketBuffer recvBuf = PacketBuffer::alloc(maxRecvLen);
+        int numReads = 0;
+        int readTimeouts = 0;
 
-            // We use accept() instead of SSL_stateless as we are using TCP and source IPs are already validated
-            // in the tcp handshake. https://www.openssl.org/docs/man1.1.1/man3/SSL_stateless.html
-            cli->sock = accept(sock, reinterpret_cast<sockaddr *>(&storage), &cli->sockAddrLen);
-            // accept() sets the size of `sockAddrLen`
+        while (readTimeouts < maxTimeouts) {
+            if (recvBuf.useCount() > 1) {
+                recvBuf = PacketBuffer::alloc(maxRecvLen); // The callback kept the last one with `PacketBuffer::retain`
+            }
+            auto target = readTarget(*cli, recvBuf);
+            std::unique_lock<std::mutex> sslLg(cli->sslMtx);
+            int readLen = SSL_read(cli->pSsl, target.first, target.second);
+
+            if (readLen > 0) {
+                sslLg.unlock();
+                readTimeouts = 0;
+                cli->touch();
+                if (!deliverRead(*cli, uuid, recvBuf, readLen)) {
+                    // `readState` is left set, so that no more reads are dispatched to this client before it's reaped.
+                    std::lock_guard<std::mutex> lg(deadMtx);
+                    deadClients.push(uuid);
+                    return;
+                }
 
-            if (cli->sock < 1) {
-                // if errno is one of these, then there's simply no client
-                if (!(errno == EAGAIN || errno == EWOULDBLOCK)) {
-                    STMS_WARN("accept() failed: {}", strerror(errno));
+                if (!running) {
+                    return; // The server was stopped (possibly by the callback). Leave the rest for `SSL_shutdown`.
                 }
 
-                goto skipConnect; // Forgive me (looks around for velociraptors)
+                if (++numReads >= reactorMaxReadsPerTask) {
+                    // Don't hog this worker. `readState` stays set, so no other task will be started meanwhile.
+                    // lambda captures validated
+                    pPool->submitTask([&, capCli = std::shared_ptr<ClientRepresentation>(cli), capUuid = UUID{uuid}]() {
+                        this->drainClient(capCli, capUuid);
+                    });
+                    return;
+                }
+                continue;
             }
 
-            // Prayin' that this works.
-            if (storage.ss_family == AF_INET) {
-                auto in4Addr = new sockaddr_in();
-                *in4Addr = *reinterpret_cast<sockaddr_in *>(&storage);
-                cli->pSockAddr = reinterpret_cast<sockaddr *>(in4Addr);
+            SSLStatus status = getSslStatus(cli->pSsl, readLen);
+            sslLg.unlock(); // Keep `pSsl` locked for `SSL_get_error`, but not for the handlers, which may block.
 
-                if (cli->pSockAddr->sa_family != AF_INET) {
-                    throw std::runtime_error("family mismatch");
+            // This is the expected way out: The socket is empty so we wait to be woken up by `loop` again.
+            if (status == SSLStatus::eWantRead) {
+                uint8_t expected = 1;
+                if (cli->readState.compare_exchange_strong(expected, 0)) {
+                    if (loop && !edgeClients && !demuxActive) {
+                        loop->modify(cli->sock, clientEvents);
+                    }
+                    return;
                 }
 
-            } else if (storage.ss_family == AF_INET6) {
-                auto in6Addr = new sockaddr_in6();
-                *in6Addr = *reinterpret_cast<sockaddr_in6 *>(&storage);
-                cli->pSockAddr = reinterpret_cast<sockaddr *>(in6Addr);
-                if (cli->pSockAddr->sa_family != AF_INET6) {
-                    throw std::runtime_error("family mismatch");
-                }
+                cli->readState = 1; // More data arrived while we were reading (edge-triggered). Go again.
+                continue;
+            }
+
+            readTimeouts++;
+            if (status == SSLStatus::eWantWrite) {
+                STMS_INFO("SSL_read() returned WANT_WRITE. Blocking then retrying!");
+                record(*cli, [](NetMetrics &m) { m.addWantWrite(); });
+                blockUntilReady(cli->sock, cli->pSsl, POLLOUT);
+            } else if (status == SSLStatus::eFatal) {
+                STMS_WARN("Fatal SSL_read() error occurred! Disconnecting client {}", uuid.buildStr());
+                cli->doShutdown = closedCleanly(cli.get());
+
+                // `readState` is left set, so that no more reads are dispatched to this client before it's reaped.
+                std::lock_guard<std::mutex> lg(deadMtx);
+                deadClients.push(uuid);
+                return;
             } else {
-                STMS_WARN("Client tried to connect with bad proto {}! Dropping connection!", storage.ss_family);
-                goto skipConnect;
+                STMS_WARN("Client {} SSL_read failed for the reason above! Retrying!", uuid.buildStr());
+            }
+        }
+
+        STMS_WARN("SSL_read() timed out completely! Dropping connection!");
+        metrics.addTimeout();
+        std::lock_guard<std::mutex> lg(deadMtx);
+        deadClients.push(uuid);
+    }
+
+    std::pair<uint8_t *, int> SSLServer::readTarget(ClientRepresentation &cli, PacketBuffer &recvBuf) {
+        if (!framedRecvCallback || isUdp) {
+            return {recvBuf.data(), maxRecvLen};
+        }
+
+        if (!cli.framer) {
+            cli.framer = std::make_unique<MessageFramer>(maxFramedLen);
+        }
+        auto span = cli.framer->writeSpan();
+        return {span.first, static_cast<int>(std::min(span.second, static_cast<std::size_t>(maxRecvLen)))};
+    }
+
+    bool SSLServer::deliverRead(ClientRepresentation &cli, const UUID &uuid, PacketBuffer &recvBuf, int readLen) {
+        if (!cli.framer) {
+            record(cli, [&](NetMetrics &m) { m.addIn(static_cast<std::size_t>(readLen)); });
+            recvBuf.setSize(static_cast<std::size_t>(readLen));
+            recvCallback(uuid, cli.pSockAddr, recvBuf.data(), readLen);
+            return true;
+        }
+
+        std::size_t numMsgs = 0;
+        bool ok = cli.framer->commit(static_cast<std::size_t>(readLen), [&](uint8_t *msg, std::size_t msgLen) {
+            numMsgs++;
+            framedRecvCallback(uuid, cli.pSockAddr, msg, static_cast<int>(msgLen));
+        });
+        record(cli, [&](NetMetrics &m) { m.addIn(static_cast<std::size_t>(readLen), numMsgs); });
+
+        if (!ok) {
+            STMS_WARN("Client {} sent a message longer than {} bytes! Dropping connection!", uuid.buildStr(), maxFramedLen);
+        }
+        return ok;
+    }
+
+    void SSLServer::scheduleIdle(const UUID &uuid, const std::shared_ptr<ClientRepresentation> &cli) {
+        // With timeouts disabled, still check back every so often in case `setTimeout` is called later.
+        auto timeout = std::chrono::milliseconds(timeoutMs > 0 ? timeoutMs : minIoTimeout);
+        idleWheel.schedule(IdleEntry{uuid, cli}, cli->getLastActive() + timeout);
+    }
+
+    void SSLServer::expireIdleClients() {
+        auto now = std::chrono::steady_clock::now();
+        idleWheel.advance(now, [&](IdleEntry &&entry) {
+            std::shared_ptr<ClientRepresentation> cli;
+            if (!clients.find(entry.uuid, cli) || cli != entry.cli.lock()) {
+                return; // The client was since dropped, or has a new UUID with its own entry
             }
 
-            cli->addrStr = getAddrStr(cli->pSockAddr);
-            STMS_INFO("New TCP client at {} is trying to connect.", cli->addrStr);
+            if (timeoutMs == 0 || now - cli->getLastActive() < std::chrono::milliseconds(timeoutMs)) {
+                scheduleIdle(entry.uuid, cli); // Was active in the meantime
+                return;
+            }
 
-            cli->pSsl = SSL_new(pCtx);
-            SSL_set_fd(cli->pSsl, cli->sock);
+            if (isUdp) { DTLSv1_handle_timeout(cli->pSsl); }
+            STMS_INFO("Client {} timed out! Dropping connection!", entry.uuid.buildStr());
+            metrics.addTimeout();
+            std::lock_guard<std::mutex> deadLg(deadMtx);
+            deadClients.push(entry.uuid);
+        });
+    }
 
-            pPool->submitTask([&, capCli{cli}]() {
-               this->doHandshake(capCli);
-            });
+    bool SSLServer::tick() {
+        if (!running) {
+            STMS_WARN("SSLServer::tick() called when stopped! Ignoring invocation!");
+            return false;
         }
 
-        skipConnect:
+        if (loop) {
+            // Pick up anything that became ready since the last `waitEvents()`
+            loop->wait(0, readyEvents);
+
+            for (const auto &event : readyEvents) {
+                if (event.fd == sock) {
+                    acceptClient();
+                    break;
+                }
+            }
+        } else if (uringReactor) {
+            handleUringCompletions(); // Accepts clients directly and fills `readyEvents`
+        } else {
+            acceptClient();
+        }
 
-        // We must use this as modifying `clients` while we are looping through is a TERRIBLE idea
+        advanceHandshakes();
+        if (demuxActive) {
+            sweepDemuxHandshakes();
+        }
+        flushPendingSends();
 
         std::lock_guard<std::mutex> lg(clientsMtx);
-        for (auto &client : clients) {
+        if (loop || uringReactor) {
+            for (const auto &event : readyEvents) {
+                auto fdIt = loopClients.find(event.fd);
+                if (fdIt == loopClients.end()) {
+                    continue; // Either the listening socket or a client that was since removed
+                }
 
-            if (SSL_get_shutdown(client.second->pSsl) & SSL_RECEIVED_SHUTDOWN) {
-                deadClients.push(client.first);
-            } else {
-                if (timeoutMs > 0 && client.second->timeoutTimer.getTime() >= static_cast<float>(timeoutMs)) {
-                    if (isUdp) { DTLSv1_handle_timeout(client.second->pSsl); }
-                    STMS_INFO("Client {} timed out! Dropping connection!", client.first.buildStr());
-                    deadClients.push(client.first);
-                    continue;
+                std::shared_ptr<ClientRepresentation> cli;
+                if (clients.find(fdIt->second, cli)) {
+                    dispatchRead(cli, fdIt->second);
+                }
+            }
+            readyEvents.clear();
+        }
+
+        expireIdleClients();
+
+        // Reads were already dispatched from `readyEvents` above, or by `demuxDatagrams`, which also notice when a
+        // client sent close_notify. Otherwise, every client has to be polled.
+        if (!loop && !uringReactor && !demuxActive) {
+            // Only shared locks are taken on `clients` here, so `send()`s from other threads aren't blocked.
+            clients.forEach([&](const UUID &uuid, const std::shared_ptr<ClientRepresentation> &client) {
+                if (SSL_get_shutdown(client->pSsl) & SSL_RECEIVED_SHUTDOWN) {
+                    std::lock_guard<std::mutex> deadLg(deadMtx);
+                    deadClients.push(uuid);
+                    return;
+                }
+
+                if (client->isReading) {
+                    return; // The read task will pick up anything that arrives while it's running.
                 }
 
                 // recvfrom can be used with both TCP & UDP (i hope i haven't been lied to by the man pages)
-                if (recvfrom(client.second->sock, nullptr, 0, MSG_PEEK, nullptr, nullptr) == -1
+                // MSG_DONTWAIT, as the accepted socket may be blocking and `clientsMtx` is held here.
+                if (recvfrom(client->sock, nullptr, 0, MSG_PEEK | MSG_DONTWAIT, nullptr, nullptr) == -1
                     && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-                    continue;  // No data could be read
+                    return;  // No data could be read
                 }
 
-                if (!client.second->isReading) {
-                    client.second->isReading = true;
-                    // lambda captures validated
-                    pPool->submitTask([&, lambCli = std::shared_ptr<ClientRepresentation>(client.second),
-                                              lambUUid = UUID{client.first}]() {
-
-                        int readTimeouts = 0;
-                        while (readTimeouts < maxTimeouts) {
-                            readTimeouts++;
-
-                            try {
-                                uint8_t recvBuf[maxRecvLen];
-                                int readLen = handleSslGetErr(lambCli->pSsl, SSL_read(lambCli->pSsl, recvBuf, maxRecvLen));
-
-                                if (readLen > 0) {
-                                    readTimeouts = 0;
-                                    lambCli->timeoutTimer.reset();
-                                    recvCallback(lambUUid, lambCli->pSockAddr, recvBuf, readLen);
-                                    break;
-                                }
-                            } catch (SSLWantWriteException &) {
-                                STMS_INFO("SSL_read() returned WANT_WRITE. Blocking then retrying!");
-                                blockUntilReady(lambCli->sock, lambCli->pSsl, POLLOUT);
-                            } catch (SSLWantReadException &) {
-                                STMS_INFO("SSL_read() returned WANT_READ. Blocking then retrying!");
-                                blockUntilReady(lambCli->sock, lambCli->pSsl, POLLIN);
-                            } catch (SSLFatalException &) {
-                                STMS_WARN("Fatal SSL_read() exception occurred! Disconnecting client {}", lambUUid.buildStr());
-                                lambCli->doShutdown = false;
-
-                                std::lock_guard<std::mutex> lgSub(clientsMtx);
+                client->isReading = true;
+                // lambda captures validated
+                pPool->submitTask([&, lambCli = std::shared_ptr<ClientRepresentation>(client),
+                                          lambUUid = UUID{uuid}]() {
+
+                    int readTimeouts = 0;
+                    while (readTimeouts < maxTimeouts) {
+                        readTimeouts++;
+
+                        PacketBuffer recvBuf = PacketBuffer::alloc(maxRecvLen);
+                        auto target = readTarget(*lambCli, recvBuf);
+                        std::unique_lock<std::mutex> sslLg(lambCli->sslMtx);
+                        int readLen = SSL_read(lambCli->pSsl, target.first, target.second);
+                        SSLStatus status = readLen > 0 ? SSLStatus::eOk : getSslStatus(lambCli->pSsl, readLen);
+                        sslLg.unlock();
+
+                        if (readLen > 0) {
+                            readTimeouts = 0;
+                            lambCli->touch();
+                            if (!deliverRead(*lambCli, lambUUid, recvBuf, readLen)) {
+                                std::lock_guard<std::mutex> lgSub(deadMtx);
                                 deadClients.push(lambUUid);
-                                break;
-                            } catch (SSLException &) {
-                                STMS_WARN("Client {} SSL_read failed for the reason above! Retrying!", lambUUid.buildStr());
                             }
-                        }
-
-                        if (readTimeouts >= maxTimeouts) {
-                            STMS_WARN("SSL_read() timed out completely! Dropping connection!");
-                            std::lock_guard<std::mutex> lgSub(clientsMtx);
+                            break;
+                        } else if (status == SSLStatus::eWantWrite) {
+                            STMS_INFO("SSL_read() returned WANT_WRITE. Blocking then retrying!");
+                            record(*lambCli, [](NetMetrics &m) { m.addWantWrite(); });
+                            blockUntilReady(lambCli->sock, lambCli->pSsl, POLLOUT);
+                        } else if (status == SSLStatus::eWantRead) {
+                            STMS_INFO("SSL_read() returned WANT_READ. Blocking then retrying!");
+                            record(*lambCli, [](NetMetrics &m) { m.addWantRead(); });
+                            blockUntilReady(lambCli->sock, lambCli->pSsl, POLLIN);
+                        } else if (status == SSLStatus::eFatal) {
+                            STMS_WARN("Fatal SSL_read() error occurred! Disconnecting client {}", lambUUid.buildStr());
+                            lambCli->doShutdown = closedCleanly(lambCli.get());
+
+                            std::lock_guard<std::mutex> lgSub(deadMtx);
                             deadClients.push(lambUUid);
+                            break;
+                        } else {
+                            STMS_WARN("Client {} SSL_read failed for the reason above! Retrying!", lambUUid.buildStr());
                         }
-                        lambCli->isReading = false;
-                    });
-                }
-            }
+                    }
+
+                    if (readTimeouts >= maxTimeouts) {
+                        STMS_WARN("SSL_read() timed out completely! Dropping connection!");
+                        metrics.addTimeout();
+                        std::lock_guard<std::mutex> lgSub(deadMtx);
+                        deadClients.push(lambUUid);
+                    }
+                    lambCli->isReading = false;
+                });
+            });
+        }
+
+        std::queue<UUID> toReap;
+        {
+            std::lock_guard<std::mutex> deadLg(deadMtx);
+            std::swap(toReap, deadClients);
         }
 
-        // We use the same mutex to protect deadClients & clients. Transition to 2 separate mutexes.
-        while (!deadClients.empty()) {
-            UUID cliUuid = deadClients.front();
-            deadClients.pop();
+        while (!toReap.empty()) {
+            UUID cliUuid = toReap.front();
+            toReap.pop();
 
-            if (clients.find(cliUuid) == clients.end()) {
+            std::shared_ptr<ClientRepresentation> cliObj;
+            if (!clients.find(cliUuid, cliObj)) {
                 STMS_INFO("Dead clients contained a non-existent client! Ignoring...");
                 continue;
             }
 
-            std::shared_ptr<ClientRepresentation> cliObj = clients[cliUuid];
-
             auto *addrCpy = new sockaddr_storage{};
             std::copy(reinterpret_cast<uint8_t *>(cliObj->pSockAddr),
                       reinterpret_cast<uint8_t *>(cliObj->pSockAddr) + cliObj->sockAddrLen,
@@ -422,10 +1449,15 @@ namespace stms {
             pPool->submitTask([&, capUuid = UUID(cliUuid),
                                       capAddr{addrCpy}, this]() {
                 disconnectCallback(capUuid, reinterpret_cast<sockaddr *>(capAddr));
-                delete addrCpy;
+                delete capAddr;
             });
 
             STMS_INFO("Client {} at {} disconnected!", cliUuid.buildStr(), cliObj->addrStr);
+            unwatchClient(cliObj->sock);
+            if (cliObj->dtls != nullptr && cliObj->dtls->demuxed) {
+                std::lock_guard<std::mutex> demuxLg(demuxMtx);
+                demuxClients.erase(cliObj->dtls->demuxKey);
+            }
             clients.erase(cliUuid);
         }
 
@@ -433,82 +1465,328 @@ namespace stms {
     }
 
     std::future<int> SSLServer::send(const UUID &clientUuid, const uint8_t *const msg, int msgLen, bool cpy) {
+        ClientRepresentation::PendingSend pending;
+        pending.len = msgLen;
+        if (cpy && running) {
+            pending.buf = PacketBuffer::copyOf(msg, msgLen);
+            pending.data = pending.buf.data();
+        } else {
+            pending.data = msg;
+        }
+
+        return queueSend(clientUuid, std::move(pending), "send");
+    }
+
+    std::future<int> SSLServer::sendFile(const UUID &clientUuid, int fd, off_t offset, int len) {
+        if (len < 0 || offset < 0) {
+            STMS_ERROR("SSLServer::sendFile() called with negative len ({}) or offset ({})!", len, offset);
+            std::promise<int> prom;
+            prom.set_value(-5);
+            return prom.get_future();
+        } else if (isUdp) {
+            STMS_ERROR("SSLServer::sendFile() is only supported on TCP! Dropping {} bytes!", len);
+            std::promise<int> prom;
+            prom.set_value(-5);
+            return prom.get_future();
+        }
+
+        ClientRepresentation::PendingSend pending;
+        pending.len = len;
+        pending.fileFd = fd;
+        pending.fileOffset = offset;
+        return queueSend(clientUuid, std::move(pending), "sendFile");
+    }
+
+    std::future<int> SSLServer::queueSend(const UUID &clientUuid, ClientRepresentation::PendingSend &&pending,
+                                          const char *fnName) {
         std::shared_ptr<std::promise<int>> prom = std::make_shared<std::promise<int>>();
+        int msgLen = pending.len;
         if (!running) {
-            STMS_ERROR("SSLServer::send() called when stopped! Dropping {} bytes!", msgLen);
+            STMS_ERROR("SSLServer::{}() called when stopped! Dropping {} bytes!", fnName, msgLen);
             prom->set_value(-1);
             return prom->get_future();
         }
 
+        std::shared_ptr<ClientRepresentation> cli;
+        if (!clients.find(clientUuid, cli)) {
+            STMS_ERROR("SSLServer::{}() called with invalid client uuid '{}'. Dropping {} bytes!", fnName,
+                       clientUuid.buildStr(), msgLen);
+            prom->set_value(0);
+            return prom->get_future();
+        }
+
+        bool startWriter = false;
+        bool scheduleFlush = false;
+        {
+            std::lock_guard<std::mutex> lg(cli->sendMtx);
+            if (cli->queuedBytes > 0 && cli->queuedBytes + static_cast<std::size_t>(msgLen) > highWatermark) {
+                cli->wantWritable = true;
+                prom->set_value(-4);
+                return prom->get_future();
+            }
+
+            pending.prom = prom;
+            cli->sendQueue.emplace_back(std::move(pending));
+            cli->queuedBytes += static_cast<std::size_t>(msgLen);
+
+            if (!cli->writerActive) {
+                if (flushDelayMs == 0 || cli->queuedBytes >= static_cast<std::size_t>(coalesceMax)) {
+                    cli->writerActive = true;
+                    startWriter = true;
+                } else if (!cli->flushPending) {
+                    cli->flushPending = true;
+                    cli->flushTimer.start();
+                    scheduleFlush = true;
+                }
+            }
+        }
+
+        if (scheduleFlush) {
+            std::lock_guard<std::mutex> lg(flushMtx);
+            pendingFlushes.emplace_back(clientUuid, cli);
+        }
+
+        if (startWriter) {
+            // lambda captures validated
+            pPool->submitTask([&, capCli = std::shared_ptr<ClientRepresentation>(cli), capUuid = UUID{clientUuid}]() {
+                this->flushClient(capCli, capUuid);
+            });
+        }
+
+        return prom->get_future();
+    }
+
+    void SSLServer::flushClient(const std::shared_ptr<ClientRepresentation> &cli, const UUID &uuid) {
+        std::vector<ClientRepresentation::PendingSend> batch;
+        int numWrites = 0;
+
+        while (true) {
+            std::size_t total = 0;
+            bool notifyWritable = false;
+            batch.clear();
+            {
+                std::lock_guard<std::mutex> lg(cli->sendMtx);
+                if (running && cli->wantWritable && cli->queuedBytes <= lowWatermark) {
+                    cli->wantWritable = false;
+                    notifyWritable = true;
+                }
+
+                if (cli->sendQueue.empty() || !running) {
+                    cli->failPendingSends(-1);
+                    cli->writerActive = false;
+                } else {
+                    // Take the first message, then as many of the following ones as fit in the same record.
+                    do {
+                        total += static_cast<std::size_t>(cli->sendQueue.front().len);
+                        batch.emplace_back(std::move(cli->sendQueue.front()));
+                        cli->sendQueue.pop_front();
+                    } while (!isUdp && !cli->sendQueue.empty() && batch.front().fileFd == -1 &&
+                             cli->sendQueue.front().fileFd == -1 &&
+                             total + static_cast<std::size_t>(cli->sendQueue.front().len) <= static_cast<std::size_t>(coalesceMax));
+                    cli->queuedBytes -= total;
+                }
+            }
+
+            if (notifyWritable) {
+                writableCallback(uuid);
+            }
+
+            if (batch.empty()) {
+                return; // `writerActive` was cleared above, so anything queued by the callback started a new writer.
+            }
 
-        // I am forced to do this as std::copy would be impossible otherwise. We don't actually do anything with
-        // the non-const-ness though.
-        uint8_t *passIn = const_cast<uint8_t *>(msg);
-        if (cpy) {
-            passIn = new uint8_t[msgLen];
-            std::copy(msg, msg + msgLen, passIn);
-        } 
-        
-        pPool->submitTask([&, capProm{prom}, capUuid{clientUuid}, capMsg{passIn}, capLen{msgLen}, capCpy{cpy}]() {
+            int ret;
+            if (batch.front().fileFd != -1) { // Files are never merged with other messages
+                ret = writeFileToClient(cli, uuid, batch.front().fileFd, batch.front().fileOffset, batch.front().len);
+            } else if (batch.size() == 1) {
+                ret = writeToClient(cli, uuid, batch.front().data, batch.front().len);
+            } else {
+                PacketBuffer merged = PacketBuffer::alloc(total);
+                std::size_t offset = 0;
+                for (const auto &msg : batch) {
+                    std::copy(msg.data, msg.data + msg.len, merged.data() + offset);
+                    offset += static_cast<std::size_t>(msg.len);
+                }
+                ret = writeToClient(cli, uuid, merged.data(), static_cast<int>(total));
+            }
 
-            std::unique_lock<std::mutex> clg(clientsMtx);
+            for (auto &msg : batch) {
+                msg.prom->set_value(ret > 0 ? msg.len : ret);
+            }
+            if (ret > 0) {
+                record(*cli, [&](NetMetrics &m) { m.addOut(total, batch.size()); });
+            }
 
-            if (clients.find(capUuid) == clients.end()) {
-                clg.unlock();
-                STMS_ERROR("SSLServer::send() called with invalid client uuid '{}'. Dropping {} bytes!", capUuid.buildStr(), msgLen);
-                prom->set_value(0);
+            if (ret <= 0 && ret != -5) {
+                // The client is being kicked, so the rest of the queue is never going to make it.
+                std::lock_guard<std::mutex> lg(cli->sendMtx);
+                cli->failPendingSends(ret);
+                cli->writerActive = false;
                 return;
             }
 
-            std::shared_ptr<ClientRepresentation> cli = clients[capUuid];
-            clg.unlock();
+            if (++numWrites >= reactorMaxReadsPerTask) {
+                // Don't hog this worker. `writerActive` stays set, so no other writer will be started meanwhile.
+                // lambda captures validated
+                pPool->submitTask([&, capCli = std::shared_ptr<ClientRepresentation>(cli), capUuid = UUID{uuid}]() {
+                    this->flushClient(capCli, capUuid);
+                });
+                return;
+            }
+        }
+    }
 
-            int sendTimeouts = 0;
-            while (sendTimeouts < maxTimeouts) {
-                sendTimeouts++;
+    int SSLServer::writeToClient(const std::shared_ptr<ClientRepresentation> &cli, const UUID &uuid,
+                                 const uint8_t *data, int len) {
+        int sendTimeouts = 0;
+        while (sendTimeouts < maxTimeouts) {
+            sendTimeouts++;
+
+            int ret;
+            SSLStatus status;
+            {
+                std::lock_guard<std::mutex> sslLg(cli->sslMtx);
+                ret = SSL_write(cli->pSsl, data, len);
+                status = ret > 0 ? SSLStatus::eOk : getSslStatus(cli->pSsl, ret);
+            }
 
-                try {
-                    int ret = handleSslGetErr(cli->pSsl, SSL_write(cli->pSsl, capMsg, capLen));
+            if (ret > 0) {
+                cli->touch();
+                return ret;
+            } else if (status == SSLStatus::eWantRead) {
+                STMS_WARN("send() failed with WANT_READ! Retrying!");
+                record(*cli, [](NetMetrics &m) { m.addWantRead(); });
+                blockUntilReady(cli->sock, cli->pSsl, POLLIN);
+            } else if (status == SSLStatus::eWantWrite) {
+                STMS_WARN("send() failed with WANT_WRITE! Retrying!");
+                record(*cli, [](NetMetrics &m) { m.addWantWrite(); });
+                blockUntilReady(cli->sock, cli->pSsl, POLLOUT);
+            } else if (status == SSLStatus::eFatal) {
+                STMS_WARN("Connection to client {} at {} closed forcefully! (Fatal SSL_write() error!)", uuid.buildStr(), cli->addrStr);
+                cli->doShutdown = false;
 
-                    if (ret > 0) {
-                        sendTimeouts = 0;
-                        capProm->set_value(ret);
-                        cli->timeoutTimer.reset();
-                        break;
-                    }
-                } catch (SSLWantReadException &) {
-                    STMS_WARN("send() failed with WANT_READ! Retrying!");
-                    blockUntilReady(cli->sock, cli->pSsl, POLLIN);
-                } catch (SSLWantWriteException &) {
-                    STMS_WARN("send() failed with WANT_WRITE! Retrying!");
-                    blockUntilReady(cli->sock, cli->pSsl, POLLOUT);
-                } catch (SSLFatalException &) {
-                    STMS_WARN("Connection to client {} at {} closed forcefully! (Fatal SSL_read() error!)", capUuid.buildStr(), cli->addrStr);
-                    cli->doShutdown = false;
+                std::lock_guard<std::mutex> lg(deadMtx);
+                deadClients.push(uuid);
+                return -2;
+            } else {
+                STMS_WARN("SSL_write failed for the reason above! Retrying!");
+            }
+        }
 
-                    std::lock_guard<std::mutex> lg(clientsMtx);
-                    deadClients.push(capUuid);
-                    capProm->set_value(-2);
-                    break;
-                } catch (SSLException &) {
-                    STMS_WARN("SSL_write failed for the reason above! Retrying!");
-                }
+        STMS_WARN("SSL_write() timed out completely! Dropping connection!");
+        metrics.addTimeout();
+
+        std::lock_guard<std::mutex> lg(deadMtx);
+        deadClients.push(uuid);
+        return -3;
+    }
+
+    int SSLServer::writeFileToClient(const std::shared_ptr<ClientRepresentation> &cli, const UUID &uuid, int fd,
+                                     off_t offset, int len) {
+        std::unique_lock<std::mutex> initLg(cli->sslMtx);
+        FileSender sender(cli->pSsl, fd, offset, static_cast<std::size_t>(len));
+        initLg.unlock();
+
+        int sendTimeouts = 0;
+        while (!sender.done() && sendTimeouts < maxTimeouts) {
+            sendTimeouts++;
+
+            long ret;
+            {
+                std::lock_guard<std::mutex> sslLg(cli->sslMtx);
+                ret = sender.step();
             }
 
-            if (capCpy) {
-                delete[] capMsg;
+            if (ret < 0) {
+                return -5;
+            } else if (ret > 0) {
+                sendTimeouts = 0;
+                cli->touch();
+            } else if (sender.getStatus() == SSLStatus::eWantRead) {
+                STMS_WARN("sendFile() failed with WANT_READ! Retrying!");
+                record(*cli, [](NetMetrics &m) { m.addWantRead(); });
+                blockUntilReady(cli->sock, cli->pSsl, POLLIN);
+            } else if (sender.getStatus() == SSLStatus::eWantWrite) {
+                record(*cli, [](NetMetrics &m) { m.addWantWrite(); });
+                blockUntilReady(cli->sock, cli->pSsl, POLLOUT); // Expected for large files, so don't spam warnings
+            } else if (sender.getStatus() == SSLStatus::eFatal) {
+                STMS_WARN("Connection to client {} at {} closed forcefully! (Fatal sendFile() error!)", uuid.buildStr(), cli->addrStr);
+                cli->doShutdown = false;
+
+                std::lock_guard<std::mutex> lg(deadMtx);
+                deadClients.push(uuid);
+                return -2;
+            } else {
+                STMS_WARN("sendFile() failed for the reason above! Retrying!");
             }
+        }
+
+        if (sender.done()) {
+            return len;
+        }
+
+        STMS_WARN("sendFile() timed out completely! Dropping connection!");
+        metrics.addTimeout();
+
+        std::lock_guard<std::mutex> lg(deadMtx);
+        deadClients.push(uuid);
+        return -3;
+    }
+
+    bool SSLServer::isKernelTls(const UUID &cli) {
+        std::shared_ptr<ClientRepresentation> cliObj;
+        if (!clients.find(cli, cliObj)) {
+            return false;
+        }
 
-            if (sendTimeouts >= maxTimeouts) {
-                STMS_WARN("SSL_write() timed out completely! Dropping connection!");
+        std::lock_guard<std::mutex> lg(cliObj->sslMtx);
+        return isKernelTlsSend(cliObj->pSsl);
+    }
+
+    void SSLServer::flushPendingSends() {
+        std::vector<std::pair<UUID, std::shared_ptr<ClientRepresentation>>> toFlush;
+        {
+            std::lock_guard<std::mutex> lg(flushMtx);
+            auto it = pendingFlushes.begin();
+            while (it != pendingFlushes.end()) {
+                auto cli = it->second.lock();
+                if (!cli) {
+                    it = pendingFlushes.erase(it);
+                    continue;
+                }
 
-                std::lock_guard<std::mutex> lg(clientsMtx);
-                deadClients.push(capUuid);
-                capProm->set_value(-3);
+                std::lock_guard<std::mutex> sendLg(cli->sendMtx);
+                if (cli->writerActive) { // Filled up to `coalesceMax` and started writing on its own
+                    cli->flushPending = false;
+                    it = pendingFlushes.erase(it);
+                } else if (cli->flushTimer.getTime() >= static_cast<float>(flushDelayMs)) {
+                    cli->flushPending = false;
+                    cli->writerActive = true;
+                    toFlush.emplace_back(it->first, cli);
+                    it = pendingFlushes.erase(it);
+                } else {
+                    ++it;
+                }
             }
-        });
+        }
 
-        return prom->get_future();
+        for (auto &flush : toFlush) {
+            // lambda captures validated
+            pPool->submitTask([&, capCli = std::move(flush.second), capUuid = UUID{flush.first}]() {
+                this->flushClient(capCli, capUuid);
+            });
+        }
+    }
+
+    std::size_t SSLServer::getQueuedBytes(const UUID &cli) {
+        std::shared_ptr<ClientRepresentation> cliObj;
+        if (!clients.find(cli, cliObj)) {
+            STMS_ERROR("SSLServer::getQueuedBytes called with invalid client uuid '{}'!", cli.buildStr());
+            return 0;
+        }
+
+        std::lock_guard<std::mutex> lg(cliObj->sendMtx);
+        return cliObj->queuedBytes;
     }
 
     size_t SSLServer::getMtu(const UUID &cli) {
@@ -517,27 +1795,48 @@ namespace stms {
             return 0;
         }
 
-        std::lock_guard<std::mutex> lg(clientsMtx);
-        if (clients.find(cli) == clients.end()) {
+        std::shared_ptr<ClientRepresentation> cliObj;
+        if (!clients.find(cli, cliObj)) {
             STMS_ERROR("SSLServer::getMtu called with invalid client uuid '{}'!", cli.buildStr());
             return 0;
         }
 
-        return DTLS_get_data_mtu(clients[cli]->pSsl);
+        return DTLS_get_data_mtu(cliObj->pSsl);
     }
 
     void SSLServer::waitEvents(int toMs) {
+        if (loop) {
+            // New clients are added to `loop` as soon as their handshake completes, so there's no need to sleep.
+            // Don't block if there are still unhandled events from a previous call.
+            loop->wait(readyEvents.empty() ? toMs : 0, readyEvents);
+            return;
+        }
+
+        if (uringReactor && waitUring(toMs)) {
+            return;
+        }
+
         // sleep for a bit and wait for clients that connected in the previous tick to become noticed.
         std::this_thread::sleep_for(std::chrono::milliseconds(waitEventsSleepAmount));
 
         std::vector<pollfd> toPoll;
         toPoll.reserve(getNumClients() + 1);
 
-        for (const auto &c : clients) {
+        clients.forEach([&](const UUID &, const std::shared_ptr<ClientRepresentation> &c) {
             pollfd cliPollFd{};
             cliPollFd.events = POLLIN;
-            cliPollFd.fd = c.second->sock;
+            cliPollFd.fd = c->sock;
             toPoll.push_back(cliPollFd);
+        });
+
+        {
+            std::lock_guard<std::mutex> lg(handshakeMtx);
+            for (const auto &hs : handshakes) {
+                pollfd hsPollFd{};
+                hsPollFd.events = hs.second->handshakeEvents;
+                hsPollFd.fd = hs.first;
+                toPoll.push_back(hsPollFd);
+            }
         }
 
         pollfd servPollFd{};
@@ -560,13 +1859,13 @@ namespace stms {
             pollfd cliPollFd{};
             cliPollFd.events = POLLIN;
 
-            std::lock_guard<std::mutex> lg(clientsMtx);
-            if (clients.find(c) == clients.end()) {
+            std::shared_ptr<ClientRepresentation> cli;
+            if (!clients.find(c, cli)) {
                 STMS_WARN("There is no client with UUID {}! Ignoring this bad UUID passed into `waitEventsFrom`...", c.buildStr());
                 continue;
             }
 
-            cliPollFd.fd = clients[c]->sock;
+            cliPollFd.fd = cli->sock;
             toPoll.push_back(cliPollFd);
         }
 
@@ -584,15 +1883,18 @@ namespace stms {
     std::vector<UUID> SSLServer::getClientUuids() {
         std::vector<UUID> ret;
 
-        std::lock_guard<std::mutex> lg(clientsMtx);
         ret.reserve(clients.size());
-        for (const auto &cliPair : clients) {
-            ret.emplace_back(cliPair.first);
-        }
+        clients.forEach([&](const UUID &uuid, const std::shared_ptr<ClientRepresentation> &) {
+            ret.emplace_back(uuid);
+        });
 
         return ret;
     }
 
+    bool SSLServer::hasClient(const UUID &cli) {
+        return clients.contains(cli);
+    }
+
     UUID SSLServer::refreshUuid(const UUID &client) {
         UUID newUuid(UUIDType::eUuid4);
 
@@ -605,19 +1907,32 @@ namespace stms {
 
     bool SSLServer::setNewUuid(const UUID &old, const UUID &newUuid) {
         std::lock_guard<std::mutex> lg(clientsMtx);
-        if (clients.find(old) == clients.end()) {
+        std::shared_ptr<ClientRepresentation> clientValue;
+        if (!clients.find(old, clientValue) || !clients.rekey(old, newUuid)) {
             STMS_WARN("Requested uuid edit {} -> {} failed: Client non-existent.", old.buildStr(), newUuid.buildStr());
             return false;
         }
 
-        std::shared_ptr<ClientRepresentation> clientValue = clients[old];
-        clients.erase(old); // this will not trigger the destructor as we saved a reference in `clientValue`
-        clients[newUuid] = clientValue;
+        auto fdIt = loopClients.find(clientValue->sock);
+        if (fdIt != loopClients.end()) {
+            fdIt->second = newUuid;
+        }
+
+        if (clientValue->dtls != nullptr && clientValue->dtls->demuxed) {
+            std::lock_guard<std::mutex> demuxLg(demuxMtx);
+            auto demuxIt = demuxClients.find(clientValue->dtls->demuxKey);
+            if (demuxIt != demuxClients.end()) {
+                demuxIt->second.uuid = newUuid;
+            }
+        }
+
+        scheduleIdle(newUuid, clientValue); // The entry under `old` is skipped once it expires.
         return true;
     }
 
     void SSLServer::kickClient(const UUID &cliId) {
-        std::lock_guard<std::mutex> lg(clientsMtx);
+        metrics.addKick();
+        std::lock_guard<std::mutex> lg(deadMtx);
         deadClients.emplace(cliId);
     }
 
@@ -635,12 +1950,41 @@ namespace stms {
 
         std::unique_lock<std::mutex> lg(clientsMtx);
         std::unique_lock<std::mutex> rhsLg(rhs.clientsMtx);
+        std::unique_lock<std::mutex> deadLg(deadMtx);
+        std::unique_lock<std::mutex> rhsDeadLg(rhs.deadMtx);
 
         clients = std::move(rhs.clients);
         deadClients = std::move(rhs.deadClients);
+        idleWheel = std::move(rhs.idleWheel);
         recvCallback = std::move(rhs.recvCallback);
         connectCallback = std::move(rhs.connectCallback);
         disconnectCallback = std::move(rhs.disconnectCallback);
+        writableCallback = std::move(rhs.writableCallback);
+        framedRecvCallback = std::move(rhs.framedRecvCallback);
+        maxFramedLen = rhs.maxFramedLen;
+        loop = std::move(rhs.loop);
+        loopClients = std::move(rhs.loopClients);
+        readyEvents = std::move(rhs.readyEvents);
+        clientEvents = rhs.clientEvents;
+        edgeClients = rhs.edgeClients;
+        uringReactor = rhs.uringReactor;
+        coalesceMax = rhs.coalesceMax;
+        flushDelayMs = rhs.flushDelayMs;
+        highWatermark = rhs.highWatermark;
+        lowWatermark = rhs.lowWatermark;
+        dtlsDemux = rhs.dtlsDemux;
+        demuxActive = rhs.demuxActive;
+        demuxClients = std::move(rhs.demuxClients);
+        demuxBuf = std::move(rhs.demuxBuf);
+        pendingFlushes = std::move(rhs.pendingFlushes);
+        sessionTickets = rhs.sessionTickets;
+        ticketKeys = std::move(rhs.ticketKeys);
+        cookieKeys = std::move(rhs.cookieKeys);
+        sessionCache = std::move(rhs.sessionCache);
+        fullHandshakes = rhs.fullHandshakes.load();
+        resumedHandshakes = rhs.resumedHandshakes.load();
+        metrics.copyFrom(rhs.metrics);
+        clientMetrics = rhs.clientMetrics;
         moveSslBase(&rhs);
 
         rhs.clients.clear(); // do we have to do this? they are std::move'd // TODO: Stack overflow this
@@ -656,32 +2000,51 @@ namespace stms {
         shutdownClient();
     }
 
+    void ClientRepresentation::failPendingSends(int code) {
+        if (!sendQueue.empty()) {
+            STMS_WARN("Dropping {} messages ({} bytes) queued for client at {}!", sendQueue.size(), queuedBytes, addrStr);
+        }
+
+        for (auto &msg : sendQueue) {
+            msg.prom->set_value(code);
+        }
+        sendQueue.clear();
+        queuedBytes = 0;
+    }
+
     void ClientRepresentation::shutdownClient() {
-        if (doShutdown && pSsl != nullptr) {
+        {
+            std::lock_guard<std::mutex> lg(sendMtx);
+            failPendingSends(-1);
+        }
+
+        if (doShutdown && pSsl != nullptr && dtls != nullptr && dtls->demuxed) {
+            // The reply would arrive on the server's socket, which isn't being read anymore. Just send close_notify.
+            SSL_shutdown(pSsl);
+        } else if (doShutdown && pSsl != nullptr) {
             int numTries = 0;
             while (numTries < sslShutdownMaxRetries) {
                 numTries++;
 
-                try {
-                    int shutdownRet = SSL_shutdown(pSsl);
-                    if (shutdownRet < 0) {
-                        handleSslGetErr(pSsl, shutdownRet);
-                    } else if (shutdownRet == 0) {
-                        STMS_INFO("Waiting to hear back after SSL_shutdown... retrying");
-                        continue;
-                    } else if (shutdownRet == 1) {
-                        break;
-                    }
-                } catch (SSLWantWriteException &) {
+                int shutdownRet = SSL_shutdown(pSsl);
+                if (shutdownRet == 0) {
+                    STMS_INFO("Waiting to hear back after SSL_shutdown... retrying");
+                    continue;
+                } else if (shutdownRet == 1) {
+                    break;
+                }
+
+                SSLStatus status = getSslStatus(pSsl, shutdownRet);
+                if (status == SSLStatus::eWantWrite) {
                     STMS_WARN("SSL_shutdown() returned WANT_WRITE! Blocking...");
                     serv->blockUntilReady(sock, pSsl, POLLOUT);
-                } catch (SSLWantReadException &) {
+                } else if (status == SSLStatus::eWantRead) {
                     STMS_WARN("SSL_shutdown() returned WANT_READ! Blocking...");
                     serv->blockUntilReady(sock, pSsl, POLLIN);
-                } catch (SSLFatalException &) {
-                    STMS_WARN("Fatal exception during SSL_shutdown()! Skipping it!");
+                } else if (status == SSLStatus::eFatal) {
+                    STMS_WARN("Fatal error during SSL_shutdown()! Skipping it!");
                     break; // just give up lol
-                } catch (SSLException &) {
+                } else {
                     STMS_INFO("Retrying SSL_shutdown()!");
                 }
             }
@@ -689,7 +2052,9 @@ namespace stms {
             if (numTries >= sslShutdownMaxRetries) {
                 STMS_WARN("Skipping SSL_shutdown: Timed out!");
             }
+        }
 
+        if (pSsl != nullptr) {
             // No need to free BIO since it is bound to the SSL object and freed when the SSL object is freed.
             SSL_free(pSsl);
             pSsl = nullptr;
@@ -732,12 +2097,27 @@ namespace stms {
         sock = rhs.sock;
         doShutdown = rhs.doShutdown;
         isReading = rhs.isReading;
-        timeoutTimer = std::move(rhs.timeoutTimer);
+        framer = std::move(rhs.framer);
+        metrics = std::move(rhs.metrics);
+        readState = rhs.readState.load();
+        lastActive = rhs.lastActive.load();
+        {
+            std::lock_guard<std::mutex> lg(rhs.sendMtx);
+            sendQueue = std::move(rhs.sendQueue);
+            queuedBytes = rhs.queuedBytes;
+            writerActive = rhs.writerActive;
+            wantWritable = rhs.wantWritable;
+            flushPending = rhs.flushPending;
+            rhs.queuedBytes = 0;
+        }
         serv = rhs.serv;
 
         if (rhs.dtls != nullptr) {
             dtls = rhs.dtls;
             rhs.dtls = nullptr;
+            if (dtls->demuxed) {
+                BIO_set_data(dtls->pBio, this);
+            }
         }
 
         rhs.sock = 0;
@@ -0,0 +1,359 @@
+#include "stms/net/ssl_session.hpp"
+#include "stms/logging.hpp"
+
+#include <cstring>
+#include <algorithm>
+
+#include "openssl/rand.h"
+#include "openssl/evp.h"
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#   include "openssl/core_names.h"
+#else
+#   include "openssl/hmac.h"
+#endif
+
+namespace stms {
+    /// `SSL_CTX` ex data destructor for the `std::shared_ptr`s stored by `install`.
+    template<typename T>
+    static void freeInstalled(void *, void *ptr, CRYPTO_EX_DATA *, int, long, void *) {
+        delete static_cast<std::shared_ptr<T> *>(ptr);
+    }
+
+    /// Get the `SSL_CTX` ex data index `T` is installed at.
+    template<typename T>
+    static int installedIndex() {
+        static int idx = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, freeInstalled<T>);
+        return idx;
+    }
+
+    /// Get the `T` installed on `ctx`, or `nullptr`
+    template<typename T>
+    static T *getInstalled(SSL_CTX *ctx) {
+        auto *holder = static_cast<std::shared_ptr<T> *>(SSL_CTX_get_ex_data(ctx, installedIndex<T>()));
+        return holder == nullptr ? nullptr : holder->get();
+    }
+
+    template<typename T>
+    static void setInstalled(SSL_CTX *ctx, const std::shared_ptr<T> &val) {
+        auto *old = static_cast<std::shared_ptr<T> *>(SSL_CTX_get_ex_data(ctx, installedIndex<T>()));
+        SSL_CTX_set_ex_data(ctx, installedIndex<T>(), val ? new std::shared_ptr<T>(val) : nullptr);
+        delete old;
+    }
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    static int ticketKeyCb(SSL *ssl, unsigned char *keyName, unsigned char *iv, EVP_CIPHER_CTX *cipherCtx,
+                           EVP_MAC_CTX *macCtx, int enc) {
+#else
+    static int ticketKeyCb(SSL *ssl, unsigned char *keyName, unsigned char *iv, EVP_CIPHER_CTX *cipherCtx,
+                           HMAC_CTX *macCtx, int enc) {
+#endif
+        auto *keys = getInstalled<SessionTicketKeys>(SSL_get_SSL_CTX(ssl));
+        if (keys == nullptr) {
+            return enc ? -1 : 0;
+        }
+        return keys->handleTicket(keyName, iv, cipherCtx, macCtx, enc);
+    }
+
+    SessionTicketKeys::SessionTicketKeys() {
+        rotateLocked();
+    }
+
+    SessionTicketKeys::~SessionTicketKeys() {
+        for (auto &key : keys) {
+            OPENSSL_cleanse(&key, sizeof(Key));
+        }
+    }
+
+    void SessionTicketKeys::rotateLocked() {
+        Key key{};
+        if (RAND_bytes(key.name, sizeof(key.name)) != 1 || RAND_bytes(key.aesKey, sizeof(key.aesKey)) != 1 ||
+            RAND_bytes(key.hmacKey, sizeof(key.hmacKey)) != 1) {
+            STMS_ERROR("OpenSSL RNG failed to generate a session ticket key! Keeping the old key!");
+            OPENSSL_cleanse(&key, sizeof(Key));
+            return;
+        }
+        key.created = std::chrono::steady_clock::now();
+
+        keys.push_front(key);
+        OPENSSL_cleanse(&key, sizeof(Key));
+
+        while (keys.size() > history + 1) {
+            OPENSSL_cleanse(&keys.back(), sizeof(Key));
+            keys.pop_back();
+        }
+    }
+
+    void SessionTicketKeys::setRotation(unsigned lifetime, std::size_t numOld) {
+        std::unique_lock<std::shared_mutex> lg(keysMtx);
+        lifetimeSecs = lifetime;
+        history = numOld;
+
+        while (keys.size() > history + 1) {
+            OPENSSL_cleanse(&keys.back(), sizeof(Key));
+            keys.pop_back();
+        }
+    }
+
+    void SessionTicketKeys::rotate() {
+        std::unique_lock<std::shared_mutex> lg(keysMtx);
+        rotateLocked();
+    }
+
+    int SessionTicketKeys::handleTicket(uint8_t *keyName, uint8_t *iv, void *cipherCtx, void *macCtx, int enc) {
+        auto *cipher = static_cast<EVP_CIPHER_CTX *>(cipherCtx);
+        auto initKey = [&](const Key &key) {
+            if ((enc ? EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, key.aesKey, iv)
+                     : EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, key.aesKey, iv)) != 1) {
+                return false;
+            }
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+            OSSL_PARAM params[3];
+            params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, const_cast<uint8_t *>(key.hmacKey),
+                                                          sizeof(key.hmacKey));
+            params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, const_cast<char *>("SHA256"), 0);
+            params[2] = OSSL_PARAM_construct_end();
+            return EVP_MAC_CTX_set_params(static_cast<EVP_MAC_CTX *>(macCtx), params) == 1;
+#else
+            return HMAC_Init_ex(static_cast<HMAC_CTX *>(macCtx), key.hmacKey, sizeof(key.hmacKey),
+                                EVP_sha256(), nullptr) == 1;
+#endif
+        };
+
+        auto isDue = [&]() {
+            return lifetimeSecs > 0 &&
+                   std::chrono::steady_clock::now() - keys.front().created >= std::chrono::seconds(lifetimeSecs);
+        };
+
+        if (enc) {
+            std::shared_lock<std::shared_mutex> lg(keysMtx);
+            if (keys.empty()) {
+                return -1;
+            }
+
+            if (isDue()) {
+                lg.unlock();
+                std::unique_lock<std::shared_mutex> rotateLg(keysMtx);
+                if (isDue()) { // Another thread may have rotated in the meantime
+                    STMS_INFO("Rotating session ticket key");
+                    rotateLocked();
+                }
+                rotateLg.unlock();
+                lg.lock();
+            }
+
+            if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1) {
+                return -1;
+            }
+            std::copy(keys.front().name, keys.front().name + sizeof(Key::name), keyName);
+            return initKey(keys.front()) ? 1 : -1;
+        }
+
+        std::shared_lock<std::shared_mutex> lg(keysMtx);
+        for (std::size_t i = 0; i < keys.size(); i++) {
+            if (std::memcmp(keys[i].name, keyName, sizeof(Key::name)) != 0) {
+                continue;
+            }
+
+            if (!initKey(keys[i])) {
+                return -1;
+            }
+            return i == 0 && !isDue() ? 1 : 2; // Replace tickets from old keys
+        }
+
+        return 0; // Key expired or from somewhere else. Fall back to a full handshake.
+    }
+
+    void SessionTicketKeys::install(SSL_CTX *ctx, const std::shared_ptr<SessionTicketKeys> &keys) {
+        setInstalled(ctx, keys);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, keys ? ticketKeyCb : nullptr);
+#else
+        SSL_CTX_set_tlsext_ticket_key_cb(ctx, keys ? ticketKeyCb : nullptr);
+#endif
+    }
+
+    static int newSessionCb(SSL *ssl, SSL_SESSION *sess) {
+        auto *cache = getInstalled<SessionCache>(SSL_get_SSL_CTX(ssl));
+        if (cache != nullptr) {
+            cache->add(sess);
+        }
+        return 0; // The cache took its own reference
+    }
+
+    static SSL_SESSION *getSessionCb(SSL *ssl, const unsigned char *id, int len, int *copy) {
+        *copy = 0; // `SessionCache::get` already returns a new reference
+        auto *cache = getInstalled<SessionCache>(SSL_get_SSL_CTX(ssl));
+        return cache == nullptr ? nullptr : cache->get(id, static_cast<unsigned>(len));
+    }
+
+    static void removeSessionCb(SSL_CTX *ctx, SSL_SESSION *sess) {
+        auto *cache = getInstalled<SessionCache>(ctx);
+        if (cache != nullptr) {
+            unsigned len;
+            const uint8_t *id = SSL_SESSION_get_id(sess, &len);
+            cache->remove(id, len);
+        }
+    }
+
+    SessionCache::SessionCache(std::size_t maxSessions, unsigned ttl, std::size_t stripeCount)
+            : numStripes(stripeCount == 0 ? 1 : stripeCount), stripes(std::make_unique<Stripe[]>(numStripes)) {
+        setLimits(maxSessions, ttl);
+    }
+
+    SessionCache::~SessionCache() {
+        clear();
+    }
+
+    void SessionCache::setLimits(std::size_t maxSessions, unsigned ttl) {
+        maxPerStripe = (maxSessions + numStripes - 1) / numStripes;
+        ttlSecs = ttl;
+    }
+
+    SessionCache::Stripe &SessionCache::stripeOf(const std::string &id) {
+        return stripes[std::hash<std::string>{}(id) % numStripes];
+    }
+
+    void SessionCache::makeRoom(Stripe &stripe) {
+        // Every session has the same TTL, so the oldest session is also the first to expire.
+        while (stripe.entries.size() >= maxPerStripe && !stripe.order.empty()) {
+            auto it = stripe.entries.find(stripe.order.front().second);
+            if (it != stripe.entries.end() && it->second.seq == stripe.order.front().first) {
+                SSL_SESSION_free(it->second.sess);
+                stripe.entries.erase(it);
+                count--;
+                evictions++;
+            }
+            stripe.order.pop_front();
+        }
+
+        // Drop entries of sessions that were removed or replaced, so that `order` doesn't grow forever.
+        if (stripe.order.size() > 2 * stripe.entries.size() + 16) {
+            std::deque<std::pair<uint64_t, std::string>> live;
+            for (auto &idPair : stripe.order) {
+                auto it = stripe.entries.find(idPair.second);
+                if (it != stripe.entries.end() && it->second.seq == idPair.first) {
+                    live.emplace_back(std::move(idPair));
+                }
+            }
+            stripe.order.swap(live);
+        }
+    }
+
+    void SessionCache::add(SSL_SESSION *sess) {
+        unsigned len;
+        const uint8_t *id = SSL_SESSION_get_id(sess, &len);
+        if (maxPerStripe == 0 || len == 0) {
+            return;
+        }
+
+        std::string key(reinterpret_cast<const char *>(id), len);
+        Stripe &stripe = stripeOf(key);
+        std::lock_guard<std::mutex> lg(stripe.mtx);
+
+        auto it = stripe.entries.find(key);
+        if (it != stripe.entries.end()) {
+            SSL_SESSION_free(it->second.sess);
+            stripe.entries.erase(it);
+            count--;
+        }
+        makeRoom(stripe);
+
+        SSL_SESSION_up_ref(sess);
+        uint64_t seq = stripe.nextSeq++;
+        stripe.entries[key] = Entry{sess, std::chrono::steady_clock::now() + std::chrono::seconds(ttlSecs), seq};
+        stripe.order.emplace_back(seq, std::move(key));
+        count++;
+    }
+
+    SSL_SESSION *SessionCache::get(const uint8_t *id, unsigned len) {
+        std::string key(reinterpret_cast<const char *>(id), len);
+        Stripe &stripe = stripeOf(key);
+        std::lock_guard<std::mutex> lg(stripe.mtx);
+
+        auto it = stripe.entries.find(key);
+        if (it == stripe.entries.end()) {
+            misses++;
+            return nullptr;
+        }
+
+        if (std::chrono::steady_clock::now() >= it->second.expiry) {
+            SSL_SESSION_free(it->second.sess);
+            stripe.entries.erase(it);
+            count--;
+            misses++;
+            return nullptr;
+        }
+
+        hits++;
+        SSL_SESSION_up_ref(it->second.sess);
+        return it->second.sess;
+    }
+
+    void SessionCache::remove(const uint8_t *id, unsigned len) {
+        std::string key(reinterpret_cast<const char *>(id), len);
+        Stripe &stripe = stripeOf(key);
+        std::lock_guard<std::mutex> lg(stripe.mtx);
+
+        auto it = stripe.entries.find(key);
+        if (it != stripe.entries.end()) {
+            SSL_SESSION_free(it->second.sess);
+            stripe.entries.erase(it);
+            count--;
+        }
+    }
+
+    void SessionCache::flushExpired() {
+        auto now = std::chrono::steady_clock::now();
+        for (std::size_t i = 0; i < numStripes; i++) {
+            std::lock_guard<std::mutex> lg(stripes[i].mtx);
+            auto it = stripes[i].entries.begin();
+            while (it != stripes[i].entries.end()) {
+                if (now < it->second.expiry) {
+                    ++it;
+                    continue;
+                }
+
+                SSL_SESSION_free(it->second.sess);
+                it = stripes[i].entries.erase(it);
+                count--;
+            }
+        }
+    }
+
+    void SessionCache::clear() {
+        for (std::size_t i = 0; i < numStripes; i++) {
+            std::lock_guard<std::mutex> lg(stripes[i].mtx);
+            for (auto &entry : stripes[i].entries) {
+                SSL_SESSION_free(entry.second.sess);
+            }
+            count -= stripes[i].entries.size();
+            stripes[i].entries.clear();
+            stripes[i].order.clear();
+        }
+    }
+
+    void SessionCache::addStats(SessionStats &stats) const {
+        stats.cacheHits += hits;
+        stats.cacheMisses += misses;
+        stats.cacheEvictions += evictions;
+        stats.cacheSize += count;
+    }
+
+    void SessionCache::install(SSL_CTX *ctx, const std::shared_ptr<SessionCache> &cache) {
+        setInstalled(ctx, cache);
+        if (cache) {
+            SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+            SSL_CTX_sess_set_new_cb(ctx, newSessionCb);
+            SSL_CTX_sess_set_get_cb(ctx, getSessionCb);
+            SSL_CTX_sess_set_remove_cb(ctx, removeSessionCb);
+        } else {
+            // Leave the rest of the mode alone, as it may have been set with `_stms_SSLBase::setCacheMode`
+            SSL_CTX_set_session_cache_mode(ctx, SSL_CTX_get_session_cache_mode(ctx) & ~SSL_SESS_CACHE_NO_INTERNAL);
+            SSL_CTX_sess_set_new_cb(ctx, nullptr);
+            SSL_CTX_sess_set_get_cb(ctx, nullptr);
+            SSL_CTX_sess_set_remove_cb(ctx, nullptr);
+        }
+    }
+}
@@ -0,0 +1,427 @@
+#include "stms/net/uring.hpp"
+
+#include "stms/logging.hpp"
+
+#include <cstring>
+#include <unistd.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#   include <linux/io_uring.h>
+#   include <sys/mman.h>
+#   include <sys/syscall.h>
+#   include <csignal>
+#   ifdef IORING_RECV_MULTISHOT // Added in the same kernel (6.0) as multishot recvmsg. Older headers can't do this.
+#       define STMS_URING_SUPPORTED
+#   endif
+#endif
+
+namespace stms {
+#ifdef STMS_URING_SUPPORTED
+    static inline int uringSetup(unsigned entries, io_uring_params *p) {
+        return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+    }
+
+    static inline int uringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags, const void *arg,
+                                 std::size_t argSize) {
+        return static_cast<int>(syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg, argSize));
+    }
+
+    static inline int uringRegister(int fd, unsigned opcode, const void *arg, unsigned numArgs) {
+        return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, numArgs));
+    }
+
+    static inline unsigned *ringField(void *base, uint32_t offset) {
+        return reinterpret_cast<unsigned *>(reinterpret_cast<uint8_t *>(base) + offset);
+    }
+
+    IOUring::IOUring(unsigned entries) {
+        io_uring_params params{};
+        params.flags = IORING_SETUP_CLAMP;
+
+        ringFd = uringSetup(entries, &params);
+        if (ringFd == -1) {
+            STMS_WARN("io_uring_setup() failed: {}", strerror(errno));
+            return;
+        }
+
+        // We need IORING_ENTER_EXT_ARG for `wait` with a timeout. It came out (5.11) long before the other features.
+        if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP)) {
+            STMS_WARN("Kernel io_uring is too old (missing EXT_ARG/NODROP)! Not using it.");
+            close(ringFd);
+            ringFd = -1;
+            return;
+        }
+
+        sqLen = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqLen = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            sqLen = cqLen = std::max(sqLen, cqLen);
+        }
+
+        sqPtr = mmap(nullptr, sqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        if (sqPtr == MAP_FAILED) {
+            sqPtr = nullptr;
+            STMS_WARN("Failed to map io_uring submission queue: {}", strerror(errno));
+            close(ringFd);
+            ringFd = -1;
+            return;
+        }
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            cqPtr = sqPtr;
+        } else {
+            cqPtr = mmap(nullptr, cqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+            if (cqPtr == MAP_FAILED) {
+                cqPtr = nullptr;
+                STMS_WARN("Failed to map io_uring completion queue: {}", strerror(errno));
+                close(ringFd);
+                ringFd = -1;
+                return;
+            }
+        }
+
+        sqesLen = params.sq_entries * sizeof(io_uring_sqe);
+        sqesPtr = mmap(nullptr, sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        if (sqesPtr == MAP_FAILED) {
+            sqesPtr = nullptr;
+            STMS_WARN("Failed to map io_uring submission entries: {}", strerror(errno));
+            close(ringFd);
+            ringFd = -1;
+            return;
+        }
+
+        sqHead = ringField(sqPtr, params.sq_off.head);
+        sqTail = ringField(sqPtr, params.sq_off.tail);
+        sqMask = *ringField(sqPtr, params.sq_off.ring_mask);
+        sqEntries = params.sq_entries;
+        sqeTail = *sqTail;
+
+        // Submission queue entries are always used in order, so the indirection array is just the identity.
+        unsigned *sqArray = ringField(sqPtr, params.sq_off.array);
+        for (unsigned i = 0; i < sqEntries; i++) {
+            sqArray[i] = i;
+        }
+
+        cqHead = ringField(cqPtr, params.cq_off.head);
+        cqTail = ringField(cqPtr, params.cq_off.tail);
+        cqMask = *ringField(cqPtr, params.cq_off.ring_mask);
+        cqes = reinterpret_cast<uint8_t *>(cqPtr) + params.cq_off.cqes;
+    }
+
+    IOUring::~IOUring() {
+        // Closing the ring cancels everything that's still pending, so it's safe to free the buffers afterwards.
+        if (ringFd != -1 && close(ringFd) == -1) {
+            STMS_WARN("Failed to close io_uring: {}", strerror(errno));
+        }
+
+        if (sqesPtr != nullptr) { munmap(sqesPtr, sqesLen); }
+        if (cqPtr != nullptr && cqPtr != sqPtr) { munmap(cqPtr, cqLen); }
+        if (sqPtr != nullptr) { munmap(sqPtr, sqLen); }
+        if (bufRing != nullptr) { munmap(bufRing, bufRingLen); }
+        delete[] bufBase;
+    }
+
+    bool IOUring::registerFiles(const int *fds, unsigned num) {
+        if (uringRegister(ringFd, IORING_REGISTER_FILES, fds, num) < 0) {
+            STMS_WARN("Failed to register files with io_uring: {}", strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    bool IOUring::unregisterFiles() {
+        if (uringRegister(ringFd, IORING_UNREGISTER_FILES, nullptr, 0) < 0) {
+            STMS_WARN("Failed to unregister files from io_uring: {}", strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    bool IOUring::setupBufRing(unsigned count, unsigned size) {
+        if (count == 0 || count > 32768 || (count & (count - 1)) != 0) {
+            STMS_ERROR("io_uring buffer ring size must be a power of 2 no larger than 32768! Got {}", count);
+            return false;
+        }
+
+        bufRingLen = count * sizeof(io_uring_buf);
+        bufRing = mmap(nullptr, bufRingLen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (bufRing == MAP_FAILED) {
+            bufRing = nullptr;
+            STMS_WARN("Failed to allocate io_uring buffer ring: {}", strerror(errno));
+            return false;
+        }
+
+        io_uring_buf_reg reg{};
+        reg.ring_addr = reinterpret_cast<uint64_t>(bufRing);
+        reg.ring_entries = count;
+        reg.bgid = 0;
+        if (uringRegister(ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+            STMS_WARN("Failed to register io_uring buffer ring: {}", strerror(errno));
+            munmap(bufRing, bufRingLen);
+            bufRing = nullptr;
+            return false;
+        }
+
+        bufCount = count;
+        bufSize = size;
+        bufBase = new uint8_t[static_cast<std::size_t>(count) * size];
+
+        std::lock_guard<std::mutex> lg(bufMtx);
+        for (unsigned i = 0; i < count; i++) {
+            pushBuf(static_cast<uint16_t>(i));
+        }
+        // The tail shares space with `resv` of the first buffer entry. See `struct io_uring_buf_ring`.
+        __atomic_store_n(&reinterpret_cast<io_uring_buf *>(bufRing)[0].resv, bufTail, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    void IOUring::pushBuf(uint16_t bid) {
+        io_uring_buf &buf = reinterpret_cast<io_uring_buf *>(bufRing)[bufTail & (bufCount - 1)];
+        buf.addr = reinterpret_cast<uint64_t>(getBuf(bid));
+        buf.len = bufSize;
+        buf.bid = bid;
+        bufTail++;
+    }
+
+    void IOUring::recycleBuf(uint16_t bid) {
+        std::lock_guard<std::mutex> lg(bufMtx);
+        pushBuf(bid);
+        __atomic_store_n(&reinterpret_cast<io_uring_buf *>(bufRing)[0].resv, bufTail, __ATOMIC_RELEASE);
+    }
+
+    void *IOUring::getSqe() {
+        unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        if (sqeTail - head >= sqEntries) {
+            return nullptr;
+        }
+
+        auto *sqe = reinterpret_cast<io_uring_sqe *>(sqesPtr) + (sqeTail & sqMask);
+        sqeTail++;
+        std::memset(sqe, 0, sizeof(io_uring_sqe));
+        return sqe;
+    }
+
+    static inline io_uring_sqe *prepCommon(void *rawSqe, uint8_t op, int fd, bool fixed, uint64_t userData) {
+        auto *sqe = reinterpret_cast<io_uring_sqe *>(rawSqe);
+        sqe->opcode = op;
+        sqe->fd = fd;
+        sqe->flags = fixed ? IOSQE_FIXED_FILE : 0;
+        sqe->user_data = userData;
+        return sqe;
+    }
+
+    bool IOUring::prepRecvMsgMultishot(int fd, bool fixed, msghdr *hdr, uint64_t userData) {
+        void *raw = getSqe();
+        if (raw == nullptr) { return false; }
+
+        io_uring_sqe *sqe = prepCommon(raw, IORING_OP_RECVMSG, fd, fixed, userData);
+        sqe->addr = reinterpret_cast<uint64_t>(hdr);
+        sqe->len = 1;
+        sqe->flags |= IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        return true;
+    }
+
+    bool IOUring::prepSendMsg(int fd, bool fixed, const msghdr *hdr, uint64_t userData) {
+        void *raw = getSqe();
+        if (raw == nullptr) { return false; }
+
+        io_uring_sqe *sqe = prepCommon(raw, IORING_OP_SENDMSG, fd, fixed, userData);
+        sqe->addr = reinterpret_cast<uint64_t>(hdr);
+        sqe->len = 1;
+        return true;
+    }
+
+    bool IOUring::prepPollMultishot(int fd, bool fixed, uint32_t events, uint64_t userData) {
+        void *raw = getSqe();
+        if (raw == nullptr) { return false; }
+
+        io_uring_sqe *sqe = prepCommon(raw, IORING_OP_POLL_ADD, fd, fixed, userData);
+        sqe->poll32_events = events;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        return true;
+    }
+
+    bool IOUring::prepPoll(int fd, bool fixed, uint32_t events, uint64_t userData) {
+        void *raw = getSqe();
+        if (raw == nullptr) { return false; }
+
+        io_uring_sqe *sqe = prepCommon(raw, IORING_OP_POLL_ADD, fd, fixed, userData);
+        sqe->poll32_events = events;
+        return true;
+    }
+
+    bool IOUring::prepPollRemove(uint64_t target, uint64_t userData) {
+        void *raw = getSqe();
+        if (raw == nullptr) { return false; }
+
+        io_uring_sqe *sqe = prepCommon(raw, IORING_OP_POLL_REMOVE, -1, false, userData);
+        sqe->addr = target;
+        return true;
+    }
+
+    bool IOUring::prepAcceptMultishot(int fd, bool fixed, uint64_t userData) {
+        void *raw = getSqe();
+        if (raw == nullptr) { return false; }
+
+        io_uring_sqe *sqe = prepCommon(raw, IORING_OP_ACCEPT, fd, fixed, userData);
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        return true;
+    }
+
+    bool IOUring::prepCancelAll(uint64_t userData) {
+        void *raw = getSqe();
+        if (raw == nullptr) { return false; }
+
+        io_uring_sqe *sqe = prepCommon(raw, IORING_OP_ASYNC_CANCEL, -1, false, userData);
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+        return true;
+    }
+
+    int IOUring::submit() {
+        __atomic_store_n(sqTail, sqeTail, __ATOMIC_RELEASE);
+
+        unsigned toSubmit = sqeTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        if (toSubmit == 0) {
+            return 0;
+        }
+
+        int ret = uringEnter(ringFd, toSubmit, 0, 0, nullptr, 0);
+        if (ret < 0) {
+            STMS_WARN("io_uring_enter() failed to submit {} requests: {}", toSubmit, strerror(errno));
+            return -1;
+        }
+        return ret;
+    }
+
+    bool IOUring::wait(int timeoutMs) {
+        if (hasCompletions()) {
+            return true;
+        }
+
+        __kernel_timespec ts{};
+        ts.tv_sec = timeoutMs / 1000;
+        ts.tv_nsec = static_cast<long long>(timeoutMs % 1000) * 1000000;
+
+        io_uring_getevents_arg arg{};
+        arg.sigmask_sz = _NSIG / 8;
+        arg.ts = reinterpret_cast<uint64_t>(&ts);
+
+        int ret;
+        if (timeoutMs < 0) {
+            ret = uringEnter(ringFd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, _NSIG / 8);
+        } else {
+            ret = uringEnter(ringFd, 0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+        }
+
+        if (ret < 0 && errno != ETIME && errno != EINTR) {
+            STMS_WARN("io_uring_enter() failed to wait for completions: {}", strerror(errno));
+        }
+
+        return hasCompletions();
+    }
+
+    unsigned IOUring::reap(std::vector<UringCompletion> &out) {
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+
+        out.reserve(out.size() + (tail - head));
+        for (unsigned i = head; i != tail; i++) {
+            const io_uring_cqe &cqe = reinterpret_cast<io_uring_cqe *>(cqes)[i & cqMask];
+            out.emplace_back(UringCompletion{cqe.user_data, cqe.res, cqe.flags});
+        }
+
+        __atomic_store_n(cqHead, tail, __ATOMIC_RELEASE);
+        return tail - head;
+    }
+
+    bool IOUring::hasUnsubmitted() const {
+        return sqeTail != __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    }
+
+    bool IOUring::hasCompletions() const {
+        return *cqHead != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+    }
+
+    bool IOUring::hasMore(const UringCompletion &c) {
+        return c.flags & IORING_CQE_F_MORE;
+    }
+
+    int IOUring::getBufId(const UringCompletion &c) {
+        return (c.flags & IORING_CQE_F_BUFFER) ? static_cast<int>(c.flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+    }
+
+    bool IOUring::parseRecvMsg(uint8_t *buf, int32_t len, const msghdr *hdr, sockaddr **addr, socklen_t *addrLen,
+                               uint8_t **payload, std::size_t *payloadLen) {
+        std::size_t headerLen = sizeof(io_uring_recvmsg_out) + hdr->msg_namelen + hdr->msg_controllen;
+        if (len < 0 || static_cast<std::size_t>(len) < headerLen) {
+            STMS_WARN("Received a malformed io_uring recvmsg buffer ({} bytes)! Dropping it.", len);
+            return false;
+        }
+
+        auto *out = reinterpret_cast<io_uring_recvmsg_out *>(buf);
+        if (out->flags & MSG_TRUNC) {
+            STMS_WARN("Dropping {} byte datagram: It doesn't fit in an io_uring buffer! (see `uringRecvBufSize`)",
+                      out->payloadlen);
+            return false;
+        }
+
+        *addr = reinterpret_cast<sockaddr *>(buf + sizeof(io_uring_recvmsg_out));
+        *addrLen = std::min<socklen_t>(out->namelen, hdr->msg_namelen);
+        *payload = buf + headerLen;
+        *payloadLen = out->payloadlen;
+        return true;
+    }
+#else
+    IOUring::IOUring(unsigned) {
+        STMS_WARN("io_uring is not supported on this platform!");
+    }
+
+    IOUring::~IOUring() = default;
+
+    bool IOUring::registerFiles(const int *, unsigned) { return false; }
+
+    bool IOUring::unregisterFiles() { return false; }
+
+    bool IOUring::setupBufRing(unsigned, unsigned) { return false; }
+
+    void IOUring::pushBuf(uint16_t) {}
+
+    void IOUring::recycleBuf(uint16_t) {}
+
+    void *IOUring::getSqe() { return nullptr; }
+
+    bool IOUring::prepRecvMsgMultishot(int, bool, msghdr *, uint64_t) { return false; }
+
+    bool IOUring::prepSendMsg(int, bool, const msghdr *, uint64_t) { return false; }
+
+    bool IOUring::prepPollMultishot(int, bool, uint32_t, uint64_t) { return false; }
+
+    bool IOUring::prepPoll(int, bool, uint32_t, uint64_t) { return false; }
+
+    bool IOUring::prepPollRemove(uint64_t, uint64_t) { return false; }
+
+    bool IOUring::prepAcceptMultishot(int, bool, uint64_t) { return false; }
+
+    bool IOUring::prepCancelAll(uint64_t) { return false; }
+
+    int IOUring::submit() { return -1; }
+
+    bool IOUring::wait(int) { return false; }
+
+    unsigned IOUring::reap(std::vector<UringCompletion> &) { return 0; }
+
+    bool IOUring::hasUnsubmitted() const { return false; }
+
+    bool IOUring::hasCompletions() const { return false; }
+
+    bool IOUring::hasMore(const UringCompletion &) { return false; }
+
+    int IOUring::getBufId(const UringCompletion &) { return -1; }
+
+    bool IOUring::parseRecvMsg(uint8_t *, int32_t, const msghdr *, sockaddr **, socklen_t *, uint8_t **,
+                               std::size_t *) { return false; }
+#endif
+}
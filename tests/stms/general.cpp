@@ -2,6 +2,7 @@
 // Created by grant on 1/25/20.
 //
 
+#include <algorithm>
 #include <thread>
 #include <bitset>
 #include <unordered_set>
@@ -14,8 +15,10 @@
 #include "stms/util/uuid.hpp"
 #include "stms/util/util.hpp"
 #include "stms/util/compare.hpp"
+#include "stms/util/striped_map.hpp"
 #include "stms/camera.hpp"
 #include "stms/util/timers.hpp"
+#include "stms/util/timing_wheel.hpp"
 
 // Timeout after 10 seconds. The actual audio that we're playing is only 5 sec long.
 constexpr unsigned alPlayBlockTimeout = 10;
@@ -282,6 +285,59 @@ namespace {
         EXPECT_EQ(tm.getLatestTps(), cpy.getLatestTps());
     }
 
+    TEST(Timers, TimingWheel) {
+        using namespace std::chrono;
+        auto start = steady_clock::now();
+        stms::TimingWheel<int> wheel(milliseconds(1), start);
+
+        // Spread over every level, including past the span of the last one, plus some that are already due
+        std::vector<int> deadlines;
+        for (int i = 0; i < 2000; i++) {
+            deadlines.push_back((i * 7919) % (1 << 20) + (i % 3 == 0 ? 1 << 25 : 0));
+        }
+        deadlines.push_back(0);
+        deadlines.push_back(-5);
+        for (std::size_t i = 0; i < deadlines.size(); i++) {
+            wheel.schedule(static_cast<int>(i), start + milliseconds(deadlines[i]));
+        }
+        EXPECT_EQ(wheel.size(), deadlines.size());
+
+        // Advance in uneven steps; Nothing may expire early, nor later than the step it became due in.
+        std::vector<bool> expired(deadlines.size(), false);
+        long long now = 0;
+        long long step = 1;
+        while (wheel.size() > 0 && now < (1ll << 27)) {
+            long long prev = now;
+            now += step;
+            step = step * 3 % 65537 + 1;
+            wheel.advance(start + milliseconds(now), [&](int &&i) {
+                EXPECT_LE(deadlines[i], now);
+                EXPECT_GT(deadlines[i], deadlines[i] <= 0 ? -1000 : prev);
+                EXPECT_FALSE(expired[i]);
+                expired[i] = true;
+            });
+        }
+        EXPECT_EQ(wheel.size(), 0);
+        EXPECT_EQ(std::count(expired.begin(), expired.end(), false), 0);
+
+        // Rescheduling from the callback
+        int fired = 0;
+        wheel.schedule(0, start + milliseconds(now + 10));
+        for (int i = 1; i <= 100; i++) {
+            wheel.advance(start + milliseconds(now + i * 10), [&](int &&item) {
+                fired++;
+                if (item < 4) {
+                    wheel.schedule(item + 1, start + milliseconds(now + i * 10 + 100));
+                }
+            });
+        }
+        EXPECT_EQ(fired, 5);
+
+        wheel.schedule(1, start + milliseconds(now + 5000));
+        wheel.clear();
+        EXPECT_EQ(wheel.size(), 0);
+    }
+
     TEST(Util, ReadFile) {
         auto raw = stms::readFile("./res/test.txt");
         std::string contents;
@@ -301,4 +357,66 @@ namespace {
         EXPECT_EQ(stms::editDistance("same thing", "same thing"), 0);
         EXPECT_EQ(stms::editDistance("", "abc"), 3);
     }
+
+    TEST(Util, StripedMap) {
+        stms::StripedMap<int, int> map{4};
+        for (int i = 0; i < 64; i++) {
+            map.insert(i, i * 2);
+        }
+        map.insert(3, 7); // Replaces
+        EXPECT_EQ(map.size(), 64u);
+
+        int val = -1;
+        EXPECT_TRUE(map.find(3, val));
+        EXPECT_EQ(val, 7);
+        EXPECT_FALSE(map.find(100, val));
+        EXPECT_EQ(val, 7);
+
+        EXPECT_TRUE(map.rekey(5, 100));
+        EXPECT_FALSE(map.contains(5));
+        EXPECT_TRUE(map.find(100, val));
+        EXPECT_EQ(val, 10);
+        EXPECT_FALSE(map.rekey(5, 101));
+        EXPECT_TRUE(map.rekey(100, 6)); // Overwrites 6
+        EXPECT_EQ(map.size(), 63u);
+
+        EXPECT_TRUE(map.erase(6));
+        EXPECT_FALSE(map.erase(6));
+
+        int sum = 0;
+        std::size_t visited = 0;
+        map.forEach([&](const int &k, const int &) {
+            sum += k;
+            visited++;
+        });
+        EXPECT_EQ(visited, map.size());
+        EXPECT_EQ(sum, 63 * 64 / 2 - 5 - 6);
+
+        // Readers and writers on other threads
+        std::atomic_bool stop{false};
+        std::vector<std::thread> readers;
+        for (int t = 0; t < 4; t++) {
+            readers.emplace_back([&]() {
+                int out;
+                while (!stop) {
+                    for (int i = 0; i < 64; i++) {
+                        map.find(i, out);
+                    }
+                }
+            });
+        }
+        for (int i = 1000; i < 2000; i++) {
+            map.insert(i, i);
+            map.rekey(i, -i);
+        }
+        stop = true;
+        for (auto &reader : readers) {
+            reader.join();
+        }
+        EXPECT_EQ(map.size(), 62u + 1000u);
+
+        map.clear();
+        EXPECT_EQ(map.size(), 0u);
+        EXPECT_FALSE(map.contains(1));
+    }
 }
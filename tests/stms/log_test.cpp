@@ -8,6 +8,9 @@
 #include "stms/stms.hpp"
 #include "stms/config.hpp"
 
+#include <thread>
+#include <unordered_map>
+
 namespace {
     class LoggingTests : public ::testing::Test {
     protected:
@@ -44,6 +47,78 @@ namespace {
         }
     }
 
+    TEST_F(LoggingTests, ThreadLocalBuffering) {
+        std::mutex seenMtx;
+        std::unordered_map<std::string, int> lastSeen; // last `i` consumed for every thread
+        int numSeen = 0;
+        bool outOfOrder = false;
+
+        stms::getLogHooks().emplace(stms::getLogHooks().begin(), [&](stms::LogRecord *rec, std::string *) {
+            if (rec == nullptr || rec->file != std::string(__FILE__)) {
+                return;
+            }
+
+            std::string msg = fmt::to_string(rec->msg);
+            auto sep = msg.find(':');
+            int i = std::stoi(msg.substr(sep + 1));
+
+            std::lock_guard<std::mutex> lg(seenMtx);
+            auto it = lastSeen.find(msg.substr(0, sep));
+            outOfOrder |= it != lastSeen.end() && it->second >= i;
+            lastSeen[msg.substr(0, sep)] = i;
+            numSeen++;
+        });
+
+        stms::getLogBuffering() = true;
+
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; t++) {
+            threads.emplace_back([t]() {
+                for (int i = 0; i < 100; i++) {
+                    STMS_TRACE("buffered {}:{}", t, i);
+                }
+            });
+        }
+
+        for (auto &t : threads) {
+            t.join(); // Exiting threads hand off their leftover records.
+        }
+
+        stms::flushLogBuffers();
+        stms::getLogBuffering() = false;
+        pool->waitIdle(1000);
+
+        stms::getLogHooks().erase(stms::getLogHooks().begin());
+
+        EXPECT_EQ(numSeen, 400);
+        EXPECT_FALSE(outOfOrder);
+    }
+
+    TEST_F(LoggingTests, TscTimestamps) {
+        std::vector<std::chrono::system_clock::time_point> times;
+        stms::getLogHooks().emplace(stms::getLogHooks().begin(), [&](stms::LogRecord *rec, std::string *) {
+            if (rec != nullptr && rec->tsc != 0) {
+                times.emplace_back(rec->time);
+            }
+        });
+
+        stms::setLogTimestampMode(stms::LogTimestampMode::eTsc);
+        auto before = std::chrono::system_clock::now();
+        STMS_INFO("Timestamped with the cycle counter");
+        STMS_INFO("Timestamped with the cycle counter, again");
+        auto after = std::chrono::system_clock::now();
+        stms::setLogTimestampMode(stms::LogTimestampMode::eWallClock);
+
+        pool->waitIdle(1000);
+        stms::getLogHooks().erase(stms::getLogHooks().begin());
+
+        ASSERT_EQ(times.size(), 2u);
+        EXPECT_LE(times[0], times[1]);
+        // Allow for a bit of calibration error.
+        EXPECT_GT(times[0], before - std::chrono::milliseconds(5));
+        EXPECT_LT(times[1], after + std::chrono::milliseconds(5));
+    }
+
     TEST_F(LoggingTests, BadFmt) {
         const char *str = nullptr;
         STMS_INFO("This should fail {} {} {}", "not enough args");
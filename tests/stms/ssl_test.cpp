@@ -5,7 +5,21 @@
 #include "gtest/gtest.h"
 #include "stms/net/ssl_client.hpp"
 #include "stms/net/ssl_server.hpp"
+#include "stms/net/sharded_ssl_server.hpp"
 #include "stms/net/plain_udp.hpp"
+#include "stms/net/plain_tcp.hpp"
+#include "stms/net/framing.hpp"
+#include "stms/net/reliable_udp.hpp"
+#include "stms/net/metrics.hpp"
+
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <set>
 
 
 namespace {
@@ -18,9 +32,28 @@ namespace {
         bool serverPinged = false;
         bool cliPinged = false;
 
+        int numReplies = 1; //!< Number of times the server echoes "HELLO" back
+        unsigned flushDelay = 0; //!< Passed to `SSLServer::setSendCoalescing`
+        std::string cliRecvd; //!< Everything the client received so far
+        int cliReads = 0; //!< Number of times the client's `recvCallback` was called
+        std::size_t highWatermark = 0; //!< If non-zero, passed to `SSLServer::setSendWatermarks`
+        std::atomic_bool writable{false}; //!< Set by the server's `writableCallback`
+        int refusedSends = 0; //!< Number of times the server's `send()` returned -4
+        int numIdleConns = 0; //!< Number of raw TCP connections opened before the client that never handshake
+        std::vector<int> idleConns; //!< Sockets of those connections
+        bool dtlsDemux = false; //!< Passed to `SSLServer::setDtlsDemux`
+        bool forgeHellos = false; //!< If true, check how the DTLS server answers ClientHellos before the client starts
+        int listenBacklog = 0; //!< If non-zero, passed to `SSLServer::setListenBacklog`
+        std::shared_ptr<stms::NetImpairment> impairment; //!< If set, passed to `setImpairment` of both ends
+
         void SetUp() override {
             serverPinged = false;
             cliPinged = false;
+            cliRecvd.clear();
+            cliReads = 0;
+            writable = false;
+            refusedSends = 0;
+            idleConns.clear();
 
             pool = new stms::ThreadPool();
             pool->start();
@@ -36,10 +69,21 @@ namespace {
             delete cli;
             delete serv;
             delete pool;
+
+            for (int fd : idleConns) {
+                close(fd);
+            }
         }
 
-        void start(bool isUdp, bool dubiousCertsCli, bool dubiousCertsServ) {
+        void start(bool isUdp, bool dubiousCertsCli, bool dubiousCertsServ,
+                   stms::IOBackend backend = stms::IOBackend::ePoll, bool edgeTriggered = false) {
             serv = new stms::SSLServer(pool, isUdp);
+            serv->setIoBackend(backend, edgeTriggered);
+            serv->setDtlsDemux(dtlsDemux);
+            serv->setImpairment(impairment);
+            if (listenBacklog > 0) {
+                serv->setListenBacklog(listenBacklog);
+            }
             serv->setHostAddr("3000", "127.0.0.1");
             serv->setIPv6(false);
             serv->setCertAuth("./res/ssl/legit/ca-pub-cert.pem", "");
@@ -51,6 +95,13 @@ namespace {
                 serv->setPrivateKey("./res/ssl/legit/serv-priv-key.pem");
             }
             serv->verifyKeyMatchCert();
+            serv->setSendCoalescing(stms::sendCoalesceMax, flushDelay);
+            if (highWatermark > 0) {
+                serv->setSendWatermarks(highWatermark, 0);
+            }
+            serv->setWritableCallback([&](const stms::UUID &) {
+                writable = true;
+            });
             serv->setConnectCallback([&](const stms::UUID &c, const sockaddr *const addr) {
                 STMS_WARN("CONNECT {}: {}", c.buildStr(), stms::getAddrStr(addr));
             });
@@ -64,8 +115,30 @@ namespace {
                 std::string str = std::string(reinterpret_cast<char *>(dat));
 
                 STMS_WARN("RECV {} from {}: {} BYTES: '{}'", c.buildStr(), stms::getAddrStr(addr), size, str);
-                auto fut = serv->send(c, dat, size, true);
-                EXPECT_EQ(fut.get(), 5);
+                std::vector<std::future<int>> futs;
+                for (int i = 0; i < numReplies; i++) {
+                    writable = false;
+                    auto fut = serv->send(c, dat, size, true);
+                    if (fut.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+                        futs.emplace_back(std::move(fut));
+                        continue;
+                    }
+
+                    int ret = fut.get();
+                    if (ret == -4) {
+                        EXPECT_GT(serv->getQueuedBytes(c), 0u);
+                        refusedSends++;
+                        while (!writable) {
+                            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                        }
+                        i--; // Retry
+                    } else {
+                        EXPECT_EQ(ret, 5);
+                    }
+                }
+                for (auto &fut : futs) {
+                    EXPECT_EQ(fut.get(), 5);
+                }
                 EXPECT_EQ(str, "HELLO");
                 std::this_thread::sleep_for(std::chrono::milliseconds(125));
                 serv->stop();
@@ -75,6 +148,7 @@ namespace {
             cli = new stms::SSLClient(pool, isUdp);
             cli->setHostAddr("3000", "127.0.0.1");
             cli->setIPv6(false);
+            cli->setImpairment(impairment);
             cli->setCertAuth("./res/ssl/legit/ca-pub-cert.pem", "");
             if (dubiousCertsCli) {
                 cli->setPublicCert("./res/ssl/dubious/cli-pub-cert.pem");
@@ -85,12 +159,26 @@ namespace {
             }
             cli->verifyKeyMatchCert();
 
-            cli->setRecvCallback([&](uint8_t *dat, size_t size) {
-                EXPECT_EQ(size, 5);
-                dat[size] = '\0';
-                std::string str = std::string(reinterpret_cast<char *>(dat));
-                STMS_WARN("CLI RECV {} BYTES: {}", size, str);
-                EXPECT_EQ(str, "HELLO");
+            // Every DTLS datagram, and a lone uncoalesced TLS reply, must arrive as exactly one "HELLO". Only
+            // coalesced TCP replies may be merged or split across reads, so those are checked once all arrived.
+            bool exactReads = isUdp || (numReplies == 1 && flushDelay == 0);
+            cli->setRecvCallback([&, exactReads](uint8_t *dat, size_t size) {
+                cliReads++;
+                cliRecvd.append(reinterpret_cast<char *>(dat), size);
+                STMS_WARN("CLI RECV {} BYTES: {}", size, std::string(reinterpret_cast<char *>(dat), size));
+                if (exactReads) {
+                    EXPECT_EQ(size, 5);
+                    EXPECT_EQ(std::string(reinterpret_cast<char *>(dat), size), "HELLO");
+                }
+                if (cliRecvd.size() < 5u * numReplies) {
+                    return;
+                }
+
+                std::string expected;
+                for (int i = 0; i < numReplies; i++) {
+                    expected += "HELLO";
+                }
+                EXPECT_EQ(cliRecvd, expected);
 
                 cli->stop();
             });
@@ -98,6 +186,21 @@ namespace {
             serv->start();
             pool->submitTask([&]() {
                 std::this_thread::sleep_for(std::chrono::milliseconds(125));
+                for (int i = 0; i < numIdleConns; i++) {
+                    sockaddr_in servAddr{};
+                    servAddr.sin_family = AF_INET;
+                    servAddr.sin_port = htons(3000);
+                    servAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+                    int fd = socket(AF_INET, SOCK_STREAM, 0);
+                    EXPECT_EQ(connect(fd, reinterpret_cast<sockaddr *>(&servAddr), sizeof(servAddr)), 0);
+                    idleConns.emplace_back(fd);
+                }
+
+                if (forgeHellos) {
+                    checkForgedHellos();
+                }
+
                 cli->start();
 
                 if (dubiousCertsServ || dubiousCertsCli) {
@@ -123,6 +226,62 @@ namespace {
                 serv->waitEvents(16);
             }
         }
+
+        /**
+         * @brief Send a minimal DTLS ClientHello to the server
+         * @param fd Socket to send from
+         * @param cookie Cookie to send along
+         * @return The reply, or an empty vector if there was none within 250ms
+         */
+        static std::vector<uint8_t> sendHello(int fd, const std::vector<uint8_t> &cookie) {
+            // Body: client_version, random, empty session_id, cookie, 1 cipher suite, null compression
+            std::vector<uint8_t> body = {0xfe, 0xfd};
+            body.resize(body.size() + 32, 0x42);
+            body.emplace_back(0);
+            body.emplace_back(static_cast<uint8_t>(cookie.size()));
+            body.insert(body.end(), cookie.begin(), cookie.end());
+            body.insert(body.end(), {0, 2, 0xc0, 0x2f, 1, 0});
+
+            auto bodyLen = static_cast<uint8_t>(body.size());
+            std::vector<uint8_t> hello = {22, 0xfe, 0xff, 0, 0, 0, 0, 0, 0, 0, 0, 0, static_cast<uint8_t>(bodyLen + 12),
+                                          1, 0, 0, bodyLen, 0, 0, 0, 0, 0, 0, 0, bodyLen};
+            hello.insert(hello.end(), body.begin(), body.end());
+            EXPECT_EQ(send(fd, hello.data(), hello.size(), 0), static_cast<ssize_t>(hello.size()));
+
+            pollfd pfd{fd, POLLIN, 0};
+            std::vector<uint8_t> reply(2048);
+            if (poll(&pfd, 1, 250) != 1) {
+                return {};
+            }
+            reply.resize(static_cast<std::size_t>(std::max(recv(fd, reply.data(), reply.size(), 0), ssize_t{0})));
+            return reply;
+        }
+
+        /// Check that the server answers ClientHellos without a cookie, and ignores ones with a bad cookie.
+        static void checkForgedHellos() {
+            sockaddr_in servAddr{};
+            servAddr.sin_family = AF_INET;
+            servAddr.sin_port = htons(3000);
+            servAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+            int fd = socket(AF_INET, SOCK_DGRAM, 0);
+            EXPECT_EQ(connect(fd, reinterpret_cast<sockaddr *>(&servAddr), sizeof(servAddr)), 0);
+
+            // HelloVerifyRequest: handshake record, message type 3, cookie after the server version.
+            std::vector<uint8_t> hvr = sendHello(fd, {});
+            ASSERT_GE(hvr.size(), 28u);
+            EXPECT_EQ(hvr[0], 22);
+            EXPECT_EQ(hvr[13], 3);
+            ASSERT_EQ(hvr.size(), 28u + hvr[27]);
+            std::vector<uint8_t> cookie(hvr.begin() + 28, hvr.end());
+            EXPECT_FALSE(cookie.empty());
+
+            // The same peer always gets the same cookie. A wrong one is dropped without an answer.
+            EXPECT_EQ(sendHello(fd, {}), hvr);
+            cookie[0] ^= 0xffu;
+            EXPECT_TRUE(sendHello(fd, cookie).empty());
+            close(fd);
+        }
     };
 
     TEST_F(SSLTest, TCP) {
@@ -133,6 +292,132 @@ namespace {
         start(true, false, false);
     }
 
+    TEST_F(SSLTest, TCPEpoll) {
+        start(false, false, false, stms::IOBackend::eEpoll);
+    }
+
+    TEST_F(SSLTest, UDPEpoll) {
+        start(true, false, false, stms::IOBackend::eEpoll);
+    }
+
+    TEST_F(SSLTest, TCPEpollEdgeTriggered) {
+        start(false, false, false, stms::IOBackend::eEpoll, true);
+    }
+
+    TEST_F(SSLTest, TCPIOUring) {
+        start(false, false, false, stms::IOBackend::eIOUring);
+    }
+
+    TEST_F(SSLTest, UDPIOUring) {
+        start(true, false, false, stms::IOBackend::eIOUring);
+    }
+
+    TEST_F(SSLTest, UDPDemux) {
+        dtlsDemux = true;
+        start(true, false, false);
+        EXPECT_EQ(cliRecvd, "HELLO");
+    }
+
+    TEST_F(SSLTest, UDPDemuxEpoll) {
+        dtlsDemux = true;
+        numReplies = 8;
+        start(true, false, false, stms::IOBackend::eEpoll);
+        EXPECT_EQ(cliReads, numReplies);
+    }
+
+    TEST_F(SSLTest, TCPCoalescedSends) {
+        numReplies = 32;
+        flushDelay = 50;
+        start(false, false, false);
+
+        // All 32 replies are queued well within `flushDelay`, so they should go out in far fewer records.
+        EXPECT_EQ(cliRecvd.size(), 5u * numReplies);
+        EXPECT_LT(cliReads, numReplies);
+    }
+
+    TEST_F(SSLTest, UDPQueuedSends) {
+        numReplies = 8;
+        start(true, false, false);
+
+        // DTLS never merges messages.
+        EXPECT_EQ(cliReads, numReplies);
+    }
+
+    TEST_F(SSLTest, TCPSendWatermarks) {
+        numReplies = 8;
+        flushDelay = 50;
+        highWatermark = 16;
+        start(false, false, false);
+
+        // Nothing is written for `flushDelay`, so every 4th message overflows the 16 byte queue.
+        EXPECT_EQ(cliRecvd.size(), 5u * numReplies);
+        EXPECT_GE(refusedSends, 2);
+    }
+
+    TEST_F(SSLTest, TCPStalledHandshakes) {
+        // More connections that never send a ClientHello than there are pool threads.
+        numIdleConns = 12;
+        start(false, false, false);
+        EXPECT_EQ(cliRecvd, "HELLO");
+    }
+
+    TEST_F(SSLTest, TCPStalledHandshakesEpoll) {
+        numIdleConns = 12;
+        start(false, false, false, stms::IOBackend::eEpoll);
+        EXPECT_EQ(cliRecvd, "HELLO");
+    }
+
+    TEST_F(SSLTest, TCPAcceptStorm) {
+        // More connections than the old backlog of 8, all arriving before the server's first accept.
+        listenBacklog = 256;
+        numIdleConns = 96;
+        start(false, false, false, stms::IOBackend::eEpoll);
+        EXPECT_EQ(cliRecvd, "HELLO");
+    }
+
+    TEST_F(SSLTest, UDPForgedHellos) {
+        forgeHellos = true;
+        start(true, false, false);
+        EXPECT_EQ(cliRecvd, "HELLO");
+    }
+
+    TEST_F(SSLTest, UDPDemuxForgedHellos) {
+        forgeHellos = true;
+        dtlsDemux = true;
+        start(true, false, false, stms::IOBackend::eEpoll);
+        EXPECT_EQ(cliRecvd, "HELLO");
+    }
+
+    TEST_F(SSLTest, UDPImpaired) {
+        // No loss: A lost "HELLO" would never be retried. Duplicates and reordering are dealt with by DTLS.
+        stms::ImpairmentConfig cfg;
+        cfg.seed = 7;
+        cfg.duplicateRate = 0.2;
+        cfg.reorderRate = 0.2;
+        cfg.latencyMs = 5;
+        cfg.jitterMs = 10;
+        impairment = std::make_shared<stms::NetImpairment>(cfg);
+
+        numReplies = 4;
+        start(true, false, false);
+        EXPECT_EQ(cliRecvd.size(), 5u * numReplies);
+        EXPECT_GT(impairment->getStats().delayed, 0u);
+    }
+
+    TEST_F(SSLTest, UDPDemuxImpaired) {
+        stms::ImpairmentConfig cfg;
+        cfg.seed = 7;
+        cfg.duplicateRate = 0.2;
+        cfg.jitterMs = 10;
+        impairment = std::make_shared<stms::NetImpairment>(cfg);
+
+        dtlsDemux = true;
+        numReplies = 4;
+        start(true, false, false);
+        EXPECT_EQ(cliRecvd.size(), 5u * numReplies);
+        EXPECT_GT(impairment->getStats().duplicated, 0u);
+    }
+
     TEST_F(SSLTest, DubiousServer) {
         start(false, false, true);
     }
@@ -141,11 +426,460 @@ namespace {
         start(true, true, false);
     }
 
-    TEST(PlainTest, UDP) {
+    /// Point a server at the legit certs in `./res/ssl`, listening on 127.0.0.1:3000
+    void setLegitCerts(stms::SSLServer &serv) {
+        serv.setHostAddr("3000", "127.0.0.1");
+        serv.setIPv6(false);
+        serv.setCertAuth("./res/ssl/legit/ca-pub-cert.pem", "");
+        serv.setPublicCert("./res/ssl/legit/serv-pub-cert.pem");
+        serv.setPrivateKey("./res/ssl/legit/serv-priv-key.pem");
+    }
+
+    /// Point a client at the legit certs in `./res/ssl`, connecting to 127.0.0.1:3000
+    void setLegitCerts(stms::SSLClient &cli) {
+        cli.setHostAddr("3000", "127.0.0.1");
+        cli.setIPv6(false);
+        cli.setCertAuth("./res/ssl/legit/ca-pub-cert.pem", "");
+        cli.setPublicCert("./res/ssl/legit/cli-pub-cert.pem");
+        cli.setPrivateKey("./res/ssl/legit/cli-priv-key.pem");
+    }
+
+    /// A TCP `SSLServer` ticked by its own thread, and an `SSLClient` with its own pool connecting to it.
+    class SSLPairTest : public ::testing::Test {
+    protected:
+        stms::ThreadPool pool{};
+        // The client gets its own pool, so that it can be stopped once its reads are done without waiting for the server.
+        stms::ThreadPool cliPool{};
+        stms::SSLServer serv{&pool, false};
+        stms::SSLClient cli{&cliPool, false};
+        std::thread servThread;
+        bool stopped = false;
+
+        void SetUp() override {
+            pool.start();
+            cliPool.start();
+            setLegitCerts(serv);
+            setLegitCerts(cli);
+        }
+
+        void TearDown() override {
+            stopAll();
+        }
+
+        /// Start the server and its tick thread. Configure `serv` before calling this.
+        void startServer() {
+            serv.start();
+            ASSERT_TRUE(serv.isRunning());
+            servThread = std::thread([&]() {
+                while (serv.isRunning() && serv.tick()) {
+                    serv.waitEvents(16);
+                }
+            });
+        }
+
+        /// Stop both ends and their pools, so that whatever the callbacks collected can be checked.
+        void stopAll() {
+            if (stopped) {
+                return;
+            }
+            stopped = true;
+
+            cliPool.waitIdle(0); // No `SSL_read()` may be in progress when `stop()` frees `pSsl`
+            cli.stop();
+            serv.stop();
+            if (servThread.joinable()) {
+                servThread.join();
+            }
+            pool.waitIdle(0);
+            pool.stop(true);
+            cliPool.stop(true);
+        }
+    };
+
+    class SSLSessionTest : public SSLPairTest {
+    protected:
+        void runSessionResumption(bool tickets);
+    };
+
+    class SSLFileTest : public SSLPairTest {};
+    class MetricsTest : public SSLPairTest {};
+    class SSLFramedTest : public SSLPairTest {};
+
+    TEST(ShardedSSLTest, TCP) {
+        constexpr int numClients = 4;
+
+        stms::ThreadPool pool{};
+        pool.start();
+
+        stms::ShardedSSLServer serv{&pool, false, 2};
+        serv.configure([](stms::SSLServer &shard) {
+            shard.setIoBackend(stms::IOBackend::eEpoll);
+            setLegitCerts(shard);
+        });
+        serv.setPinThreads(false);
+
+        std::atomic_int connects{0};
+        serv.setConnectCallback([&](const stms::UUID &, const sockaddr *const) {
+            connects++;
+        });
+        serv.setRecvCallback([&](const stms::UUID &c, const sockaddr *const, uint8_t *dat, int size) {
+            EXPECT_EQ(serv.send(c, dat, size, true).get(), 5);
+        });
+        serv.start();
+        EXPECT_EQ(serv.getNumShards(), 2u);
+        EXPECT_TRUE(serv.isRunning());
+
+        std::atomic_int replies{0};
+        std::vector<std::unique_ptr<stms::SSLClient>> clis;
+        for (int i = 0; i < numClients; i++) {
+            clis.emplace_back(std::make_unique<stms::SSLClient>(&pool, false));
+            auto &cli = *clis.back();
+            setLegitCerts(cli);
+            cli.setRecvCallback([&](uint8_t *dat, size_t size) {
+                EXPECT_EQ(std::string(reinterpret_cast<char *>(dat), size), "HELLO");
+                replies++;
+                cli.stop();
+            });
+
+            cli.start();
+            ASSERT_TRUE(cli.isRunning());
+            EXPECT_EQ(cli.send(reinterpret_cast<const uint8_t *>("HELLO"), 5, true).get(), 5);
+        }
+
+        stms::Stopwatch sw;
+        sw.start();
+        while (replies < numClients && sw.getTime() < 10000) {
+            for (auto &cli : clis) {
+                if (cli->isRunning()) {
+                    cli->tick();
+                }
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        EXPECT_EQ(replies, numClients);
+        EXPECT_EQ(connects, numClients);
+        EXPECT_EQ(serv.getClientUuids().size(), serv.getNumClients());
+
+        for (auto &cli : clis) {
+            cli->stop();
+        }
+        serv.stop();
+        EXPECT_FALSE(serv.isRunning());
+
+        pool.waitIdle(0);
+        pool.stop(true);
+    }
+
+    void SSLSessionTest::runSessionResumption(bool tickets) {
+        serv.setSessionTickets(tickets);
+        serv.setRecvCallback([&](const stms::UUID &c, const sockaddr *const, uint8_t *dat, int size) {
+            EXPECT_EQ(serv.send(c, dat, size, true).get(), 5);
+            serv.kickClient(c); // TLS 1.3 tickets come after the handshake. Wake up reads still waiting for them.
+        });
+        ASSERT_NO_FATAL_FAILURE(startServer());
+
+        std::atomic_int replies{0};
+        cli.setRecvCallback([&](uint8_t *dat, size_t size) {
+            EXPECT_EQ(std::string(reinterpret_cast<char *>(dat), size), "HELLO");
+            replies++;
+        });
+
+        // The first connection does a full handshake and stores the session; the second one resumes it.
+        for (int i = 0; i < 2; i++) {
+            cli.start();
+            ASSERT_TRUE(cli.isRunning());
+            EXPECT_EQ(cli.isSessionReused(), i == 1);
+            EXPECT_EQ(cli.send(reinterpret_cast<const uint8_t *>("HELLO"), 5, true).get(), 5);
+
+            stms::Stopwatch sw;
+            sw.start();
+            while (replies <= i && cli.tick() && sw.getTime() < 10000) {
+                cli.waitEvents(16);
+            }
+            EXPECT_EQ(replies, i + 1);
+
+            cliPool.waitIdle(0); // No `SSL_read()` may be in progress when `stop()` frees `pSsl`
+            cli.stop();
+        }
+        stopAll();
+
+        stms::SessionStats stats = serv.getSessionStats();
+        EXPECT_EQ(stats.fullHandshakes, 1u);
+        EXPECT_EQ(stats.resumedHandshakes, 1u);
+        EXPECT_DOUBLE_EQ(stats.resumptionRate(), 0.5);
+        EXPECT_EQ(cli.getSessionStats().resumedHandshakes, 1u);
+        if (!tickets) {
+            EXPECT_GE(stats.cacheHits, 1u);
+            EXPECT_GE(stats.cacheSize, 1u);
+        }
+    }
+
+    TEST(CookieKeysTest, Rotation) {
+        stms::CookieKeys keys;
+        sockaddr_in peer{};
+        peer.sin_family = AF_INET;
+        peer.sin_port = htons(4000);
+        peer.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        sockaddr_in other = peer;
+        other.sin_port = htons(4001);
+
+        auto *peerAddr = reinterpret_cast<sockaddr *>(&peer);
+        uint8_t cookie[DTLS1_COOKIE_LENGTH - 1];
+        unsigned len = keys.generate(peerAddr, cookie);
+        ASSERT_GT(len, 0u);
+
+        // Same cookie each time, only for that peer.
+        uint8_t again[DTLS1_COOKIE_LENGTH - 1];
+        ASSERT_EQ(keys.generate(peerAddr, again), len);
+        EXPECT_EQ(std::memcmp(cookie, again, len), 0);
+        EXPECT_TRUE(keys.verify(peerAddr, cookie, len));
+        EXPECT_FALSE(keys.verify(reinterpret_cast<sockaddr *>(&other), cookie, len));
+        EXPECT_FALSE(keys.verify(peerAddr, cookie, len - 1));
+
+        // Still accepted during the grace period after a rotation, even from another thread.
+        keys.rotate();
+        ASSERT_EQ(keys.generate(peerAddr, again), len);
+        EXPECT_NE(std::memcmp(cookie, again, len), 0);
+        EXPECT_TRUE(keys.verify(peerAddr, again, len));
+        std::thread([&]() {
+            EXPECT_TRUE(keys.verify(peerAddr, cookie, len));
+        }).join();
+
+        keys.setRotation(0, 0);
+        EXPECT_FALSE(keys.verify(peerAddr, cookie, len));
+        EXPECT_TRUE(keys.verify(peerAddr, again, len));
+
+        // Rotated twice: Only the latest secret and the one before it are kept.
+        keys.setRotation(0, 60);
+        keys.rotate();
+        keys.rotate();
+        EXPECT_FALSE(keys.verify(peerAddr, again, len));
+    }
+
+    TEST_F(SSLSessionTest, TCPTickets) {
+        runSessionResumption(true);
+    }
+
+    TEST_F(SSLSessionTest, TCPCache) {
+        runSessionResumption(false);
+    }
+
+    TEST_F(SSLFileTest, SendFile) {
+        // Works with or without kTLS. Without it, the file is sent in `sendFileChunk`-sized pieces.
+        std::string content;
+        for (int i = 0; content.size() < 100000; i++) {
+            content += std::to_string(i) + ",";
+        }
+
+        char path[] = "/tmp/stms_sendfile_XXXXXX";
+        int fd = mkstemp(path);
+        ASSERT_NE(fd, -1);
+        unlink(path);
+        ASSERT_EQ(write(fd, content.data(), content.size()), static_cast<ssize_t>(content.size()));
+        int fileLen = static_cast<int>(content.size()) - 10;
+
+        serv.setKernelTls(true);
+
+        std::mutex servRecvMtx;
+        std::string servRecv;
+        serv.setRecvCallback([&](const stms::UUID &c, const sockaddr *const, uint8_t *dat, int size) {
+            std::lock_guard<std::mutex> lg(servRecvMtx);
+            servRecv.append(reinterpret_cast<char *>(dat), size);
+            if (servRecv.size() == static_cast<std::size_t>(fileLen)) {
+                EXPECT_EQ(serv.sendFile(c, fd, 10, fileLen).get(), fileLen); // Echo it back from a different offset
+            }
+        });
+        ASSERT_NO_FATAL_FAILURE(startServer());
+        cli.setKernelTls(true);
+
+        std::mutex cliRecvMtx;
+        std::string cliRecv;
+        cli.setRecvCallback([&](uint8_t *dat, size_t size) {
+            std::lock_guard<std::mutex> lg(cliRecvMtx);
+            cliRecv.append(reinterpret_cast<char *>(dat), size);
+        });
+
+        cli.start();
+        ASSERT_TRUE(cli.isRunning());
+        STMS_INFO("SendFile test is using kernel TLS: {}", cli.isKernelTls());
+        EXPECT_EQ(cli.sendFile(fd, 0, fileLen).get(), fileLen);
+
+        stms::Stopwatch sw;
+        sw.start();
+        auto cliRecvLen = [&]() {
+            std::lock_guard<std::mutex> lg(cliRecvMtx);
+            return cliRecv.size();
+        };
+        while (cliRecvLen() < static_cast<std::size_t>(fileLen) && cli.tick() && sw.getTime() < 10000) {
+            cli.waitEvents(16);
+        }
+
+        stopAll();
+        close(fd);
+
+        EXPECT_EQ(servRecv, content.substr(0, fileLen));
+        EXPECT_EQ(cliRecv, content.substr(10, fileLen));
+    }
+
+    TEST_F(MetricsTest, TCP) {
+        serv.setClientMetrics(true);
+        serv.setRecvCallback([&](const stms::UUID &c, const sockaddr *const, uint8_t *dat, int size) {
+            serv.send(c, dat, size, true);
+        });
+        ASSERT_NO_FATAL_FAILURE(startServer());
+
+        std::atomic<std::size_t> cliRecvLen{0};
+        cli.setRecvCallback([&](uint8_t *, size_t size) {
+            cliRecvLen += size;
+        });
+        cli.start();
+        ASSERT_TRUE(cli.isRunning());
+
+        const std::string msg = "Hello, metrics!";
+        for (int i = 0; i < 4; i++) {
+            EXPECT_EQ(cli.send(reinterpret_cast<const uint8_t *>(msg.data()), static_cast<int>(msg.size()), true).get(),
+                      static_cast<int>(msg.size()));
+        }
+
+        stms::Stopwatch sw;
+        sw.start();
+        while (cliRecvLen < msg.size() * 4 && cli.tick() && sw.getTime() < 5000) {
+            cli.waitEvents(16);
+        }
+        EXPECT_EQ(cliRecvLen, msg.size() * 4);
+
+        stms::MetricsSnapshot servTotals = serv.getMetrics();
+        EXPECT_EQ(servTotals.connections, 1u);
+        EXPECT_EQ(servTotals.handshakes, 1u);
+        EXPECT_EQ(servTotals.handshakeFailures, 0u);
+        EXPECT_EQ(servTotals.bytesIn, msg.size() * 4);
+        EXPECT_EQ(servTotals.bytesOut, msg.size() * 4);
+        uint64_t bucketSum = 0;
+        for (auto count : servTotals.handshakeBuckets) {
+            bucketSum += count;
+        }
+        EXPECT_EQ(bucketSum, servTotals.handshakes);
+
+        auto perClient = serv.getClientMetrics();
+        ASSERT_EQ(perClient.size(), 1u);
+        EXPECT_EQ(perClient[0].second.bytesIn, servTotals.bytesIn);
+
+        stms::MetricsSnapshot cliTotals = cli.getMetrics();
+        EXPECT_EQ(cliTotals.connections, 1u);
+        EXPECT_EQ(cliTotals.handshakes, 1u);
+        EXPECT_EQ(cliTotals.bytesOut, msg.size() * 4);
+        EXPECT_EQ(cliTotals.messagesOut, 4u);
+        EXPECT_EQ(cliTotals.bytesIn, msg.size() * 4);
+
+        stms::MetricsExporter exporter;
+        exporter.addSource("serv", serv);
+        exporter.addSource("cli", cli);
+        std::string page = exporter.render();
+        EXPECT_NE(page.find("# TYPE stms_received_bytes_total counter"), std::string::npos);
+        EXPECT_NE(page.find("stms_received_bytes_total{source=\"serv\"} " + std::to_string(msg.size() * 4)),
+                  std::string::npos);
+        EXPECT_NE(page.find("stms_sent_messages_total{source=\"cli\"} 4"), std::string::npos);
+        EXPECT_NE(page.find("stms_handshake_duration_seconds_count{source=\"serv\"} 1"), std::string::npos);
+        EXPECT_NE(page.find("stms_handshake_duration_seconds_bucket{source=\"serv\",le=\"+Inf\"} 1"),
+                  std::string::npos);
+        EXPECT_NE(page.find(",client=\"" + perClient[0].first.buildStr() + "\""), std::string::npos);
+
+        std::string filePath = "/tmp/stms_metrics_test.prom";
+        ASSERT_TRUE(exporter.writeFile(filePath));
+        std::ifstream file(filePath);
+        std::string fileContent((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        EXPECT_NE(fileContent.find("stms_sent_messages_total{source=\"cli\"} 4"), std::string::npos);
+        unlink(filePath.c_str());
+
+        // Scrape it over a unix socket, like a node exporter sidecar would.
+        std::string sockPath = "/tmp/stms_metrics_test.sock";
+        ASSERT_TRUE(exporter.listen(sockPath));
+        int scraper = socket(AF_UNIX, SOCK_STREAM, 0);
+        ASSERT_NE(scraper, -1);
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        std::strncpy(addr.sun_path, sockPath.c_str(), sizeof(addr.sun_path) - 1);
+        ASSERT_EQ(connect(scraper, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)), 0);
+        std::string request = "GET /metrics HTTP/1.0\r\n\r\n";
+        ASSERT_EQ(write(scraper, request.data(), request.size()), static_cast<ssize_t>(request.size()));
+
+        std::string response;
+        sw.reset();
+        while (sw.getTime() < 2000) {
+            exporter.tick();
+            pollfd pfd{scraper, POLLIN, 0};
+            if (poll(&pfd, 1, 16) <= 0) {
+                continue;
+            }
+            char buf[4096];
+            ssize_t got = read(scraper, buf, sizeof(buf));
+            if (got <= 0) {
+                break;
+            }
+            response.append(buf, static_cast<std::size_t>(got));
+        }
+        close(scraper);
+        exporter.close();
+
+        EXPECT_EQ(response.rfind("HTTP/1.0 200 OK", 0), 0u);
+        EXPECT_NE(response.find("stms_sent_messages_total{source=\"cli\"} 4"), std::string::npos);
+    }
+
+    TEST_F(SSLFramedTest, TCP) {
+        std::vector<std::string> msgs = {"hi", std::string(40000, 'm'), "", "bye"};
+        std::string stream;
+        for (const auto &msg : msgs) {
+            auto hdr = stms::encodeFrameHeader(static_cast<uint32_t>(msg.size()));
+            stream.append(hdr.begin(), hdr.end());
+            stream += msg;
+        }
+
+        serv.setIoBackend(stms::IOBackend::eEpoll);
+
+        std::vector<std::string> servRecv;
+        serv.setFramedRecvCallback([&](const stms::UUID &c, const sockaddr *const, uint8_t *dat, int size) {
+            servRecv.emplace_back(reinterpret_cast<char *>(dat), size);
+            auto hdr = stms::encodeFrameHeader(static_cast<uint32_t>(size));
+            std::string echo(hdr.begin(), hdr.end());
+            echo.append(reinterpret_cast<char *>(dat), size);
+            serv.send(c, reinterpret_cast<const uint8_t *>(echo.data()), static_cast<int>(echo.size()), true);
+        });
+        ASSERT_NO_FATAL_FAILURE(startServer());
+
+        std::vector<std::string> cliRecv;
+        std::atomic_size_t numCliRecv{0};
+        cli.setFramedRecvCallback([&](uint8_t *dat, size_t size) {
+            cliRecv.emplace_back(reinterpret_cast<char *>(dat), size);
+            numCliRecv++;
+        });
+
+        cli.start();
+        ASSERT_TRUE(cli.isRunning());
+        // Split the stream mid-header and mid-message. Each `send()` is its own task, so wait to keep them in order.
+        EXPECT_EQ(cli.send(reinterpret_cast<const uint8_t *>(stream.data()), 3).get(), 3);
+        EXPECT_EQ(cli.send(reinterpret_cast<const uint8_t *>(stream.data()) + 3, 20000).get(), 20000);
+        int rest = static_cast<int>(stream.size()) - 20003;
+        EXPECT_EQ(cli.send(reinterpret_cast<const uint8_t *>(stream.data()) + 20003, rest).get(), rest);
+
+        stms::Stopwatch sw;
+        sw.start();
+        while (numCliRecv < msgs.size() && cli.tick() && sw.getTime() < 10000) {
+            cli.waitEvents(16);
+        }
+
+        stopAll();
+
+        EXPECT_EQ(servRecv, msgs);
+        EXPECT_EQ(cliRecv, msgs);
+    }
+
+    void runPlainUdp(stms::IOBackend backend) {
         stms::ThreadPool p{};
 
         stms::UDPPeer serv{true, &p};
         stms::UDPPeer cli{false, &p};
+        serv.setIoBackend(backend);
+        cli.setIoBackend(backend);
 
         cli.setRecvCallback([&](const sockaddr *const addr, socklen_t alen, uint8_t *buf, ssize_t len) {
             EXPECT_EQ(len, 4);
@@ -191,6 +925,795 @@ namespace {
         while (serv.tick()) {
             serv.waitEvents(16);
         }
+
+        // The client is still ticking on the pool; don't let it outlive `cli`.
+        p.waitIdle(0);
+        p.stop(true);
     }
-}
 
+    TEST(PlainTest, UDP) {
+        runPlainUdp(stms::IOBackend::ePoll);
+    }
+
+    TEST(PlainTest, UDPIOUring) {
+        runPlainUdp(stms::IOBackend::eIOUring);
+    }
+
+    TEST(PlainTest, UDPSendv) {
+        stms::ThreadPool p{};
+
+        stms::UDPPeer serv{true, &p};
+        stms::UDPPeer cli{false, &p};
+        cli.setZeroCopy(true, 1024); // Over loopback the kernel copies anyway, but still sends completions.
+
+        std::string header = "HDR:";
+        std::string bigBody(20000, 'x');
+        std::string smallBody = "small";
+
+        cli.setRecvCallback([&](const sockaddr *const, socklen_t, uint8_t *buf, ssize_t len) {
+            EXPECT_EQ(std::string(reinterpret_cast<char *>(buf), len), "PING");
+
+            serv.stop();
+            cli.stop();
+        });
+
+        std::vector<std::string> received;
+        serv.setRecvCallback([&](const sockaddr *const addr, socklen_t alen, uint8_t *buf, ssize_t len) {
+            received.emplace_back(reinterpret_cast<char *>(buf), len);
+            if (received.size() == 2) {
+                const char *ping = "PING";
+                serv.sendTo(addr, alen, reinterpret_cast<const uint8_t *>(ping), 4, true);
+            }
+        });
+
+        serv.setIPv6(false); cli.setIPv6(false);
+        serv.setHostAddr("3000", "127.0.0.1"); cli.setHostAddr("3000", "127.0.0.1");
+
+        std::future<int> bigSent;
+        std::future<int> smallSent;
+        p.start();
+        serv.start();
+
+        p.submitTask([&]() {
+            cli.start();
+
+            iovec bigIov[2] = {{header.data(), header.size()}, {bigBody.data(), bigBody.size()}};
+            bigSent = cli.sendv(bigIov, 2);
+            // The future is only ready once `tick()` sees the kernel is done with `bigBody`. Wait for that before
+            // the next send, so that both datagrams arrive in order.
+            while (bigSent.wait_for(std::chrono::seconds(0)) != std::future_status::ready && cli.tick()) {
+                cli.waitEvents(16);
+            }
+
+            iovec smallIov[2] = {{header.data(), header.size()}, {smallBody.data(), smallBody.size()}};
+            smallSent = cli.sendv(smallIov, 2, true);
+
+            while (cli.tick()) {
+                cli.waitEvents(16);
+            }
+        });
+
+        while (serv.tick()) {
+            serv.waitEvents(16);
+        }
+
+        p.waitIdle(0);
+        p.stop(true);
+
+        ASSERT_EQ(received.size(), 2u);
+        EXPECT_EQ(received[0], header + bigBody);
+        EXPECT_EQ(received[1], header + smallBody);
+        EXPECT_EQ(bigSent.get(), static_cast<int>(header.size() + bigBody.size()));
+        EXPECT_EQ(smallSent.get(), static_cast<int>(header.size() + smallBody.size()));
+    }
+
+    TEST(PlainTest, TCP) {
+        stms::ThreadPool p{};
+
+        stms::TCPServer serv{&p};
+        stms::TCPClient cli{&p};
+
+        std::string expected = "HELLO WORLD!";
+        std::string cliRecvd;
+        std::mutex recvMtx;
+        std::atomic_bool done{false};
+        std::atomic_int numConnects{0};
+        std::atomic_int numDisconnects{0};
+
+        serv.setConnectCallback([&](const stms::UUID &, const sockaddr *const) { numConnects++; });
+        serv.setDisconnectCallback([&](const stms::UUID &, const sockaddr *const) { numDisconnects++; });
+        serv.setRecvCallback([&](const stms::UUID &uuid, const sockaddr *const, uint8_t *buf, int len) {
+            // Only 1 read task runs per client at a time, so the echoes are queued in the order they came in.
+            serv.send(uuid, buf, len, true);
+        });
+
+        cli.setRecvCallback([&](uint8_t *buf, size_t len) {
+            std::lock_guard<std::mutex> lg(recvMtx);
+            cliRecvd.append(reinterpret_cast<char *>(buf), len);
+            if (cliRecvd.size() >= expected.size()) {
+                done = true;
+            }
+        });
+
+        serv.setIPv6(false); cli.setIPv6(false);
+        serv.setHostAddr("3000", "127.0.0.1"); cli.setHostAddr("3000", "127.0.0.1");
+
+        std::string world = "WORLD";
+        std::string bang = "!";
+        std::future<int> helloSent;
+        std::future<int> worldSent;
+        p.start();
+        serv.start();
+
+        p.submitTask([&]() {
+            cli.start();
+            EXPECT_TRUE(cli.setCork(true));
+
+            helloSent = cli.send(reinterpret_cast<const uint8_t *>(expected.data()), 6, true);
+            iovec iov[2] = {{world.data(), world.size()}, {bang.data(), bang.size()}};
+            worldSent = cli.sendv(iov, 2); // Not copied, so `world` & `bang` outlive the task
+
+            EXPECT_TRUE(cli.setCork(false));
+            while (!done && cli.tick()) {
+                cli.waitEvents(16);
+            }
+        });
+
+        stms::Stopwatch timeout;
+        timeout.start();
+        while (!done && serv.tick() && timeout.getTime() < 10000) {
+            serv.waitEvents(16);
+        }
+
+        p.waitIdle(0);
+        EXPECT_EQ(helloSent.get(), 6);
+        EXPECT_EQ(worldSent.get(), 6);
+        EXPECT_EQ(serv.getNumClients(), 1u);
+
+        cli.stop();
+        while (numDisconnects == 0 && serv.tick() && timeout.getTime() < 10000) {
+            serv.waitEvents(16);
+        }
+
+        serv.stop();
+        p.waitIdle(0);
+        p.stop(true);
+
+        EXPECT_EQ(cliRecvd, expected);
+        EXPECT_EQ(numConnects, 1);
+        EXPECT_EQ(numDisconnects, 1);
+        EXPECT_EQ(serv.getNumClients(), 0u);
+    }
+
+    TEST(PlainTest, TCPFramed) {
+        stms::ThreadPool p{};
+
+        stms::TCPServer serv{&p};
+        stms::TCPClient cli{&p};
+
+        std::vector<std::string> msgs = {"first", "", std::string(100000, 'b'), "last"};
+        std::vector<std::string> cliRecvd;
+        std::atomic_bool done{false};
+
+        serv.setFramedRecvCallback([&](const stms::UUID &uuid, const sockaddr *const, uint8_t *msg, int len) {
+            auto hdr = stms::encodeFrameHeader(static_cast<uint32_t>(len));
+            iovec iov[2] = {{hdr.data(), hdr.size()}, {msg, static_cast<std::size_t>(len)}};
+            serv.sendv(uuid, iov, 2, true);
+        });
+
+        cli.setFramedRecvCallback([&](uint8_t *msg, size_t len) {
+            cliRecvd.emplace_back(reinterpret_cast<char *>(msg), len);
+            if (cliRecvd.size() == msgs.size()) {
+                done = true;
+            }
+        });
+
+        serv.setIPv6(false); cli.setIPv6(false);
+        serv.setHostAddr("3000", "127.0.0.1"); cli.setHostAddr("3000", "127.0.0.1");
+
+        // The whole stream, sent 1 byte at a time below, so every message is split across reads.
+        std::string stream;
+        for (const auto &msg : msgs) {
+            auto hdr = stms::encodeFrameHeader(static_cast<uint32_t>(msg.size()));
+            stream.append(hdr.begin(), hdr.end());
+            stream += msg;
+        }
+
+        p.start();
+        serv.start();
+        p.submitTask([&]() {
+            cli.start();
+            cli.send(reinterpret_cast<const uint8_t *>(stream.data()), 1);
+            cli.send(reinterpret_cast<const uint8_t *>(stream.data()) + 1, 6);
+            cli.send(reinterpret_cast<const uint8_t *>(stream.data()) + 7, static_cast<int>(stream.size() - 7));
+
+            while (!done && cli.tick()) {
+                cli.waitEvents(16);
+            }
+        });
+
+        stms::Stopwatch timeout;
+        timeout.start();
+        while (!done && serv.tick() && timeout.getTime() < 10000) {
+            serv.waitEvents(16);
+        }
+
+        p.waitIdle(0);
+        cli.stop();
+        serv.stop();
+        p.waitIdle(0);
+        p.stop(true);
+
+        EXPECT_EQ(cliRecvd, msgs);
+    }
+
+    TEST(PlainTest, UDPBatch) {
+        constexpr std::size_t numMsgs = 16;
+        stms::ThreadPool p{};
+
+        stms::UDPPeer serv{true, &p};
+        stms::UDPPeer cli{false, &p};
+
+        cli.setRecvCallback([&](const sockaddr *const, socklen_t, uint8_t *buf, ssize_t len) {
+            EXPECT_EQ(std::string(reinterpret_cast<char *>(buf), len), "PING");
+
+            serv.stop();
+            cli.stop();
+        });
+
+        std::size_t numRecv = 0;
+        stms::PacketBuffer kept;
+        serv.setBatchRecvCallback([&](stms::UDPMessage *msgs, std::size_t num) {
+            EXPECT_GT(num, 0);
+            if (!kept) {
+                kept = stms::PacketBuffer::retain(msgs[0].data);
+            }
+            for (std::size_t i = 0; i < num; i++) {
+                EXPECT_EQ(std::string(reinterpret_cast<char *>(msgs[i].data), msgs[i].size), "MSG" + std::to_string(numRecv));
+                numRecv++;
+            }
+
+            if (numRecv == numMsgs) {
+                uint8_t ping[] = {'P', 'I', 'N', 'G'}; // `UDPMessage::data` isn't const
+                stms::UDPMessage pong{msgs[num - 1].addr, msgs[num - 1].addrLen, ping, 4};
+                serv.sendToMany(&pong, 1, true);
+            }
+        });
+
+        serv.setIPv6(false); cli.setIPv6(false);
+        serv.setHostAddr("3000", "127.0.0.1"); cli.setHostAddr("3000", "127.0.0.1");
+
+        std::future<int> sent;
+        p.start();
+        serv.start();
+
+        p.submitTask([&]() {
+            cli.start();
+
+            std::vector<std::string> strs;
+            std::vector<stms::UDPMessage> msgs;
+            for (std::size_t i = 0; i < numMsgs; i++) {
+                strs.emplace_back("MSG" + std::to_string(i));
+            }
+            for (auto &str : strs) {
+                msgs.emplace_back(stms::UDPMessage{nullptr, 0, reinterpret_cast<uint8_t *>(str.data()),
+                                                   static_cast<ssize_t>(str.size())});
+            }
+            sent = cli.sendToMany(msgs, true);
+
+            while (cli.tick()) {
+                cli.waitEvents(16);
+            }
+        });
+
+        while (serv.tick()) {
+            serv.waitEvents(16);
+        }
+
+        p.waitIdle(0);
+        p.stop(true);
+        EXPECT_EQ(sent.get(), static_cast<int>(numMsgs));
+        EXPECT_EQ(numRecv, numMsgs);
+
+        // The first datagram's buffer was kept past the callback without being copied or reused.
+        ASSERT_TRUE(kept);
+        EXPECT_EQ(std::string(reinterpret_cast<char *>(kept.data()), kept.size()), "MSG0");
+    }
+
+    TEST(PlainTest, ReliableUDP) {
+        constexpr int numMsgs = 60;
+        stms::ThreadPool p{};
+
+        stms::UDPPeer serv{true, &p};
+        stms::UDPPeer cli{false, &p};
+        stms::UDPPeer relayIn{true, &p}; // Listens for `cli`
+        stms::UDPPeer relayOut{false, &p}; // Forwards to `serv`
+
+        serv.setIPv6(false); cli.setIPv6(false); relayIn.setIPv6(false); relayOut.setIPv6(false);
+        serv.setHostAddr("3000", "127.0.0.1");
+        relayIn.setHostAddr("3001", "127.0.0.1");
+        relayOut.setHostAddr("3000", "127.0.0.1");
+        cli.setHostAddr("3001", "127.0.0.1");
+
+        // The relay drops 1 in 5 datagrams in each direction. Each forwarded datagram is sent by its own pool task,
+        // so they get reordered too.
+        std::mutex relayMtx;
+        std::mt19937 rng{42};
+        sockaddr_storage cliAddr{};
+        socklen_t cliAddrLen = 0;
+        auto shouldForward = [&]() {
+            std::lock_guard<std::mutex> lg(relayMtx);
+            return rng() % 5 != 0;
+        };
+        relayIn.setRecvCallback([&](const sockaddr *const addr, socklen_t addrLen, uint8_t *buf, ssize_t len) {
+            {
+                std::lock_guard<std::mutex> lg(relayMtx);
+                std::memcpy(&cliAddr, addr, addrLen);
+                cliAddrLen = addrLen;
+            }
+            if (shouldForward()) {
+                relayOut.send(buf, len, true);
+            }
+        });
+        relayOut.setRecvCallback([&](const sockaddr *const, socklen_t, uint8_t *buf, ssize_t len) {
+            if (shouldForward()) {
+                std::lock_guard<std::mutex> lg(relayMtx);
+                relayIn.sendTo(reinterpret_cast<sockaddr *>(&cliAddr), cliAddrLen, buf, len, true);
+            }
+        });
+
+        stms::ReliableUDP rServ{&serv};
+        stms::ReliableUDP rCli{&cli};
+        for (auto *r : {&rServ, &rCli}) {
+            EXPECT_EQ(r->addChannel(stms::ChannelType::eReliableOrdered), 0);
+            EXPECT_EQ(r->addChannel(stms::ChannelType::eReliableUnordered), 1);
+            EXPECT_EQ(r->addChannel(stms::ChannelType::eUnreliable), 2);
+        }
+
+        // Every 4th message is larger than the MTU, so it is fragmented.
+        auto makeMsg = [](int i) {
+            std::string ret = std::to_string(i) + ":";
+            ret.resize(i % 4 == 0 ? 5000 : 20 + i, static_cast<char>('a' + i % 26));
+            return ret;
+        };
+
+        std::mutex recvMtx;
+        std::vector<std::string> ordered;
+        std::multiset<std::string> unordered;
+        std::multiset<std::string> unreliable;
+        std::atomic<int> echoes{0};
+        rServ.setRecvCallback([&](const sockaddr *const addr, socklen_t addrLen, uint8_t channel, uint8_t *buf,
+                                  std::size_t len) {
+            std::string msg(reinterpret_cast<char *>(buf), len);
+            std::lock_guard<std::mutex> lg(recvMtx);
+            if (channel == 0) {
+                ordered.emplace_back(msg);
+            } else if (channel == 1) {
+                unordered.emplace(msg);
+                rServ.sendTo(addr, addrLen, 1, buf, len); // Echo it back to test the other direction
+            } else {
+                unreliable.emplace(msg);
+            }
+        });
+        rCli.setRecvCallback([&](const sockaddr *const, socklen_t, uint8_t channel, uint8_t *, std::size_t) {
+            EXPECT_EQ(channel, 1);
+            echoes++;
+        });
+
+        p.start();
+        serv.start(); relayIn.start(); relayOut.start(); cli.start();
+
+        std::vector<std::future<int>> reliableSent;
+        std::vector<std::string> sent;
+        for (int i = 0; i < numMsgs; i++) {
+            sent.emplace_back(makeMsg(i));
+            auto *data = reinterpret_cast<const uint8_t *>(sent.back().data());
+            reliableSent.emplace_back(rCli.send(0, data, sent.back().size()));
+            reliableSent.emplace_back(rCli.send(1, data, sent.back().size()));
+            EXPECT_EQ(rCli.send(2, data, sent.back().size()).get(), static_cast<int>(sent.back().size()));
+        }
+
+        auto allAcked = [&]() {
+            return std::all_of(reliableSent.begin(), reliableSent.end(), [](const std::future<int> &f) {
+                return f.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+            });
+        };
+
+        stms::Stopwatch sw;
+        sw.start();
+        while (sw.getTime() < 30000 && (!allAcked() || echoes < numMsgs)) {
+            serv.tick(); relayIn.tick(); relayOut.tick(); cli.tick();
+            rServ.tick(); rCli.tick();
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        stms::ReliableStats stats;
+        EXPECT_TRUE(rCli.getStats(nullptr, 0, stats));
+        EXPECT_GT(stats.retransmits, 0);
+        EXPECT_GE(stats.packetsSent, stats.retransmits);
+        EXPECT_EQ(rServ.getNumPeers(), 1);
+
+        cli.stop(); relayOut.stop(); relayIn.stop(); serv.stop();
+        p.waitIdle(0);
+        p.stop(true);
+
+        ASSERT_TRUE(allAcked());
+        for (std::size_t i = 0; i < reliableSent.size(); i++) {
+            EXPECT_EQ(reliableSent[i].get(), static_cast<int>(sent[i / 2].size()));
+        }
+        EXPECT_EQ(echoes, numMsgs);
+
+        std::lock_guard<std::mutex> lg(recvMtx);
+        EXPECT_EQ(ordered, sent);
+        EXPECT_EQ(unordered, std::multiset<std::string>(sent.begin(), sent.end()));
+        EXPECT_GT(unreliable.size(), 0);
+        EXPECT_LE(unreliable.size(), sent.size());
+        for (const auto &msg : unreliable) {
+            EXPECT_EQ(unreliable.count(msg), 1); // Lost maybe, but never duplicated
+            EXPECT_NE(std::find(sent.begin(), sent.end(), msg), sent.end());
+        }
+    }
+
+    TEST(PlainTest, ReliableUDPLimits) {
+        constexpr int numSources = 6;
+        stms::ThreadPool p{};
+        stms::UDPPeer serv{true, &p};
+        serv.setIPv6(false);
+        serv.setHostAddr("3000", "127.0.0.1");
+
+        stms::ReliableUDP rServ{&serv};
+        rServ.addChannel(stms::ChannelType::eReliableOrdered);
+        rServ.setMaxPeers(4);
+        rServ.setMaxMessageLen(4096);
+
+        std::atomic<int> numRecv{0};
+        rServ.setRecvCallback([&](const sockaddr *const, socklen_t, uint8_t, uint8_t *, std::size_t len) {
+            EXPECT_EQ(len, 4);
+            numRecv++;
+        });
+
+        p.start();
+        serv.start();
+
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(3000);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        // [kind][channel][seq u32][msg id u32][frag index u16][frag count u16][msg len u32], in network byte order.
+        auto forge = [](uint8_t kind, uint32_t msgId, uint16_t fragCount, uint32_t msgLen, std::size_t payloadLen) {
+            std::vector<uint8_t> ret(18 + payloadLen, 'x');
+            ret[0] = kind;
+            ret[1] = 0;
+            uint32_t netSeq = htonl(msgId);
+            uint32_t netId = htonl(msgId);
+            uint16_t netIndex = htons(0);
+            uint16_t netCount = htons(fragCount);
+            uint32_t netLen = htonl(msgLen);
+            std::memcpy(ret.data() + 2, &netSeq, 4);
+            std::memcpy(ret.data() + 6, &netId, 4);
+            std::memcpy(ret.data() + 10, &netIndex, 2);
+            std::memcpy(ret.data() + 12, &netCount, 2);
+            std::memcpy(ret.data() + 14, &netLen, 4);
+            return ret;
+        };
+
+        std::vector<std::vector<uint8_t>> forged;
+        forged.emplace_back(forge(0xA2, 0, 0, 0, 0)); // An ack from a source we never sent to
+        forged.emplace_back(forge(0xA1, 0, 0xFFFF, 0xFFFFFFFF, 1)); // Far over the max message length
+        forged.emplace_back(forge(0xA1, 0, 0xFFFF, 4096, 1)); // More fragments than bytes
+        forged.emplace_back(forge(0xA1, 1U << 30U, 1, 4, 4)); // Far ahead of the next message id
+        forged.emplace_back(forge(0xA1, 0, 1, 4, 4)); // The only valid one
+
+        std::vector<int> socks;
+        for (int i = 0; i < numSources; i++) {
+            socks.emplace_back(socket(AF_INET, SOCK_DGRAM, 0));
+            for (const auto &dgram : forged) {
+                EXPECT_EQ(sendto(socks.back(), dgram.data(), dgram.size(), 0, reinterpret_cast<sockaddr *>(&addr),
+                                 sizeof(addr)), static_cast<ssize_t>(dgram.size()));
+            }
+        }
+
+        stms::Stopwatch sw;
+        sw.start();
+        while (sw.getTime() < 2000 && numRecv < 4) {
+            serv.tick();
+            rServ.tick();
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        serv.tick();
+
+        // Only the first 4 sources got state, and each of them delivered only the valid message.
+        EXPECT_EQ(rServ.getNumPeers(), 4);
+        EXPECT_EQ(numRecv, 4);
+
+        std::string tooLong(4097, 'x');
+        EXPECT_EQ(rServ.sendTo(reinterpret_cast<sockaddr *>(&addr), sizeof(addr), 0,
+                               reinterpret_cast<const uint8_t *>(tooLong.data()), tooLong.size()).get(), -2);
+
+        for (int sock : socks) {
+            close(sock);
+        }
+        serv.stop();
+        p.waitIdle(0);
+        p.stop(true);
+    }
+
+    TEST(PlainTest, ReliableUDPUnreliableBypassesCwnd) {
+        stms::ThreadPool p{};
+        stms::UDPPeer serv{true, &p};
+        serv.setIPv6(false);
+        serv.setHostAddr("3000", "127.0.0.1");
+
+        stms::ReliableUDP rServ{&serv};
+        rServ.addChannel(stms::ChannelType::eReliableOrdered);
+        rServ.addChannel(stms::ChannelType::eUnreliable);
+
+        p.start();
+        serv.start();
+
+        // A raw socket that never acks, so the congestion window stays exhausted.
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(3002);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int sock = socket(AF_INET, SOCK_DGRAM, 0);
+        ASSERT_EQ(bind(sock, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)), 0);
+        timeval recvTimeout{0, 100000};
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &recvTimeout, sizeof(recvTimeout));
+
+        const uint8_t msg[] = "ping";
+        std::vector<std::future<int>> reliableSent;
+        for (int i = 0; i < static_cast<int>(stms::reliableInitialCwnd) * 2; i++) {
+            reliableSent.emplace_back(rServ.sendTo(reinterpret_cast<sockaddr *>(&addr), sizeof(addr), 0, msg,
+                                                   sizeof(msg)));
+        }
+
+        stms::ReliableStats stats;
+        ASSERT_TRUE(rServ.getStats(reinterpret_cast<sockaddr *>(&addr), sizeof(addr), stats));
+        EXPECT_GE(static_cast<double>(stats.inFlight), stats.cwnd);
+
+        EXPECT_EQ(rServ.sendTo(reinterpret_cast<sockaddr *>(&addr), sizeof(addr), 1, msg, sizeof(msg)).get(),
+                  static_cast<int>(sizeof(msg)));
+
+        // Only `cwnd` reliable packets may come through, but the unreliable one must too.
+        int numReliable = 0;
+        bool gotUnreliable = false;
+        uint8_t buf[2048];
+        stms::Stopwatch sw;
+        sw.start();
+        while (sw.getTime() < 2000 && !gotUnreliable) {
+            ssize_t len = recv(sock, buf, sizeof(buf), 0);
+            if (len < 18 || buf[0] != 0xA1) {
+                continue;
+            } else if (buf[1] == 1) {
+                gotUnreliable = true;
+            } else {
+                numReliable++;
+            }
+        }
+        EXPECT_TRUE(gotUnreliable);
+        EXPECT_LE(numReliable, static_cast<int>(stms::reliableInitialCwnd));
+
+        close(sock);
+        serv.stop();
+        p.waitIdle(0);
+        p.stop(true);
+    }
+
+    TEST(ImpairmentTest, Deterministic) {
+        constexpr int numDatagrams = 300;
+
+        // Send through the shim between 2 raw sockets, and collect whatever arrives.
+        auto run = [](uint64_t seed, stms::ImpairmentStats &stats) {
+            int rx = socket(AF_INET, SOCK_DGRAM, 0);
+            int tx = socket(AF_INET, SOCK_DGRAM, 0);
+            sockaddr_in addr{};
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            socklen_t addrLen = sizeof(addr);
+            EXPECT_EQ(bind(rx, reinterpret_cast<sockaddr *>(&addr), addrLen), 0);
+            EXPECT_EQ(getsockname(rx, reinterpret_cast<sockaddr *>(&addr), &addrLen), 0);
+
+            stms::ImpairmentConfig cfg;
+            cfg.seed = seed;
+            cfg.lossRate = 0.2;
+            cfg.duplicateRate = 0.1;
+            cfg.reorderRate = 0.1;
+            cfg.jitterMs = 2;
+
+            std::vector<std::string> got;
+            {
+                stms::NetImpairment imp{cfg};
+                for (int i = 0; i < numDatagrams; i++) {
+                    std::string msg = std::to_string(i);
+                    EXPECT_EQ(imp.sendto(tx, msg.data(), msg.size(), 0, reinterpret_cast<sockaddr *>(&addr), addrLen),
+                              static_cast<ssize_t>(msg.size()));
+                }
+
+                char buf[16];
+                pollfd params{rx, POLLIN, 0};
+                while (poll(&params, 1, 200) > 0) {
+                    ssize_t len = recv(rx, buf, sizeof(buf), 0);
+                    got.emplace_back(buf, len);
+                }
+                stats = imp.getStats();
+            }
+
+            close(rx);
+            close(tx);
+            return got;
+        };
+
+        stms::ImpairmentStats first, second, other;
+        auto got = run(42, first);
+        auto again = run(42, second);
+        auto otherSeed = run(43, other);
+
+        EXPECT_EQ(first.datagrams, static_cast<uint64_t>(numDatagrams));
+        EXPECT_EQ(got.size(), first.sent);
+        EXPECT_EQ(first.sent, numDatagrams - first.lost + first.duplicated);
+        EXPECT_GT(first.lost, 0u);
+        EXPECT_GT(first.duplicated, 0u);
+        EXPECT_GT(first.reordered, 0u);
+        EXPECT_FALSE(std::is_sorted(got.begin(), got.end(), [](const std::string &a, const std::string &b) {
+            return std::stoi(a) < std::stoi(b);
+        }));
+
+        // The same seed picks the same datagrams. Only the order within the jitter window depends on timing.
+        EXPECT_EQ(first.lost, second.lost);
+        EXPECT_EQ(first.duplicated, second.duplicated);
+        EXPECT_EQ(first.reordered, second.reordered);
+        EXPECT_EQ(std::multiset<std::string>(got.begin(), got.end()),
+                  std::multiset<std::string>(again.begin(), again.end()));
+        EXPECT_NE(std::multiset<std::string>(got.begin(), got.end()),
+                  std::multiset<std::string>(otherSeed.begin(), otherSeed.end()));
+    }
+
+    TEST(ImpairmentTest, UDPPeerBandwidth) {
+        constexpr std::size_t numMsgs = 64;
+        constexpr std::size_t msgLen = 1000;
+        stms::ThreadPool p{};
+
+        // 64 KB at 256 KB/s takes about 250ms, and the queue only holds half of it.
+        stms::ImpairmentConfig cfg;
+        cfg.bandwidthBytesPerSec = 256 * 1024;
+        cfg.queueLimitBytes = 32 * 1024;
+        auto imp = std::make_shared<stms::NetImpairment>(cfg);
+
+        stms::UDPPeer serv{true, &p};
+        stms::UDPPeer cli{false, &p};
+        cli.setImpairment(imp);
+
+        std::atomic<std::size_t> numRecv{0};
+        serv.setRecvCallback([&](const sockaddr *const, socklen_t, uint8_t *, ssize_t len) {
+            EXPECT_EQ(len, static_cast<ssize_t>(msgLen));
+            numRecv++;
+        });
+
+        serv.setIPv6(false); cli.setIPv6(false);
+        serv.setHostAddr("3000", "127.0.0.1"); cli.setHostAddr("3000", "127.0.0.1");
+        p.start();
+        serv.start();
+        cli.start();
+
+        std::vector<uint8_t> payload(msgLen * numMsgs, 'x');
+        std::vector<stms::UDPMessage> msgs;
+        for (std::size_t i = 0; i < numMsgs; i++) {
+            msgs.emplace_back(stms::UDPMessage{nullptr, 0, payload.data() + i * msgLen, static_cast<ssize_t>(msgLen)});
+        }
+
+        stms::Stopwatch sw;
+        sw.start();
+        EXPECT_EQ(cli.sendToMany(msgs, true).get(), static_cast<int>(numMsgs));
+
+        auto stats = imp->getStats();
+        EXPECT_GT(stats.overflowed, 0u);
+        EXPECT_LT(stats.overflowed, numMsgs);
+        while (numRecv < numMsgs - stats.overflowed && sw.getTime() < 5000) {
+            serv.tick();
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        EXPECT_EQ(numRecv, numMsgs - stats.overflowed);
+        EXPECT_GE(sw.getTime(), 100); // The bytes that fit in the queue are paced out, not sent all at once.
+
+        cli.stop();
+        serv.stop();
+        p.waitIdle(0);
+        p.stop(true);
+    }
+
+    TEST(PacketPool, RefCounting) {
+        auto buf = stms::PacketBuffer::copyOf(reinterpret_cast<const uint8_t *>("hello"), 5);
+        EXPECT_EQ(buf.size(), 5);
+        EXPECT_GE(buf.capacity(), 5);
+        EXPECT_EQ(buf.useCount(), 1);
+
+        {
+            auto copy = buf;
+            auto retained = stms::PacketBuffer::retain(buf.data());
+            EXPECT_EQ(buf.useCount(), 3);
+            EXPECT_EQ(retained.data(), buf.data());
+        }
+        EXPECT_EQ(buf.useCount(), 1);
+
+        auto moved = std::move(buf);
+        EXPECT_FALSE(buf);
+        EXPECT_EQ(moved.useCount(), 1);
+        EXPECT_EQ(std::string(reinterpret_cast<char *>(moved.data()), moved.size()), "hello");
+
+        uint8_t notPooled[64]{};
+        EXPECT_FALSE(stms::PacketBuffer::retain(notPooled + 32));
+        EXPECT_FALSE(stms::PacketBuffer::retain(moved.data() + 1)); // Not the start of a buffer
+
+        const uint8_t *freed = moved.data();
+        moved.reset();
+        EXPECT_FALSE(stms::PacketBuffer::retain(freed)); // Back in the pool, so it mustn't be revived
+    }
+
+    TEST(PacketPool, Reuse) {
+        uint8_t *first;
+        {
+            auto buf = stms::PacketBuffer::alloc(stms::maxRecvLen);
+            first = buf.data();
+        }
+
+        // Freed buffers go back to this thread's cache, and are handed out again without hitting the allocator.
+        auto again = stms::PacketBuffer::alloc(stms::maxRecvLen);
+        EXPECT_EQ(again.data(), first);
+
+        auto huge = stms::PacketBuffer::alloc(stms::packetPoolMaxSize * 2);
+        EXPECT_EQ(huge.capacity(), stms::packetPoolMaxSize * 2);
+        EXPECT_TRUE(stms::PacketBuffer::retain(huge.data()));
+
+        // Buffers freed on other threads make their way back to the global pool.
+        std::vector<stms::PacketBuffer> bufs;
+        for (unsigned i = 0; i < stms::packetPoolThreadCache * 4; i++) {
+            bufs.emplace_back(stms::PacketBuffer::alloc(512));
+        }
+        std::thread([&]() { bufs.clear(); }).join();
+        EXPECT_EQ(stms::PacketBuffer::alloc(512).capacity(), 512);
+    }
+
+    TEST(MessageFramer, Reassembly) {
+        stms::MessageFramer framer{64, 16};
+        std::vector<std::string> got;
+        auto onMessage = [&](uint8_t *msg, std::size_t len) {
+            got.emplace_back(reinterpret_cast<char *>(msg), len);
+        };
+
+        auto frame = [](const std::string &msg) {
+            auto hdr = stms::encodeFrameHeader(static_cast<uint32_t>(msg.size()));
+            return std::string(hdr.begin(), hdr.end()) + msg;
+        };
+
+        // 2 messages in 1 read, then one split across reads that wraps around the end of the 16 byte ring.
+        std::string stream = frame("ab") + frame("") + frame("0123456789");
+        ASSERT_TRUE(framer.feed(reinterpret_cast<const uint8_t *>(stream.data()), 16, onMessage));
+        EXPECT_EQ(got, (std::vector<std::string>{"ab", ""}));
+        EXPECT_EQ(framer.getBufferedBytes(), 6);
+
+        auto span = framer.writeSpan();
+        ASSERT_GT(span.second, 0);
+        std::size_t part = std::min(span.second, stream.size() - 16);
+        std::copy(stream.begin() + 16, stream.begin() + 16 + static_cast<long>(part), span.first);
+        ASSERT_TRUE(framer.commit(part, onMessage));
+        ASSERT_TRUE(framer.feed(reinterpret_cast<const uint8_t *>(stream.data()) + 16 + part,
+                                stream.size() - 16 - part, onMessage));
+        ASSERT_EQ(got.size(), 3);
+        EXPECT_EQ(got[2], "0123456789");
+        EXPECT_EQ(framer.getBufferedBytes(), 0);
+
+        // Larger than the ring: It grows to fit.
+        std::string big = frame(std::string(50, 'x'));
+        ASSERT_TRUE(framer.feed(reinterpret_cast<const uint8_t *>(big.data()), big.size(), onMessage));
+        ASSERT_EQ(got.size(), 4);
+        EXPECT_EQ(got[3], std::string(50, 'x'));
+
+        // Over the max length is a protocol error.
+        std::string tooBig = frame(std::string(65, 'y'));
+        EXPECT_FALSE(framer.feed(reinterpret_cast<const uint8_t *>(tooBig.data()), tooBig.size(), onMessage));
+        EXPECT_EQ(got.size(), 4);
+    }
+}